@@ -0,0 +1,401 @@
+/**
+ * @file main.c
+ * @brief G2Basic Benchmark Suite
+ *
+ * Runs a fixed set of BASIC workloads through the interpreter and reports
+ * how fast they execute, so every change of the engine can be compared
+ * against a baseline:
+ *
+ * - for_count: tight FOR/NEXT counting loop
+ * - nested_loops: two nested FOR loops around an assignment
+ * - gosub_recursion: recursion-style GOSUB chains 50 levels deep
+ * - math_builtins: expressions dominated by built-in function calls
+ * - print_output: PRINT of numbers into a null output sink
+ * - array_bulk: sum() and dot() over a 1024 element DIM array in a loop
+ * - many_variables: a loop body touching 128 different variables
+ * - goto_large: GOTO jumps across a program of 2000 lines
+ *
+ * Every workload runs in its own interpreter context. The best of several
+ * runs is reported as executed statements per second and nanoseconds per
+ * statement, together with the heap allocations of the first, untimed run
+ * (which compiles the program) and of the timed runs.
+ *
+ * Usage: g2basic-bench [--csv] [--runs N] [--baseline FILE] [--threshold PCT]
+ *
+ * With --csv the results are printed as CSV, which can be saved and passed
+ * back with --baseline. Compared to a baseline, the benchmark exits with
+ * status 1 when a workload got slower per statement by more than the
+ * threshold (10% by default).
+ *
+ * @author G2Basic Development Team
+ * @version 0.1.0
+ * @date 2025
+ * @copyright SPDX-License-Identifier: MIT
+ */
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* SPDX-License-Identifier: MIT */
+/*--------------------------------------------------------------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "g2basic.h"
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief Default number of timed runs per workload */
+#define DEFAULT_RUNS 5
+
+/** @brief Default allowed slowdown against the baseline, in percent */
+#define DEFAULT_THRESHOLD 10.0
+
+/** @brief Maximum number of workloads read from a baseline file */
+#define MAX_BASELINE 32
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Benchmark workload
+ *
+ * The program is either a fixed text or generated into a buffer. The number
+ * of statements one run executes is worked out from the loop bounds of the
+ * program; it is what the per-statement figures are based on.
+ */
+typedef struct Workload {
+    const char* name;                              /**< Name in the report */
+    const char* text;                              /**< Program text, or NULL */
+    size_t (*generate)(char* buffer, size_t size); /**< Program generator */
+    uint64_t statements;                           /**< Statements executed by one run */
+} Workload;
+
+/** @brief Result of one workload */
+typedef struct Result {
+    char name[32];          /**< Workload name */
+    int runs;               /**< Timed runs */
+    uint64_t best_ns;       /**< Fastest run */
+    uint64_t statements;    /**< Statements executed by one run */
+    size_t allocs_first;    /**< Allocations of the first run */
+    size_t allocs_steady;   /**< Allocations of the last timed run */
+} Result;
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Program text with 128 variables updated in a loop
+ *
+ * Statements: FOR + 2000 * (128 assignments + NEXT).
+ */
+static size_t generate_many_variables(char* buffer, size_t size) {
+    size_t length = 0;
+    length += (size_t)snprintf(buffer + length, size - length, "10 FOR I = 1 TO 2000\n");
+    length += (size_t)snprintf(buffer + length, size - length, "20 V0 = I\n");
+    for (int i = 1; i < 128; i++) {
+        length += (size_t)snprintf(buffer + length, size - length, "%d V%d = V%d + I\n", 20 + i * 10, i, i - 1);
+    }
+    length += (size_t)snprintf(buffer + length, size - length, "9000 NEXT I\n");
+    return length;
+}
+
+/**
+ * @brief Program text of 1000 blocks visited in a scattered order with GOTO
+ *
+ * Block b (lines 100 + 20 * b and 110 + 20 * b) counts and jumps to block
+ * (b + 499) mod 1000, which visits every block once per cycle. Block 0 is
+ * preceded by the end check. Statements: C = 0 + 101 checks + 100 cycles of
+ * 1000 blocks of 2 lines.
+ */
+static size_t generate_goto_large(char* buffer, size_t size) {
+    size_t length = 0;
+    length += (size_t)snprintf(buffer + length, size - length, "10 C = 0\n");
+    length += (size_t)snprintf(buffer + length, size - length, "95 IF C >= 100000 THEN END\n");
+    for (int block = 0; block < 1000; block++) {
+        int next = (block + 499) % 1000;
+        length += (size_t)snprintf(buffer + length, size - length, "%d C = C + 1\n", 100 + block * 20);
+        length += (size_t)snprintf(buffer + length, size - length, "%d GOTO %d\n", 110 + block * 20,
+                                   next == 0 ? 95 : 100 + next * 20);
+    }
+    return length;
+}
+
+/**
+ * @brief The workloads, in report order
+ */
+static const Workload workloads[] = {
+    {"for_count",
+     "10 FOR I = 1 TO 1000000\n"
+     "20 NEXT I\n",
+     NULL, 1 + 1000000},
+    {"nested_loops",
+     "10 S = 0\n"
+     "20 FOR I = 1 TO 300\n"
+     "30 FOR J = 1 TO 300\n"
+     "40 S = S + I * J\n"
+     "50 NEXT J\n"
+     "60 NEXT I\n",
+     NULL, 2 + 300 * (1 + 300 * 2 + 1)},
+    {"gosub_recursion",
+     "10 T = 0\n"
+     "20 FOR I = 1 TO 2000\n"
+     "30 D = 50\n"
+     "40 GOSUB 100\n"
+     "50 NEXT I\n"
+     "60 END\n"
+     "100 IF D = 0 THEN RETURN\n"
+     "110 D = D - 1\n"
+     "120 T = T + 1\n"
+     "130 GOSUB 100\n"
+     "140 RETURN\n",
+     NULL, 3 + 2000 * (3 + 50 * 4 + 1 + 50)},
+    {"math_builtins",
+     "10 S = 0\n"
+     "20 FOR I = 1 TO 100000\n"
+     "30 S = S + sqrt(I) * sin(I) + abs(cos(I)) + pow(I, 0.5)\n"
+     "40 NEXT I\n",
+     NULL, 2 + 100000 * 2},
+    {"print_output",
+     "10 FOR I = 1 TO 100000\n"
+     "20 PRINT I, I / 7\n"
+     "30 NEXT I\n",
+     NULL, 1 + 100000 * 2},
+    {"array_bulk",
+     "10 DIM S(1023)\n"
+     "20 FOR I = 0 TO 1023\n"
+     "30 S(I) = I / 1024\n"
+     "40 NEXT I\n"
+     "50 T = 0\n"
+     "60 FOR K = 1 TO 10000\n"
+     "70 T = T + sum(S) + dot(S, S)\n"
+     "80 NEXT K\n",
+     NULL, 2 + 1024 * 2 + 2 + 10000 * 2},
+    {"many_variables", NULL, generate_many_variables, 1 + 2000 * (128 + 1)},
+    {"goto_large", NULL, generate_goto_large, 1 + 101 + 100 * 1000 * 2},
+};
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Output sink that drops everything
+ */
+static void null_write(void* context, const char* data, size_t length) {
+    (void)context;
+    (void)data;
+    (void)length;
+}
+
+/**
+ * @brief Print function for interpreter errors
+ */
+static void error_print(const char* str) {
+    fputs(str, stderr);
+}
+
+/**
+ * @brief Current wall clock time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Load and run one workload @p runs times
+ *
+ * An untimed first run compiles the program; its allocations are reported
+ * separately from those of the timed runs.
+ *
+ * @return 0 on success, -1 if the program failed to load or run
+ */
+static int run_workload(const Workload* workload, int runs, Result* result) {
+    static char generated[128 * 1024];
+    const char* text = workload->text;
+    size_t length = text ? strlen(text) : workload->generate(generated, sizeof(generated));
+    if (text == NULL) {
+        text = generated;
+    }
+
+    g2basic_ctx_t* ctx = g2basic_ctx_create(error_print, NULL);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: cannot create interpreter\n", workload->name);
+        return -1;
+    }
+    g2basic_ctx_set_output(ctx, null_write, NULL);
+
+    const char* error = NULL;
+    if (g2basic_ctx_load_program(ctx, text, length, &error) != 0) {
+        fprintf(stderr, "%s: %s\n", workload->name, error);
+        g2basic_ctx_destroy(ctx);
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", workload->name);
+    result->runs = runs;
+    result->statements = workload->statements;
+    result->best_ns = UINT64_MAX;
+    for (int run = 0; run <= runs; run++) {
+        size_t allocations = g2basic_ctx_allocation_count(ctx);
+        uint64_t start = now_ns();
+        int ret = g2basic_ctx_run(ctx);
+        uint64_t elapsed = now_ns() - start;
+        allocations = g2basic_ctx_allocation_count(ctx) - allocations;
+        if (ret != 0) {
+            fprintf(stderr, "%s: program failed\n", workload->name);
+            g2basic_ctx_destroy(ctx);
+            return -1;
+        }
+        if (run == 0) {
+            result->allocs_first = allocations;
+            continue;
+        }
+        result->allocs_steady = allocations;
+        if (elapsed < result->best_ns) {
+            result->best_ns = elapsed;
+        }
+    }
+    g2basic_ctx_destroy(ctx);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief Statements per second of a result */
+static double statements_per_second(const Result* result) {
+    return result->best_ns ? (double)result->statements * 1e9 / (double)result->best_ns : 0.0;
+}
+
+/** @brief Nanoseconds per statement of a result */
+static double ns_per_statement(const Result* result) {
+    return result->statements ? (double)result->best_ns / (double)result->statements : 0.0;
+}
+
+/**
+ * @brief Read the results of an earlier --csv run
+ *
+ * @return Number of results read, or -1 if the file cannot be opened
+ */
+static int read_baseline(const char* path, Result* baseline, int capacity) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[256];
+    int count = 0;
+    while (count < capacity && fgets(line, sizeof(line), file)) {
+        Result* entry = &baseline[count];
+        unsigned long long best_ns;
+        unsigned long long statements;
+        if (sscanf(line, "%31[^,],%d,%llu,%llu", entry->name, &entry->runs, &best_ns, &statements) == 4) {
+            entry->best_ns = best_ns;
+            entry->statements = statements;
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+/**
+ * @brief Find the baseline entry of a workload
+ */
+static const Result* find_baseline(const Result* baseline, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Main program entry point
+ *
+ * Parses the command line, runs every workload and prints the report.
+ *
+ * @param argc Command line argument count
+ * @param argv Command line argument vector
+ * @return 0 on success, 1 on a regression against the baseline, 2 on
+ * errors
+ */
+int main(int argc, char* argv[]) {
+    int csv = 0;
+    int runs = DEFAULT_RUNS;
+    double threshold = DEFAULT_THRESHOLD;
+    const char* baseline_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            csv = 1;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--csv] [--runs N] [--baseline FILE] [--threshold PCT]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+
+    Result baseline[MAX_BASELINE];
+    int baseline_count = 0;
+    if (baseline_path != NULL) {
+        baseline_count = read_baseline(baseline_path, baseline, MAX_BASELINE);
+        if (baseline_count < 0) {
+            fprintf(stderr, "cannot read baseline %s\n", baseline_path);
+            return 2;
+        }
+    }
+
+    if (csv) {
+        printf("name,runs,best_ns,statements,statements_per_sec,ns_per_statement,allocs_first,allocs_steady%s\n",
+               baseline_path ? ",change_pct" : "");
+    } else {
+        printf("%-16s %12s %14s %10s %8s %8s%s\n", "workload", "best ms", "statements/s", "ns/stmt", "allocs", "steady",
+               baseline_path ? "   change" : "");
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        Result result;
+        if (run_workload(&workloads[i], runs, &result) != 0) {
+            return 2;
+        }
+
+        char change[32] = "";
+        const Result* base = find_baseline(baseline, baseline_count, result.name);
+        if (base != NULL && ns_per_statement(base) > 0.0) {
+            double percent = (ns_per_statement(&result) / ns_per_statement(base) - 1.0) * 100.0;
+            int regressed = percent > threshold;
+            snprintf(change, sizeof(change), csv ? ",%.1f" : " %+7.1f%%%s", percent, regressed && !csv ? " !" : "");
+            if (regressed) {
+                status = 1;
+            }
+        } else if (baseline_path != NULL) {
+            snprintf(change, sizeof(change), csv ? "," : " %8s", "new");
+        }
+
+        if (csv) {
+            printf("%s,%d,%llu,%llu,%.0f,%.2f,%zu,%zu%s\n", result.name, result.runs,
+                   (unsigned long long)result.best_ns, (unsigned long long)result.statements,
+                   statements_per_second(&result), ns_per_statement(&result), result.allocs_first,
+                   result.allocs_steady, change);
+        } else {
+            printf("%-16s %12.3f %14.0f %10.2f %8zu %8zu%s\n", result.name, (double)result.best_ns / 1e6,
+                   statements_per_second(&result), ns_per_statement(&result), result.allocs_first,
+                   result.allocs_steady, change);
+        }
+    }
+    return status;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
@@ -15,6 +15,7 @@
  *
  * The program accepts both immediate statements (executed right away) and
  * numbered program lines (stored for later execution with RUN command).
+ * Given a program file as argument, it loads and runs the file instead.
  *
  * @author G2Basic Development Team
  * @version 0.0.1
@@ -38,20 +39,51 @@
 /*--------------------------------------------------------------------------------------------------------------------*/
 
 /**
- * @brief Print function for BASIC program output
+ * @brief Output sink for BASIC program output
  *
  * This function is passed to the G2Basic interpreter to handle all output
- * from BASIC PRINT statements. It writes output to stdout and ensures
- * immediate display by flushing the output buffer.
+ * from BASIC PRINT statements. The interpreter buffers its output and calls
+ * the sink about once per line, so the data is written to stdout as it
+ * comes without flushing on every call.
  *
- * @param str The string to print (null-terminated)
+ * @param context Output stream (stdout)
+ * @param data The text to print (not null-terminated)
+ * @param length Number of characters in @p data
  *
  * @note This function is called by the interpreter for all PRINT statements
- * @note Output is immediately flushed to ensure real-time display
  */
-static void basic_print(const char* str) {
-    printf("%s", str);
-    fflush(stdout);  // Ensure immediate output
+static void basic_write(void* context, const char* data, size_t length) {
+    fwrite(data, 1, length, (FILE*)context);
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Load and run a BASIC program file
+ *
+ * Runs the program once in its own interpreter context, so a runtime error
+ * can be told apart from a normal end of the program.
+ *
+ * @param path Path of the program file
+ * @return 0 when the program ended normally, 1 on a load or runtime error
+ */
+static int run_file(const char* path) {
+    g2basic_ctx_t* ctx = g2basic_ctx_create(NULL, NULL);
+    if (ctx == NULL) {
+        printf("Error: cannot create interpreter\n");
+        return 1;
+    }
+    g2basic_ctx_set_output(ctx, basic_write, stdout);
+
+    const char* error = NULL;
+    int ret = g2basic_ctx_load_file(ctx, path, &error);
+    if (ret != 0) {
+        printf("Error: %s\n", error);
+    } else {
+        ret = g2basic_ctx_run(ctx);
+    }
+    g2basic_ctx_destroy(ctx);
+    return ret == 0 ? 0 : 1;
 }
 
 /*--------------------------------------------------------------------------------------------------------------------*/
@@ -72,20 +104,26 @@ static void basic_print(const char* str) {
  * or Ctrl-Z. All errors are reported with descriptive messages to help users
  * debug their BASIC programs.
  *
- * @param argc Command line argument count (unused)
- * @param argv Command line argument vector (unused)
- * @return 0 on successful termination
+ * With a program file given on the command line, the file is loaded and run
+ * once without entering the REPL.
+ *
+ * @param argc Command line argument count
+ * @param argv Command line argument vector, optionally a program file
+ * @return 0 on successful termination, 1 if the program file failed
  *
  * @note The program uses stdin for input and stdout for output
  * @note Lines longer than MAX_LINE_LENGTH are truncated
  * @note Empty lines are ignored and do not generate errors
  */
 int main(int argc, char* argv[]) {
-    (void)argc;
-    (void)argv;
+    if (argc > 1) {
+        return run_file(argv[1]);
+    }
+
     char line[MAX_LINE_LENGTH];
 
-    g2basic_init(basic_print);
+    g2basic_init(NULL);
+    g2basic_set_output(basic_write, stdout);
 
     printf(
         "G2BASIC Interpreter with line numbers. Ctrl-C/Ctrl-D/Ctrl-Z to "
@@ -101,7 +139,7 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
-        double val;
+        g2basic_number_t val;
         const char* error = NULL;
         g2basic_parse(line, &val, &error);
         if (error) {
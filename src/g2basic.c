@@ -8,9 +8,15 @@
  *
  * Key features implemented:
  * - Dynamic linked-list based data structures (no fixed limits)
- * - Recursive descent expression parser
+ * - Program lines tokenized once when stored (keywords, numbers, identifiers)
+ * - Recursive descent compiler emitting bytecode for a stack virtual machine
+ *   (computed goto dispatch where the compiler supports it)
+ * - Optional native code for compiled expressions on x86-64 (G2BASIC_JIT)
  * - Full BASIC language support including:
  *   - Variables and mathematical expressions
+ *   - Integer variables (I%) evaluated with native integer arithmetic
+ *   - DIM arrays in contiguous storage, with bulk built-ins (sum, mean, dot,
+ *     FILL, COPY) and arrays mapped onto host buffers
  *   - Control flow: IF/THEN, FOR/NEXT loops with proper nesting
  *   - Program flow: GOTO, GOSUB/RETURN with unlimited nesting
  *   - Built-in mathematical functions (sin, cos, sqrt, pow, etc.)
@@ -20,11 +26,13 @@
  * - Error handling and reporting
  *
  * Architecture:
- * - All data structures use dynamic linked lists (variables, functions, program
- * lines, stacks)
+ * - Data structures are dynamically allocated (linked lists, hash tables and
+ * growable arrays) and reused, so running a stored program does not allocate
+ * heap memory in steady state
  * - No arbitrary limits on nesting depth or program size (memory permitting)
  * - Configurable output system for different environments
- * - Thread-safe design for single-threaded usage
+ * - Pluggable allocator, with a bundled arena for heapless targets
+ * - Reentrant: all state lives in a context, one context per thread
  *
  * @author Grzegorz Grzęda
  * @version 0.0.1
@@ -35,20 +43,75 @@
 /*--------------------------------------------------------------------------------------------------------------------*/
 /* SPDX-License-Identifier: MIT */
 /*--------------------------------------------------------------------------------------------------------------------*/
+#if defined(G2BASIC_JIT) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS in strict C modes
+#endif
 #include "g2basic.h"
+#include <assert.h>
 #include <ctype.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+/*
+ * Building with G2BASIC_JIT defined adds a native code tier for compiled
+ * expressions (g2basic_compile_expr()). It covers x86-64 with the System V
+ * calling convention in double precision builds without the profiler and
+ * the trace;
+ * on every other target, and for expressions using instructions it does not
+ * translate, the flag has no effect and the virtual machine runs them.
+ */
+#if defined(G2BASIC_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || \
+    defined(__FreeBSD__)) && !defined(G2BASIC_FIXED_POINT) && !defined(G2BASIC_PROFILE) && !defined(G2BASIC_TRACE)
+#define JIT_ENABLED 1
+#include <sys/mman.h>
+#else
+#define JIT_ENABLED 0
+#endif
 /*--------------------------------------------------------------------------------------------------------------------*/
 
 /** @brief Maximum number of arguments allowed for registered functions */
 #define MAX_FUNC_ARGS 8
 
+/*
+ * Building with G2BASIC_PROFILE defined adds the profiler: every program
+ * line starts with an OP_LINE instruction that counts the line and times it
+ * with the clock set by g2basic_set_profile_clock(), and the PROFILE command
+ * reports the last run. Without it OP_LINE is never emitted and nothing is
+ * counted.
+ *
+ * Building with G2BASIC_TRACE defined lets g2basic_set_trace() record the
+ * execution trace: every program line and every jump to a line starts with
+ * an OP_TRACE instruction, and the virtual machine appends a record for the
+ * FOR loops, function calls and errors as they happen. Without it OP_TRACE
+ * is never emitted and the trace code is left out.
+ */
+
+/** @brief Rows evaluated per instruction by g2basic_eval_batch() */
+#ifndef G2BASIC_BATCH_WIDTH
+#define G2BASIC_BATCH_WIDTH 64
+#endif
+
+/** @brief Size of the output buffer, flushed at line end or when full */
+#ifndef G2BASIC_OUTPUT_BUFFER_SIZE
+#define G2BASIC_OUTPUT_BUFFER_SIZE 128
+#endif
+
+/** @brief FOR loop nesting depth preallocated by g2basic_init() */
+#ifndef G2BASIC_FOR_STACK_DEPTH
+#define G2BASIC_FOR_STACK_DEPTH 8
+#endif
+
+/** @brief GOSUB nesting depth preallocated by g2basic_init() */
+#ifndef G2BASIC_GOSUB_STACK_DEPTH
+#define G2BASIC_GOSUB_STACK_DEPTH 16
+#endif
+
 /*--------------------------------------------------------------------------------------------------------------------*/
 /* BASIC Language Keywords - These define the supported BASIC language elements
  */
@@ -57,6 +120,8 @@
 #define G2BASIC_KEYWORD_IF "IF"
 /** @brief THEN statement keyword for conditional execution */
 #define G2BASIC_KEYWORD_THEN "THEN"
+/** @brief ELSE keyword for the alternative branch of an IF statement */
+#define G2BASIC_KEYWORD_ELSE "ELSE"
 /** @brief FOR statement keyword for loop initialization */
 #define G2BASIC_KEYWORD_FOR "FOR"
 /** @brief TO keyword for FOR loop range specification */
@@ -73,54 +138,142 @@
 #define G2BASIC_KEYWORD_RETURN "RETURN"
 /** @brief END statement keyword for program termination */
 #define G2BASIC_KEYWORD_END "END"
+/** @brief STEP keyword for FOR loop increment specification */
+#define G2BASIC_KEYWORD_STEP "STEP"
+/** @brief DIM statement keyword for array allocation */
+#define G2BASIC_KEYWORD_DIM "DIM"
+/** @brief FILL statement keyword for setting all elements of an array */
+#define G2BASIC_KEYWORD_FILL "FILL"
+/** @brief COPY statement keyword for copying an array */
+#define G2BASIC_KEYWORD_COPY "COPY"
+
+/** @brief Longest keyword or command (PROFILE), the case mask has a bit per letter */
+#define MAX_KEYWORD_LENGTH 7
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* Token stream encoding - bytes 0x01..0x7F stand for themselves (operators,
+ * punctuation, whitespace), the values below introduce multi-byte tokens.
+ */
+
+/** @brief End of token stream marker */
+#define TOKEN_END 0x00
+/** @brief Numeric literal: double value, 16-bit spelling length, spelling */
+#define TOKEN_NUMBER 0x80
+/** @brief Identifier: 16-bit length followed by the NUL-terminated name */
+#define TOKEN_IDENTIFIER 0x81
+/** @brief Keyword: keyword index followed by a mask of lowercase letters */
+#define TOKEN_KEYWORD 0x82
+/** @brief Escaped source byte outside of the 7-bit ASCII range */
+#define TOKEN_RAW 0x83
+
+/** @brief Longest identifier or numeric literal spelling that can be stored */
+#define MAX_TOKEN_SPELLING 0xFFFF
 
 /*--------------------------------------------------------------------------------------------------------------------*/
 
 /**
- * @brief Variable storage structure
+ * @brief Variable symbol table entry
  *
- * Represents a single variable in the BASIC program. Variables are stored
- * in a dynamically allocated linked list with no arbitrary limits on the
- * number of variables that can be created.
+ * Represents a single variable name in the BASIC program. Every name is
+ * interned once into a hash table with no arbitrary limits on the number of
+ * variables that can be created, and is assigned a slot: the index of its
+ * value in the contiguous variable_values array. Compiled code refers to
+ * variables by slot only, so loads and stores are plain array indexing.
  *
- * All variable names are dynamically allocated and must be freed when the
- * variable is destroyed. Variable values are stored as double precision
- * floating point numbers, supporting both integer and decimal arithmetic.
+ * The name is stored inline, the entry is a single allocation. Variable
+ * values are numbers (g2basic_number_t). A name ending in '%' is an integer
+ * variable, its value is a 32-bit integer kept at the same slot of the
+ * integer_values array, so integer code never converts between the two.
  *
  * @note Variables are case-sensitive
  * @note Variable names must start with a letter and contain only alphanumeric
- * characters and underscores
+ * characters and underscores, optionally followed by '%'
+ * @note NUMBER_UNDEFINED (NaN) and INTEGER_UNDEFINED mark a variable that has
+ * not been assigned yet
  */
 typedef struct Variable {
-    char* name;            /**< Dynamically allocated variable name string */
-    double value;          /**< Variable value (double precision float) */
-    struct Variable* next; /**< Pointer to next variable in linked list */
+    struct Variable* next; /**< Next variable in the same hash bucket */
+    int32_t slot;          /**< Index of the value in ctx->variable_values */
+    char name[];           /**< Variable name string */
 } Variable;
 /*--------------------------------------------------------------------------------------------------------------------*/
 
+/**
+ * @brief Array symbol table entry
+ *
+ * Arrays are named apart from the variables, A and A() are two different
+ * things. The elements of an array are one contiguous block of numbers,
+ * allocated by DIM or mapped onto a host buffer with g2basic_ctx_map_array(),
+ * so indexing is a bounds check and a load and the bulk built-ins are plain
+ * loops over the block. Like variables, arrays are interned by the compiler
+ * and the compiled code refers to them by slot, their index in ctx->arrays.
+ *
+ * @note Array names are case-sensitive and never end in '%', elements are
+ * always numbers
+ * @note Elements of a DIM array start out as 0
+ */
+typedef struct Array {
+    g2basic_number_t* values; /**< Elements, NULL until dimensioned or mapped */
+    size_t length;            /**< Number of elements */
+    size_t capacity;          /**< Allocated elements, 0 for a host buffer */
+    bool mapped;              /**< values is a host buffer */
+    bool declared;            /**< Named by a compiled DIM or mapped, so
+                                   NAME(...) reads it instead of calling */
+    char name[];              /**< Array name string */
+} Array;
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief One operand of batch evaluation, a value for each row of a block */
+typedef g2basic_number_t BatchLanes[G2BASIC_BATCH_WIDTH];
+
 /**
  * @brief Function registration structure
  *
- * Represents a registered function that can be called from BASIC expressions.
- * Functions are stored in a dynamically allocated linked list, allowing
- * unlimited number of custom functions to be registered.
+ * Represents a function that can be called from BASIC expressions. The
+ * built-in functions are a constant table (builtin_functions[]) shared by all
+ * contexts, which costs no memory when a context is set up. Custom functions
+ * are stored in a dynamically allocated linked list, allowing unlimited
+ * number of them to be registered.
  *
  * Functions can have a fixed number of arguments or be variadic. The function
- * pointer must implement the signature: double func(double[], int)
+ * pointer must implement the signature:
+ * g2basic_number_t func(g2basic_number_t[], int)
  *
  * @note Function names are case-sensitive
  * @note Function names must be valid identifiers (alphanumeric + underscore,
  * starting with letter)
  */
 typedef struct Function {
-    char* name;    /**< Dynamically allocated function name string */
+    const char* name; /**< Function name, dynamically allocated for custom
+                           functions */
     int arg_count; /**< Number of arguments expected (-1 for variadic functions)
                     */
-    double (*func_ptr)(double args[],
-                       int count); /**< Pointer to implementing C function */
+    g2basic_number_t (*func_ptr)(g2basic_number_t args[],
+                                 int count); /**< Pointer to implementing C function */
+    /** Column kernel for batch evaluation, storing the results over args[0].
+        NULL calls func_ptr row by row. */
+    void (*batch_ptr)(BatchLanes args[], int count, size_t lanes);
+    g2basic_async_func_t async_ptr; /**< Function that may wait, called by
+                                         OP_CALL_ASYNC, or NULL */
+    void* async_context;            /**< Argument of async_ptr */
+    unsigned flags; /**< G2BASIC_FUNCTION_* flags */
+#ifdef G2BASIC_PROFILE
+    uint64_t profile_calls; /**< Calls during the last run, custom functions
+                                 only */
+#endif
     struct Function* next; /**< Pointer to next function in linked list */
+    struct Function* bucket_next; /**< Next function in the same hash
+                                     bucket */
 } Function;
 
+/** @brief Function flag marking an entry of builtin_functions[] */
+#define FUNCTION_BUILTIN (1u << 31)
+
+/** @brief Number of built-in functions */
+#define BUILTIN_FUNCTION_COUNT 13
+
+static const Function builtin_functions[BUILTIN_FUNCTION_COUNT];
+
 /*--------------------------------------------------------------------------------------------------------------------*/
 
 /**
@@ -130,18 +283,29 @@ typedef struct Function {
  * in a dynamically allocated linked list, sorted by line number for proper
  * execution order.
  *
- * Each line contains the original text of the BASIC statement, which is
- * parsed and executed when the program runs. Line numbers must be positive
- * integers and are used for program flow control (GOTO, GOSUB, etc.).
+ * Each line is tokenized once when it is stored: keywords are replaced by
+ * their keyword index, numeric literals are converted to their double value
+ * and identifiers are stored as ready-to-use NUL-terminated names. Running
+ * the program therefore never re-lexes the source text. The token stream
+ * keeps enough information (original spelling of numbers, keyword letter
+ * case and all whitespace) to reproduce the source text exactly for LIST.
  *
  * @note Line numbers must be unique within a program
  * @note Lines are automatically sorted by line number
- * @note Line text is dynamically allocated and must be freed when destroyed
+ * @note The token stream is dynamically allocated and must be freed when
+ * destroyed
  */
 typedef struct ProgramLine {
     int line_number; /**< Line number for this program line (must be positive)
                       */
-    char* text;      /**< Dynamically allocated program line text */
+    uint8_t* tokens; /**< Dynamically allocated token stream of the line */
+    size_t code_offset; /**< Start of the line in the compiled program */
+    bool loaded;        /**< Entry of ctx->loaded_lines, not allocated alone */
+    bool shared_tokens; /**< Tokens live in ctx->loaded_tokens */
+#ifdef G2BASIC_PROFILE
+    uint64_t profile_hits; /**< Times the line was entered during the last run */
+    uint64_t profile_time; /**< Clock ticks spent in the line during the last run */
+#endif
     struct ProgramLine*
         next; /**< Pointer to next program line in sorted linked list */
 } ProgramLine;
@@ -152,25 +316,36 @@ typedef struct ProgramLine {
  * @brief FOR loop state structure
  *
  * Represents the state of a single FOR loop during program execution.
- * FOR loops are stored in a stack implemented as a linked list, allowing
- * unlimited nesting depth of FOR loops.
+ * FOR loops are stored in a stack implemented as an array that is
+ * preallocated by g2basic_init() and only grows when a program nests deeper
+ * than ever before, allowing unlimited nesting depth of FOR loops without
+ * allocating memory for every loop entered.
  *
  * The structure maintains all information needed to properly iterate the
- * loop and return to the correct program location for each iteration.
- * Loop variables are dynamically allocated and automatically managed.
+ * loop: the loop variable, its limits and the position in the compiled
+ * program where the loop body starts, which is where NEXT jumps back to.
+ * Everything NEXT needs is resolved when the loop is entered, so an
+ * iteration costs one add, one compare and a branch.
  *
  * @note FOR loops support both positive and negative step values
  * @note Loop variables are automatically created and managed
  * @note Nested FOR loops are fully supported with proper scoping
  */
 typedef struct ForLoop {
-    char* var_name;      /**< Dynamically allocated loop variable name */
-    double start_value;  /**< Starting value for the loop */
-    double end_value;    /**< Ending value for the loop */
-    double step_value;   /**< Step increment (default 1, can be negative) */
-    int for_line_number; /**< Line number of the FOR statement */
-    struct ForLoop*
-        next; /**< Pointer to next loop in the stack (linked list) */
+    int32_t slot;                /**< Slot of the loop variable */
+    g2basic_number_t end_value;  /**< Ending value for the loop */
+    g2basic_number_t step_value; /**< Step increment (default 1, can be negative) */
+    int32_t end_integer;         /**< Ending value of an integer loop variable */
+    int32_t step_integer;        /**< Step of an integer loop variable */
+    bool ascending;              /**< Positive step, the loop counts up to the end */
+    size_t body_pc;       /**< Code offset of the first instruction of the body
+                           */
+#ifdef G2BASIC_ASSERT_NO_ALLOC
+    size_t allocations; /**< Allocation count at the previous NEXT */
+#endif
+#ifdef G2BASIC_TRACE
+    int32_t trace_line; /**< Line of the FOR, where the body starts */
+#endif
 } ForLoop;
 /*--------------------------------------------------------------------------------------------------------------------*/
 
@@ -178,51 +353,394 @@ typedef struct ForLoop {
  * @brief GOSUB call stack entry structure
  *
  * Represents a single GOSUB subroutine call on the call stack. GOSUB calls
- * are stored in a stack implemented as a linked list, allowing unlimited
- * nesting depth of subroutine calls.
+ * are stored in a stack implemented as a preallocated array that grows on
+ * demand, allowing unlimited nesting depth of subroutine calls.
  *
- * Each entry stores the line number to return to when the corresponding
- * RETURN statement is executed. The stack maintains proper nesting order
- * for nested GOSUB calls.
+ * Each entry stores the code offset to continue at when the corresponding
+ * RETURN statement is executed, i.e. the instruction following the GOSUB.
+ * The stack maintains proper nesting order for nested GOSUB calls.
  *
  * @note GOSUB calls support unlimited nesting depth
  * @note Each GOSUB must have a corresponding RETURN statement
- * @note The return line number can be -2 to indicate end of program
  */
 typedef struct GosubStackEntry {
-    int return_line_number; /**< Line number to return to after RETURN statement
-                             */
-    struct GosubStackEntry*
-        next; /**< Pointer to next entry in the stack (linked list) */
+    size_t return_pc; /**< Code offset to continue at after RETURN */
+#ifdef G2BASIC_TRACE
+    int32_t trace_line; /**< Line of the GOSUB */
+#endif
 } GosubStackEntry;
 
 /*--------------------------------------------------------------------------------------------------------------------*/
-/* Global Variables - Internal interpreter state */
+/* BYTECODE */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief Depth of the virtual machine operand stack */
+#define VM_STACK_SIZE 64
+
+/**
+ * @brief Virtual machine instruction set
+ *
+ * Every instruction is a 32-bit opcode word followed by its 32-bit operand
+ * words. Operands are indexes (constants, variable slots, functions, messages),
+ * code offsets or line numbers, never raw pointers. The comment of each
+ * entry lists the operands followed by the stack effect, the number next to
+ * the name counts the operand words.
+ *
+ * Integer values (i) live on an operand stack of their own, next to the
+ * numbers (v). The *_INT instructions work on that stack with native 32-bit
+ * arithmetic and fail on overflow instead of wrapping around. Array indexes
+ * are integers as well.
+ *
+ * A value a FOR loop body computes from nothing the loop changes is cached:
+ * OP_CACHED pushes the value and skips the code computing it once
+ * OP_CACHE_STORE at the end of that code has run, and OP_CACHE_RESET in
+ * front of the FOR forgets the values of the body every time the loop is
+ * entered.
+ */
+#define OPCODE_LIST(X)                                                               \
+    X(OP_END, 0)                 /* -                 : stop execution */            \
+    X(OP_PUSH_CONST, 1)          /* const   -- v      : push constants[const] */     \
+    X(OP_LOAD, 1)                /* var     -- v      : push variable value */       \
+    X(OP_LOAD_HOST, 1)           /* load    -- v      : push bound host value */     \
+    X(OP_STORE, 1)               /* var   v --        : assign variable */           \
+    X(OP_DUP, 0)                 /* -     v -- v v */                                \
+    X(OP_POP, 0)                 /* -     v -- */                                    \
+    X(OP_RESULT, 0)              /* -     v --        : immediate mode result */     \
+    X(OP_NEG, 0)                 /* -     v -- -v */                                 \
+    X(OP_ADD, 0)                 /* -   a b -- a+b */                                \
+    X(OP_SUB, 0)                 /* -   a b -- a-b */                                \
+    X(OP_MUL, 0)                 /* -   a b -- a*b */                                \
+    X(OP_DIV, 0)                 /* -   a b -- a/b */                                \
+    X(OP_LT, 0)                  /* -   a b -- a<b */                                \
+    X(OP_GT, 0)                  /* -   a b -- a>b */                                \
+    X(OP_LE, 0)                  /* -   a b -- a<=b */                               \
+    X(OP_GE, 0)                  /* -   a b -- a>=b */                               \
+    X(OP_EQ, 0)                  /* -   a b -- a=b */                                \
+    X(OP_NE, 0)                  /* -   a b -- a<>b */                               \
+    X(OP_CALL, 2)                /* func argc  args -- v */                          \
+    X(OP_CALL_ASYNC, 2)          /* func argc  args -- v : call that may wait */     \
+    X(OP_JUMP, 1)                /* target            : jump to code offset */       \
+    X(OP_JUMP_IF_FALSE, 1)       /* target  c --      : jump when c is zero */       \
+    X(OP_JUMP_UNLESS, 2)         /* cmp target  a b -- : jump unless a cmp b */      \
+    X(OP_JUMP_UNLESS_VAR, 4)     /* cmp var const target : same on var, const */     \
+    X(OP_GOTO, 1)                /* line              : jump to missing line */      \
+    X(OP_GOSUB, 1)               /* target            : call subroutine */           \
+    X(OP_RETURN, 0)              /* -                 : return from subroutine */    \
+    X(OP_FOR, 1)                 /* var   start end step -- : enter FOR loop */      \
+    X(OP_NEXT, 1)                /* var               : iterate FOR loop */          \
+    X(OP_PRINT, 0)               /* -     v --        : print number */              \
+    X(OP_PRINT_CHAR, 1)          /* char              : print one character */       \
+    X(OP_PUSH_INT, 1)            /* value   -- i      : push integer operand */      \
+    X(OP_LOAD_INT, 1)            /* var     -- i      : push integer variable */     \
+    X(OP_LOAD_INT_NUM, 1)        /* var     -- v      : push it as a number */       \
+    X(OP_STORE_INT, 1)           /* var   i --        : assign integer variable */   \
+    X(OP_RESULT_INT, 0)          /* -     i --        : immediate mode result */     \
+    X(OP_INT_TO_NUM, 0)          /* -     i -- v      : convert to number */         \
+    X(OP_INT_TO_NUM_UNDER, 0)    /* -  i, v -- w v : convert below the top */        \
+    X(OP_NUM_TO_INT, 0)          /* -     v -- i      : truncate to integer */       \
+    X(OP_NEG_INT, 0)             /* -     i -- -i */                                 \
+    X(OP_ADD_INT, 0)             /* -   a b -- a+b */                                \
+    X(OP_SUB_INT, 0)             /* -   a b -- a-b */                                \
+    X(OP_MUL_INT, 0)             /* -   a b -- a*b */                                \
+    X(OP_COMPARE_INT, 1)         /* cmp   a b -- v    : a cmp b, as a number */      \
+    X(OP_JUMP_UNLESS_INT, 2)     /* cmp target  a b -- : integer OP_JUMP_UNLESS */   \
+    X(OP_JUMP_UNLESS_VAR_INT, 4) /* cmp var value target : on var, value */          \
+    X(OP_FOR_INT, 1)             /* var   start end step -- : integer FOR loop */    \
+    X(OP_NEXT_INT, 1)            /* var               : iterate integer loop */      \
+    X(OP_PRINT_INT, 0)           /* -     i --        : print integer */             \
+    X(OP_DIM, 1)                 /* array i --        : allocate 0..i, zeroed */     \
+    X(OP_ARRAY_LOAD, 1)          /* array i -- v      : push element */              \
+    X(OP_ARRAY_STORE, 1)         /* array i, v --     : assign element */            \
+    X(OP_ARRAY_SUM, 1)           /* array   -- v      : sum of the elements */       \
+    X(OP_ARRAY_MEAN, 1)          /* array   -- v      : mean of the elements */      \
+    X(OP_ARRAY_DOT, 2)           /* array array -- v  : dot product */               \
+    X(OP_ARRAY_FILL, 1)          /* array v --        : set every element */         \
+    X(OP_ARRAY_COPY, 2)          /* dest source       : copy the elements */         \
+    X(OP_CACHE_RESET, 2)         /* first count       : forget cached values */      \
+    X(OP_CACHED, 2)              /* cache skip  -- v  : push cached value, skip */   \
+    X(OP_CACHED_INT, 2)          /* cache skip  -- i  : same on the integer stack */ \
+    X(OP_CACHE_STORE, 1)         /* cache   v -- v    : cache the value */           \
+    X(OP_CACHE_STORE_INT, 1)     /* cache i -- i    : cache the integer */           \
+    X(OP_ERROR, 1)               /* message           : raise compile error */       \
+    X(OP_LINE, 1)                /* line              : profile line entry */        \
+    X(OP_TRACE, 2)               /* event value       : record a trace event */
+
+#define OPCODE_ENUM(op, operands) op,
+typedef enum { OPCODE_LIST(OPCODE_ENUM) OPCODE_COUNT } Opcode;
+#undef OPCODE_ENUM
+
+#define OPCODE_OPERANDS(op, operands) operands,
+/** @brief Number of operand words of each opcode */
+static const uint8_t opcode_operands[OPCODE_COUNT] = {OPCODE_LIST(OPCODE_OPERANDS)};
+#undef OPCODE_OPERANDS
+
+/** @brief Jump to a program line waiting for its target code offset */
+typedef struct LineFixup {
+    size_t operand;  /**< Code offset of the jump target operand */
+    int line_number; /**< Target line number */
+    Opcode op;       /**< Jump instruction (OP_JUMP, OP_GOSUB) */
+} LineFixup;
+
+/**
+ * @brief Start of the code of a program line in a patched program
+ *
+ * A line edited after the program was compiled gets its code appended, so
+ * code offsets no longer follow line numbers. The spans keep the line of
+ * every piece of code in code order.
+ */
+typedef struct LineSpan {
+    size_t offset;            /**< First instruction word of the code */
+    struct ProgramLine* line; /**< Line compiled there, NULL once deleted */
+} LineSpan;
+
+/**
+ * @brief Variable read of a compiled expression
+ *
+ * Binding the variable to a host location rewrites the OP_LOAD of every
+ * read of it into an OP_LOAD_HOST of its entry here, unbinding restores the
+ * OP_LOAD.
+ */
+typedef struct VariableLoad {
+    size_t operand;         /**< Code offset of the instruction operand */
+    int32_t slot;           /**< Context variable slot read without binding */
+    const g2basic_number_t* location; /**< Bound host location */
+} VariableLoad;
+
+/**
+ * @brief Compiled bytecode chunk
+ *
+ * Holds the instructions produced by the compiler together with the tables
+ * their operands refer to. The stored program is compiled into one chunk as
+ * a whole, immediate mode lines are compiled into a separate scratch chunk.
+ * Clearing a chunk keeps its buffers, so recompiling does not allocate
+ * unless it outgrows them.
+ *
+ * GOTO and GOSUB targets are bound to code offsets when the program is
+ * compiled, so a taken branch costs a single operand load. Jumps to lines
+ * that do not exist compile to OP_GOTO, which reports the missing line when
+ * it is reached.
+ */
+typedef struct Chunk {
+    int32_t* code;                /**< Instruction words */
+    size_t code_count;            /**< Number of used instruction words */
+    size_t code_capacity;         /**< Allocated instruction words */
+    g2basic_number_t* constants;  /**< Constant pool */
+    size_t constant_count;        /**< Number of used constants */
+    size_t constant_capacity;     /**< Allocated constants */
+    const struct Function** functions; /**< Functions referenced by the code */
+    size_t function_count;        /**< Number of referenced functions */
+    size_t function_capacity;     /**< Allocated function references */
+    char** messages;              /**< Compile error messages (OP_ERROR) */
+    size_t message_count;         /**< Number of messages */
+    size_t message_capacity;      /**< Allocated messages */
+    LineFixup* fixups;            /**< Jumps to program lines, kept to rebind
+                                       them when a line is edited */
+    size_t fixup_count;           /**< Number of line jumps */
+    size_t fixup_capacity;        /**< Allocated line jumps */
+    LineSpan* spans;              /**< Lines in code order, once patched */
+    size_t span_count;            /**< Number of spans, 0 when not patched */
+    size_t span_capacity;         /**< Allocated spans */
+    size_t compiled_count;        /**< Instruction words of the last full
+                                       compile */
+    size_t cache_count;           /**< Cache slots used by the code */
+    VariableLoad* loads;          /**< Variable reads (compiled expressions) */
+    size_t load_count;            /**< Number of variable reads */
+    size_t load_capacity;         /**< Allocated variable reads */
+    int max_depth;                /**< Deepest operand stack use */
+    bool out_of_memory;           /**< Set when a buffer failed to grow */
+    bool immediate;               /**< RETURN never jumps, NEXT only jumps
+                                       back to a FOR of the same line */
+    bool borrowed;                /**< Code, constants and messages belong to a
+                                       program image */
+    g2basic_memory_kind_t kind;   /**< Memory kind of the buffers */
+} Chunk;
+
+/** @brief Reason the virtual machine stopped */
+typedef enum {
+    VM_DONE,           /**< OP_END reached */
+    VM_ERROR,          /**< Runtime or compile error raised */
+    VM_LINE_NOT_FOUND, /**< GOTO/GOSUB to a line that does not exist */
+    VM_YIELD,          /**< Step budget used up, resume at exit->pc */
+    VM_WAIT,           /**< A function call waits, resume at exit->pc once
+                            it completed */
+} VmStatus;
+
+/** @brief Details of how the virtual machine stopped */
+typedef struct VmExit {
+    g2basic_number_t result; /**< Last value stored by OP_RESULT */
+    const char* error;       /**< Error message (VM_ERROR) */
+    size_t pc;               /**< Code offset of the failing instruction, or
+                                  the one to resume at (VM_YIELD) */
+    int line_number;         /**< Missing target line (VM_LINE_NOT_FOUND) */
+} VmExit;
+
+/** @brief State of the function call a stepped run waits for */
+typedef enum {
+    CALL_NONE,     /**< No call is waiting */
+    CALL_PENDING,  /**< Waiting for g2basic_ctx_complete_call() */
+    CALL_COMPLETE, /**< Result delivered, the run resumes with it */
+} CallState;
+
+/**
+ * @brief Operand stacks of a run parked in a function call
+ *
+ * Allocated when the first function that may wait is registered, so
+ * waiting does not allocate.
+ */
+typedef struct CallWait {
+    CallState state;                    /**< State of the call */
+    g2basic_number_t result;            /**< Result (CALL_COMPLETE) */
+    size_t value_count;                 /**< Saved operand stack entries */
+    size_t integer_count;               /**< Saved integer stack entries */
+    g2basic_number_t values[VM_STACK_SIZE]; /**< Operand stack below the
+                                                 arguments */
+    int32_t integers[VM_STACK_SIZE];    /**< Integer operand stack */
+} CallWait;
+
+/** @brief Loop invariant value, kept by OP_CACHE_STORE for OP_CACHED */
+typedef struct CachedValue {
+    g2basic_number_t value; /**< Cached number (OP_CACHE_STORE) */
+    int32_t integer;        /**< Cached integer (OP_CACHE_STORE_INT) */
+    bool valid;             /**< Stored since the last OP_CACHE_RESET */
+} CachedValue;
+
+/** @brief Memory statistics of one memory use, kept apart by memory kind */
+typedef struct MemoryAccount {
+    size_t live_bytes[2];  /**< Bytes not released, by memory kind */
+    size_t live_blocks[2]; /**< Blocks not released, by memory kind */
+    size_t peak_bytes;     /**< Highest sum of live_bytes */
+    size_t allocations;    /**< Blocks allocated */
+    size_t frees;          /**< Blocks released */
+} MemoryAccount;
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* Interpreter context - all mutable interpreter state */
+
+/**
+ * @brief Interpreter context
+ *
+ * Holds the complete state of one interpreter instance. Nothing else in the
+ * interpreter is mutable, so independent contexts can be used from different
+ * threads at the same time without locking. The original single-instance API
+ * works on a statically allocated default context.
+ */
+struct g2basic_ctx {
+    g2basic_allocator_t allocator; /**< Allocator for all context memory */
+    size_t allocation_count;       /**< Number of heap allocations made */
+    MemoryAccount memory[G2BASIC_MEMORY_USE_COUNT]; /**< Memory statistics by use */
+    size_t memory_live;            /**< Bytes not released, in total */
+    size_t memory_peak;            /**< Highest value of memory_live */
+    Variable** variable_buckets;  /**< Variable symbol hash table */
+    size_t variable_bucket_count; /**< Size of the hash table */
+    Variable** variable_symbols;  /**< Symbol of each slot, for messages */
+    g2basic_number_t* variable_values; /**< Variable values, by slot */
+    int32_t* integer_values;      /**< Integer variable values, by slot */
+    size_t variable_count;        /**< Number of used slots */
+    size_t variable_capacity;     /**< Allocated slots */
+    Array** arrays;               /**< Array symbols, by slot */
+    size_t array_count;           /**< Number of used array slots */
+    size_t array_capacity;        /**< Allocated array slots */
+    size_t declared_arrays;       /**< Arrays declared so far */
+    bool array_rejected;          /**< Code compiled since the last full
+                                       compile took an undeclared array for a
+                                       function */
+    Function* functions_head;     /**< Head of custom functions linked list */
+    Function** function_buckets;  /**< Function name hash table */
+    size_t function_bucket_count; /**< Size of the function hash table */
+    size_t function_count;        /**< Number of custom functions */
+    ProgramLine* program_head;    /**< Head of program lines linked list */
+    ProgramLine** line_index;     /**< Program lines sorted by line number */
+    size_t line_count;            /**< Number of program lines */
+    size_t line_index_capacity;   /**< Allocated line index entries */
+    ProgramLine* loaded_lines;    /**< Lines of g2basic_ctx_load_program() */
+    uint8_t* loaded_tokens;       /**< Token streams of the loaded lines (or
+                                       the copy of a program image) */
+    size_t loaded_line_count;     /**< Allocated loaded_lines entries */
+    size_t loaded_token_size;     /**< Allocated loaded_tokens bytes */
+    ForLoop* for_stack;           /**< FOR loops stack */
+    size_t for_depth;             /**< Number of active FOR loops */
+    size_t for_capacity;          /**< Allocated FOR loop frames */
+    size_t for_peak_depth;        /**< Deepest FOR loop nesting */
+    GosubStackEntry* gosub_stack; /**< GOSUB call stack */
+    size_t gosub_depth;           /**< Number of pending RETURNs */
+    size_t gosub_capacity;        /**< Allocated GOSUB frames */
+    size_t gosub_peak_depth;      /**< Deepest GOSUB nesting */
+    Chunk program_chunk;          /**< Compiled form of the stored program */
+    Chunk immediate_chunk;        /**< Scratch chunk for immediate mode lines */
+    bool program_dirty;           /**< Program changed since last compile */
+    bool run_active;              /**< Stepped run begun and not finished */
+    size_t run_pc;                /**< Code offset the stepped run resumes at */
+    bool program_running;         /**< The VM runs program_chunk, which must not
+                                       be patched under it */
+    CallWait* call_wait;          /**< Parked function call, NULL until a
+                                       function that may wait is registered */
+    CachedValue* caches;          /**< Loop invariant values, by cache slot */
+    size_t cache_capacity;        /**< Allocated cache slots */
+#ifdef G2BASIC_PROFILE
+    g2basic_clock_func_t profile_clock; /**< Clock timing the lines */
+    void* profile_clock_context;        /**< Argument of profile_clock */
+    ProgramLine* profile_line;          /**< Line the clock runs for */
+    uint64_t profile_start;             /**< Clock reading at its start */
+    uint64_t builtin_profile_calls[BUILTIN_FUNCTION_COUNT]; /**< Calls of the built-in functions */
+#endif
+#ifdef G2BASIC_TRACE
+    g2basic_trace_ring_t* trace_ring;   /**< Ring buffer receiving the trace, or NULL */
+    g2basic_clock_func_t trace_clock;   /**< Clock stamping the trace records */
+    void* trace_clock_context;          /**< Argument of trace_clock */
+    int32_t trace_line;                 /**< Line running, 0 outside of the program */
+#endif
+    void (*print_function)(const char* str); /**< User output function */
+    g2basic_write_func_t write_function; /**< Length-aware output sink */
+    void* write_context;                 /**< Argument of write_function */
+    size_t output_length;                /**< Bytes waiting in output */
+    char output[G2BASIC_OUTPUT_BUFFER_SIZE + 1]; /**< Output buffer (and NUL
+                                                    for print_function) */
+    char message[64]; /**< Buffer for formatted error messages */
+};
 
-static Variable* variables_head = NULL; /**< Head of variables linked list */
-static Function* functions_head = NULL; /**< Head of functions linked list */
-static ProgramLine* program_head =
-    NULL;                    /**< Head of program lines linked list */
-static int goto_target = -1; /**< Target line number for GOTO (-1 = no jump) */
-static ForLoop* for_stack_head =
-    NULL; /**< Head of FOR loops stack (linked list) */
-static int current_line_index = -1; /**< Current executing line index */
-static GosubStackEntry* gosub_stack_head =
-    NULL; /**< Head of GOSUB stack (linked list) */
+static g2basic_ctx_t default_ctx; /**< Context of the single-instance API */
+
+/**
+ * @brief Compiled expression
+ *
+ * An expression compiled once by g2basic_ctx_compile_expr() and evaluated
+ * any number of times without touching its source text again.
+ */
+#if JIT_ENABLED
+/**
+ * @brief Native code of a compiled expression
+ *
+ * @return -1 on success, otherwise the code offset of the failing instruction
+ */
+typedef int32_t (*JitEntry)(const g2basic_number_t* values, const int32_t* integers, g2basic_number_t* result);
+
+/** @brief Executable pages holding the native code of a compiled expression */
+typedef struct JitCode {
+    void* memory;   /**< Mapped pages, NULL when the expression runs in the VM */
+    size_t size;    /**< Size of the mapping */
+    JitEntry entry; /**< Entry point inside memory */
+} JitCode;
+#endif
+
+struct g2basic_expr {
+    g2basic_ctx_t* ctx; /**< Context owning variables and functions */
+    Chunk chunk;        /**< Code computing the value, ends in OP_RESULT */
+    BatchLanes* lanes;  /**< Batch operand stack, allocated on first use */
+#if JIT_ENABLED
+    JitCode jit; /**< Native code, regenerated whenever a binding changes */
+#endif
+};
 
-// Print function pointer for output
-static void (*print_function)(const char* str) =
-    NULL; /**< User-provided print function for output */
 
 /*--------------------------------------------------------------------------------------------------------------------*/
 
 /**
  * @brief Expression parser state structure
  *
- * Maintains the state of the recursive descent parser during expression
- * evaluation and statement parsing. The parser works by advancing through
- * the input string character by character, maintaining position and error
- * state.
+ * Maintains the state of the recursive descent parser while it compiles a
+ * line into bytecode. The parser works by advancing through the token stream
+ * of a line token by token, emitting instructions into the target chunk in
+ * evaluation order.
  *
  * The parser supports:
  * - Mathematical expressions with operator precedence
@@ -231,67 +749,151 @@ static void (*print_function)(const char* str) =
  * - BASIC language statements and control flow
  * - Error reporting with position information
  *
- * @note The parser temporarily modifies the input string during parsing
- * @note Error messages are statically allocated string literals
+ * A syntax error does not abort compilation of the program: the parser
+ * emits an OP_ERROR instruction at the point of the error, so the error is
+ * reported when (and only if) execution reaches it.
+ *
+ * @note The token stream is never modified during parsing
+ * @note Error messages are string literals or formatted into the message
+ * buffer of the context
  */
 typedef struct {
-    const char*
-        start; /**< Beginning of the input string (for position reporting) */
-    const char* s;   /**< Current parsing cursor position */
-    const char* err; /**< Error message string (NULL if no error) */
+    g2basic_ctx_t* ctx; /**< Interpreter the line is compiled for */
+    const uint8_t*
+        start; /**< Beginning of the token stream (for position reporting) */
+    const uint8_t* s; /**< Current parsing cursor position */
+    const char* err;  /**< Error message string (NULL if no error) */
+    Chunk* chunk;     /**< Chunk receiving the compiled instructions */
+    bool immediate;   /**< Compiling an immediate mode line */
+    bool expression;  /**< Compiling a standalone expression */
+    int depth;        /**< Operand stack depth at the current position */
+    size_t recent[3]; /**< Code offsets of the last instructions, newest
+                         first, for the peephole optimizer */
+    int recent_count; /**< Valid entries of recent */
+    int constant_run; /**< OP_PUSH_CONST instructions ending the code */
+    struct Hoist* hoist; /**< Loop analysis of the program, NULL when no value
+                            is cached */
+    unsigned variant;    /**< Values emitted so far that the innermost
+                            analyzed loop may change */
+    int branches;        /**< IF branches around the cursor */
 } Parser;
+
+/**
+ * @brief Type of the value a compiled expression leaves on the operand stack
+ *
+ * Expressions are typed at compile time, so the virtual machine never checks
+ * types: integer variables and the operations on them compile to the *_INT
+ * instructions, and mixing them with numbers converts the integers.
+ */
+typedef enum {
+    VALUE_NUMBER,  /**< g2basic_number_t on the number stack */
+    VALUE_INTEGER, /**< int32_t on the integer stack */
+} ValueType;
 /*--------------------------------------------------------------------------------------------------------------------*/
 typedef struct Keyword {
     const char* word;
-    double (*parser_func)(Parser* p);
+    void (*parser_func)(Parser* p); /**< Statement compiler (NULL for keywords
+                                       that do not start a statement) */
 } Keyword;
 /*--------------------------------------------------------------------------------------------------------------------*/
+/** @brief Keyword indexes, in the order of the keywords[] table */
+enum {
+    KEYWORD_PRINT,
+    KEYWORD_GOTO,
+    KEYWORD_IF,
+    KEYWORD_FOR,
+    KEYWORD_NEXT,
+    KEYWORD_GOSUB,
+    KEYWORD_RETURN,
+    KEYWORD_END,
+    KEYWORD_THEN,
+    KEYWORD_TO,
+    KEYWORD_STEP,
+    KEYWORD_DIM,
+    KEYWORD_FILL,
+    KEYWORD_COPY,
+    KEYWORD_ELSE,
+};
+/*--------------------------------------------------------------------------------------------------------------------*/
 /* Forward declarations (grammar):
+   line := statement (':' statement)*
    statement := assignment | print_stmt | goto_stmt | if_stmt | for_stmt |
-   next_stmt | gosub_stmt | return_stmt | expr
-   assignment := VARIABLE '=' expr
+   next_stmt | gosub_stmt | return_stmt | dim_stmt | fill_stmt | copy_stmt |
+   expr
+   assignment := (VARIABLE | element) '=' expr
    print_stmt := 'PRINT' expr_list
    goto_stmt := 'GOTO' NUMBER
    gosub_stmt := 'GOSUB' NUMBER
    return_stmt := 'RETURN'
-   if_stmt := 'IF' comparison 'THEN' (NUMBER | statement)
+   if_stmt := 'IF' comparison 'THEN' branch ['ELSE' branch]
+   branch := NUMBER | statement (':' statement)*   (up to ELSE or the end of the line)
    for_stmt := 'FOR' VARIABLE '=' expr 'TO' expr ['STEP' expr]
    next_stmt := 'NEXT' VARIABLE
+   dim_stmt := 'DIM' element (',' element)*
+   fill_stmt := 'FILL' ARRAY ',' expr
+   copy_stmt := 'COPY' ARRAY 'TO' ARRAY
    comparison := expr ('>'|'<'|'>='|'<='|'='|'<>') expr
    expr_list := expr (',' expr)*
    expr  := term (('+'|'-') term)*
    term  := factor (('*'|'/') factor)*
-   factor := NUMBER | VARIABLE | FUNCTION_CALL | '(' expr ')' | ('+'|'-') factor
-   (unary)
+   factor := NUMBER | VARIABLE | FUNCTION_CALL | element | array_call |
+   '(' expr ')' | ('+'|'-') factor (unary)
    function_call := IDENTIFIER '(' arg_list ')'
    arg_list := expr (',' expr)*
+   element := ARRAY '(' expr ')'   (an identifier that is not a function)
+   array_call := ('sum' | 'mean') '(' ARRAY ')' | 'dot' '(' ARRAY ',' ARRAY ')'
+   VARIABLE := IDENTIFIER ['%']   (a trailing '%' makes an integer variable)
+   ARRAY := IDENTIFIER
 */
 /*--------------------------------------------------------------------------------------------------------------------*/
-static int g2basic_eval(const char* expr, double* result, const char** error);
+static int g2basic_eval(g2basic_ctx_t* ctx, const uint8_t* tokens,
+                        g2basic_number_t* result,
+                        const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_expr(Parser* p);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_cached_expr(Parser* p);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int compile_program(g2basic_ctx_t* ctx);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static VmStatus vm_execute(g2basic_ctx_t* ctx, const Chunk* chunk, size_t start_pc, size_t budget,
+                           VmExit* exit);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static struct ProgramLine* find_line_at_offset(g2basic_ctx_t* ctx, size_t pc);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void patch_stored_line(g2basic_ctx_t* ctx, struct ProgramLine* line, bool added);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void patch_deleted_line(g2basic_ctx_t* ctx, struct ProgramLine* line);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_statement(Parser* p);
+/** @brief Compile ':' separated statements up to the end of the line or an ELSE */
+static void parse_statements(Parser* p);
+/*--------------------------------------------------------------------------------------------------------------------*/
+static const uint8_t* skip_ws(const uint8_t* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_expr(Parser* p);
+static const char* skip_text_ws(const char* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_statement(Parser* p);
+static void parse_print_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static const char* skip_ws(const char* p);
+static void parse_goto_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static const char* skip_word(const char* p, const char* word);
+static void parse_if_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_print_statement(Parser* p);
+static void parse_for_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_goto_statement(Parser* p);
+static void parse_next_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_if_statement(Parser* p);
+static void parse_gosub_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_for_statement(Parser* p);
+static void parse_return_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_next_statement(Parser* p);
+static void parse_end_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_gosub_statement(Parser* p);
+static void parse_dim_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_return_statement(Parser* p);
+static void parse_fill_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_end_statement(Parser* p);
+static void parse_copy_statement(Parser* p);
 /*--------------------------------------------------------------------------------------------------------------------*/
 static const Keyword keywords[] = {
     {G2BASIC_KEYWORD_PRINT, parse_print_statement},
@@ -302,1271 +904,7630 @@ static const Keyword keywords[] = {
     {G2BASIC_KEYWORD_GOSUB, parse_gosub_statement},
     {G2BASIC_KEYWORD_RETURN, parse_return_statement},
     {G2BASIC_KEYWORD_END, parse_end_statement},
+    {G2BASIC_KEYWORD_THEN, NULL},
+    {G2BASIC_KEYWORD_TO, NULL},
+    {G2BASIC_KEYWORD_STEP, NULL},
+    {G2BASIC_KEYWORD_DIM, parse_dim_statement},
+    {G2BASIC_KEYWORD_FILL, parse_fill_statement},
+    {G2BASIC_KEYWORD_COPY, parse_copy_statement},
+    {G2BASIC_KEYWORD_ELSE, NULL},
     {NULL, NULL}  // Sentinel
 };
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void safe_print(const char* str) {
-    if (print_function != NULL) {
-        print_function(str);
-    }
-}
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void safe_printf(const char* format, ...) {
-    if (print_function != NULL) {
-        char buffer[512];
-        va_list args;
-        va_start(args, format);
-        vsnprintf(buffer, sizeof(buffer), format, args);
-        va_end(args);
-        print_function(buffer);
-    }
+/* HEAP ALLOCATION WRAPPERS - every allocation of the interpreter goes
+ * through these to the configured allocator, so they can be counted
+ */
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void* libc_alloc(void* context, g2basic_memory_kind_t kind, size_t size) {
+    (void)context;
+    (void)kind;
+    return malloc(size);
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static int is_alpha_or_underscore(char c) {
-    return isalpha((unsigned char)c) || c == '_';
+static void* libc_realloc(void* context,
+                          g2basic_memory_kind_t kind,
+                          void* ptr,
+                          size_t size) {
+    (void)context;
+    (void)kind;
+    return realloc(ptr, size);
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static int is_alnum_or_underscore(char c) {
-    return isalnum((unsigned char)c) || c == '_';
+static void libc_free(void* context, g2basic_memory_kind_t kind, void* ptr) {
+    (void)context;
+    (void)kind;
+    free(ptr);
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static char* parse_identifier(Parser* p) {
-    if (!is_alpha_or_underscore(*p->s)) {
-        return NULL;
-    }
-
-    const char* start = p->s;
-    const char* end = p->s;
-    while (is_alnum_or_underscore(*end)) {
-        end++;
+/** @brief Allocator used when none is given to g2basic_init_with_allocator() */
+static const g2basic_allocator_t default_allocator = {
+    .alloc = libc_alloc,
+    .realloc = libc_realloc,
+    .free = libc_free,
+    .reset = NULL,
+    .context = NULL,
+};
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Account a block of @p size bytes as allocated for @p use
+ */
+static void memory_account_alloc(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind,
+                                 g2basic_memory_use_t use,
+                                 size_t size) {
+    MemoryAccount* account = &ctx->memory[use];
+    account->live_bytes[kind] += size;
+    account->live_blocks[kind]++;
+    account->allocations++;
+    size_t live = account->live_bytes[G2BASIC_MEMORY_STATE] + account->live_bytes[G2BASIC_MEMORY_PROGRAM];
+    if (live > account->peak_bytes) {
+        account->peak_bytes = live;
     }
-
-    int len = end - start;
-    if (len == 0) {
-        return NULL;
+    ctx->memory_live += size;
+    if (ctx->memory_live > ctx->memory_peak) {
+        ctx->memory_peak = ctx->memory_live;
     }
-
-    char* identifier = (char*)calloc(len + 1, sizeof(char));
-    if (identifier == NULL) {
-        return NULL;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Account a block of @p size bytes of @p use as released
+ */
+static void memory_account_free(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind,
+                                g2basic_memory_use_t use,
+                                size_t size) {
+    MemoryAccount* account = &ctx->memory[use];
+    account->live_bytes[kind] -= size;
+    account->live_blocks[kind]--;
+    account->frees++;
+    ctx->memory_live -= size;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void* mem_alloc(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind, g2basic_memory_use_t use, size_t size) {
+    ctx->allocation_count++;
+    void* ptr = ctx->allocator.alloc(ctx->allocator.context, kind, size);
+    if (ptr != NULL) {
+        memory_account_alloc(ctx, kind, use, size);
     }
-
-    strncpy(identifier, start, len);
-    identifier[len] = '\0';
-    p->s = end;
-
-    return identifier;
+    return ptr;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double get_variable(const char* name) {
-    Variable* current = variables_head;
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0) {
-            return current->value;
-        }
-        current = current->next;
+static void* mem_calloc(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind, g2basic_memory_use_t use,
+                        size_t count,
+                        size_t size) {
+    void* ptr = mem_alloc(ctx, kind, use, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
     }
-    return NAN;
+    return ptr;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void set_variable(const char* name, double value) {
-    Variable* current = variables_head;
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0) {
-            current->value = value;
-            return;
+/**
+ * @brief Resize a block of @p old_size bytes (none if @p ptr is NULL)
+ */
+static void* mem_realloc(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind, g2basic_memory_use_t use,
+                         void* ptr,
+                         size_t old_size,
+                         size_t size) {
+    ctx->allocation_count++;
+    void* grown = ctx->allocator.realloc(ctx->allocator.context, kind, ptr, size);
+    if (grown != NULL) {
+        if (ptr != NULL) {
+            memory_account_free(ctx, kind, use, old_size);
         }
-        current = current->next;
-    }
-
-    Variable* new_var = (Variable*)calloc(1, sizeof(Variable));
-    if (new_var == NULL) {
-        return;
-    }
-
-    // Allocate memory for name
-    new_var->name = (char*)calloc(strlen(name) + 1, sizeof(char));
-    if (new_var->name == NULL) {
-        free(new_var);
-        return;  // Memory allocation failed
+        memory_account_alloc(ctx, kind, use, size);
     }
-
-    strcpy(new_var->name, name);
-    new_var->value = value;
-    new_var->next = variables_head;  // Insert at head
-    variables_head = new_var;
+    return grown;
 }
-
-/*--------------------------------------------------------------------------------------------------------------------*/
-/* MEMORY MANAGEMENT FUNCTIONS */
 /*--------------------------------------------------------------------------------------------------------------------*/
-
 /**
- * @brief Clear all variables from memory
- * 
- * Frees all dynamically allocated variables and their associated memory.
- * This includes freeing the variable name strings and the variable structures
- * themselves. After calling this function, the variables list will be empty.
- * 
- * @note This function is called during interpreter initialization and cleanup
- * @note All variable values are lost when this function is called
+ * @brief Release a block of @p size bytes
+ *
+ * The statistics need the size, allocators do not store it for the
+ * interpreter.
  */
-static void clear_all_variables(void) {
-    Variable* current = variables_head;
-    while (current != NULL) {
-        Variable* to_delete = current;
-        current = current->next;
-        free(to_delete->name);
-        free(to_delete);
+static void mem_free(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind, g2basic_memory_use_t use,
+                     void* ptr,
+                     size_t size) {
+    if (ptr != NULL) {
+        ctx->allocator.free(ctx->allocator.context, kind, ptr);
+        memory_account_free(ctx, kind, use, size);
     }
-    variables_head = NULL;
 }
-
+/*--------------------------------------------------------------------------------------------------------------------*/
 /**
- * @brief Clear all registered functions from memory
- * 
- * Frees all dynamically allocated function registrations and their associated
- * memory. This includes freeing the function name strings and the function
- * structures themselves. Built-in functions will be re-registered during
- * interpreter initialization.
- * 
- * @note This function is called during interpreter initialization
- * @note All custom registered functions are lost when this function is called
+ * @brief Check whether memory is released with a single reset per kind
+ *
+ * When the allocator can reset a whole memory kind at once (like the bundled
+ * arena), the clear_all_* functions just forget their structures instead of
+ * freeing them node by node.
  */
-static void clear_all_functions(void) {
-    Function* current = functions_head;
-    while (current != NULL) {
-        Function* to_delete = current;
-        current = current->next;
-        free(to_delete->name);
-        free(to_delete);
-    }
-    functions_head = NULL;
+static bool memory_bulk_release(g2basic_ctx_t* ctx) {
+    return ctx->allocator.reset != NULL;
 }
-
+/*--------------------------------------------------------------------------------------------------------------------*/
 /**
- * @brief Clear all program lines from memory
- * 
- * Frees all stored BASIC program lines and their associated memory.
- * This includes freeing the program line text strings and the program line
- * structures themselves. After calling this function, no program will be
- * stored in memory.
- * 
- * @note This function is called during interpreter initialization
- * @note The entire stored BASIC program is lost when this function is called
+ * @brief Release a whole memory kind at once
+ *
+ * Everything still allocated from @p kind counts as released.
  */
-static void clear_all_program_lines(void) {
-    ProgramLine* current = program_head;
-    while (current != NULL) {
-        ProgramLine* to_delete = current;
-        current = current->next;
-        free(to_delete->text);
-        free(to_delete);
+static void memory_reset(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind) {
+    ctx->allocator.reset(ctx->allocator.context, kind);
+    for (size_t use = 0; use < G2BASIC_MEMORY_USE_COUNT; use++) {
+        MemoryAccount* account = &ctx->memory[use];
+        ctx->memory_live -= account->live_bytes[kind];
+        account->frees += account->live_blocks[kind];
+        account->live_bytes[kind] = 0;
+        account->live_blocks[kind] = 0;
     }
-    program_head = NULL;
 }
-
+/*--------------------------------------------------------------------------------------------------------------------*/
 /**
- * @brief Clear all FOR loop state from memory
- * 
- * Frees all FOR loop state structures and their associated memory.
- * This includes freeing the loop variable name strings and the loop
- * structures themselves. This effectively resets all FOR loop nesting.
- * 
- * @note This function is called during interpreter initialization and program execution
- * @note All nested FOR loops are terminated when this function is called
+ * @brief Make room for @p needed items in a growable buffer
+ *
+ * @return The (possibly moved) buffer, or NULL if it could not grow. The
+ * original buffer stays valid on failure.
  */
-static void clear_all_for_loops(void) {
-    ForLoop* current = for_stack_head;
-    while (current != NULL) {
-        ForLoop* next = current->next;
-        if (current->var_name != NULL) {
-            free(current->var_name);
-        }
-        free(current);
-        current = next;
+static void* grow_buffer(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind,
+                         g2basic_memory_use_t use,
+                         void* items,
+                         size_t* capacity,
+                         size_t item_size,
+                         size_t needed) {
+    if (needed <= *capacity) {
+        return items;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void* grown = mem_realloc(ctx, kind, use, items, *capacity * item_size, new_capacity * item_size);
+    if (grown == NULL) {
+        return NULL;
     }
-    for_stack_head = NULL;
+    *capacity = new_capacity;
+    return grown;
 }
-
+/*--------------------------------------------------------------------------------------------------------------------*/
 /**
- * @brief Clear all GOSUB call stack from memory
- * 
- * Frees all GOSUB subroutine call stack entries and their associated memory.
- * This effectively clears all pending RETURN addresses and resets the
- * subroutine call stack to empty.
- * 
- * @note This function is called during interpreter initialization and program execution
- * @note All nested GOSUB calls are cleared when this function is called
+ * @brief Pass the buffered output on to the output sink
+ *
+ * Output goes to the length-aware sink when one is set, otherwise to the
+ * NUL-terminated print function.
  */
-static void clear_all_gosub_stack(void) {
-    GosubStackEntry* current = gosub_stack_head;
-    while (current != NULL) {
-        GosubStackEntry* next = current->next;
-        free(current);
-        current = next;
+static void output_flush(g2basic_ctx_t* ctx) {
+    if (ctx->output_length == 0) {
+        return;
+    }
+    if (ctx->write_function != NULL) {
+        ctx->write_function(ctx->write_context, ctx->output, ctx->output_length);
+    } else if (ctx->print_function != NULL) {
+        ctx->output[ctx->output_length] = '\0';
+        ctx->print_function(ctx->output);
     }
-    gosub_stack_head = NULL;
+    ctx->output_length = 0;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static ProgramLine* find_program_line(int line_number) {
-    ProgramLine* current = program_head;
-    while (current != NULL) {
-        if (current->line_number == line_number) {
-            return current;
+/**
+ * @brief Append output to the buffer
+ *
+ * The buffer is flushed after every newline and whenever it is full, so the
+ * sink is called about once per line instead of once per printed item.
+ */
+static void output_write(g2basic_ctx_t* ctx, const char* data, size_t length) {
+    while (length > 0) {
+        size_t count = G2BASIC_OUTPUT_BUFFER_SIZE - ctx->output_length;
+        if (count > length) {
+            count = length;
+        }
+        const char* newline = memchr(data, '\n', count);
+        if (newline != NULL) {
+            count = (size_t)(newline - data) + 1;
+        }
+        memcpy(ctx->output + ctx->output_length, data, count);
+        ctx->output_length += count;
+        data += count;
+        length -= count;
+        if (newline != NULL || ctx->output_length == G2BASIC_OUTPUT_BUFFER_SIZE) {
+            output_flush(ctx);
         }
-        current = current->next;
     }
-    return NULL;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static ProgramLine* find_next_program_line(int line_number) {
-    ProgramLine* current = program_head;
-    while (current != NULL) {
-        if (current->line_number > line_number) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
+static void safe_print(g2basic_ctx_t* ctx, const char* str) {
+    output_write(ctx, str, strlen(str));
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void insert_program_line_sorted(int line_number, const char* text) {
-    ProgramLine* existing = find_program_line(line_number);
-    if (existing != NULL) {
-        if (existing == program_head) {
-            program_head = existing->next;
-        } else {
-            ProgramLine* prev = program_head;
-            while (prev->next != existing) {
-                prev = prev->next;
-            }
-            prev->next = existing->next;
-        }
-        free(existing->text);
-        free(existing);
-    }
-
-    ProgramLine* new_line = (ProgramLine*)calloc(1, sizeof(ProgramLine));
-    if (new_line == NULL) {
-        return;
+static void safe_printf(g2basic_ctx_t* ctx, const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length > 0) {
+        output_write(ctx, buffer,
+                     (size_t)length < sizeof(buffer) ? (size_t)length
+                                                     : sizeof(buffer) - 1);
     }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* NUMBERS - arithmetic on g2basic_number_t. In the default build these are
+ * the plain double operations. With G2BASIC_FIXED_POINT defined they work on
+ * the fixed-point format with integer instructions only, and fail on
+ * overflow instead of wrapping around.
+ */
+/*--------------------------------------------------------------------------------------------------------------------*/
 
-    new_line->line_number = line_number;
-    new_line->text = (char*)calloc(strlen(text) + 1, sizeof(char));
-    if (new_line->text == NULL) {
-        free(new_line);
-        return;
-    }
-    strcpy(new_line->text, text);
-
-    if (program_head == NULL || program_head->line_number > line_number) {
-        new_line->next = program_head;
-        program_head = new_line;
-    } else {
-        ProgramLine* current = program_head;
-        while (current->next != NULL &&
-               current->next->line_number < line_number) {
-            current = current->next;
-        }
-        new_line->next = current->next;
-        current->next = new_line;
-    }
+/** @brief Value of a number variable that has not been assigned yet */
+#define NUMBER_UNDEFINED G2BASIC_NUMBER_INVALID
+/** @brief Value of an integer variable that has not been assigned yet */
+#define INTEGER_UNDEFINED INT32_MIN
+
+#ifdef G2BASIC_FIXED_POINT
+/** @brief The number 1, value of a true comparison */
+#define NUMBER_ONE G2BASIC_FIXED_ONE
+#else
+/** @brief The number 1, value of a true comparison */
+#define NUMBER_ONE 1.0
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool number_is_undefined(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    return value == NUMBER_UNDEFINED;
+#else
+    return isnan(value);
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static Function* find_function(const char* name) {
-    Function* current = functions_head;
-    while (current != NULL) {
-        if (strcmp(current->name, name) == 0) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
+/**
+ * @brief Check for a zero that leaves every value unchanged when subtracted
+ */
+static bool number_is_positive_zero(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    return value == 0;
+#else
+    return value == 0.0 && !signbit(value);
+#endif
 }
-
 /*--------------------------------------------------------------------------------------------------------------------*/
-
 /**
- * @brief Register a custom function with the expression evaluator
- * 
- * @copydetails g2basic_register_function()
+ * @brief Store a wide intermediate result in 32 bits
+ *
+ * INT32_MIN is left out of the range, it marks undefined values.
+ *
+ * @return false if the value does not fit
  */
-int g2basic_register_function(const char* name,
-                              int arg_count,
-                              double (*func_ptr)(double[], int)) {
-    if (find_function(name) != NULL) {
-        return -1;
-    }
-
-    Function* new_func = (Function*)calloc(1, sizeof(Function));
-    if (new_func == NULL) {
-        return -1;
-    }
-
-    new_func->name = (char*)calloc(strlen(name) + 1, sizeof(char));
-    if (new_func->name == NULL) {
-        free(new_func);
-        return -1;
+static bool narrow_integer(int64_t value, int32_t* result) {
+    if (value > INT32_MAX || value < -INT32_MAX) {
+        return false;
     }
-
-    strcpy(new_func->name, name);
-    new_func->arg_count = arg_count;
-    new_func->func_ptr = func_ptr;
-    new_func->next = NULL;
-
-    new_func->next = functions_head;
-    functions_head = new_func;
-
-    return 0;
+    *result = (int32_t)value;
+    return true;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_sin(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return sin(args[0]);
+static bool number_add(g2basic_number_t a, g2basic_number_t b, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    return narrow_integer((int64_t)a + b, result);
+#else
+    *result = a + b;
+    return true;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_cos(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return cos(args[0]);
+static bool number_sub(g2basic_number_t a, g2basic_number_t b, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    return narrow_integer((int64_t)a - b, result);
+#else
+    *result = a - b;
+    return true;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_tan(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return tan(args[0]);
+#ifdef G2BASIC_FIXED_POINT
+/**
+ * @brief Product of two fixed-point numbers before narrowing to 32 bits
+ *
+ * Rounds to nearest, halves away from zero.
+ */
+static int64_t fixed_product(g2basic_number_t a, g2basic_number_t b) {
+    int64_t product = (int64_t)a * b;
+    int64_t half = (int64_t)1 << (G2BASIC_FIXED_FRACTION_BITS - 1);
+    return product >= 0 ? (product + half) / G2BASIC_FIXED_ONE : -((half - product) / G2BASIC_FIXED_ONE);
 }
+#endif
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_sqrt(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    if (args[0] < 0)
-        return NAN;
-    return sqrt(args[0]);
+static bool number_mul(g2basic_number_t a, g2basic_number_t b, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    return narrow_integer(fixed_product(a, b), result);
+#else
+    *result = a * b;
+    return true;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_abs(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return fabs(args[0]);
+/**
+ * @brief Divide @p a by @p b, which the caller has checked to be nonzero
+ */
+static bool number_div(g2basic_number_t a, g2basic_number_t b, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    return narrow_integer((int64_t)a * G2BASIC_FIXED_ONE / b, result);
+#else
+    *result = a / b;
+    return true;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_pow(double args[], int count) {
-    if (count != 2)
-        return NAN;
-    return pow(args[0], args[1]);
+/**
+ * @brief Add the step to a FOR loop variable
+ *
+ * @return false on overflow or if the variable is undefined, which NaN
+ * reports through the end test instead
+ */
+static bool number_step(g2basic_number_t value, g2basic_number_t step, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    return value != NUMBER_UNDEFINED && narrow_integer((int64_t)value + step, result);
+#else
+    *result = value + step;
+    return true;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_log(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    if (args[0] <= 0)
-        return NAN;
-    return log(args[0]);
+static g2basic_number_t number_abs(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    return value < 0 ? -value : value;
+#else
+    return fabs(value);
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_log10(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    if (args[0] <= 0)
-        return NAN;
-    return log10(args[0]);
+static g2basic_number_t number_floor(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    // Clearing the fraction rounds towards minus infinity in two's
+    // complement, the result is out of range (undefined) only at INT32_MIN
+    return (g2basic_number_t)((uint32_t)value & ~(uint32_t)(G2BASIC_FIXED_ONE - 1));
+#else
+    return floor(value);
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_exp(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return exp(args[0]);
+static g2basic_number_t number_ceil(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    g2basic_number_t floored = number_floor(-value);
+    return floored == NUMBER_UNDEFINED ? NUMBER_UNDEFINED : -floored;
+#else
+    return ceil(value);
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_floor(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return floor(args[0]);
+/**
+ * @brief Convert a double (a literal or a math library result) to a number
+ *
+ * @return The nearest number, NUMBER_UNDEFINED if there is none
+ */
+static g2basic_number_t number_from_double(double value) {
+#ifdef G2BASIC_FIXED_POINT
+    double scaled = value * G2BASIC_FIXED_ONE;
+    if (!(scaled > -(double)INT32_MAX - 0.5 && scaled < (double)INT32_MAX + 0.5)) {
+        return NUMBER_UNDEFINED;
+    }
+    return (g2basic_number_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+#else
+    return value;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_ceil(double args[], int count) {
-    if (count != 1)
-        return NAN;
-    return ceil(args[0]);
+static double number_to_double(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    return (double)value / G2BASIC_FIXED_ONE;
+#else
+    return value;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_min(double args[], int count) {
-    if (count < 1)
-        return NAN;
-    double min_val = args[0];
-    for (int i = 1; i < count; i++) {
-        if (args[i] < min_val)
-            min_val = args[i];
+/**
+ * @brief Convert an integer variable value to a number
+ *
+ * @return false if the integer is out of the range of a fixed-point number
+ */
+static bool integer_to_number(int32_t value, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    return narrow_integer((int64_t)value * G2BASIC_FIXED_ONE, result);
+#else
+    *result = value;
+    return true;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Convert an integer to a number, NUMBER_UNDEFINED if out of range
+ */
+static g2basic_number_t number_from_integer(int32_t value) {
+    g2basic_number_t number;
+    return integer_to_number(value, &number) ? number : NUMBER_UNDEFINED;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Convert a number to an integer variable value, truncating towards
+ * zero
+ *
+ * @return false if the number is undefined or out of the integer range
+ */
+static bool number_to_integer(g2basic_number_t value, int32_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    if (value == NUMBER_UNDEFINED) {
+        return false;
     }
-    return min_val;
+    *result = value >= 0 ? value / G2BASIC_FIXED_ONE : -(-value / G2BASIC_FIXED_ONE);
+    return true;
+#else
+    if (!(value > -2147483648.0 && value < 2147483648.0)) {
+        return false;
+    }
+    *result = (int32_t)value;
+    return true;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double func_max(double args[], int count) {
-    if (count < 1)
-        return NAN;
-    double max_val = args[0];
-    for (int i = 1; i < count; i++) {
-        if (args[i] > max_val)
-            max_val = args[i];
+/**
+ * @brief Check whether a function result reports invalid arguments
+ *
+ * Fixed-point numbers have no NaN to carry on, such a result raises an
+ * error instead.
+ */
+static bool function_failed(g2basic_number_t value) {
+#ifdef G2BASIC_FIXED_POINT
+    return value == G2BASIC_NUMBER_INVALID;
+#else
+    (void)value;
+    return false;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Format the decimal digits of an integer
+ *
+ * @param buffer Receives the text, at least 22 bytes
+ * @return Length of the text
+ */
+static size_t format_integer(uint64_t magnitude, bool negative, char* buffer) {
+    char digits[20];
+    size_t count = 0;
+    size_t length = 0;
+    if (negative) {
+        buffer[length++] = '-';
     }
-    return max_val;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    while (count > 0) {
+        buffer[length++] = digits[--count];
+    }
+    buffer[length] = '\0';
+    return length;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void init_builtin_functions(void) {
-    g2basic_register_function("sin", 1, func_sin);
-    g2basic_register_function("cos", 1, func_cos);
-    g2basic_register_function("tan", 1, func_tan);
-    g2basic_register_function("sqrt", 1, func_sqrt);
-    g2basic_register_function("abs", 1, func_abs);
-    g2basic_register_function("pow", 2, func_pow);
-    g2basic_register_function("log", 1, func_log);
-    g2basic_register_function("log10", 1, func_log10);
-    g2basic_register_function("exp", 1, func_exp);
-    g2basic_register_function("floor", 1, func_floor);
-    g2basic_register_function("ceil", 1, func_ceil);
-    g2basic_register_function("min", -1, func_min);
-    g2basic_register_function("max", -1, func_max);
-}
-/*--------------------------------------------------------------------------------------------------------------------*/
-static void delete_program_line(int line_number) {
-    ProgramLine* to_delete = find_program_line(line_number);
-    if (to_delete == NULL) {
-        return;  // Line not found
+/**
+ * @brief Format a number the way PRINT shows it
+ *
+ * Produces the same text as printf("%.15g"). Integral values, by far the
+ * most common ones in BASIC programs, are converted digit by digit without
+ * going through the printf machinery. Fixed-point numbers are always
+ * converted that way, with the fewest decimals that read back as the same
+ * number.
+ *
+ * @param buffer Receives the text, at least 32 bytes
+ * @return Length of the text
+ */
+static size_t format_number(g2basic_number_t value, char* buffer) {
+#ifdef G2BASIC_FIXED_POINT
+    uint32_t magnitude = value < 0 ? (uint32_t)-(int64_t)value : (uint32_t)value;
+    uint32_t fraction = magnitude & (G2BASIC_FIXED_ONE - 1);
+    size_t length = format_integer(magnitude >> G2BASIC_FIXED_FRACTION_BITS, value < 0, buffer);
+    if (fraction == 0) {
+        return length;
     }
-
-    if (to_delete == program_head) {
-        program_head = to_delete->next;
-    } else {
-        ProgramLine* prev = program_head;
-        while (prev->next != to_delete) {
-            prev = prev->next;
-        }
-        prev->next = to_delete->next;
+    // Ten decimals tell apart even 30 fraction bits
+    uint64_t scale = 1;
+    uint64_t decimals;
+    int count = 0;
+    do {
+        scale *= 10;
+        count++;
+        decimals = ((uint64_t)fraction * scale + G2BASIC_FIXED_ONE / 2) >> G2BASIC_FIXED_FRACTION_BITS;
+    } while (count < 10 && ((decimals << G2BASIC_FIXED_FRACTION_BITS) + scale / 2) / scale != fraction);
+    buffer[length++] = '.';
+    for (int i = count - 1; i >= 0; i--) {
+        buffer[length + (size_t)i] = (char)('0' + decimals % 10);
+        decimals /= 10;
     }
-
-    free(to_delete->text);
-    free(to_delete);
+    length += (size_t)count;
+    while (buffer[length - 1] == '0') {
+        length--;
+    }
+    buffer[length] = '\0';
+    return length;
+#else
+    if (value > -1e15 && value < 1e15 && value == floor(value)) {
+        return format_integer((uint64_t)fabs(value), signbit(value), buffer);
+    }
+    int length = snprintf(buffer, 32, "%.*g", 15, value);
+    return length > 0 ? (size_t)length : 0;
+#endif
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void clear_program(void) {
-    clear_all_program_lines();
+static int is_alpha_or_underscore(char c) {
+    return isalpha((unsigned char)c) || c == '_';
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void list_program(void) {
-    ProgramLine* current = program_head;
-    while (current != NULL) {
-        safe_printf("%d %s\n", current->line_number, current->text);
-        current = current->next;
+static int is_alnum_or_underscore(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static const uint8_t* skip_ws(const uint8_t* p) {
+    while (*p != TOKEN_END && *p < 0x80 && isspace(*p)) {
+        p++;
     }
+    return p;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void insert_program_line(int line_number, const char* text) {
-    insert_program_line_sorted(line_number, text);
+static const char* skip_text_ws(const char* p) {
+    while (*p && isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static int run_program(void) {
-    goto_target = -1;
-    clear_all_for_loops();
-    clear_all_gosub_stack();
-
-    ProgramLine* current_line = program_head;
-
-    while (current_line != NULL) {
-        current_line_index = current_line->line_number;
-        double result;
-
-        const char* p = current_line->text;
-        while (isspace((unsigned char)*p)) {
-            p++;
-        }
-
-        const char* error = NULL;
-        int ret = g2basic_eval(current_line->text, &result, &error);
-        if (ret != 0) {
-            safe_printf("Error in line %d: %s\n", current_line->line_number,
-                        error ? error : "Unknown error");
-            return -1;
-        }
-
-        if (goto_target != -1) {
-            if (goto_target == -2) {
-                break;
-            }
-
-            ProgramLine* target_line = find_program_line(goto_target);
-            if (target_line == NULL) {
-                safe_printf("Error: line %d not found\n", goto_target);
-                return -1;
-            }
-
-            goto_target = -1;            // Reset GOTO target
-            current_line = target_line;  // Jump to target line
-            continue;
-        }
+/* TOKENIZER */
+/*--------------------------------------------------------------------------------------------------------------------*/
 
-        current_line = current_line->next;  // Move to next line
+/**
+ * @brief Token stream writer
+ *
+ * Collects the bytes of a token stream. When @c out is NULL the writer only
+ * counts bytes, which lets the tokenizer size the stream exactly before it
+ * is allocated.
+ */
+typedef struct {
+    uint8_t* out; /**< Output buffer (NULL when only measuring) */
+    size_t len;   /**< Number of bytes emitted so far */
+} TokenWriter;
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_bytes(TokenWriter* w, const void* data, size_t count) {
+    if (w->out != NULL) {
+        memcpy(w->out + w->len, data, count);
     }
-    return 0;  // Success
+    w->len += count;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static bool is_keyword(const char* input, const char* command) {
-    const char* p = skip_ws(input);
-    size_t cmd_len = strlen(command);
-    size_t i;
-    for (i = 0; i < cmd_len; ++i) {
-        if (tolower((unsigned char)p[i]) !=
-            tolower((unsigned char)command[i])) {
-            break;
+static void emit_byte(TokenWriter* w, uint8_t byte) {
+    emit_bytes(w, &byte, 1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_u16(TokenWriter* w, size_t value) {
+    uint8_t bytes[2] = {(uint8_t)(value & 0xFF), (uint8_t)(value >> 8)};
+    emit_bytes(w, bytes, sizeof(bytes));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static size_t read_u16(const uint8_t* p) {
+    return (size_t)p[0] | ((size_t)p[1] << 8);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Fold a word that may be a keyword to uppercase
+ *
+ * Keywords and commands consist of letters only, so anything longer than
+ * the longest of them or containing another character (a digit, '_' or
+ * '%') is rejected on the spot.
+ *
+ * @param folded Receives the uppercase letters, MAX_KEYWORD_LENGTH bytes
+ * @param case_mask Receives a bit for each lowercase letter of @p word
+ * @return false if the word cannot be a keyword
+ */
+static bool fold_word(const char* word, size_t len, char* folded, uint8_t* case_mask) {
+    if (len == 0 || len > MAX_KEYWORD_LENGTH) {
+        return false;
+    }
+    uint8_t mask = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = word[i];
+        if (c >= 'a' && c <= 'z') {
+            mask |= (uint8_t)(1u << i);
+            c = (char)(c - 'a' + 'A');
+        } else if (c < 'A' || c > 'Z') {
+            return false;
         }
+        folded[i] = c;
     }
-    return (i == cmd_len &&
-            (isspace((unsigned char)p[cmd_len]) || p[cmd_len] == '\0'));
+    *case_mask = mask;
+    return true;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static bool handle_basic_command(const char* input) {
-    const char* p = skip_ws(input);
-
-    if (is_keyword(p, "LIST")) {
-        list_program();
-        return true;
+static bool folded_word_is(const char* folded, size_t len, const char* word) {
+    return strlen(word) == len && memcmp(folded, word, len) == 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Recognize a keyword in one pass over the word
+ *
+ * The word is folded once and its first letter selects the only keywords it
+ * can be, at most two. Identifiers, by far the most frequent words, mostly
+ * fail at the first letter or while folding, without any comparison.
+ *
+ * @return Keyword index, or -1 if the word is not a keyword
+ */
+static int find_keyword(const char* word, size_t len, uint8_t* case_mask) {
+    char folded[MAX_KEYWORD_LENGTH];
+    if (!fold_word(word, len, folded, case_mask)) {
+        return -1;
     }
-
-    if (is_keyword(p, "RUN")) {
-        run_program();
-        return true;
+    int candidates[2] = {-1, -1};
+    switch (folded[0]) {
+        case 'C':
+            candidates[0] = KEYWORD_COPY;
+            break;
+        case 'D':
+            candidates[0] = KEYWORD_DIM;
+            break;
+        case 'E':
+            candidates[0] = KEYWORD_END;
+            candidates[1] = KEYWORD_ELSE;
+            break;
+        case 'F':
+            candidates[0] = KEYWORD_FOR;
+            candidates[1] = KEYWORD_FILL;
+            break;
+        case 'G':
+            candidates[0] = KEYWORD_GOTO;
+            candidates[1] = KEYWORD_GOSUB;
+            break;
+        case 'I':
+            candidates[0] = KEYWORD_IF;
+            break;
+        case 'N':
+            candidates[0] = KEYWORD_NEXT;
+            break;
+        case 'P':
+            candidates[0] = KEYWORD_PRINT;
+            break;
+        case 'R':
+            candidates[0] = KEYWORD_RETURN;
+            break;
+        case 'S':
+            candidates[0] = KEYWORD_STEP;
+            break;
+        case 'T':
+            candidates[0] = KEYWORD_THEN;
+            candidates[1] = KEYWORD_TO;
+            break;
+        default:
+            return -1;
     }
-
-    if (is_keyword(p, "NEW")) {
-        clear_program();
-        return true;
+    for (int i = 0; i < 2 && candidates[i] >= 0; i++) {
+        if (folded_word_is(folded, len, keywords[candidates[i]].word)) {
+            return candidates[i];
+        }
     }
-
-    return false;
+    return -1;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_print_statement(Parser* p) {
-    if (*p->s == '\0') {
-        safe_print("\n");
-        return 0.0;
-    }
-
-    int first = 1;
-    do {
-        if (!first) {
-            safe_print(" ");  // Space between expressions
-        }
-        first = 0;
-
-        double value = parse_expr(p);
-        if (p->err) {
-            printf("!\n");
-            return NAN;
-        }
-
-        safe_printf("%.*g", 15, value);
-
-        p->s = skip_ws(p->s);
-        if (*p->s == ',') {
-            p->s++;  // consume comma
-            p->s = skip_ws(p->s);
+/**
+ * @brief Convert BASIC source text into a token stream
+ *
+ * A word is turned into a keyword token under the same rule the interactive
+ * commands use: it must match a keyword (case-insensitively) and be followed
+ * by whitespace, the end of the line or a ':' ending the statement. Any other
+ * word becomes an identifier.
+ *
+ * @param w Token writer receiving the stream
+ * @param text NUL-terminated source text
+ * @param error Set to a static error message on failure
+ * @return 0 on success, -1 on error
+ */
+static int tokenize_into(TokenWriter* w, const char* text, const char** error) {
+    const char* s = text;
+    while (*s != '\0') {
+        unsigned char c = (unsigned char)*s;
+        if (isdigit(c) || (c == '.' && isdigit((unsigned char)s[1]))) {
+            char* endptr = NULL;
+            double value = strtod(s, &endptr);
+            size_t len = endptr - s;
+            if (len > MAX_TOKEN_SPELLING) {
+                *error = "numeric literal too long";
+                return -1;
+            }
+            emit_byte(w, TOKEN_NUMBER);
+            emit_bytes(w, &value, sizeof(value));
+            emit_u16(w, len);
+            emit_bytes(w, s, len);
+            s = endptr;
+        } else if (is_alpha_or_underscore(c)) {
+            const char* end = s;
+            while (is_alnum_or_underscore(*end)) {
+                end++;
+            }
+            if (*end == '%') {
+                end++;  // Integer variable
+            }
+            size_t len = end - s;
+            int keyword = -1;
+            uint8_t case_mask = 0;
+            if (*end == '\0' || *end == ':' || isspace((unsigned char)*end)) {
+                keyword = find_keyword(s, len, &case_mask);
+            }
+            if (keyword >= 0) {
+                emit_byte(w, TOKEN_KEYWORD);
+                emit_byte(w, (uint8_t)keyword);
+                emit_byte(w, case_mask);
+            } else {
+                if (len > MAX_TOKEN_SPELLING) {
+                    *error = "identifier too long";
+                    return -1;
+                }
+                emit_byte(w, TOKEN_IDENTIFIER);
+                emit_u16(w, len);
+                emit_bytes(w, s, len);
+                emit_byte(w, '\0');
+            }
+            s = end;
+        } else if (c >= 0x80) {
+            emit_byte(w, TOKEN_RAW);
+            emit_byte(w, c);
+            s++;
         } else {
-            break;
+            emit_byte(w, c);
+            s++;
         }
-    } while (*p->s != '\0');
-
-    safe_print("\n");  // End with newline
-    return 0.0;        // PRINT statements don't return meaningful values
+    }
+    emit_byte(w, TOKEN_END);
+    return 0;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_goto_statement(Parser* p) {
-    if (!isdigit((unsigned char)*p->s)) {
-        p->err = "GOTO requires a line number";
-        return NAN;
+/**
+ * @brief Tokenize source text into a newly allocated token stream
+ *
+ * @param kind Memory kind to allocate the token stream from
+ * @param use What the token stream is used for
+ * @param text NUL-terminated source text
+ * @param error Set to a static error message on failure
+ * @return Token stream to be released with mem_free(), or NULL on error
+ */
+static uint8_t* tokenize(g2basic_ctx_t* ctx, g2basic_memory_kind_t kind,
+                         g2basic_memory_use_t use,
+                         const char* text,
+                         const char** error) {
+    TokenWriter measure = {.out = NULL, .len = 0};
+    if (tokenize_into(&measure, text, error) != 0) {
+        return NULL;
     }
 
-    char* endptr;
-    long target_line = strtol(p->s, &endptr, 10);
-
-    if (target_line < 0 || target_line > 65535) {
-        p->err = "invalid GOTO line number";
-        return NAN;
+    TokenWriter writer = {.out = (uint8_t*)mem_alloc(ctx, kind, use, measure.len), .len = 0};
+    if (writer.out == NULL) {
+        *error = "memory allocation failed for program line";
+        return NULL;
     }
-
-    p->s = endptr;
-
-    // Set the goto target
-    goto_target = (int)target_line;
-
-    return 0.0;  // GOTO statements don't return meaningful values
+    tokenize_into(&writer, text, error);
+    return writer.out;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_comparison(Parser* p) {
-    double left = parse_expr(p);
-    if (p->err)
-        return NAN;
-
-    p->s = skip_ws(p->s);
-
-    // Parse comparison operator
-    char op1 = *p->s;
-    char op2 = '\0';
-
-    if (op1 == '>' || op1 == '<' || op1 == '=') {
-        p->s++;
-        // Check for two-character operators
-        if (*p->s == '=' || (*p->s == '>' && op1 == '<')) {
-            op2 = *p->s++;
-        }
-    } else {
-        p->err = "expected comparison operator";
-        return NAN;
-    }
-
-    double right = parse_expr(p);
-    if (p->err)
-        return NAN;
-
-    // Evaluate comparison
-    if (op1 == '>' && op2 == '\0') {
-        return (left > right) ? 1.0 : 0.0;
-    } else if (op1 == '<' && op2 == '\0') {
-        return (left < right) ? 1.0 : 0.0;
-    } else if (op1 == '>' && op2 == '=') {
-        return (left >= right) ? 1.0 : 0.0;
-    } else if (op1 == '<' && op2 == '=') {
-        return (left <= right) ? 1.0 : 0.0;
-    } else if (op1 == '=' && op2 == '\0') {
-        return (left == right) ? 1.0 : 0.0;
-    } else if (op1 == '<' && op2 == '>') {
-        return (left != right) ? 1.0 : 0.0;
-    } else {
-        p->err = "unknown comparison operator";
-        return NAN;
+/**
+ * @brief Size in bytes of the token starting at @p t
+ */
+static size_t token_length(const uint8_t* t) {
+    switch (*t) {
+        case TOKEN_NUMBER:
+            return 1 + sizeof(double) + 2 + read_u16(t + 1 + sizeof(double));
+        case TOKEN_IDENTIFIER:
+            return 1 + 2 + read_u16(t + 1) + 1;
+        case TOKEN_KEYWORD:
+            return 3;
+        case TOKEN_RAW:
+            return 2;
+        default:
+            return 1;
     }
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_if_statement(Parser* p) {
-    double condition = parse_comparison(p);
-    if (p->err)
-        return NAN;
-
-    p->s = skip_ws(p->s);
-
-    // Expect THEN keyword
-    if (!is_keyword(p->s, G2BASIC_KEYWORD_THEN)) {
-        p->err = "expected THEN after IF condition";
-        return NAN;
+/**
+ * @brief Size of a token stream including its TOKEN_END
+ */
+static size_t token_stream_length(const uint8_t* t) {
+    size_t length = 0;
+    while (t[length] != TOKEN_END) {
+        length += token_length(t + length);
     }
-    p->s = skip_word(p->s, G2BASIC_KEYWORD_THEN);
-    p->s = skip_ws(p->s);
-
-    // Check if condition is true (non-zero)
-    if (condition != 0.0) {
-        // Condition is true, execute the THEN part
-
-        // Check if THEN is followed by a line number
-        if (isdigit((unsigned char)*p->s)) {
-            // Parse line number and set GOTO target
-            char* endptr;
-            long target_line = strtol(p->s, &endptr, 10);
-
-            if (target_line < 0 || target_line > 65535) {
-                p->err = "invalid IF-THEN line number";
-                return NAN;
+    return length + 1;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Turn a token stream back into its original source text
+ *
+ * @param t Token stream
+ * @param buf Output buffer, always NUL-terminated (truncated if too small)
+ * @param size Size of the output buffer
+ */
+static void detokenize(const uint8_t* t, char* buf, size_t size) {
+    size_t n = 0;
+#define DETOKENIZE_PUT(ch)       \
+    do {                         \
+        if (n + 1 < size) {      \
+            buf[n++] = (char)(ch); \
+        }                        \
+    } while (0)
+
+    while (*t != TOKEN_END) {
+        switch (*t) {
+            case TOKEN_NUMBER: {
+                size_t len = read_u16(t + 1 + sizeof(double));
+                const uint8_t* spelling = t + 1 + sizeof(double) + 2;
+                for (size_t i = 0; i < len; i++) {
+                    DETOKENIZE_PUT(spelling[i]);
+                }
+                break;
             }
-
-            p->s = endptr;
-            goto_target = (int)target_line;
-            return 0.0;
-        } else {
-            return parse_statement(p);
+            case TOKEN_IDENTIFIER: {
+                size_t len = read_u16(t + 1);
+                for (size_t i = 0; i < len; i++) {
+                    DETOKENIZE_PUT(t[3 + i]);
+                }
+                break;
+            }
+            case TOKEN_KEYWORD: {
+                const char* kw = keywords[t[1]].word;
+                for (size_t i = 0; kw[i] != '\0'; i++) {
+                    bool lower = (t[2] >> i) & 1u;
+                    DETOKENIZE_PUT(lower ? tolower((unsigned char)kw[i]) : kw[i]);
+                }
+                break;
+            }
+            case TOKEN_RAW:
+                DETOKENIZE_PUT(t[1]);
+                break;
+            default:
+                DETOKENIZE_PUT(*t);
+                break;
         }
-    } else {
-        // Condition is false, skip the THEN part
-        // Just advance to end of line (we'll ignore the THEN part)
-        while (*p->s != '\0')
-            p->s++;
-        return 0.0;
+        t += token_length(t);
+    }
+#undef DETOKENIZE_PUT
+    if (size > 0) {
+        buf[n] = '\0';
     }
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_for_statement(Parser* p) {
-    if (!is_alpha_or_underscore(*p->s)) {
-        p->err = "expected variable name after FOR";
-        return NAN;
-    }
-
-    char* var_name = parse_identifier(p);
-    if (var_name == NULL) {
-        p->err = "failed to parse variable name or memory allocation failed";
-        return NAN;
+/**
+ * @brief Consume an identifier token
+ *
+ * @return Pointer to the NUL-terminated name stored inside the token stream
+ * (valid as long as the stream), or NULL if the next token is not an
+ * identifier
+ */
+static const char* parse_identifier(Parser* p) {
+    if (*p->s != TOKEN_IDENTIFIER) {
+        return NULL;
     }
-
+    const char* name = (const char*)p->s + 3;
+    p->s += token_length(p->s);
+    return name;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool accept_keyword(Parser* p, int keyword) {
     p->s = skip_ws(p->s);
-
-    // Expect '='
-    if (*p->s != '=') {
-        p->err = "expected '=' after FOR variable";
-        free(var_name);
-        return NAN;
-    }
-    p->s++;
-
-    // Parse start value
-    double start_val = parse_expr(p);
-    if (p->err) {
-        free(var_name);
-        return NAN;
+    if (p->s[0] == TOKEN_KEYWORD && p->s[1] == keyword) {
+        p->s += 3;
+        return true;
     }
-
+    return false;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Consume a line number (GOTO/GOSUB/THEN target)
+ *
+ * @return 1 on success, 0 if the next token is not a number starting with a
+ * digit, -1 if the number is not a valid line number
+ */
+static int parse_line_number(Parser* p, int* line_number) {
     p->s = skip_ws(p->s);
-
-    // Expect TO
-    if (!is_keyword(p->s, "TO")) {
-        p->err = "expected TO after FOR start value";
-        free(var_name);
-        return NAN;
+    if (*p->s != TOKEN_NUMBER ||
+        !isdigit(p->s[1 + sizeof(double) + 2])) {
+        return 0;
     }
-    p->s += 2;
-
-    // Parse end value
-    double end_val = parse_expr(p);
-    if (p->err) {
-        free(var_name);
-        return NAN;
+    double value;
+    memcpy(&value, p->s + 1, sizeof(value));
+    p->s += token_length(p->s);
+    if (value < 0 || value > 65535 || value != floor(value)) {
+        return -1;
     }
-
-    p->s = skip_ws(p->s);
-
-    // Check for optional STEP
-    double step_val = 1.0;
-    if (is_keyword(p->s, "STEP")) {
-        p->s += 4;
-        step_val = parse_expr(p);
-        if (p->err) {
-            free(var_name);
-            return NAN;
-        }
+    *line_number = (int)value;
+    return 1;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief FNV-1a hash of a NUL-terminated name
+ */
+static uint32_t hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
     }
-
-    // Create new FOR loop node
-    ForLoop* loop = (ForLoop*)calloc(1, sizeof(ForLoop));
-    if (loop == NULL) {
-        p->err = "memory allocation failed for FOR loop";
-        free(var_name);
-        return NAN;
+    return hash;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Double the variable hash table and redistribute the entries
+ *
+ * @return 0 on success, -1 if memory allocation failed
+ */
+static int grow_variable_buckets(g2basic_ctx_t* ctx) {
+    size_t new_count = ctx->variable_bucket_count ? ctx->variable_bucket_count * 2 : 16;
+    Variable** buckets = (Variable**)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, new_count,
+                                                  sizeof(Variable*));
+    if (buckets == NULL) {
+        return -1;
     }
-
-    // Allocate memory for variable name
-    loop->var_name = (char*)calloc(strlen(var_name) + 1, sizeof(char));
-    if (loop->var_name == NULL) {
-        p->err = "memory allocation failed for FOR loop variable";
-        free(loop);
-        free(var_name);
-        return NAN;
+    for (size_t i = 0; i < ctx->variable_count; i++) {
+        Variable* var = ctx->variable_symbols[i];
+        size_t bucket = hash_name(var->name) & (new_count - 1);
+        var->next = buckets[bucket];
+        buckets[bucket] = var;
     }
-    strcpy(loop->var_name, var_name);
-
-    // Set loop parameters
-    loop->start_value = start_val;
-    loop->end_value = end_val;
-    loop->step_value = step_val;
-    loop->for_line_number =
-        current_line_index;  // Use current executing line number
-
-    // Push to head of linked list (stack behavior)
-    loop->next = for_stack_head;
-    for_stack_head = loop;
-
-    // Set the loop variable to start value
-    set_variable(var_name, start_val);
-
-    // Free the temporary variable name since we've copied it
-    free(var_name);
-
-    return 0.0;
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->variable_buckets,
+             ctx->variable_bucket_count * sizeof(Variable*));
+    ctx->variable_buckets = buckets;
+    ctx->variable_bucket_count = new_count;
+    return 0;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_next_statement(Parser* p) {
-    if (!is_alpha_or_underscore(*p->s)) {
-        p->err = "expected variable name after NEXT";
-        return NAN;
+/**
+ * @brief Look up a variable slot by name, creating it if it does not exist yet
+ *
+ * The compiler resolves every variable reference once, so the compiled code
+ * refers to the slot directly. Variables created here start out undefined
+ * (NUMBER_UNDEFINED or INTEGER_UNDEFINED) until the program assigns them. Slots are only ever added while
+ * compiling, never while the compiled code runs.
+ *
+ * @return The slot, or -1 if memory allocation failed
+ */
+static int32_t intern_variable(g2basic_ctx_t* ctx, const char* name) {
+    uint32_t hash = hash_name(name);
+    if (ctx->variable_bucket_count > 0) {
+        Variable* current = ctx->variable_buckets[hash & (ctx->variable_bucket_count - 1)];
+        while (current != NULL) {
+            if (strcmp(current->name, name) == 0) {
+                return current->slot;
+            }
+            current = current->next;
+        }
     }
 
-    char* var_name = parse_identifier(p);
-    if (var_name == NULL) {
-        p->err = "failed to parse variable name or memory allocation failed";
-        return NAN;
+    // Keep the load factor below 3/4
+    if ((ctx->variable_count + 1) * 4 > ctx->variable_bucket_count * 3 &&
+        grow_variable_buckets(ctx) != 0) {
+        return -1;
     }
 
-    // Check if there's a matching FOR loop
-    if (for_stack_head == NULL) {
-        p->err = "NEXT without matching FOR";
-        free(var_name);
-        return NAN;
+    if (ctx->variable_count == ctx->variable_capacity) {
+        size_t new_capacity = ctx->variable_capacity ? ctx->variable_capacity * 2 : 16;
+        g2basic_number_t* values = (g2basic_number_t*)mem_realloc(
+            ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->variable_values,
+            ctx->variable_capacity * sizeof(g2basic_number_t), new_capacity * sizeof(g2basic_number_t));
+        if (values == NULL) {
+            return -1;
+        }
+        ctx->variable_values = values;
+        int32_t* integers = (int32_t*)mem_realloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES,
+                                                  ctx->integer_values, ctx->variable_capacity * sizeof(int32_t),
+                                                  new_capacity * sizeof(int32_t));
+        if (integers == NULL) {
+            return -1;
+        }
+        ctx->integer_values = integers;
+        Variable** symbols = (Variable**)mem_realloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES,
+                                                     ctx->variable_symbols, ctx->variable_capacity * sizeof(Variable*),
+                                                     new_capacity * sizeof(Variable*));
+        if (symbols == NULL) {
+            return -1;
+        }
+        ctx->variable_symbols = symbols;
+        ctx->variable_capacity = new_capacity;
     }
 
-    ForLoop* loop = for_stack_head;
-    if (strcmp(loop->var_name, var_name) != 0) {
-        p->err = "NEXT variable doesn't match FOR variable";
-        free(var_name);
-        return NAN;
+    size_t name_length = strlen(name);
+    Variable* new_var = (Variable*)mem_alloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES,
+                                             sizeof(Variable) + name_length + 1);
+    if (new_var == NULL) {
+        return -1;  // Memory allocation failed
     }
-
-    // Get current variable value and increment it
-    double current_val = get_variable(var_name);
-    if (isnan(current_val)) {
-        p->err = "FOR variable not found";
-        free(var_name);
-        return NAN;
+    memcpy(new_var->name, name, name_length + 1);
+    new_var->slot = (int32_t)ctx->variable_count;
+
+    size_t bucket = hash & (ctx->variable_bucket_count - 1);
+    new_var->next = ctx->variable_buckets[bucket];
+    ctx->variable_buckets[bucket] = new_var;
+    ctx->variable_symbols[ctx->variable_count] = new_var;
+    ctx->variable_values[ctx->variable_count] = NUMBER_UNDEFINED;
+    ctx->integer_values[ctx->variable_count] = INTEGER_UNDEFINED;
+    return (int32_t)ctx->variable_count++;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Look up an array slot by name, creating it if it does not exist yet
+ *
+ * Programs use a handful of arrays at most, so they are found by a linear
+ * search, which only the compiler and the host API do. Arrays created here
+ * are undefined until DIM allocates their elements or the host maps them.
+ *
+ * @return The slot, or -1 if memory allocation failed
+ */
+static int32_t intern_array(g2basic_ctx_t* ctx, const char* name) {
+    for (size_t i = 0; i < ctx->array_count; i++) {
+        if (strcmp(ctx->arrays[i]->name, name) == 0) {
+            return (int32_t)i;
+        }
     }
-
-    current_val += loop->step_value;
-
-    // Check if loop should continue
-    int continue_loop;
-    if (loop->step_value > 0) {
-        continue_loop = (current_val <= loop->end_value);
-    } else {
-        continue_loop = (current_val >= loop->end_value);
+    Array** arrays = grow_buffer(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, ctx->arrays,
+                                 &ctx->array_capacity, sizeof(Array*), ctx->array_count + 1);
+    if (arrays == NULL) {
+        return -1;
     }
-
-    if (continue_loop) {
-        // Update variable and jump back to the line AFTER the FOR statement
-        set_variable(var_name, current_val);
-
-        // Find the next line after the FOR statement
-        ProgramLine* next_line = find_next_program_line(loop->for_line_number);
-        if (next_line != NULL) {
-            goto_target = next_line->line_number;
-        }
-        // If no next line found, continue to end of program
-    } else {
-        // Loop finished, pop from stack and free memory
-        for_stack_head = loop->next;
-        if (loop->var_name != NULL) {
-            free(loop->var_name);
-        }
-        free(loop);
+    ctx->arrays = arrays;
+    size_t name_length = strlen(name);
+    Array* array = (Array*)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, 1,
+                                      sizeof(Array) + name_length + 1);
+    if (array == NULL) {
+        return -1;
     }
-
-    // Free the temporary variable name
-    free(var_name);
-
-    return 0.0;
+    memcpy(array->name, name, name_length + 1);
+    ctx->arrays[ctx->array_count] = array;
+    return (int32_t)ctx->array_count++;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_gosub_statement(Parser* p) {
-    if (!isdigit((unsigned char)*p->s)) {
-        p->err = "GOSUB requires a line number";
-        return NAN;
+/**
+ * @brief Note that a DIM or the host has made @p array known
+ *
+ * Reads of it compiled before were calls to an unknown function.
+ */
+static void declare_array(g2basic_ctx_t* ctx, Array* array) {
+    if (array->declared) {
+        return;
+    }
+    array->declared = true;
+    ctx->declared_arrays++;
+    if (ctx->array_rejected) {
+        ctx->program_dirty = true;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool array_declared(const g2basic_ctx_t* ctx, const char* name) {
+    for (size_t i = 0; i < ctx->array_count; i++) {
+        if (strcmp(ctx->arrays[i]->name, name) == 0) {
+            return ctx->arrays[i]->declared;
+        }
     }
+    return false;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* MEMORY MANAGEMENT FUNCTIONS */
+/*--------------------------------------------------------------------------------------------------------------------*/
 
-    char* endptr;
-    long target_line = strtol(p->s, &endptr, 10);
+/**
+ * @brief Clear all variables from memory
+ * 
+ * Frees all variable symbols, the symbol hash table and the value slots.
+ * After calling this function, the symbol table will be empty.
+ * 
+ * @note This function is called during interpreter initialization and cleanup
+ * @note All variable values are lost when this function is called
+ */
+static void clear_all_variables(g2basic_ctx_t* ctx) {
+    if (!memory_bulk_release(ctx)) {
+        for (size_t i = 0; i < ctx->variable_count; i++) {
+            Variable* var = ctx->variable_symbols[i];
+            mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, var,
+                     sizeof(Variable) + strlen(var->name) + 1);
+        }
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->variable_symbols,
+                 ctx->variable_capacity * sizeof(Variable*));
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->variable_values,
+                 ctx->variable_capacity * sizeof(g2basic_number_t));
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->integer_values,
+                 ctx->variable_capacity * sizeof(int32_t));
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->variable_buckets,
+                 ctx->variable_bucket_count * sizeof(Variable*));
+    }
+    ctx->variable_symbols = NULL;
+    ctx->variable_values = NULL;
+    ctx->integer_values = NULL;
+    ctx->variable_buckets = NULL;
+    ctx->variable_count = 0;
+    ctx->variable_capacity = 0;
+    ctx->variable_bucket_count = 0;
+}
 
-    if (target_line < 0 || target_line > 65535) {
-        p->err = "invalid GOSUB line number";
-        return NAN;
+/**
+ * @brief Clear all arrays from memory
+ *
+ * Frees the array symbols and the elements allocated by DIM. Host buffers
+ * mapped onto arrays are left alone.
+ */
+static void clear_all_arrays(g2basic_ctx_t* ctx) {
+    if (!memory_bulk_release(ctx)) {
+        for (size_t i = 0; i < ctx->array_count; i++) {
+            Array* array = ctx->arrays[i];
+            if (!array->mapped) {
+                mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, array->values,
+                         array->capacity * sizeof(g2basic_number_t));
+            }
+            mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, array,
+                     sizeof(Array) + strlen(array->name) + 1);
+        }
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, ctx->arrays,
+                 ctx->array_capacity * sizeof(Array*));
     }
+    ctx->arrays = NULL;
+    ctx->array_count = 0;
+    ctx->array_capacity = 0;
+}
 
-    p->s = endptr;
+/**
+ * @brief Clear all registered functions from memory
+ * 
+ * Frees all dynamically allocated function registrations and their associated
+ * memory. This includes freeing the function name strings and the function
+ * structures themselves. Built-in functions are not registered, they stay
+ * available.
+ * 
+ * @note This function is called during interpreter initialization
+ * @note All custom registered functions are lost when this function is called
+ */
+static void clear_all_functions(g2basic_ctx_t* ctx) {
+    Function* current = memory_bulk_release(ctx) ? NULL : ctx->functions_head;
+    while (current != NULL) {
+        Function* to_delete = current;
+        current = current->next;
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, (char*)to_delete->name,
+                 strlen(to_delete->name) + 1);
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, to_delete, sizeof(Function));
+    }
+    if (!memory_bulk_release(ctx)) {
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, ctx->function_buckets,
+                 ctx->function_bucket_count * sizeof(Function*));
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, ctx->call_wait, sizeof(CallWait));
+    }
+    ctx->call_wait = NULL;
+    ctx->functions_head = NULL;
+    ctx->function_buckets = NULL;
+    ctx->function_bucket_count = 0;
+    ctx->function_count = 0;
+}
 
-    GosubStackEntry* entry =
-        (GosubStackEntry*)calloc(1, sizeof(GosubStackEntry));
-    if (entry == NULL) {
-        p->err = "memory allocation failed for GOSUB stack";
-        return NAN;
+/**
+ * @brief Free one program line, except for the parts of a loaded program
+ *
+ * Lines of a bulk loaded program share two allocations, which are released
+ * together with the whole program.
+ */
+static void free_program_line(g2basic_ctx_t* ctx, ProgramLine* line) {
+    if (!line->shared_tokens) {
+        mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, line->tokens,
+                 token_stream_length(line->tokens));
     }
+    if (!line->loaded) {
+        mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, line, sizeof(ProgramLine));
+    }
+}
 
-    ProgramLine* next_line = find_next_program_line(current_line_index);
-    if (next_line != NULL) {
-        entry->return_line_number = next_line->line_number;
+/**
+ * @brief Clear all program lines from memory
+ * 
+ * Frees all stored BASIC program lines and their associated memory.
+ * This includes freeing the program line token streams and the program line
+ * structures themselves. After calling this function, no program will be
+ * stored in memory.
+ * 
+ * @note This function is called during interpreter initialization
+ * @note The entire stored BASIC program is lost when this function is called
+ */
+static void clear_all_program_lines(g2basic_ctx_t* ctx) {
+    if (memory_bulk_release(ctx)) {
+        // The program lines and the compiled program are all there is in
+        // the program memory, drop it at once
+        memory_reset(ctx, G2BASIC_MEMORY_PROGRAM);
+        memset(&ctx->program_chunk, 0, sizeof(ctx->program_chunk));
+        ctx->program_chunk.kind = G2BASIC_MEMORY_PROGRAM;
     } else {
-        entry->return_line_number = -2;
+        ProgramLine* current = ctx->program_head;
+        while (current != NULL) {
+            ProgramLine* to_delete = current;
+            current = current->next;
+            free_program_line(ctx, to_delete);
+        }
+        mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, ctx->line_index,
+                 ctx->line_index_capacity * sizeof(ProgramLine*));
+        mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, ctx->loaded_lines,
+                 ctx->loaded_line_count * sizeof(ProgramLine));
+        mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, ctx->loaded_tokens,
+                 ctx->loaded_token_size);
     }
+    ctx->loaded_lines = NULL;
+    ctx->loaded_tokens = NULL;
+    ctx->loaded_line_count = 0;
+    ctx->loaded_token_size = 0;
+    ctx->run_active = false;
+    ctx->program_head = NULL;
+    ctx->line_index = NULL;
+    ctx->line_count = 0;
+    ctx->line_index_capacity = 0;
+    ctx->program_dirty = true;
+}
 
-    entry->next = gosub_stack_head;
-    gosub_stack_head = entry;
-    goto_target = (int)target_line;
-
-    return 0.0;
+/**
+ * @brief Clear all FOR loop state
+ * 
+ * Pops all FOR loop frames. This effectively resets all FOR loop nesting.
+ * The stack memory is kept for the next program run.
+ * 
+ * @note This function is called during interpreter initialization and program execution
+ * @note All nested FOR loops are terminated when this function is called
+ */
+static void clear_all_for_loops(g2basic_ctx_t* ctx) {
+    ctx->for_depth = 0;
 }
-/*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_return_statement(Parser* p) {
-    if (gosub_stack_head == NULL) {
-        p->err = "RETURN without matching GOSUB";
-        return NAN;
-    }
 
-    GosubStackEntry* entry = gosub_stack_head;
-    int return_line_number = entry->return_line_number;
-    gosub_stack_head = entry->next;
-    free(entry);
+/**
+ * @brief Clear all GOSUB call stack
+ * 
+ * Pops all GOSUB subroutine call stack entries. This effectively clears all
+ * pending RETURN addresses and resets the subroutine call stack to empty.
+ * The stack memory is kept for the next program run.
+ * 
+ * @note This function is called during interpreter initialization and program execution
+ * @note All nested GOSUB calls are cleared when this function is called
+ */
+static void clear_all_gosub_stack(g2basic_ctx_t* ctx) {
+    ctx->gosub_depth = 0;
+}
 
-    // Jump back to the return address
-    if (return_line_number == -2) {
-        // Return past end of program - stop execution
-        goto_target = -2;  // Special value to indicate end of program
-    } else {
-        goto_target = return_line_number;
+/**
+ * @brief Preallocate the FOR and GOSUB stacks
+ *
+ * Running a program then does not allocate heap memory for loops and
+ * subroutine calls unless it nests deeper than the preallocated depth.
+ * A failure is not fatal, the stacks are grown again when needed.
+ */
+static void reserve_control_stacks(g2basic_ctx_t* ctx) {
+    if (ctx->for_capacity < G2BASIC_FOR_STACK_DEPTH) {
+        ForLoop* grown = (ForLoop*)mem_realloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FOR_STACK,
+                                               ctx->for_stack, ctx->for_capacity * sizeof(ForLoop),
+                                               G2BASIC_FOR_STACK_DEPTH * sizeof(ForLoop));
+        if (grown != NULL) {
+            ctx->for_stack = grown;
+            ctx->for_capacity = G2BASIC_FOR_STACK_DEPTH;
+        }
+    }
+    if (ctx->gosub_capacity < G2BASIC_GOSUB_STACK_DEPTH) {
+        GosubStackEntry* grown = (GosubStackEntry*)mem_realloc(
+            ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_GOSUB_STACK, ctx->gosub_stack,
+            ctx->gosub_capacity * sizeof(GosubStackEntry), G2BASIC_GOSUB_STACK_DEPTH * sizeof(GosubStackEntry));
+        if (grown != NULL) {
+            ctx->gosub_stack = grown;
+            ctx->gosub_capacity = G2BASIC_GOSUB_STACK_DEPTH;
+        }
     }
-
-    return 0.0;
 }
-/*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_end_statement(Parser* p) {
-    goto_target = -2;  // Special value to indicate end of program
 
-    return 0.0;
-}
-/*--------------------------------------------------------------------------------------------------------------------*/
-static const char* skip_ws(const char* p) {
-    while (*p && isspace((unsigned char)*p)) {
-        p++;
+/**
+ * @brief Release the FOR and GOSUB stacks and the loop invariant caches
+ */
+static void free_control_stacks(g2basic_ctx_t* ctx) {
+    if (!memory_bulk_release(ctx)) {
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FOR_STACK, ctx->for_stack,
+                 ctx->for_capacity * sizeof(ForLoop));
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_GOSUB_STACK, ctx->gosub_stack,
+                 ctx->gosub_capacity * sizeof(GosubStackEntry));
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->caches,
+                 ctx->cache_capacity * sizeof(CachedValue));
     }
-    return p;
+    ctx->for_stack = NULL;
+    ctx->gosub_stack = NULL;
+    ctx->caches = NULL;
+    ctx->for_depth = 0;
+    ctx->gosub_depth = 0;
+    ctx->for_capacity = 0;
+    ctx->gosub_capacity = 0;
+    ctx->cache_capacity = 0;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static const char* skip_word(const char* p, const char* word) {
-    size_t len = strlen(word);
-    return p + len;
+/**
+ * @brief Forget every cached loop invariant value
+ *
+ * Called whenever variables may have changed outside of the program, the
+ * cached values are computed again when the loops get to them.
+ */
+static void forget_caches(g2basic_ctx_t* ctx) {
+    for (size_t i = 0; i < ctx->cache_capacity; i++) {
+        ctx->caches[i].valid = false;
+    }
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static int accept(Parser* p, char c) {
-    p->s = skip_ws(p->s);
-    if (*p->s == c) {
-        p->s++;
-        return 1;
+/**
+ * @brief Make room for the cache slots of the compiled program
+ *
+ * @return false if memory ran out
+ */
+static bool reserve_caches(g2basic_ctx_t* ctx, size_t count) {
+    if (count <= ctx->cache_capacity) {
+        return true;
     }
-    return 0;
+    CachedValue* caches = grow_buffer(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_VARIABLES, ctx->caches,
+                                      &ctx->cache_capacity, sizeof(CachedValue), count);
+    if (caches == NULL) {
+        return false;
+    }
+    ctx->caches = caches;
+    forget_caches(ctx);
+    return true;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static void expect(Parser* p, char c) {
-    p->s = skip_ws(p->s);
-    if (*p->s != c) {
-        static char msg[64];
-        snprintf(msg, sizeof(msg), "expected '%c'", c);
-        p->err = msg;
-        return;
+/**
+ * @brief Binary search the line index
+ *
+ * @return Position of @p line_number in line_index, or of the first line
+ * after it if there is no such line
+ */
+static size_t line_index_position(g2basic_ctx_t* ctx, int line_number) {
+    size_t low = 0;
+    size_t high = ctx->line_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ctx->line_index[mid]->line_number < line_number) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    p->s++;
+    return low;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_number(Parser* p) {
-    p->s = skip_ws(p->s);
-    const char* beg = p->s;
-    // Accept optional digits, dot, digits, exponent, etc., via strtod
-    char* endptr = NULL;
-    double v = strtod(p->s, &endptr);
-    if (endptr == p->s) {
-        p->err = "expected number";
-        return NAN;
+static ProgramLine* find_program_line(g2basic_ctx_t* ctx, int line_number) {
+    size_t position = line_index_position(ctx, line_number);
+    if (position < ctx->line_count &&
+        ctx->line_index[position]->line_number == line_number) {
+        return ctx->line_index[position];
     }
-    p->s = endptr;
-    return v;
+    return NULL;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_variable(Parser* p) {
-    p->s = skip_ws(p->s);
+static int insert_program_line_sorted(g2basic_ctx_t* ctx, int line_number,
+                                      const char* text,
+                                      const char** error) {
+    uint8_t* tokens = tokenize(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, text, error);
+    if (tokens == NULL) {
+        return -1;
+    }
 
-    if (!is_alpha_or_underscore(*p->s)) {
-        p->err = "expected variable name";
-        return NAN;
+    size_t position = line_index_position(ctx, line_number);
+    if (position < ctx->line_count &&
+        ctx->line_index[position]->line_number == line_number) {
+        ProgramLine* existing = ctx->line_index[position];
+        if (!existing->shared_tokens) {
+            mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, existing->tokens,
+                     token_stream_length(existing->tokens));
+        }
+        existing->tokens = tokens;
+        existing->shared_tokens = false;
+        patch_stored_line(ctx, existing, false);
+        return 0;
     }
 
-    char* var_name = parse_identifier(p);
-    if (var_name == NULL) {
-        p->err = "failed to parse variable name or memory allocation failed";
-        return NAN;
+    if (ctx->line_count == ctx->line_index_capacity) {
+        size_t new_capacity =
+            ctx->line_index_capacity ? ctx->line_index_capacity * 2 : 16;
+        ProgramLine** index = (ProgramLine**)mem_realloc(
+            ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, ctx->line_index,
+            ctx->line_index_capacity * sizeof(ProgramLine*), new_capacity * sizeof(ProgramLine*));
+        if (index == NULL) {
+            mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, tokens, token_stream_length(tokens));
+            *error = "memory allocation failed for program line";
+            return -1;
+        }
+        ctx->line_index = index;
+        ctx->line_index_capacity = new_capacity;
     }
 
-    double value = get_variable(var_name);
-    if (isnan(value)) {
-        static char msg[64];
-        snprintf(msg, sizeof(msg), "undefined variable '%s'", var_name);
-        p->err = msg;
-        free(var_name);
-        return NAN;
+    ProgramLine* new_line = (ProgramLine*)mem_calloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, 1,
+                                                     sizeof(ProgramLine));
+    if (new_line == NULL) {
+        mem_free(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, tokens, token_stream_length(tokens));
+        *error = "memory allocation failed for program line";
+        return -1;
     }
 
-    free(var_name);
-    return value;
+    new_line->line_number = line_number;
+    new_line->tokens = tokens;
+
+    // The index tells the predecessor, no need to walk the list
+    if (position == 0) {
+        new_line->next = ctx->program_head;
+        ctx->program_head = new_line;
+    } else {
+        ProgramLine* prev = ctx->line_index[position - 1];
+        new_line->next = prev->next;
+        prev->next = new_line;
+    }
+    memmove(&ctx->line_index[position + 1], &ctx->line_index[position],
+            (ctx->line_count - position) * sizeof(ProgramLine*));
+    ctx->line_index[position] = new_line;
+    ctx->line_count++;
+    patch_stored_line(ctx, new_line, true);
+    return 0;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_function_call(Parser* p, const char* func_name) {
-    Function* func = find_function(func_name);
-    if (!func) {
-        static char msg[64];
-        snprintf(msg, sizeof(msg), "unknown function '%s'", func_name);
-        p->err = msg;
-        return NAN;
+/**
+ * @brief Look up a built-in or registered function by name
+ *
+ * Only the compiler looks functions up, call sites refer to the Function
+ * entry they were bound to. Custom functions cannot reuse the name of a
+ * built-in one, so the order of the two searches does not matter.
+ */
+static const Function* find_function(g2basic_ctx_t* ctx, const char* name) {
+    for (size_t i = 0; i < BUILTIN_FUNCTION_COUNT; i++) {
+        if (strcmp(builtin_functions[i].name, name) == 0) {
+            return &builtin_functions[i];
+        }
+    }
+    if (ctx->function_bucket_count == 0) {
+        return NULL;
     }
+    Function* current =
+        ctx->function_buckets[hash_name(name) & (ctx->function_bucket_count - 1)];
+    while (current != NULL) {
+        if (strcmp(current->name, name) == 0) {
+            return current;
+        }
+        current = current->bucket_next;
+    }
+    return NULL;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Double the function hash table and redistribute the entries
+ *
+ * @return 0 on success, -1 if memory allocation failed
+ */
+static int grow_function_buckets(g2basic_ctx_t* ctx) {
+    size_t new_count = ctx->function_bucket_count ? ctx->function_bucket_count * 2 : 32;
+    Function** buckets = (Function**)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, new_count,
+                                                  sizeof(Function*));
+    if (buckets == NULL) {
+        return -1;
+    }
+    for (Function* func = ctx->functions_head; func != NULL; func = func->next) {
+        size_t bucket = hash_name(func->name) & (new_count - 1);
+        func->bucket_next = buckets[bucket];
+        buckets[bucket] = func;
+    }
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, ctx->function_buckets,
+             ctx->function_bucket_count * sizeof(Function*));
+    ctx->function_buckets = buckets;
+    ctx->function_bucket_count = new_count;
+    return 0;
+}
 
-    expect(p, '(');
-    if (p->err)
-        return NAN;
+/*--------------------------------------------------------------------------------------------------------------------*/
 
-    double args[MAX_FUNC_ARGS];
-    int arg_count = 0;
+/**
+ * @brief Register a custom function with flags in an interpreter context
+ * 
+ * @copydetails g2basic_ctx_register_function_ex()
+ */
+int g2basic_ctx_register_function_ex(g2basic_ctx_t* ctx,
+                                     const char* name,
+                                     int arg_count,
+                                     g2basic_number_t (*func_ptr)(g2basic_number_t[], int),
+                                     unsigned flags) {
+    if (find_function(ctx, name) != NULL) {
+        return -1;
+    }
 
-    // Parse arguments
-    p->s = skip_ws(p->s);
-    if (*p->s != ')') {  // Function has arguments
-        do {
-            if (arg_count >= MAX_FUNC_ARGS) {
-                p->err = "too many function arguments";
-                return NAN;
-            }
+    // Keep the load factor below 3/4
+    if ((ctx->function_count + 1) * 4 > ctx->function_bucket_count * 3 &&
+        grow_function_buckets(ctx) != 0) {
+        return -1;
+    }
 
-            args[arg_count] = parse_expr(p);
-            if (p->err)
-                return NAN;
-            arg_count++;
+    Function* new_func = (Function*)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, 1,
+                                               sizeof(Function));
+    if (new_func == NULL) {
+        return -1;
+    }
 
-            p->s = skip_ws(p->s);
-            if (*p->s == ',') {
-                p->s++;  // consume comma
-            } else {
-                break;
-            }
-        } while (1);
+    char* name_copy = (char*)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS,
+                                        strlen(name) + 1, sizeof(char));
+    if (name_copy == NULL) {
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, new_func, sizeof(Function));
+        return -1;
     }
 
-    expect(p, ')');
-    if (p->err)
-        return NAN;
+    strcpy(name_copy, name);
+    new_func->name = name_copy;
+    new_func->arg_count = arg_count;
+    new_func->func_ptr = func_ptr;
+    new_func->flags = flags & ~FUNCTION_BUILTIN;
 
-    // Validate argument count
-    if (func->arg_count >= 0 && arg_count != func->arg_count) {
-        static char msg[64];
-        snprintf(msg, sizeof(msg), "function '%s' expects %d arguments, got %d",
-                 func_name, func->arg_count, arg_count);
-        p->err = msg;
-        return NAN;
-    }
+    new_func->next = ctx->functions_head;
+    ctx->functions_head = new_func;
+    size_t bucket = hash_name(name) & (ctx->function_bucket_count - 1);
+    new_func->bucket_next = ctx->function_buckets[bucket];
+    ctx->function_buckets[bucket] = new_func;
+    ctx->function_count++;
+    ctx->program_dirty = true;  // Calls to it may have failed to compile before
 
-    // Call the function
-    return func->func_ptr(args, arg_count);
+    return 0;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_factor(Parser* p) {
-    p->s = skip_ws(p->s);
-    // unary +/-
-    if (*p->s == '+' || *p->s == '-') {
-        int neg = (*p->s == '-');
-        p->s++;
-        double v = parse_factor(p);
-        return neg ? -v : v;
+static g2basic_number_t func_wait_only(g2basic_number_t args[], int count) {
+    (void)args;
+    (void)count;
+    return G2BASIC_NUMBER_INVALID;  // Functions that may wait are called through async_ptr
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function that may wait in an interpreter context
+ *
+ * @copydetails g2basic_ctx_register_async_function()
+ */
+int g2basic_ctx_register_async_function(g2basic_ctx_t* ctx,
+                                        const char* name,
+                                        int arg_count,
+                                        g2basic_async_func_t func,
+                                        void* context) {
+    if (ctx->call_wait == NULL) {
+        ctx->call_wait = (CallWait*)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FUNCTIONS, 1,
+                                               sizeof(CallWait));
+        if (ctx->call_wait == NULL) {
+            return -1;
+        }
     }
-
-    if (accept(p, '(')) {
-        double v = parse_expr(p);
-        if (p->err)
-            return v;
-        expect(p, ')');
-        return v;
+    if (g2basic_ctx_register_function_ex(ctx, name, arg_count, func_wait_only, G2BASIC_FUNCTION_MAY_YIELD) != 0) {
+        return -1;
     }
-
-    if (is_alpha_or_underscore(*p->s)) {
-        const char* start = p->s;
-        char* identifier = parse_identifier(p);
-        if (identifier == NULL) {
-            p->err = "failed to parse identifier or memory allocation failed";
-            return NAN;
-        }
-        p->s = skip_ws(p->s);
-
-        if (*p->s == '(') {
-            double result = parse_function_call(p, identifier);
-            free(identifier);
-            return result;
-        } else {
-            free(identifier);
-            p->s = start;
-            return parse_variable(p);
-        }
+    Function* registered = ctx->functions_head;  // New functions go first
+    registered->async_ptr = func;
+    registered->async_context = context;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function with an interpreter context
+ * 
+ * @copydetails g2basic_ctx_register_function()
+ */
+int g2basic_ctx_register_function(g2basic_ctx_t* ctx,
+                                  const char* name,
+                                  int arg_count,
+                                  g2basic_number_t (*func_ptr)(g2basic_number_t[], int)) {
+    return g2basic_ctx_register_function_ex(ctx, name, arg_count, func_ptr, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_sin(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(sin(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_cos(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(cos(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_tan(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(tan(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_sqrt(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    if (args[0] < 0)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(sqrt(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_abs(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_abs(args[0]);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_pow(g2basic_number_t args[], int count) {
+    if (count != 2)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(pow(number_to_double(args[0]), number_to_double(args[1])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_log(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    if (args[0] <= 0)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(log(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_log10(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    if (args[0] <= 0)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(log10(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_exp(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_from_double(exp(number_to_double(args[0])));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_floor(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_floor(args[0]);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_ceil(g2basic_number_t args[], int count) {
+    if (count != 1)
+        return G2BASIC_NUMBER_INVALID;
+    return number_ceil(args[0]);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static g2basic_number_t func_min(g2basic_number_t args[], int count) {
+    if (count < 1)
+        return G2BASIC_NUMBER_INVALID;
+    g2basic_number_t min_val = args[0];
+    for (int i = 1; i < count; i++) {
+        if (args[i] < min_val)
+            min_val = args[i];
     }
-
-    return parse_number(p);
+    return min_val;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_term(Parser* p) {
-    double v = parse_factor(p);
-    while (!p->err) {
-        p->s = skip_ws(p->s);
-        if (*p->s == '*' || *p->s == '/') {
-            char op = *p->s++;
-            double rhs = parse_factor(p);
-            if (p->err)
-                return v;
-            if (op == '*') {
-                v *= rhs;
-            } else {
-                if (rhs == 0.0) {
-                    p->err = "division by zero";
-                    return NAN;
-                }
-                v /= rhs;
-            }
-        } else {
-            break;
-        }
+static g2basic_number_t func_max(g2basic_number_t args[], int count) {
+    if (count < 1)
+        return G2BASIC_NUMBER_INVALID;
+    g2basic_number_t max_val = args[0];
+    for (int i = 1; i < count; i++) {
+        if (args[i] > max_val)
+            max_val = args[i];
     }
-    return v;
+    return max_val;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_expr(Parser* p) {
-    double v = parse_term(p);
-    while (!p->err) {
-        p->s = skip_ws(p->s);
-        if (*p->s == '+' || *p->s == '-') {
-            char op = *p->s++;
-            double rhs = parse_term(p);
-            if (p->err)
-                return v;
-            v = (op == '+') ? (v + rhs) : (v - rhs);
-        } else {
-            break;
+/* Column kernels of the built-in functions, for batch evaluation. They are
+   plain loops over the lanes of a block, which the compiler vectorizes for
+   whatever SIMD instruction set the build targets. Arities are checked at
+   compile time, so only variadic kernels look at the argument count.
+   Fixed-point builds have no kernels, their blocks call the functions lane
+   by lane. */
+#ifndef G2BASIC_FIXED_POINT
+
+/** @brief Define a batch kernel of a one argument function */
+#define BATCH_UNARY_KERNEL(name, expression)                             \
+    static void name(BatchLanes args[], int count, size_t lanes) {       \
+        (void)count;                                                     \
+        double* x = args[0];                                             \
+        for (size_t i = 0; i < lanes; i++) {                             \
+            x[i] = (expression);                                         \
+        }                                                                \
+    }
+
+BATCH_UNARY_KERNEL(batch_sin, sin(x[i]))
+BATCH_UNARY_KERNEL(batch_cos, cos(x[i]))
+BATCH_UNARY_KERNEL(batch_tan, tan(x[i]))
+BATCH_UNARY_KERNEL(batch_sqrt, x[i] < 0 ? NAN : sqrt(x[i]))
+BATCH_UNARY_KERNEL(batch_abs, fabs(x[i]))
+BATCH_UNARY_KERNEL(batch_log, x[i] <= 0 ? NAN : log(x[i]))
+BATCH_UNARY_KERNEL(batch_log10, x[i] <= 0 ? NAN : log10(x[i]))
+BATCH_UNARY_KERNEL(batch_exp, exp(x[i]))
+BATCH_UNARY_KERNEL(batch_floor, floor(x[i]))
+BATCH_UNARY_KERNEL(batch_ceil, ceil(x[i]))
+#undef BATCH_UNARY_KERNEL
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void batch_pow(BatchLanes args[], int count, size_t lanes) {
+    (void)count;
+    for (size_t i = 0; i < lanes; i++) {
+        args[0][i] = pow(args[0][i], args[1][i]);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void batch_min(BatchLanes args[], int count, size_t lanes) {
+    if (count < 1) {
+        for (size_t i = 0; i < lanes; i++) {
+            args[0][i] = NAN;
+        }
+        return;
+    }
+    for (int arg = 1; arg < count; arg++) {
+        for (size_t i = 0; i < lanes; i++) {
+            args[0][i] = args[arg][i] < args[0][i] ? args[arg][i] : args[0][i];
         }
     }
-    return v;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-static double parse_statement(Parser* p) {
-    p->s = skip_ws(p->s);
-
-    for (const Keyword* kw = keywords; kw->word != NULL; kw++) {
-        if (is_keyword(p->s, kw->word)) {
-            p->s = skip_word(p->s, kw->word);
-            p->s = skip_ws(p->s);
-            return kw->parser_func(p);
+static void batch_max(BatchLanes args[], int count, size_t lanes) {
+    if (count < 1) {
+        for (size_t i = 0; i < lanes; i++) {
+            args[0][i] = NAN;
         }
+        return;
     }
-
-    // Check if this looks like an assignment (variable = ...)
-    const char* saved_pos = p->s;
-    if (is_alpha_or_underscore(*p->s)) {
-        char* var_name = parse_identifier(p);
-        if (var_name == NULL) {
-            p->err =
-                "failed to parse variable name or memory allocation failed";
-            return NAN;
+    for (int arg = 1; arg < count; arg++) {
+        for (size_t i = 0; i < lanes; i++) {
+            args[0][i] = args[arg][i] > args[0][i] ? args[arg][i] : args[0][i];
         }
-        p->s = skip_ws(p->s);
+    }
+}
 
-        if (*p->s == '=') {
-            p->s++;  // consume '='
+/** @brief The batch kernel of a built-in function */
+#define BATCH_KERNEL(kernel) kernel
+#else
+#define BATCH_KERNEL(kernel) NULL
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/** @brief Entry of builtin_functions[] */
+#define BUILTIN_FUNCTION(function_name, arity, func, kernel)                                         \
+    {.name = function_name, .arg_count = arity, .func_ptr = func, .batch_ptr = BATCH_KERNEL(kernel), \
+     .flags = G2BASIC_FUNCTION_PURE | FUNCTION_BUILTIN}
 
-            double value = parse_expr(p);
-            if (p->err) {
-                free(var_name);
-                return value;
-            }
+/**
+ * @brief Built-in functions, in read-only memory
+ *
+ * Shared by every context and never modified, the profiler keeps their call
+ * counts in the context (builtin_profile_calls).
+ */
+static const Function builtin_functions[BUILTIN_FUNCTION_COUNT] = {
+    BUILTIN_FUNCTION("sin", 1, func_sin, batch_sin),
+    BUILTIN_FUNCTION("cos", 1, func_cos, batch_cos),
+    BUILTIN_FUNCTION("tan", 1, func_tan, batch_tan),
+    BUILTIN_FUNCTION("sqrt", 1, func_sqrt, batch_sqrt),
+    BUILTIN_FUNCTION("abs", 1, func_abs, batch_abs),
+    BUILTIN_FUNCTION("pow", 2, func_pow, batch_pow),
+    BUILTIN_FUNCTION("log", 1, func_log, batch_log),
+    BUILTIN_FUNCTION("log10", 1, func_log10, batch_log10),
+    BUILTIN_FUNCTION("exp", 1, func_exp, batch_exp),
+    BUILTIN_FUNCTION("floor", 1, func_floor, batch_floor),
+    BUILTIN_FUNCTION("ceil", 1, func_ceil, batch_ceil),
+    BUILTIN_FUNCTION("min", -1, func_min, batch_min),
+    BUILTIN_FUNCTION("max", -1, func_max, batch_max),
+};
+#undef BUILTIN_FUNCTION
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void delete_program_line(g2basic_ctx_t* ctx, int line_number) {
+    size_t position = line_index_position(ctx, line_number);
+    if (position >= ctx->line_count ||
+        ctx->line_index[position]->line_number != line_number) {
+        return;  // Line not found
+    }
 
-            set_variable(var_name, value);
-            free(var_name);
-            return value;
-        } else {
-            free(var_name);
-        }
+    ProgramLine* to_delete = ctx->line_index[position];
+    patch_deleted_line(ctx, to_delete);
+    if (position == 0) {
+        ctx->program_head = to_delete->next;
+    } else {
+        ctx->line_index[position - 1]->next = to_delete->next;
     }
+    ctx->line_count--;
+    memmove(&ctx->line_index[position], &ctx->line_index[position + 1],
+            (ctx->line_count - position) * sizeof(ProgramLine*));
 
-    p->s = saved_pos;
-    return parse_expr(p);
+    free_program_line(ctx, to_delete);
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
-/* PUBLIC API IMPLEMENTATION */
+static void clear_program(g2basic_ctx_t* ctx) {
+    clear_all_program_lines(ctx);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void list_program(g2basic_ctx_t* ctx) {
+    ProgramLine* current = ctx->program_head;
+    while (current != NULL) {
+        char text[512];
+        detokenize(current->tokens, text, sizeof(text));
+        safe_printf(ctx, "%d %s\n", current->line_number, text);
+        current = current->next;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int insert_program_line(g2basic_ctx_t* ctx, int line_number,
+                               const char* text,
+                               const char** error) {
+    return insert_program_line_sorted(ctx, line_number, text, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/** @brief One line of a program text, see next_source_line() */
+typedef struct SourceLine {
+    const char* statement; /**< Statement after the line number */
+    size_t length;         /**< Length of the statement */
+    int line_number;       /**< Line number, -1 for a blank line */
+} SourceLine;
 /*--------------------------------------------------------------------------------------------------------------------*/
 /**
- * @brief Initialize the G2Basic interpreter system
+ * @brief Split the next line off a program text
  *
- * @copydetails g2basic_init()
+ * @param cursor Position in the text, advanced past the line
+ * @param end End of the text
+ * @return 0 on success, -1 for a line without a valid line number
  */
-void g2basic_init(void (*print_func)(const char* str)) {
-    print_function = print_func;
+static int next_source_line(const char** cursor,
+                            const char* end,
+                            SourceLine* line) {
+    const char* s = *cursor;
+    const char* eol = memchr(s, '\n', (size_t)(end - s));
+    if (eol == NULL) {
+        eol = end;
+    }
+    *cursor = eol < end ? eol + 1 : end;
 
-    clear_all_variables();
-    clear_all_functions();
-    clear_all_program_lines();
-    clear_all_for_loops();
-    clear_all_gosub_stack();
+    while (s < eol && isspace((unsigned char)*s)) {
+        s++;
+    }
+    while (eol > s && isspace((unsigned char)eol[-1])) {
+        eol--;
+    }
+    line->line_number = -1;
+    if (s == eol) {
+        return 0;
+    }
 
-    goto_target = -1;
-    current_line_index = -1;
-    init_builtin_functions();
-}
-/*--------------------------------------------------------------------------------------------------------------------*/
-static int g2basic_eval(const char* expr, double* result, const char** error) {
-    Parser p = {.start = expr, .s = expr, .err = NULL};
-    double v = parse_statement(&p);
-    if (p.err) {
-        if (error) {
-            *error = p.err;
+    long line_number = 0;
+    if (!isdigit((unsigned char)*s)) {
+        return -1;
+    }
+    while (s < eol && isdigit((unsigned char)*s)) {
+        line_number = line_number * 10 + (*s++ - '0');
+        if (line_number > 65535) {
+            return -1;
         }
-        return -1;  // Error: parsing failed
     }
-    p.s = skip_ws(p.s);
-    if (*p.s != '\0') {
-        *error = "Unexpected characters at end";
-        return -1;  // Error: unexpected characters at end
+    while (s < eol && isspace((unsigned char)*s)) {
+        s++;
     }
-    *result = v;
+    line->line_number = (int)line_number;
+    line->statement = s;
+    line->length = (size_t)(eol - s);
     return 0;
 }
-
 /*--------------------------------------------------------------------------------------------------------------------*/
-
 /**
- * @brief Parse and execute a BASIC language line
- * 
- * @copydetails g2basic_parse()
+ * @brief Tokenize one statement of a program text
+ *
+ * The tokenizer wants NUL-terminated text, so the statement is copied into
+ * a scratch buffer first.
  */
-int g2basic_parse(const char* input, double* result, const char** error) {
-    const char* p = input;
-
-    while (isspace((unsigned char)*p))
-        p++;
-
-    // Check for special BASIC commands first
-    if (handle_basic_command(input)) {
-        *result = 0;
-        return 3;  // Special command executed
+static int tokenize_source_line(g2basic_ctx_t* ctx,
+                                const SourceLine* line,
+                                char** scratch,
+                                size_t* scratch_capacity,
+                                TokenWriter* writer,
+                                const char** error) {
+    char* text = grow_buffer(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, *scratch,
+                             scratch_capacity, 1, line->length + 1);
+    if (text == NULL) {
+        *error = "memory allocation failed for program line";
+        return -1;
+    }
+    *scratch = text;
+    memcpy(text, line->statement, line->length);
+    text[line->length] = '\0';
+    return tokenize_into(writer, text, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int compare_loaded_lines(const void* a, const void* b) {
+    const ProgramLine* line_a = *(const ProgramLine* const*)a;
+    const ProgramLine* line_b = *(const ProgramLine* const*)b;
+    if (line_a->line_number != line_b->line_number) {
+        return line_a->line_number < line_b->line_number ? -1 : 1;
+    }
+    // Same number: keep the input order, the later line wins
+    return line_a < line_b ? -1 : (line_a > line_b ? 1 : 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Build the stored program from a whole program text at once
+ *
+ * Unlike storing the lines one by one, this tokenizes the text in two linear
+ * passes (measure, then write) into a single token block, with all line
+ * entries in a single array. The line index is filled in input order and
+ * only sorted when the input is not in line number order already.
+ *
+ * Like in interactive entry, a later line replaces an earlier one with the
+ * same number and a line number on its own deletes the line.
+ *
+ * @param scratch Line copy buffer, released by the caller
+ * @return 0 on success, -1 on error
+ */
+static int build_program(g2basic_ctx_t* ctx,
+                         const char* text,
+                         size_t length,
+                         char** scratch,
+                         size_t* scratch_capacity,
+                         const char** error) {
+    const char* end = text + length;
+    TokenWriter measure = {.out = NULL, .len = 0};
+    size_t count = 0;
+    SourceLine line;
+    for (const char* cursor = text; cursor < end;) {
+        if (next_source_line(&cursor, end, &line) != 0) {
+            *error = "invalid line number";
+            return -1;
+        }
+        if (line.line_number < 0) {
+            continue;
+        }
+        if (line.length > 0 &&
+            tokenize_source_line(ctx, &line, scratch, scratch_capacity,
+                                 &measure, error) != 0) {
+            return -1;
+        }
+        count++;
+    }
+    if (count == 0) {
+        return 0;
     }
 
-    // Check if line starts with a number (line number)
-    if (isdigit((unsigned char)*p)) {
-        // Parse line number
-        char* endptr;
-        long line_num = strtol(p, &endptr, 10);
+    ctx->loaded_line_count = count;
+    ctx->loaded_token_size = measure.len ? measure.len : 1;
+    ctx->line_index_capacity = count;
+    ctx->loaded_lines = (ProgramLine*)mem_calloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, count,
+                                                 sizeof(ProgramLine));
+    ctx->loaded_tokens = (uint8_t*)mem_alloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM,
+                                             ctx->loaded_token_size);
+    ctx->line_index = (ProgramLine**)mem_alloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM,
+                                               count * sizeof(ProgramLine*));
+    if (ctx->loaded_lines == NULL || ctx->loaded_tokens == NULL || ctx->line_index == NULL) {
+        *error = "memory allocation failed for program line";
+        return -1;
+    }
 
-        if (line_num < 0 || line_num > 65535) {
-            return -1;  // Invalid line number
+    TokenWriter writer = {.out = ctx->loaded_tokens, .len = 0};
+    bool sorted = true;
+    size_t loaded = 0;
+    for (const char* cursor = text; cursor < end;) {
+        next_source_line(&cursor, end, &line);
+        if (line.line_number < 0) {
+            continue;
         }
+        ProgramLine* entry = &ctx->loaded_lines[loaded];
+        entry->line_number = line.line_number;
+        entry->loaded = true;
+        if (line.length > 0) {
+            entry->tokens = ctx->loaded_tokens + writer.len;
+            entry->shared_tokens = true;
+            tokenize_source_line(ctx, &line, scratch, scratch_capacity,
+                                 &writer, error);
+        }
+        if (loaded > 0 && line.line_number <= ctx->line_index[loaded - 1]->line_number) {
+            sorted = false;
+        }
+        ctx->line_index[loaded++] = entry;
+    }
 
-        p = endptr;
-
-        // Skip whitespace after line number
-        while (isspace((unsigned char)*p))
-            p++;
+    if (!sorted) {
+        qsort(ctx->line_index, count, sizeof(ProgramLine*), compare_loaded_lines);
+    }
 
-        if (*p == '\0') {
-            // Just a line number - delete the line
-            delete_program_line((int)line_num);
-            *result = line_num;
-            return 1;  // Line deleted
-        } else {
-            // Line number followed by statement - store the line
-            insert_program_line((int)line_num, p);
-            *result = line_num;
-            return 2;  // Line stored
+    // Drop replaced and deleted lines and link the rest in order
+    ProgramLine** tail = &ctx->program_head;
+    for (size_t i = 0; i < count; i++) {
+        ProgramLine* entry = ctx->line_index[i];
+        bool replaced = i + 1 < count && ctx->line_index[i + 1]->line_number == entry->line_number;
+        if (replaced || entry->tokens == NULL) {
+            continue;
         }
-    } else {
-        // No line number - immediate mode evaluation
-        return g2basic_eval(input, result, error);
+        ctx->line_index[ctx->line_count++] = entry;
+        *tail = entry;
+        tail = &entry->next;
     }
+    *tail = NULL;
+    ctx->program_dirty = true;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a whole program text
+ *
+ * @return 0 on success, -1 on error (the stored program is empty then)
+ */
+static int load_program(g2basic_ctx_t* ctx,
+                        const char* text,
+                        size_t length,
+                        const char** error) {
+    clear_all_program_lines(ctx);
+    char* scratch = NULL;
+    size_t scratch_capacity = 0;
+    int ret = build_program(ctx, text, length, &scratch, &scratch_capacity,
+                            error);
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, scratch, scratch_capacity);
+    if (ret != 0) {
+        clear_all_program_lines(ctx);
+    }
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* ARRAYS - the elements of an array are one contiguous block and the bulk
+ * built-ins are tight loops over it. With doubles, sums keep four partial
+ * results, so the additions do not wait for each other and the compiler can
+ * keep the partials in vector registers. Fixed-point elements are summed
+ * exactly in 64 bits, only the result has to fit a number.
+ */
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Sum of the elements of an array
+ *
+ * @return false on overflow
+ */
+static bool array_sum(const g2basic_number_t* values, size_t length, g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    int64_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += values[i];
+    }
+    return narrow_integer(sum, result);
+#else
+    double partial[4] = {0.0, 0.0, 0.0, 0.0};
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        partial[0] += values[i];
+        partial[1] += values[i + 1];
+        partial[2] += values[i + 2];
+        partial[3] += values[i + 3];
+    }
+    double sum = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+    for (; i < length; i++) {
+        sum += values[i];
+    }
+    *result = sum;
+    return true;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Mean of the elements of an array of at least one element
+ *
+ * The mean of fixed-point numbers always fits, even if their sum does not.
+ */
+static g2basic_number_t array_mean(const g2basic_number_t* values, size_t length) {
+#ifdef G2BASIC_FIXED_POINT
+    int64_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += values[i];
+    }
+    return (g2basic_number_t)(sum / (int64_t)length);
+#else
+    g2basic_number_t sum;
+    array_sum(values, length, &sum);
+    return sum / (double)length;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Dot product of two arrays of the same length
+ *
+ * Fixed-point products are rounded like number_mul() before they are summed.
+ *
+ * @return false on overflow
+ */
+static bool array_dot(const g2basic_number_t* a,
+                      const g2basic_number_t* b,
+                      size_t length,
+                      g2basic_number_t* result) {
+#ifdef G2BASIC_FIXED_POINT
+    // A rounded product is below 2^61, so the sum cannot wrap around while
+    // it stays below 2^62
+    int64_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += fixed_product(a[i], b[i]);
+        if (sum > ((int64_t)1 << 62) || sum < -((int64_t)1 << 62)) {
+            return false;
+        }
+    }
+    return narrow_integer(sum, result);
+#else
+    double partial[4] = {0.0, 0.0, 0.0, 0.0};
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        partial[0] += a[i] * b[i];
+        partial[1] += a[i + 1] * b[i + 1];
+        partial[2] += a[i + 2] * b[i + 2];
+        partial[3] += a[i + 3] * b[i + 3];
+    }
+    double sum = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+    for (; i < length; i++) {
+        sum += a[i] * b[i];
+    }
+    *result = sum;
+    return true;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void array_fill(g2basic_number_t* values, size_t length, g2basic_number_t value) {
+    for (size_t i = 0; i < length; i++) {
+        values[i] = value;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/** @brief Format the error for using an array that was never dimensioned */
+static const char* undefined_array(g2basic_ctx_t* ctx, const Array* array) {
+    snprintf(ctx->message, sizeof(ctx->message), "undefined array '%s'", array->name);
+    return ctx->message;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Format the error for an index outside of an array
+ *
+ * An array that was never dimensioned has no valid index at all, that is
+ * reported as such.
+ */
+static const char* array_index_error(g2basic_ctx_t* ctx, const Array* array) {
+    return array->values == NULL ? undefined_array(ctx, array) : "array index out of range";
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Give an array the elements 0 to @p last, all set to 0 (DIM)
+ *
+ * Dimensioning an array again resets it. The elements are kept in the same
+ * block while it is large enough, so running a program with a DIM again and
+ * again allocates nothing after the first run.
+ *
+ * @return NULL on success, the error message otherwise
+ */
+static const char* dimension_array(g2basic_ctx_t* ctx, Array* array, int32_t last) {
+    if (array->mapped) {
+        snprintf(ctx->message, sizeof(ctx->message), "array '%s' is mapped by the host", array->name);
+        return ctx->message;
+    }
+    if (last < 0) {
+        return "invalid array size";
+    }
+    size_t length = (size_t)last + 1;
+    if (length > array->capacity) {
+        if (length > SIZE_MAX / sizeof(g2basic_number_t)) {
+            return "memory allocation failed for array";
+        }
+        g2basic_number_t* values = (g2basic_number_t*)mem_realloc(
+            ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, array->values,
+            array->capacity * sizeof(g2basic_number_t), length * sizeof(g2basic_number_t));
+        if (values == NULL) {
+            return "memory allocation failed for array";
+        }
+        array->values = values;
+        array->capacity = length;
+    }
+    array->length = length;
+    array_fill(array->values, length, 0);
+    return NULL;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* EXECUTION TRACE */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/*
+ * A trace ring buffer has one writer, the interpreter, and one reader,
+ * g2basic_trace_read(), possibly on another core. The writer fills a record
+ * before it publishes it by advancing head, the reader copies records out
+ * before it frees their slots by advancing tail.
+ */
+#if defined(__GNUC__)
+#define TRACE_LOAD(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define TRACE_STORE(index, value) __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+#else
+#define TRACE_LOAD(index) (*(volatile uint32_t*)&(index))
+#define TRACE_STORE(index, value) (*(volatile uint32_t*)&(index) = (value))
+#endif
+
+#ifdef G2BASIC_TRACE
+/**
+ * @brief Append a record to the trace of @p ctx, for the line running
+ *
+ * Nothing is recorded without a ring buffer, and a full buffer drops the
+ * record.
+ */
+static void trace_event(g2basic_ctx_t* ctx, g2basic_trace_event_t event, int32_t value, const char* text) {
+    g2basic_trace_ring_t* ring = ctx->trace_ring;
+    if (ring == NULL) {
+        return;
+    }
+    uint32_t head = ring->head;  // Only the writer changes it
+    if (head - TRACE_LOAD(ring->tail) >= ring->capacity) {
+        ring->dropped++;
+        return;
+    }
+    g2basic_trace_record_t* record = &ring->records[head & (ring->capacity - 1)];
+    record->time = ctx->trace_clock != NULL ? ctx->trace_clock(ctx->trace_clock_context) : 0;
+    record->event = (uint32_t)event;
+    record->line = ctx->trace_line;
+    record->value = value;
+    record->text = text;
+    TRACE_STORE(ring->head, head + 1);
+}
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* PROFILER */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/**
+ * @brief Clear the counters of the profiler before a run
+ */
+static void profile_reset(g2basic_ctx_t* ctx) {
+#ifdef G2BASIC_PROFILE
+    for (ProgramLine* line = ctx->program_head; line != NULL; line = line->next) {
+        line->profile_hits = 0;
+        line->profile_time = 0;
+    }
+    for (Function* func = ctx->functions_head; func != NULL; func = func->next) {
+        func->profile_calls = 0;
+    }
+    memset(ctx->builtin_profile_calls, 0, sizeof(ctx->builtin_profile_calls));
+    ctx->profile_line = NULL;
+#else
+    (void)ctx;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+#ifdef G2BASIC_PROFILE
+/**
+ * @brief Call counter of @p func
+ *
+ * The table of built-in functions is read-only, their counters are kept in
+ * the context.
+ */
+static uint64_t* function_profile_calls(g2basic_ctx_t* ctx, const Function* func) {
+    if (func->flags & FUNCTION_BUILTIN) {
+        return &ctx->builtin_profile_calls[func - builtin_functions];
+    }
+    return &((Function*)func)->profile_calls;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Charge the time since the last switch to the current line and
+ * continue timing @p line
+ */
+static void profile_switch(g2basic_ctx_t* ctx, ProgramLine* line) {
+    if (ctx->profile_clock != NULL) {
+        uint64_t now = ctx->profile_clock(ctx->profile_clock_context);
+        if (ctx->profile_line != NULL) {
+            ctx->profile_line->profile_time += now - ctx->profile_start;
+        }
+        ctx->profile_start = now;
+    }
+    ctx->profile_line = line;
+}
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Restart the clock when the program continues running
+ */
+static void profile_resume(g2basic_ctx_t* ctx) {
+#ifdef G2BASIC_PROFILE
+    if (ctx->profile_clock != NULL) {
+        ctx->profile_start = ctx->profile_clock(ctx->profile_clock_context);
+    }
+#else
+    (void)ctx;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Charge the time until the program stopped running
+ */
+static void profile_pause(g2basic_ctx_t* ctx) {
+#ifdef G2BASIC_PROFILE
+    profile_switch(ctx, ctx->profile_line);
+#else
+    (void)ctx;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+#ifdef G2BASIC_PROFILE
+static int compare_profile_lines(const void* a, const void* b) {
+    const ProgramLine* left = *(const ProgramLine* const*)a;
+    const ProgramLine* right = *(const ProgramLine* const*)b;
+    if (left->profile_time != right->profile_time) {
+        return left->profile_time < right->profile_time ? 1 : -1;
+    }
+    if (left->profile_hits != right->profile_hits) {
+        return left->profile_hits < right->profile_hits ? 1 : -1;
+    }
+    return left->line_number - right->line_number;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/** @brief Call count of a function in the profile report */
+typedef struct ProfileCalls {
+    const char* name; /**< Function name */
+    uint64_t calls;   /**< Calls during the last run */
+} ProfileCalls;
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int compare_profile_functions(const void* a, const void* b) {
+    const ProfileCalls* left = (const ProfileCalls*)a;
+    const ProfileCalls* right = (const ProfileCalls*)b;
+    if (left->calls != right->calls) {
+        return left->calls < right->calls ? 1 : -1;
+    }
+    return strcmp(left->name, right->name);
+}
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Print the profile of the last run (PROFILE command)
+ *
+ * Lines are listed by time spent in them (by hits without a clock), then
+ * the functions that were called, by number of calls.
+ */
+static void profile_report(g2basic_ctx_t* ctx) {
+#ifdef G2BASIC_PROFILE
+    size_t function_count = ctx->function_count + BUILTIN_FUNCTION_COUNT;
+    size_t sorted_size = ctx->line_count * sizeof(void*);
+    if (sorted_size < function_count * sizeof(ProfileCalls)) {
+        sorted_size = function_count * sizeof(ProfileCalls);
+    }
+    void** sorted = (void**)mem_alloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, sorted_size);
+    if (sorted == NULL) {
+        safe_print(ctx, "Error: memory allocation failed for profile\n");
+        return;
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < ctx->line_count; i++) {
+        sorted[i] = ctx->line_index[i];
+        total += ctx->line_index[i]->profile_time;
+    }
+    qsort(sorted, ctx->line_count, sizeof(void*), compare_profile_lines);
+    safe_print(ctx, " LINE         HITS          TIME  TIME%  STATEMENT\n");
+    for (size_t i = 0; i < ctx->line_count; i++) {
+        const ProgramLine* line = (const ProgramLine*)sorted[i];
+        char text[40];
+        detokenize(line->tokens, text, sizeof(text));
+        safe_printf(ctx, "%5d %12llu %13llu %6.1f  %s\n", line->line_number,
+                    (unsigned long long)line->profile_hits, (unsigned long long)line->profile_time,
+                    total ? 100.0 * (double)line->profile_time / (double)total : 0.0, text);
+    }
+
+    // The lines are printed, the buffer is reused for the functions
+    ProfileCalls* calls = (ProfileCalls*)sorted;
+    size_t called = 0;
+    for (size_t i = 0; i < BUILTIN_FUNCTION_COUNT; i++) {
+        if (ctx->builtin_profile_calls[i] > 0) {
+            calls[called++] = (ProfileCalls){builtin_functions[i].name, ctx->builtin_profile_calls[i]};
+        }
+    }
+    for (Function* func = ctx->functions_head; func != NULL; func = func->next) {
+        if (func->profile_calls > 0) {
+            calls[called++] = (ProfileCalls){func->name, func->profile_calls};
+        }
+    }
+    if (called > 0) {
+        qsort(calls, called, sizeof(ProfileCalls), compare_profile_functions);
+        safe_print(ctx, "FUNCTION            CALLS\n");
+        for (size_t i = 0; i < called; i++) {
+            safe_printf(ctx, "%-12s %12llu\n", calls[i].name, (unsigned long long)calls[i].calls);
+        }
+    }
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, sorted, sorted_size);
+#else
+    safe_print(ctx, "Error: profiler not built in (define G2BASIC_PROFILE)\n");
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Bring program_chunk up to date with the stored program
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+static int compile_if_dirty(g2basic_ctx_t* ctx) {
+    if (ctx->program_dirty) {
+        if (compile_program(ctx) != 0) {
+            return -1;
+        }
+        ctx->program_dirty = false;
+    }
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Forget the function call the run was waiting for
+ */
+static void cancel_call(g2basic_ctx_t* ctx) {
+    if (ctx->call_wait != NULL) {
+        ctx->call_wait->state = CALL_NONE;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile the program and reset the interpreter stacks for a run
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+static int start_program(g2basic_ctx_t* ctx) {
+    ctx->run_active = false;
+    cancel_call(ctx);
+    if (compile_if_dirty(ctx) != 0) {
+        safe_print(ctx, "Error: memory allocation failed for compiled program\n");
+        return -1;
+    }
+    clear_all_for_loops(ctx);
+    clear_all_gosub_stack(ctx);
+    forget_caches(ctx);
+    profile_reset(ctx);
+#ifdef G2BASIC_TRACE
+    ctx->trace_line = 0;
+#endif
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Report how the program stopped
+ *
+ * @return 0 when the program ended normally, -1 on error
+ */
+static int finish_program(g2basic_ctx_t* ctx, VmStatus status, const VmExit* exit) {
+    ctx->run_active = false;
+    cancel_call(ctx);
+    if (status == VM_LINE_NOT_FOUND) {
+#ifdef G2BASIC_TRACE
+        trace_event(ctx, G2BASIC_TRACE_ERROR, exit->line_number, "line not found");
+#endif
+        safe_printf(ctx, "Error: line %d not found\n", exit->line_number);
+        return -1;
+    }
+    if (status == VM_ERROR) {
+        ProgramLine* line = find_line_at_offset(ctx, exit->pc);
+#ifdef G2BASIC_TRACE
+        ctx->trace_line = line ? line->line_number : 0;
+        trace_event(ctx, G2BASIC_TRACE_ERROR, 0, exit->error);
+#endif
+        safe_printf(ctx, "Error in line %d: %s\n", line ? line->line_number : 0,
+                    exit->error ? exit->error : "Unknown error");
+        return -1;
+    }
+    return 0;  // Success
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int run_program(g2basic_ctx_t* ctx) {
+    if (start_program(ctx) != 0) {
+        return -1;
+    }
+
+    VmExit exit;
+    profile_resume(ctx);
+    ctx->program_running = true;
+    VmStatus status = vm_execute(ctx, &ctx->program_chunk, 0, SIZE_MAX, &exit);
+    while (status == VM_YIELD) {
+        // Only after SIZE_MAX branches, which a 32-bit size_t can reach
+        status = vm_execute(ctx, &ctx->program_chunk, exit.pc, SIZE_MAX, &exit);
+    }
+    ctx->program_running = false;
+    profile_pause(ctx);
+    return finish_program(ctx, status, &exit);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Continue a run started with start_program() for a number of steps
+ */
+static g2basic_run_status_t run_steps(g2basic_ctx_t* ctx, size_t max_steps) {
+    if (!ctx->run_active) {
+        return G2BASIC_RUN_DONE;
+    }
+    if (ctx->program_dirty) {
+        // The code offset to resume at belongs to the old program
+        ctx->run_active = false;
+        cancel_call(ctx);
+        safe_print(ctx, "Error: program changed while running\n");
+        return G2BASIC_RUN_ERROR;
+    }
+    if (ctx->call_wait != NULL && ctx->call_wait->state == CALL_PENDING) {
+        return G2BASIC_RUN_WAITING;
+    }
+    if (max_steps == 0) {
+        return G2BASIC_RUN_RUNNING;
+    }
+
+    VmExit exit;
+    profile_resume(ctx);
+    ctx->program_running = true;
+    VmStatus status = vm_execute(ctx, &ctx->program_chunk, ctx->run_pc, max_steps, &exit);
+    ctx->program_running = false;
+    profile_pause(ctx);
+    if (status == VM_YIELD || status == VM_WAIT) {
+        ctx->run_pc = exit.pc;
+        return status == VM_YIELD ? G2BASIC_RUN_RUNNING : G2BASIC_RUN_WAITING;
+    }
+    return finish_program(ctx, status, &exit) == 0 ? G2BASIC_RUN_DONE : G2BASIC_RUN_ERROR;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Execute a command (LIST, RUN, NEW, PROFILE) given as a whole line
+ *
+ * The first word is scanned once, like find_keyword() does for keywords, so
+ * every other line (assignments first of all) is turned down after a single
+ * pass over its first word.
+ *
+ * @return true if the line was a command
+ */
+static bool handle_basic_command(g2basic_ctx_t* ctx, const char* input) {
+    const char* p = skip_text_ws(input);
+    size_t len = 0;
+    while (isalpha((unsigned char)p[len])) {
+        if (++len > MAX_KEYWORD_LENGTH) {
+            return false;
+        }
+    }
+    char folded[MAX_KEYWORD_LENGTH];
+    uint8_t case_mask;
+    if ((p[len] != '\0' && !isspace((unsigned char)p[len])) || !fold_word(p, len, folded, &case_mask)) {
+        return false;
+    }
+
+    switch (folded[0]) {
+        case 'L':
+            if (folded_word_is(folded, len, "LIST")) {
+                list_program(ctx);
+                return true;
+            }
+            break;
+        case 'R':
+            if (folded_word_is(folded, len, "RUN")) {
+                run_program(ctx);
+                return true;
+            }
+            break;
+        case 'N':
+            if (folded_word_is(folded, len, "NEW")) {
+                clear_program(ctx);
+                return true;
+            }
+            break;
+        case 'P':
+            if (folded_word_is(folded, len, "PROFILE")) {
+                profile_report(ctx);
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+    return false;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* BYTECODE COMPILER */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+static void chunk_clear(g2basic_ctx_t* ctx, Chunk* chunk) {
+    if (chunk->borrowed) {
+        // Leave the image alone, the next compile gets buffers of its own
+        chunk->code = NULL;
+        chunk->code_capacity = 0;
+        chunk->constants = NULL;
+        chunk->constant_capacity = 0;
+        chunk->message_count = 0;
+        chunk->borrowed = false;
+    }
+    for (size_t i = 0; i < chunk->message_count; i++) {
+        mem_free(ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->messages[i], strlen(chunk->messages[i]) + 1);
+    }
+    chunk->code_count = 0;
+    chunk->constant_count = 0;
+    chunk->function_count = 0;
+    chunk->message_count = 0;
+    chunk->fixup_count = 0;
+    chunk->span_count = 0;
+    chunk->load_count = 0;
+    chunk->cache_count = 0;
+    chunk->max_depth = 0;
+    chunk->out_of_memory = false;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void chunk_free_buffers(g2basic_ctx_t* ctx, Chunk* chunk) {
+    g2basic_memory_kind_t kind = chunk->kind;
+    chunk_clear(ctx, chunk);
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->code, chunk->code_capacity * sizeof(int32_t));
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->constants,
+             chunk->constant_capacity * sizeof(g2basic_number_t));
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->functions, chunk->function_capacity * sizeof(Function*));
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->messages, chunk->message_capacity * sizeof(char*));
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->fixups, chunk->fixup_capacity * sizeof(LineFixup));
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->spans, chunk->span_capacity * sizeof(LineSpan));
+    mem_free(ctx, kind, G2BASIC_MEMORY_USE_CODE, chunk->loads, chunk->load_capacity * sizeof(VariableLoad));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void chunk_free(g2basic_ctx_t* ctx, Chunk* chunk) {
+    g2basic_memory_kind_t kind = chunk->kind;
+    if (!memory_bulk_release(ctx)) {
+        chunk_free_buffers(ctx, chunk);
+    }
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->kind = kind;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_word(Parser* p, int32_t word) {
+    Chunk* chunk = p->chunk;
+    int32_t* code = grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->code, &chunk->code_capacity,
+                                sizeof(int32_t), chunk->code_count + 1);
+    if (code == NULL) {
+        chunk->out_of_memory = true;
+        return;
+    }
+    chunk->code = code;
+    chunk->code[chunk->code_count++] = word;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Account for the stack effect of the next instruction
+ *
+ * Nothing is emitted after a syntax error, so the code of a line is always
+ * a valid prefix of its evaluation followed by the OP_ERROR that reports the
+ * problem. The operand stack depth is checked here, at compile time, which
+ * lets the virtual machine skip overflow checks.
+ *
+ * @return true if the instruction should be emitted
+ */
+static bool begin_instruction(Parser* p, int stack_effect) {
+    if (p->err) {
+        return false;
+    }
+    if (p->depth + stack_effect > VM_STACK_SIZE) {
+        p->err = "expression too complex";
+        return false;
+    }
+    p->depth += stack_effect;
+    if (p->depth > p->chunk->max_depth) {
+        p->chunk->max_depth = p->depth;
+    }
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Record the start of an instruction for the peephole optimizer
+ */
+static void note_instruction(Parser* p, Opcode op) {
+    p->recent[2] = p->recent[1];
+    p->recent[1] = p->recent[0];
+    p->recent[0] = p->chunk->code_count;
+    if (p->recent_count < 3) {
+        p->recent_count++;
+    }
+    p->constant_run = op == OP_PUSH_CONST ? p->constant_run + 1 : 0;
+    emit_word(p, op);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Forget the @p count newest instructions after they were removed
+ */
+static void forget_instructions(Parser* p, int count) {
+    for (int i = 0; i + count < 3; i++) {
+        p->recent[i] = p->recent[i + count];
+    }
+    p->recent_count = p->recent_count > count ? p->recent_count - count : 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check whether the recorded instructions may be rewritten
+ *
+ * Nothing is rewritten after an error or a failed allocation. Instructions
+ * before a jump target are never recorded, patch_jump() forgets them.
+ */
+static bool can_optimize(const Parser* p) {
+    return p->err == NULL && !p->chunk->out_of_memory;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/** @brief Deepest nesting of FOR loops whose bodies cache invariant values */
+#define HOIST_MAX_LOOPS 8
+/** @brief Instruction words wrapped around a cached value */
+#define CACHE_WORDS 5
+/** @brief Smallest code worth caching, a single operation on a variable is not */
+#define CACHE_MIN_WORDS 4
+
+/** @brief Control transfer between program lines, for the loop analysis */
+typedef struct HoistJump {
+    int from;        /**< Line of the GOTO, GOSUB, THEN, ELSE or RETURN */
+    int to;          /**< Target line, -1 for RETURN */
+    bool subroutine; /**< GOSUB */
+} HoistJump;
+
+/** @brief FOR loop whose body is compiled with cached invariant values */
+typedef struct HoistLoop {
+    const ProgramLine* last; /**< Line of the NEXT ending the body */
+    const uint8_t* next;     /**< Variable token of that NEXT */
+    const uint8_t* written;  /**< Variables the body may change, a bit per slot */
+    size_t count_operand;    /**< Code offset of the OP_CACHE_RESET count */
+    size_t first_cache;      /**< First cache slot of the body */
+} HoistLoop;
+
+/**
+ * @brief Loop invariant analysis of the program being compiled
+ *
+ * Before the program is compiled, every statement is scanned for the
+ * variables it assigns (FOR and NEXT included) and for its jumps to other
+ * lines. At a FOR, the body up to the NEXT of the loop variable is scanned
+ * the same way. While the body is compiled, code building a value from
+ * constants, pure functions and variables outside of that set gets an
+ * OP_CACHED in front, so it runs once per entry of the loop.
+ *
+ * Values are only right to keep while the body is what runs. A body that
+ * calls subroutines, returns or is left or entered by a jump may run any
+ * part of the program, so only the variables no statement assigns count as
+ * unchanged there. Immediate mode lines can change any variable, they
+ * forget all cached values.
+ */
+typedef struct Hoist {
+    const ProgramLine* line; /**< Line being compiled */
+    uint8_t* sets;           /**< Variable bit sets of set_size bytes: the
+                                  variables the program assigns, then one per
+                                  entry of loops */
+    size_t set_size;         /**< Bytes of a set */
+    size_t slot_count;       /**< Variable slots covered by the sets */
+    HoistJump* jumps;        /**< Jumps of the whole program */
+    size_t jump_count;       /**< Number of jumps */
+    size_t jump_capacity;    /**< Allocated jumps */
+    HoistLoop loops[HOIST_MAX_LOOPS]; /**< Loops around the cursor, innermost
+                                           last */
+    int depth;               /**< Used entries of loops */
+} Hoist;
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool hoist_note_write(g2basic_ctx_t* ctx, const Hoist* h, uint8_t* written, const char* name) {
+    int32_t slot = intern_variable(ctx, name);
+    if (slot < 0) {
+        return false;
+    }
+    if (written != NULL) {
+        if ((size_t)slot >= h->slot_count) {
+            return false;
+        }
+        written[slot / 8] |= (uint8_t)(1u << (slot % 8));
+    }
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool hoist_note_jump(g2basic_ctx_t* ctx, Hoist* h, int from, int to, bool subroutine) {
+    HoistJump* jumps = grow_buffer(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, h->jumps,
+                                   &h->jump_capacity, sizeof(HoistJump), h->jump_count + 1);
+    if (jumps == NULL) {
+        return false;
+    }
+    h->jumps = jumps;
+    h->jumps[h->jump_count].from = from;
+    h->jumps[h->jump_count].to = to;
+    h->jumps[h->jump_count].subroutine = subroutine;
+    h->jump_count++;
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Scan the statements of a token stream for the loop analysis
+ *
+ * @param written Receives the variables assigned, NULL to intern them only
+ * @param jumps Record the jumps in h->jumps
+ * @param loop_var Variable of the loop whose body is scanned, or NULL
+ * @param next Set to the variable token of the NEXT of @p loop_var outside of
+ *             an IF, where the scan stops
+ * @return false if memory ran out or the body starts a loop of its own
+ * variable
+ */
+static bool hoist_scan(g2basic_ctx_t* ctx,
+                       Hoist* h,
+                       const uint8_t* tokens,
+                       int line_number,
+                       uint8_t* written,
+                       bool jumps,
+                       const char* loop_var,
+                       const uint8_t** next) {
+    Parser scan = {.ctx = ctx, .start = tokens, .s = tokens};
+    bool statement = true;  // The cursor is at the start of a statement
+    bool branch = false;
+    for (;;) {
+        scan.s = skip_ws(scan.s);
+        const uint8_t* token = scan.s;
+        if (*token == TOKEN_END) {
+            return true;
+        }
+        if (*token == TOKEN_IDENTIFIER && statement) {
+            const char* name = parse_identifier(&scan);
+            if (*skip_ws(scan.s) == '=' && !hoist_note_write(ctx, h, written, name)) {
+                return false;
+            }
+            statement = false;
+            continue;
+        }
+        if (*token != TOKEN_KEYWORD) {
+            statement = *token == ':';
+            scan.s += token_length(token);
+            continue;
+        }
+
+        int keyword = token[1];
+        int target;
+        scan.s += 3;
+        if ((keyword == KEYWORD_FOR || keyword == KEYWORD_NEXT) && statement) {
+            scan.s = skip_ws(scan.s);
+            const uint8_t* variable = scan.s;
+            const char* name = parse_identifier(&scan);
+            if (name != NULL && loop_var != NULL && strcmp(name, loop_var) == 0) {
+                if (keyword == KEYWORD_FOR) {
+                    return false;
+                }
+                if (!branch) {
+                    *next = variable;
+                    return true;
+                }
+            }
+            if (name != NULL && !hoist_note_write(ctx, h, written, name)) {
+                return false;
+            }
+        } else if (keyword == KEYWORD_GOTO || keyword == KEYWORD_GOSUB || keyword == KEYWORD_THEN ||
+                   keyword == KEYWORD_ELSE) {
+            if (parse_line_number(&scan, &target) > 0 && jumps &&
+                !hoist_note_jump(ctx, h, line_number, target, keyword == KEYWORD_GOSUB)) {
+                return false;
+            }
+        } else if (keyword == KEYWORD_RETURN && jumps && !hoist_note_jump(ctx, h, line_number, -1, false)) {
+            return false;
+        }
+        branch = branch || keyword == KEYWORD_IF;
+        statement = keyword == KEYWORD_THEN || keyword == KEYWORD_ELSE;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void hoist_release(g2basic_ctx_t* ctx, Hoist* h) {
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, h->sets,
+             (HOIST_MAX_LOOPS + 1) * h->set_size);
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, h->jumps,
+             h->jump_capacity * sizeof(HoistJump));
+    h->sets = NULL;
+    h->jumps = NULL;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Find the variables and the jumps of the stored program
+ *
+ * The first pass interns the assigned variables, so the sets cover them.
+ * Without memory for the analysis the program is compiled without caching
+ * (h->sets is NULL).
+ */
+static void hoist_prepare(g2basic_ctx_t* ctx, Hoist* h) {
+    memset(h, 0, sizeof(*h));
+    bool scanned = true;
+    for (const ProgramLine* line = ctx->program_head; line != NULL && scanned; line = line->next) {
+        scanned = hoist_scan(ctx, h, line->tokens, line->line_number, NULL, true, NULL, NULL);
+    }
+    h->slot_count = ctx->variable_count;
+    h->set_size = h->slot_count / 8 + 1;
+    if (scanned) {
+        h->sets = (uint8_t*)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY,
+                                       HOIST_MAX_LOOPS + 1, h->set_size);
+    }
+    for (const ProgramLine* line = ctx->program_head; line != NULL && h->sets != NULL; line = line->next) {
+        if (!hoist_scan(ctx, h, line->tokens, line->line_number, h->sets, false, NULL, NULL)) {
+            hoist_release(ctx, h);
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Start caching values in the body of the FOR loop being compiled
+ *
+ * Called with the cursor at the end of the FOR statement, where the body
+ * begins. Emits the OP_CACHE_RESET of the loop, its count is filled in when
+ * the body is closed. Loops inside an IF branch are left alone, their
+ * extent is not known.
+ */
+static void hoist_loop_begin(Parser* p, const char* var_name) {
+    Hoist* h = p->hoist;
+    if (h == NULL || h->sets == NULL || h->depth == HOIST_MAX_LOOPS || p->branches > 0 || !can_optimize(p)) {
+        return;
+    }
+    uint8_t* written = h->sets + (size_t)(h->depth + 1) * h->set_size;
+    memset(written, 0, h->set_size);
+    if (!hoist_note_write(p->ctx, h, written, var_name)) {
+        return;
+    }
+    const uint8_t* next = NULL;
+    const ProgramLine* last = h->line;
+    const uint8_t* tokens = p->s;
+    while (last != NULL) {
+        if (!hoist_scan(p->ctx, h, tokens, last->line_number, written, false, var_name, &next)) {
+            return;
+        }
+        if (next != NULL) {
+            break;
+        }
+        last = last->next;
+        tokens = last != NULL ? last->tokens : NULL;
+    }
+    if (next == NULL) {
+        return;
+    }
+
+    // Any jump across the edge of the body makes it run other code
+    int first_line = h->line->line_number;
+    int last_line = last->line_number;
+    for (size_t i = 0; i < h->jump_count; i++) {
+        const HoistJump* jump = &h->jumps[i];
+        bool from_body = jump->from >= first_line && jump->from <= last_line;
+        bool into_body = jump->to > first_line && jump->to <= last_line;
+        if (from_body != into_body || (from_body && jump->subroutine) || (into_body && jump->from == last_line)) {
+            written = h->sets;
+            break;
+        }
+    }
+
+    Chunk* chunk = p->chunk;
+    if (!begin_instruction(p, 0)) {
+        return;
+    }
+    note_instruction(p, OP_CACHE_RESET);
+    emit_word(p, (int32_t)chunk->cache_count);
+    emit_word(p, 0);
+    HoistLoop* loop = &h->loops[h->depth++];
+    loop->last = last;
+    loop->next = next;
+    loop->written = written;
+    loop->count_operand = chunk->code_count - 1;
+    loop->first_cache = chunk->cache_count;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Stop caching values for the innermost analyzed loop
+ */
+static void hoist_loop_end(Hoist* h, Chunk* chunk) {
+    const HoistLoop* loop = &h->loops[--h->depth];
+    if (loop->count_operand < chunk->code_count) {
+        chunk->code[loop->count_operand] = (int32_t)(chunk->cache_count - loop->first_cache);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Close the analyzed loops whose NEXT is on @p line
+ *
+ * NEXT closes its loop already, unless an error on the line kept it from
+ * being compiled or loops overlap. Loops inside the closed one end with it.
+ */
+static void hoist_line_end(Hoist* h, Chunk* chunk, const ProgramLine* line) {
+    for (int i = h->depth - 1; i >= 0; i--) {
+        if (h->loops[i].last == line) {
+            while (h->depth > i) {
+                hoist_loop_end(h, chunk);
+            }
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Count a read of a variable slot the innermost analyzed loop may change
+ */
+static void hoist_note_load(Parser* p, int32_t slot) {
+    const Hoist* h = p->hoist;
+    if (h != NULL && h->depth > 0) {
+        const uint8_t* written = h->loops[h->depth - 1].written;
+        if ((size_t)slot < h->slot_count && (written[slot / 8] >> (slot % 8)) & 1u) {
+            p->variant++;
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Cache the value computed by the code from @p start to @p end
+ *
+ * The code is wrapped into OP_CACHED and OP_CACHE_STORE, moving the code
+ * after it along. Only called for code building one value the innermost
+ * analyzed loop does not change, with no jump into or out of it.
+ *
+ * @param type Type of the value
+ * @return true if the code was wrapped, CACHE_WORDS words longer
+ */
+static bool cache_value(Parser* p, size_t start, size_t end, ValueType type) {
+    Hoist* h = p->hoist;
+    Chunk* chunk = p->chunk;
+    if (h == NULL || h->depth == 0 || !can_optimize(p) || end - start < CACHE_MIN_WORDS) {
+        return false;
+    }
+    int32_t* code = grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->code, &chunk->code_capacity,
+                                sizeof(int32_t), chunk->code_count + CACHE_WORDS);
+    if (code == NULL) {
+        chunk->out_of_memory = true;
+        return false;
+    }
+    chunk->code = code;
+    memmove(code + end + CACHE_WORDS, code + end, (chunk->code_count - end) * sizeof(int32_t));
+    memmove(code + start + 3, code + start, (end - start) * sizeof(int32_t));
+    int32_t slot = (int32_t)chunk->cache_count++;
+    code[start] = type == VALUE_INTEGER ? OP_CACHED_INT : OP_CACHED;
+    code[start + 1] = slot;
+    code[start + 2] = (int32_t)(end - start + 2);
+    code[end + 3] = type == VALUE_INTEGER ? OP_CACHE_STORE_INT : OP_CACHE_STORE;
+    code[end + 4] = slot;
+    chunk->code_count += CACHE_WORDS;
+    // The recorded instructions have moved
+    p->recent_count = 0;
+    p->constant_run = 0;
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Cache the loop invariant operands of a binary operator
+ *
+ * An invariant operand next to one that changes is cached on its own, two
+ * invariant operands are left to be cached with the operation.
+ *
+ * @param start Code offset of the left operand
+ * @param right_start Code offset of the right operand, moved along when the
+ *                    left one is cached
+ * @param each Cache every invariant operand (comparisons, whose result goes
+ *             to a branch)
+ */
+static void cache_operands(Parser* p,
+                           size_t start,
+                           size_t* right_start,
+                           bool left_invariant,
+                           bool right_invariant,
+                           ValueType left,
+                           ValueType right,
+                           bool each) {
+    if (right_invariant && (each || !left_invariant)) {
+        cache_value(p, *right_start, p->chunk->code_count, right);
+    }
+    if (left_invariant && (each || !right_invariant) && cache_value(p, start, *right_start, left)) {
+        *right_start += CACHE_WORDS;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_op(Parser* p, Opcode op, int stack_effect) {
+    if (begin_instruction(p, stack_effect)) {
+        note_instruction(p, op);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_op_arg(Parser* p, Opcode op, int32_t arg, int stack_effect) {
+    if (begin_instruction(p, stack_effect)) {
+        note_instruction(p, op);
+        emit_word(p, arg);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit a forward jump whose target is filled in by patch_jump()
+ *
+ * @return Code offset of the target operand
+ */
+static size_t emit_jump(Parser* p, Opcode op, int stack_effect) {
+    emit_op_arg(p, op, 0, stack_effect);
+    return p->chunk->code_count - 1;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void patch_jump(Parser* p, size_t operand) {
+    if (operand < p->chunk->code_count) {
+        p->chunk->code[operand] = (int32_t)p->chunk->code_count;
+    }
+    // The code after a jump target must not be merged with the code before
+    p->recent_count = 0;
+    p->constant_run = 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Remove the last @p count OP_PUSH_CONST instructions
+ *
+ * Every OP_PUSH_CONST has a constant of its own at the end of the pool, so
+ * the constants go as well.
+ *
+ * @param values Receives the constants, in push order
+ */
+static void drop_constants(Parser* p, int count, g2basic_number_t* values) {
+    Chunk* chunk = p->chunk;
+    chunk->constant_count -= (size_t)count;
+    memcpy(values, chunk->constants + chunk->constant_count,
+           (size_t)count * sizeof(g2basic_number_t));
+    chunk->code_count -= 2 * (size_t)count;
+    p->depth -= count;
+    p->constant_run -= count;
+    forget_instructions(p, count);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_constant(Parser* p, g2basic_number_t value) {
+    Chunk* chunk = p->chunk;
+    g2basic_number_t* constants =
+        grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->constants, &chunk->constant_capacity,
+                    sizeof(g2basic_number_t), chunk->constant_count + 1);
+    if (constants == NULL) {
+        chunk->out_of_memory = true;
+        return;
+    }
+    chunk->constants = constants;
+    chunk->constants[chunk->constant_count] = value;
+    emit_op_arg(p, OP_PUSH_CONST, (int32_t)chunk->constant_count++, 1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_variable_op(Parser* p,
+                             Opcode op,
+                             const char* name,
+                             int stack_effect) {
+    int32_t slot = intern_variable(p->ctx, name);
+    if (slot < 0) {
+        p->err = "memory allocation failed for variable";
+        return;
+    }
+    emit_op_arg(p, op, slot, stack_effect);
+    if (op == OP_LOAD || op == OP_LOAD_INT || op == OP_LOAD_INT_NUM) {
+        hoist_note_load(p, slot);
+    }
+    if (p->expression && op == OP_LOAD && p->err == NULL) {
+        Chunk* chunk = p->chunk;
+        VariableLoad* loads =
+            grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->loads, &chunk->load_capacity,
+                        sizeof(VariableLoad), chunk->load_count + 1);
+        if (loads == NULL) {
+            chunk->out_of_memory = true;
+            return;
+        }
+        chunk->loads = loads;
+        chunk->loads[chunk->load_count].operand = chunk->code_count - 1;
+        chunk->loads[chunk->load_count].slot = slot;
+        chunk->loads[chunk->load_count].location = NULL;
+        chunk->load_count++;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_call(Parser* p, const Function* func, int arg_count) {
+    Chunk* chunk = p->chunk;
+    if ((func->flags & (G2BASIC_FUNCTION_PURE | G2BASIC_FUNCTION_MAY_YIELD)) ==
+            G2BASIC_FUNCTION_PURE &&
+        can_optimize(p) && p->constant_run >= arg_count) {
+        // Constant arguments, the result is a constant as well. Invalid
+        // arguments are left to raise their error at run time.
+        g2basic_number_t args[MAX_FUNC_ARGS];
+        memcpy(args, chunk->constants + chunk->constant_count - arg_count, (size_t)arg_count * sizeof(args[0]));
+        g2basic_number_t result = func->func_ptr(args, arg_count);
+        if (!function_failed(result)) {
+            drop_constants(p, arg_count, args);
+            emit_constant(p, result);
+            return;
+        }
+    }
+    size_t index = 0;
+    while (index < chunk->function_count && chunk->functions[index] != func) {
+        index++;
+    }
+    if (index == chunk->function_count) {
+        const Function** functions =
+            grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->functions, &chunk->function_capacity,
+                        sizeof(Function*), chunk->function_count + 1);
+        if (functions == NULL) {
+            chunk->out_of_memory = true;
+            return;
+        }
+        chunk->functions = functions;
+        chunk->functions[chunk->function_count++] = func;
+    }
+    if (begin_instruction(p, 1 - arg_count)) {
+        note_instruction(p, func->async_ptr != NULL ? OP_CALL_ASYNC : OP_CALL);
+        emit_word(p, (int32_t)index);
+        emit_word(p, arg_count);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool is_comparison(int32_t op) {
+    return op == OP_LT || op == OP_GT || op == OP_LE || op == OP_GE ||
+           op == OP_EQ || op == OP_NE;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool compare_values(int32_t op, g2basic_number_t a, g2basic_number_t b) {
+    switch (op) {
+        case OP_LT:
+            return a < b;
+        case OP_GT:
+            return a > b;
+        case OP_LE:
+            return a <= b;
+        case OP_GE:
+            return a >= b;
+        case OP_EQ:
+            return a == b;
+        default:
+            return a != b;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compute a binary operation at compile time
+ *
+ * @return false if the operation must be left to run time (division by
+ * zero and overflow raise an error there)
+ */
+static bool fold_binary(Opcode op, g2basic_number_t a, g2basic_number_t b, g2basic_number_t* result) {
+    switch (op) {
+        case OP_ADD:
+            return number_add(a, b, result);
+        case OP_SUB:
+            return number_sub(a, b, result);
+        case OP_MUL:
+            return number_mul(a, b, result);
+        case OP_DIV:
+            if (b == 0) {
+                return false;
+            }
+            return number_div(a, b, result);
+        default:
+            *result = compare_values(op, a, b) ? NUMBER_ONE : 0;
+            return true;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit an arithmetic or comparison operator
+ *
+ * Operations on two constants are folded into one constant, and operations
+ * with a right operand that leaves the left one unchanged (X*1, X/1, X-0)
+ * are dropped. X+0 is kept, it turns -0 into 0.
+ */
+static void emit_binary(Parser* p, Opcode op) {
+    Chunk* chunk = p->chunk;
+    if (can_optimize(p) && p->constant_run >= 2) {
+        g2basic_number_t a = chunk->constants[chunk->constant_count - 2];
+        g2basic_number_t b = chunk->constants[chunk->constant_count - 1];
+        g2basic_number_t result;
+        if (fold_binary(op, a, b, &result)) {
+            g2basic_number_t operands[2];
+            drop_constants(p, 2, operands);
+            emit_constant(p, result);
+            return;
+        }
+    } else if (can_optimize(p) && p->constant_run == 1) {
+        g2basic_number_t b = chunk->constants[chunk->constant_count - 1];
+        if ((b == NUMBER_ONE && (op == OP_MUL || op == OP_DIV)) ||
+            (number_is_positive_zero(b) && op == OP_SUB)) {
+            drop_constants(p, 1, &b);
+            return;
+        }
+    }
+    emit_op(p, op, -1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool is_integer_name(const char* name) {
+    size_t length = strlen(name);
+    return length > 0 && name[length - 1] == '%';
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Rewrite an OP_PUSH_CONST at code offset @p offset into OP_PUSH_INT
+ *
+ * @param exact Only rewrite integral constants, otherwise truncate
+ * @return false if the constant has no integer value
+ */
+static bool constant_to_integer(Parser* p, size_t offset, bool exact) {
+    Chunk* chunk = p->chunk;
+    int32_t index = chunk->code[offset + 1];
+    g2basic_number_t value = chunk->constants[index];
+    int32_t integer;
+    g2basic_number_t exact_value;
+    if (!number_to_integer(value, &integer) ||
+        (exact && (!integer_to_number(integer, &exact_value) || exact_value != value))) {
+        return false;
+    }
+    chunk->code[offset] = OP_PUSH_INT;
+    chunk->code[offset + 1] = integer;
+    if ((size_t)index + 1 == chunk->constant_count) {
+        chunk->constant_count--;
+    }
+    if (offset == p->recent[0]) {
+        p->constant_run = 0;
+    }
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Convert the value on top of the stack from type @p from to @p to
+ *
+ * Constants are converted at compile time, and an integer variable read
+ * right before is turned into a read that converts.
+ */
+static void emit_conversion(Parser* p, ValueType from, ValueType to) {
+    Chunk* chunk = p->chunk;
+    if (from == to) {
+        return;
+    }
+    if (to == VALUE_INTEGER) {
+        if (!can_optimize(p) || p->constant_run < 1 || !constant_to_integer(p, p->recent[0], false)) {
+            emit_op(p, OP_NUM_TO_INT, 0);
+        }
+        return;
+    }
+    if (can_optimize(p) && p->recent_count >= 1 && chunk->code[p->recent[0]] == OP_LOAD_INT) {
+        chunk->code[p->recent[0]] = OP_LOAD_INT_NUM;
+        return;
+    }
+    emit_op(p, OP_INT_TO_NUM, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit an arithmetic or comparison operator on two integers
+ *
+ * Comparisons leave a number, like their OP_LT..OP_NE counterparts.
+ * Operations that leave the left operand unchanged (I%*1, I%+0, I%-0) are
+ * dropped.
+ */
+static void emit_integer_binary(Parser* p, Opcode op) {
+    Chunk* chunk = p->chunk;
+    if (is_comparison(op)) {
+        emit_op_arg(p, OP_COMPARE_INT, op, -1);
+        return;
+    }
+    if (can_optimize(p) && p->recent_count >= 1 && chunk->code[p->recent[0]] == OP_PUSH_INT &&
+        chunk->code[p->recent[0] + 1] == (op == OP_MUL ? 1 : 0)) {
+        chunk->code_count = p->recent[0];
+        forget_instructions(p, 1);
+        p->depth -= 1;
+        return;
+    }
+    emit_op(p, op == OP_ADD ? OP_ADD_INT : op == OP_SUB ? OP_SUB_INT : OP_MUL_INT, -1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Code offset of the left operand of a binary operator when it is a
+ * lone constant, SIZE_MAX otherwise
+ *
+ * Called right before the right operand is compiled.
+ */
+static size_t left_constant_offset(const Parser* p) {
+    return can_optimize(p) && p->constant_run >= 1 ? p->recent[0] : SIZE_MAX;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit an arithmetic or comparison operator on typed operands
+ *
+ * Two integers make an integer operation, otherwise the integer operand is
+ * converted to a number. Integral constants count as integers next to an
+ * integer, so I% + 1 stays an integer operation. Division always works on
+ * numbers.
+ *
+ * @param left_constant Result of left_constant_offset() for the left operand
+ * @param right_start Code offset of the first instruction of the right operand
+ * @return Type of the result
+ */
+static ValueType emit_typed_binary(Parser* p,
+                                   Opcode op,
+                                   ValueType left,
+                                   ValueType right,
+                                   size_t left_constant,
+                                   size_t right_start) {
+    Chunk* chunk = p->chunk;
+    if (op != OP_DIV && left == VALUE_INTEGER && right == VALUE_NUMBER && can_optimize(p) &&
+        p->constant_run >= 1 && constant_to_integer(p, p->recent[0], true)) {
+        right = VALUE_INTEGER;
+    } else if (op != OP_DIV && left == VALUE_NUMBER && right == VALUE_INTEGER && can_optimize(p) &&
+               left_constant != SIZE_MAX && constant_to_integer(p, left_constant, true)) {
+        left = VALUE_INTEGER;
+    }
+    if (op != OP_DIV && left == VALUE_INTEGER && right == VALUE_INTEGER) {
+        emit_integer_binary(p, op);
+        return is_comparison(op) ? VALUE_NUMBER : VALUE_INTEGER;
+    }
+    emit_conversion(p, right, VALUE_NUMBER);
+    if (left == VALUE_INTEGER) {
+        // A lone integer variable on the left is read as a number instead
+        if (can_optimize(p) && p->recent_count >= 2 && p->recent[0] == right_start &&
+            chunk->code[p->recent[1]] == OP_LOAD_INT) {
+            chunk->code[p->recent[1]] = OP_LOAD_INT_NUM;
+        } else {
+            emit_op(p, OP_INT_TO_NUM_UNDER, 0);
+        }
+    }
+    emit_binary(p, op);
+    return VALUE_NUMBER;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_negate(Parser* p, ValueType type) {
+    Chunk* chunk = p->chunk;
+    if (type == VALUE_INTEGER) {
+        emit_op(p, OP_NEG_INT, 0);
+        return;
+    }
+    if (can_optimize(p) && p->constant_run >= 1) {
+        chunk->constants[chunk->constant_count - 1] =
+            -chunk->constants[chunk->constant_count - 1];
+        return;
+    }
+    emit_op(p, OP_NEG, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit the jump over the THEN part of an IF statement
+ *
+ * A comparison followed by a conditional jump is fused into OP_JUMP_UNLESS,
+ * and comparing a variable with a constant, the most common condition, into
+ * a single OP_JUMP_UNLESS_VAR. Integer comparisons are fused the same way,
+ * into OP_JUMP_UNLESS_INT and OP_JUMP_UNLESS_VAR_INT.
+ *
+ * @return Code offset of the target operand, for patch_jump()
+ */
+static size_t emit_condition_jump(Parser* p) {
+    Chunk* chunk = p->chunk;
+    bool integer = can_optimize(p) && p->recent_count >= 1 && chunk->code[p->recent[0]] == OP_COMPARE_INT;
+    if (!integer && (!can_optimize(p) || p->recent_count < 1 ||
+                     !is_comparison(chunk->code[p->recent[0]]))) {
+        return emit_jump(p, OP_JUMP_IF_FALSE, -1);
+    }
+    int32_t comparison = chunk->code[p->recent[0] + (integer ? 1 : 0)];
+    if (p->recent_count >= 3 && chunk->code[p->recent[2]] == (integer ? OP_LOAD_INT : OP_LOAD) &&
+        chunk->code[p->recent[1]] == (integer ? OP_PUSH_INT : OP_PUSH_CONST)) {
+        int32_t slot = chunk->code[p->recent[2] + 1];
+        int32_t constant = chunk->code[p->recent[1] + 1];
+        chunk->code_count = p->recent[2];
+        forget_instructions(p, 3);
+        p->depth -= 1;
+        if (begin_instruction(p, 0)) {
+            note_instruction(p, integer ? OP_JUMP_UNLESS_VAR_INT : OP_JUMP_UNLESS_VAR);
+            emit_word(p, comparison);
+            emit_word(p, slot);
+            emit_word(p, constant);
+            emit_word(p, 0);
+        }
+        return chunk->code_count - 1;
+    }
+    chunk->code_count = p->recent[0];
+    forget_instructions(p, 1);
+    p->depth += 1;
+    if (begin_instruction(p, -2)) {
+        note_instruction(p, integer ? OP_JUMP_UNLESS_INT : OP_JUMP_UNLESS);
+        emit_word(p, comparison);
+        emit_word(p, 0);
+    }
+    return chunk->code_count - 1;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_print_char(Parser* p, char c) {
+    emit_op_arg(p, OP_PRINT_CHAR, c, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+#ifdef G2BASIC_TRACE
+/**
+ * @brief Emit an instruction recording a trace event
+ *
+ * For G2BASIC_TRACE_LINE @p value is the line entered, which later events
+ * are recorded for.
+ */
+static void emit_trace(Parser* p, g2basic_trace_event_t event, int32_t value) {
+    if (begin_instruction(p, 0)) {
+        note_instruction(p, OP_TRACE);
+        emit_word(p, (int32_t)event);
+        emit_word(p, value);
+    }
+}
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit a control transfer to a program line (OP_JUMP, OP_GOSUB)
+ *
+ * The target line may not be compiled yet, so the jump is recorded and
+ * bound by compile_program() once all lines have their code offsets. Like
+ * in the line interpreter before it, jumping to a program line has no
+ * effect in immediate mode.
+ */
+static void emit_line_jump(Parser* p, Opcode op, int line_number) {
+    if (p->immediate) {
+        return;
+    }
+#ifdef G2BASIC_TRACE
+    emit_trace(p, op == OP_GOSUB ? G2BASIC_TRACE_GOSUB : G2BASIC_TRACE_GOTO, line_number);
+#endif
+    Chunk* chunk = p->chunk;
+    LineFixup* fixups =
+        grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->fixups, &chunk->fixup_capacity,
+                    sizeof(LineFixup), chunk->fixup_count + 1);
+    if (fixups == NULL) {
+        chunk->out_of_memory = true;
+        return;
+    }
+    chunk->fixups = fixups;
+    size_t operand = emit_jump(p, op, 0);
+    if (p->err == NULL && !chunk->out_of_memory) {
+        chunk->fixups[chunk->fixup_count].operand = operand;
+        chunk->fixups[chunk->fixup_count].line_number = line_number;
+        chunk->fixups[chunk->fixup_count].op = op;
+        chunk->fixup_count++;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Emit an instruction raising @p message and clear the error state
+ */
+static void emit_error(Parser* p, const char* message) {
+    Chunk* chunk = p->chunk;
+    int32_t index = -1;
+    char** messages =
+        grow_buffer(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->messages, &chunk->message_capacity,
+                    sizeof(char*), chunk->message_count + 1);
+    if (messages != NULL) {
+        chunk->messages = messages;
+        char* copy = (char*)mem_alloc(p->ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, strlen(message) + 1);
+        if (copy != NULL) {
+            strcpy(copy, message);
+            index = (int32_t)chunk->message_count;
+            chunk->messages[chunk->message_count++] = copy;
+        }
+    }
+    if (index < 0) {
+        chunk->out_of_memory = true;
+    }
+    p->err = NULL;
+    emit_op_arg(p, OP_ERROR, index, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool is_else(const uint8_t* s) {
+    return s[0] == TOKEN_KEYWORD && s[1] == KEYWORD_ELSE;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check whether the cursor has reached the end of a statement
+ *
+ * A statement ends with the line, with the ':' separating it from the next
+ * one or with the ELSE of the IF statement it belongs to.
+ */
+static bool at_statement_end(Parser* p) {
+    p->s = skip_ws(p->s);
+    return *p->s == TOKEN_END || *p->s == ':' || is_else(p->s);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_print_statement(Parser* p) {
+    if (at_statement_end(p)) {
+        emit_print_char(p, '\n');
+        return;
+    }
+
+    int first = 1;
+    do {
+        if (!first) {
+            emit_print_char(p, ' ');  // Space between expressions
+        }
+        first = 0;
+
+        ValueType type = parse_cached_expr(p);
+        if (p->err) {
+            return;
+        }
+        emit_op(p, type == VALUE_INTEGER ? OP_PRINT_INT : OP_PRINT, -1);
+
+        p->s = skip_ws(p->s);
+        if (*p->s == ',') {
+            p->s++;  // consume comma
+        } else {
+            break;
+        }
+    } while (!at_statement_end(p));
+
+    emit_print_char(p, '\n');  // End with newline
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_goto_statement(Parser* p) {
+    int target_line;
+    int status = parse_line_number(p, &target_line);
+    if (status == 0) {
+        p->err = "GOTO requires a line number";
+        return;
+    }
+    if (status < 0) {
+        p->err = "invalid GOTO line number";
+        return;
+    }
+
+    emit_line_jump(p, OP_JUMP, target_line);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_comparison(Parser* p) {
+    size_t start = p->chunk->code_count;
+    unsigned variant = p->variant;
+    ValueType left = parse_expr(p);
+    if (p->err)
+        return;
+    bool left_invariant = p->variant == variant;
+
+    p->s = skip_ws(p->s);
+
+    // Parse comparison operator
+    char op1 = (char)*p->s;
+    char op2 = '\0';
+
+    if (op1 == '>' || op1 == '<' || op1 == '=') {
+        p->s++;
+        // Check for two-character operators
+        if (*p->s == '=' || (*p->s == '>' && op1 == '<')) {
+            op2 = (char)*p->s++;
+        }
+    } else {
+        p->err = "expected comparison operator";
+        return;
+    }
+
+    size_t left_constant = left_constant_offset(p);
+    size_t right_start = p->chunk->code_count;
+    variant = p->variant;
+    ValueType right = parse_expr(p);
+    if (p->err)
+        return;
+    bool right_invariant = p->variant == variant;
+
+    // Emit comparison
+    Opcode op;
+    if (op1 == '>' && op2 == '\0') {
+        op = OP_GT;
+    } else if (op1 == '<' && op2 == '\0') {
+        op = OP_LT;
+    } else if (op1 == '>' && op2 == '=') {
+        op = OP_GE;
+    } else if (op1 == '<' && op2 == '=') {
+        op = OP_LE;
+    } else if (op1 == '=' && op2 == '\0') {
+        op = OP_EQ;
+    } else if (op1 == '<' && op2 == '>') {
+        op = OP_NE;
+    } else {
+        p->err = "unknown comparison operator";
+        return;
+    }
+    cache_operands(p, start, &right_start, left_invariant, right_invariant, left, right, true);
+    emit_typed_binary(p, op, left, right, left_constant, right_start);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile the THEN or ELSE branch of an IF statement
+ *
+ * A branch is either a line number to jump to or statements up to the ELSE
+ * or the end of the line. Errors in a branch are only raised when it is
+ * taken, the rest of the branch is skipped.
+ *
+ * @param invalid_line Error message for an invalid line number
+ */
+static void parse_branch(Parser* p, const char* invalid_line) {
+    int target_line;
+    int status = p->err ? 0 : parse_line_number(p, &target_line);
+    if (status < 0) {
+        p->err = invalid_line;
+    } else if (status > 0) {
+        p->s = skip_ws(p->s);
+        if (*p->s != TOKEN_END && !is_else(p->s)) {
+            p->err = "Unexpected characters at end";
+        }
+        emit_line_jump(p, OP_JUMP, target_line);
+    } else if (!p->err) {
+        p->branches++;
+        parse_statements(p);
+        p->branches--;
+    }
+
+    if (p->err) {
+        emit_error(p, p->err);
+        while (*p->s != TOKEN_END && !is_else(p->s)) {
+            p->s += token_length(p->s);
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile an IF statement
+ *
+ * The branch offsets are fixed at compile time: a false condition takes a
+ * single jump to the ELSE branch (or past the THEN branch), and the THEN
+ * branch ends with a jump over the ELSE branch.
+ */
+static void parse_if_statement(Parser* p) {
+    parse_comparison(p);
+    if (p->err)
+        return;
+
+    // Expect THEN keyword
+    if (!accept_keyword(p, KEYWORD_THEN)) {
+        p->err = "expected THEN after IF condition";
+        return;
+    }
+    p->s = skip_ws(p->s);
+
+    // Skip the THEN branch when the condition is false (zero)
+    size_t skip = emit_condition_jump(p);
+    parse_branch(p, "invalid IF-THEN line number");
+    if (!is_else(p->s)) {
+        patch_jump(p, skip);
+        return;
+    }
+
+    // An ELSE binds to the innermost IF, nested IF statements have consumed theirs
+    p->s += 3;
+    size_t done = emit_jump(p, OP_JUMP, 0);
+    patch_jump(p, skip);
+    parse_branch(p, "invalid IF-ELSE line number");
+    patch_jump(p, done);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_for_statement(Parser* p) {
+    const char* var_name = parse_identifier(p);
+    if (var_name == NULL) {
+        p->err = "expected variable name after FOR";
+        return;
+    }
+
+    p->s = skip_ws(p->s);
+
+    // Expect '='
+    if (*p->s != '=') {
+        p->err = "expected '=' after FOR variable";
+        return;
+    }
+    p->s++;
+
+    // The bounds and the step have the type of the loop variable
+    ValueType type = is_integer_name(var_name) ? VALUE_INTEGER : VALUE_NUMBER;
+
+    // Parse start value
+    emit_conversion(p, parse_cached_expr(p), type);
+    if (p->err) {
+        return;
+    }
+
+    // Expect TO
+    if (!accept_keyword(p, KEYWORD_TO)) {
+        p->err = "expected TO after FOR start value";
+        return;
+    }
+
+    // Parse end value
+    emit_conversion(p, parse_cached_expr(p), type);
+    if (p->err) {
+        return;
+    }
+
+    // Check for optional STEP
+    if (accept_keyword(p, KEYWORD_STEP)) {
+        emit_conversion(p, parse_cached_expr(p), type);
+        if (p->err) {
+            return;
+        }
+    } else if (type == VALUE_INTEGER) {
+        emit_op_arg(p, OP_PUSH_INT, 1, 1);
+    } else {
+        emit_constant(p, NUMBER_ONE);
+    }
+
+    // Push the loop and set the loop variable to the start value
+    hoist_loop_begin(p, var_name);
+    emit_variable_op(p, type == VALUE_INTEGER ? OP_FOR_INT : OP_FOR, var_name, -3);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_next_statement(Parser* p) {
+    if (p->hoist != NULL && p->hoist->depth > 0 && p->hoist->loops[p->hoist->depth - 1].next == p->s) {
+        hoist_loop_end(p->hoist, p->chunk);
+    }
+    const char* var_name = parse_identifier(p);
+    if (var_name == NULL) {
+        p->err = "expected variable name after NEXT";
+        return;
+    }
+
+    emit_variable_op(p, is_integer_name(var_name) ? OP_NEXT_INT : OP_NEXT, var_name, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_gosub_statement(Parser* p) {
+    int target_line;
+    int status = parse_line_number(p, &target_line);
+    if (status == 0) {
+        p->err = "GOSUB requires a line number";
+        return;
+    }
+    if (status < 0) {
+        p->err = "invalid GOSUB line number";
+        return;
+    }
+
+    emit_line_jump(p, OP_GOSUB, target_line);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_return_statement(Parser* p) {
+    emit_op(p, OP_RETURN, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_end_statement(Parser* p) {
+    emit_op(p, OP_END, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int accept(Parser* p, char c) {
+    p->s = skip_ws(p->s);
+    if (*p->s == c) {
+        p->s++;
+        return 1;
+    }
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void expect(Parser* p, char c) {
+    p->s = skip_ws(p->s);
+    if (*p->s != c) {
+        snprintf(p->ctx->message, sizeof(p->ctx->message), "expected '%c'",
+                 c);
+        p->err = p->ctx->message;
+        return;
+    }
+    p->s++;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_number(Parser* p) {
+    p->s = skip_ws(p->s);
+    // Numeric literals were converted by the tokenizer already
+    if (*p->s != TOKEN_NUMBER) {
+        p->err = "expected number";
+        return VALUE_NUMBER;
+    }
+    double v;
+    memcpy(&v, p->s + 1, sizeof(v));
+    p->s += token_length(p->s);
+    g2basic_number_t value = number_from_double(v);
+    if (number_is_undefined(value)) {
+        // Too large for a fixed-point number, but it may still be an integer
+        if (v == floor(v) && fabs(v) <= INT32_MAX) {
+            emit_op_arg(p, OP_PUSH_INT, (int32_t)v, 1);
+            return VALUE_INTEGER;
+        }
+        p->err = "number out of range";
+        return VALUE_NUMBER;
+    }
+    emit_constant(p, value);
+    return VALUE_NUMBER;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_variable(Parser* p) {
+    p->s = skip_ws(p->s);
+
+    const char* var_name = parse_identifier(p);
+    if (var_name == NULL) {
+        p->err = "expected variable name";
+        return VALUE_NUMBER;
+    }
+
+    if (!is_integer_name(var_name)) {
+        emit_variable_op(p, OP_LOAD, var_name, 1);
+        return VALUE_NUMBER;
+    }
+    // Compiled expressions only work on numbers
+    if (p->expression) {
+        emit_variable_op(p, OP_LOAD_INT_NUM, var_name, 1);
+        return VALUE_NUMBER;
+    }
+    emit_variable_op(p, OP_LOAD_INT, var_name, 1);
+    return VALUE_INTEGER;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_function_call(Parser* p, const char* func_name) {
+    const Function* func = find_function(p->ctx, func_name);
+    if (!func) {
+        snprintf(p->ctx->message, sizeof(p->ctx->message),
+                 "unknown function '%s'", func_name);
+        p->err = p->ctx->message;
+        return;
+    }
+
+    expect(p, '(');
+    if (p->err)
+        return;
+
+    int arg_count = 0;
+    size_t starts[MAX_FUNC_ARGS + 1];
+    bool invariant[MAX_FUNC_ARGS];
+
+    // Parse arguments, they are left on the stack in order
+    p->s = skip_ws(p->s);
+    if (*p->s != ')') {  // Function has arguments
+        do {
+            if (arg_count >= MAX_FUNC_ARGS) {
+                p->err = "too many function arguments";
+                return;
+            }
+
+            starts[arg_count] = p->chunk->code_count;
+            unsigned variant = p->variant;
+            emit_conversion(p, parse_expr(p), VALUE_NUMBER);
+            if (p->err)
+                return;
+            invariant[arg_count] = p->variant == variant;
+            arg_count++;
+
+            p->s = skip_ws(p->s);
+            if (*p->s == ',') {
+                p->s++;  // consume comma
+            } else {
+                break;
+            }
+        } while (1);
+    }
+
+    expect(p, ')');
+    if (p->err)
+        return;
+
+    // Validate argument count
+    if (func->arg_count >= 0 && arg_count != func->arg_count) {
+        snprintf(p->ctx->message, sizeof(p->ctx->message),
+                 "function '%s' expects %d arguments, got %d", func_name,
+                 func->arg_count, arg_count);
+        p->err = p->ctx->message;
+        return;
+    }
+
+    // A call that changes on its own or with its arguments caches the
+    // invariant ones, the last first so the others stay in place
+    bool pure = (func->flags & (G2BASIC_FUNCTION_PURE | G2BASIC_FUNCTION_MAY_YIELD)) == G2BASIC_FUNCTION_PURE &&
+                func->async_ptr == NULL;
+    bool call_invariant = pure;
+    for (int i = 0; i < arg_count; i++) {
+        call_invariant = call_invariant && invariant[i];
+    }
+    starts[arg_count] = p->chunk->code_count;
+    for (int i = arg_count - 1; i >= 0 && !call_invariant; i--) {
+        if (invariant[i]) {
+            cache_value(p, starts[i], starts[i + 1], VALUE_NUMBER);
+        }
+    }
+    if (!pure) {
+        p->variant++;
+    }
+
+    // Call the function
+    emit_call(p, func, arg_count);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Built-in functions of whole arrays
+ *
+ * They take array names instead of values and compile to instructions of
+ * their own. Like the other built-ins they are lowercase, and a registered
+ * function of the same name takes precedence.
+ */
+static const struct {
+    const char* name;   /**< Function name */
+    Opcode op;          /**< Instruction computing the result */
+    int array_count;    /**< Number of array arguments */
+} array_functions[] = {
+    {"sum", OP_ARRAY_SUM, 1},
+    {"mean", OP_ARRAY_MEAN, 1},
+    {"dot", OP_ARRAY_DOT, 2},
+};
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @return Index of the array function @p name in array_functions[], or -1
+ */
+static int find_array_function(const char* name) {
+    for (size_t i = 0; i < sizeof(array_functions) / sizeof(array_functions[0]); i++) {
+        if (strcmp(array_functions[i].name, name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Resolve the array @p name to its slot
+ *
+ * @return The slot, or -1 with the error set
+ */
+static int32_t array_slot(Parser* p, const char* name) {
+    if (p->expression) {
+        p->err = "arrays are not supported in compiled expressions";
+        return -1;
+    }
+    if (is_integer_name(name)) {
+        p->err = "arrays hold numbers, not integers";
+        return -1;
+    }
+    int32_t slot = intern_array(p->ctx, name);
+    if (slot < 0) {
+        p->err = "memory allocation failed for array";
+    }
+    return slot;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Consume an array name
+ *
+ * @return The slot of the array, or -1 with the error set
+ */
+static int32_t parse_array(Parser* p) {
+    p->s = skip_ws(p->s);
+    const char* name = parse_identifier(p);
+    if (name == NULL) {
+        p->err = "expected array name";
+        return -1;
+    }
+    return array_slot(p, name);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile a parenthesized array index, leaving it on the integer stack
+ */
+static void parse_array_index(Parser* p) {
+    expect(p, '(');
+    if (p->err) {
+        return;
+    }
+    emit_conversion(p, parse_cached_expr(p), VALUE_INTEGER);
+    if (p->err) {
+        return;
+    }
+    expect(p, ')');
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check whether the parenthesis at @p s closes in front of an '='
+ *
+ * Tells an assignment to an array element from an expression statement
+ * before any code is compiled for it.
+ */
+static bool is_element_assignment(const uint8_t* s) {
+    int nesting = 0;
+    do {
+        if (*s == '(') {
+            nesting++;
+        } else if (*s == ')') {
+            nesting--;
+        }
+        s += token_length(s);
+    } while (nesting > 0 && *s != TOKEN_END);
+    return nesting == 0 && *skip_ws(s) == '=';
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_array_function(Parser* p, int index) {
+    int32_t slots[2] = {0, 0};
+    expect(p, '(');
+    for (int i = 0; i < array_functions[index].array_count && !p->err; i++) {
+        if (i > 0) {
+            expect(p, ',');
+        }
+        if (!p->err) {
+            slots[i] = parse_array(p);
+        }
+    }
+    if (!p->err) {
+        expect(p, ')');
+    }
+    p->variant++;
+    if (begin_instruction(p, 1)) {
+        note_instruction(p, array_functions[index].op);
+        for (int i = 0; i < array_functions[index].array_count; i++) {
+            emit_word(p, slots[i]);
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_dim_statement(Parser* p) {
+    do {
+        int32_t slot = parse_array(p);
+        if (p->err) {
+            return;
+        }
+        declare_array(p->ctx, p->ctx->arrays[slot]);
+        parse_array_index(p);
+        emit_op_arg(p, OP_DIM, slot, -1);
+    } while (!p->err && accept(p, ','));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_fill_statement(Parser* p) {
+    int32_t slot = parse_array(p);
+    if (p->err) {
+        return;
+    }
+    expect(p, ',');
+    if (p->err) {
+        return;
+    }
+    emit_conversion(p, parse_cached_expr(p), VALUE_NUMBER);
+    emit_op_arg(p, OP_ARRAY_FILL, slot, -1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_copy_statement(Parser* p) {
+    int32_t source = parse_array(p);
+    if (p->err) {
+        return;
+    }
+    if (!accept_keyword(p, KEYWORD_TO)) {
+        p->err = "expected TO after COPY source array";
+        return;
+    }
+    int32_t dest = parse_array(p);
+    if (begin_instruction(p, 0)) {
+        note_instruction(p, OP_ARRAY_COPY);
+        emit_word(p, dest);
+        emit_word(p, source);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_factor(Parser* p) {
+    p->s = skip_ws(p->s);
+    // unary +/-
+    if (*p->s == '+' || *p->s == '-') {
+        int neg = (*p->s == '-');
+        p->s++;
+        ValueType type = parse_factor(p);
+        if (neg) {
+            emit_negate(p, type);
+        }
+        return type;
+    }
+
+    if (accept(p, '(')) {
+        ValueType type = parse_expr(p);
+        if (p->err)
+            return type;
+        expect(p, ')');
+        return type;
+    }
+
+    if (*p->s == TOKEN_IDENTIFIER) {
+        const uint8_t* start = p->s;
+        const char* identifier = parse_identifier(p);
+        p->s = skip_ws(p->s);
+
+        if (*p->s == '(') {
+            // Compiled expressions have no arrays, anything else is a call
+            int array_function = find_array_function(identifier);
+            if (p->expression || find_function(p->ctx, identifier) != NULL) {
+                parse_function_call(p, identifier);
+            } else if (array_function >= 0) {
+                parse_array_function(p, array_function);
+            } else if (!array_declared(p->ctx, identifier)) {
+                // Neither dimensioned nor mapped, most likely a mistyped call
+                p->ctx->array_rejected = true;
+                parse_function_call(p, identifier);
+            } else {
+                int32_t slot = array_slot(p, identifier);
+                if (!p->err) {
+                    parse_array_index(p);
+                }
+                p->variant++;
+                emit_op_arg(p, OP_ARRAY_LOAD, slot, 0);
+            }
+            return VALUE_NUMBER;
+        }
+        p->s = start;
+        return parse_variable(p);
+    }
+
+    return parse_number(p);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_term(Parser* p) {
+    size_t start = p->chunk->code_count;
+    unsigned variant = p->variant;
+    ValueType type = parse_factor(p);
+    while (!p->err) {
+        p->s = skip_ws(p->s);
+        if (*p->s == '*' || *p->s == '/') {
+            char op = (char)*p->s++;
+            bool left_invariant = p->variant == variant;
+            size_t left_constant = left_constant_offset(p);
+            size_t right_start = p->chunk->code_count;
+            unsigned right_variant = p->variant;
+            ValueType right = parse_factor(p);
+            cache_operands(p, start, &right_start, left_invariant, p->variant == right_variant, type, right, false);
+            type = emit_typed_binary(p, op == '*' ? OP_MUL : OP_DIV, type, right, left_constant, right_start);
+        } else {
+            break;
+        }
+    }
+    return type;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ValueType parse_expr(Parser* p) {
+    size_t start = p->chunk->code_count;
+    unsigned variant = p->variant;
+    ValueType type = parse_term(p);
+    while (!p->err) {
+        p->s = skip_ws(p->s);
+        if (*p->s == '+' || *p->s == '-') {
+            char op = (char)*p->s++;
+            bool left_invariant = p->variant == variant;
+            size_t left_constant = left_constant_offset(p);
+            size_t right_start = p->chunk->code_count;
+            unsigned right_variant = p->variant;
+            ValueType right = parse_term(p);
+            cache_operands(p, start, &right_start, left_invariant, p->variant == right_variant, type, right, false);
+            type = emit_typed_binary(p, op == '+' ? OP_ADD : OP_SUB, type, right, left_constant, right_start);
+        } else {
+            break;
+        }
+    }
+    return type;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile an expression whose value is used as a whole
+ *
+ * The value is cached when the loop around it does not change it.
+ */
+static ValueType parse_cached_expr(Parser* p) {
+    size_t start = p->chunk->code_count;
+    unsigned variant = p->variant;
+    ValueType type = parse_expr(p);
+    if (p->variant == variant) {
+        cache_value(p, start, p->chunk->code_count, type);
+    }
+    return type;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_statement(Parser* p) {
+    p->s = skip_ws(p->s);
+
+    // Keywords were resolved by the tokenizer, dispatch straight to the handler
+    if (p->s[0] == TOKEN_KEYWORD && keywords[p->s[1]].parser_func != NULL) {
+        const Keyword* kw = &keywords[p->s[1]];
+        p->s += 3;
+        p->s = skip_ws(p->s);
+        kw->parser_func(p);
+        return;
+    }
+    // ELSE has no handler of its own, it is consumed by the IF it belongs to
+    if (is_else(p->s)) {
+        p->err = "ELSE without IF";
+        return;
+    }
+
+    // Check if this looks like an assignment (variable = ...)
+    const uint8_t* saved_pos = p->s;
+    const char* var_name = parse_identifier(p);
+    if (var_name != NULL) {
+        p->s = skip_ws(p->s);
+
+        if (*p->s == '=') {
+            p->s++;  // consume '='
+
+            ValueType type = parse_cached_expr(p);
+            if (is_integer_name(var_name)) {
+                emit_conversion(p, type, VALUE_INTEGER);
+                emit_variable_op(p, OP_STORE_INT, var_name, -1);
+                if (p->immediate) {
+                    emit_variable_op(p, OP_LOAD_INT, var_name, 1);
+                    emit_op(p, OP_RESULT_INT, -1);
+                }
+                return;
+            }
+            emit_conversion(p, type, VALUE_NUMBER);
+            if (p->immediate) {
+                emit_op(p, OP_DUP, 1);
+                emit_op(p, OP_RESULT, -1);
+            }
+            emit_variable_op(p, OP_STORE, var_name, -1);
+            return;
+        }
+
+        if (*p->s == '(' && find_function(p->ctx, var_name) == NULL && find_array_function(var_name) < 0 &&
+            is_element_assignment(p->s)) {
+            int32_t slot = array_slot(p, var_name);
+            if (!p->err) {
+                parse_array_index(p);
+            }
+            if (!p->err) {
+                expect(p, '=');
+            }
+            if (p->err) {
+                return;
+            }
+            emit_conversion(p, parse_cached_expr(p), VALUE_NUMBER);
+            if (p->immediate) {
+                emit_op(p, OP_DUP, 1);
+                emit_op(p, OP_RESULT, -1);
+            }
+            emit_op_arg(p, OP_ARRAY_STORE, slot, -2);
+            return;
+        }
+    }
+
+    // Expression statement, its value is the immediate mode result
+    p->s = saved_pos;
+    emit_conversion(p, parse_cached_expr(p), VALUE_NUMBER);
+    emit_op(p, p->immediate ? OP_RESULT : OP_POP, -1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void parse_statements(Parser* p) {
+    do {
+        parse_statement(p);
+        if (!p->err && !at_statement_end(p)) {
+            p->err = "Unexpected characters at end";
+        }
+    } while (!p->err && accept(p, ':'));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile one line (statements separated by ':') into @p chunk
+ *
+ * The statements are compiled back to back, so moving on to the next one
+ * costs nothing at run time.
+ *
+ * @param hoist Loop analysis of the program the line belongs to, or NULL
+ */
+static void compile_line(g2basic_ctx_t* ctx,
+                         Chunk* chunk,
+                         const uint8_t* tokens,
+                         bool immediate,
+                         Hoist* hoist) {
+    Parser p = {.ctx = ctx,
+                .start = tokens,
+                .s = tokens,
+                .err = NULL,
+                .chunk = chunk,
+                .immediate = immediate,
+                .depth = 0,
+                .hoist = hoist};
+    parse_statements(&p);
+    if (!p.err && *p.s != TOKEN_END) {
+        p.err = "ELSE without IF";
+    }
+    if (p.err) {
+        emit_error(&p, p.err);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void emit_end(g2basic_ctx_t* ctx, Chunk* chunk) {
+    Parser p = {.ctx = ctx, .chunk = chunk};
+    emit_op(&p, OP_END, 0);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile a stored line at the end of program_chunk
+ *
+ * A line edited later is redirected with a jump written over its first two
+ * words, so shorter code (a lone RETURN or END) is padded to that size.
+ *
+ * @param hoist Loop analysis of the whole program, NULL to cache nothing
+ */
+static void compile_program_line(g2basic_ctx_t* ctx, ProgramLine* line, Hoist* hoist) {
+    Chunk* chunk = &ctx->program_chunk;
+    line->code_offset = chunk->code_count;
+#ifdef G2BASIC_PROFILE
+    // Jumps to the line land on its marker, so every entry is counted
+    Parser marker = {.ctx = ctx, .chunk = chunk};
+    emit_op_arg(&marker, OP_LINE, (int32_t)line_index_position(ctx, line->line_number), 0);
+#endif
+#ifdef G2BASIC_TRACE
+    Parser trace = {.ctx = ctx, .chunk = chunk};
+    emit_trace(&trace, G2BASIC_TRACE_LINE, line->line_number);
+#endif
+    if (hoist != NULL) {
+        hoist->line = line;
+    }
+    compile_line(ctx, chunk, line->tokens, false, hoist);
+    if (chunk->code_count - line->code_offset < 2) {
+        Parser padding = {.ctx = ctx, .chunk = chunk};
+        patch_jump(&padding, emit_jump(&padding, OP_JUMP, 0));
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Point a jump to a program line at the current code of @p target
+ *
+ * Without a target line the jump turns into OP_GOTO, which reports it.
+ */
+static void bind_fixup(g2basic_ctx_t* ctx, const LineFixup* fixup, const ProgramLine* target) {
+    int32_t* code = ctx->program_chunk.code;
+    if (target != NULL) {
+        code[fixup->operand - 1] = fixup->op;
+        code[fixup->operand] = (int32_t)target->code_offset;
+    } else {
+        code[fixup->operand - 1] = OP_GOTO;
+        code[fixup->operand] = fixup->line_number;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile the whole stored program into program_chunk
+ *
+ * Lines are laid out back to back in line number order, so falling off the
+ * end of a line continues with the next one without any dispatch overhead.
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+static int compile_program(g2basic_ctx_t* ctx) {
+    // A DIM further down declares arrays read on the lines before it, the
+    // program is then compiled once more with all of its arrays known
+    size_t declared;
+    do {
+        declared = ctx->declared_arrays;
+        ctx->array_rejected = false;
+        chunk_clear(ctx, &ctx->program_chunk);
+        Hoist hoist;
+        hoist_prepare(ctx, &hoist);
+        for (ProgramLine* line = ctx->program_head; line != NULL; line = line->next) {
+            compile_program_line(ctx, line, &hoist);
+            hoist_line_end(&hoist, &ctx->program_chunk, line);
+        }
+        hoist_release(ctx, &hoist);
+    } while (ctx->array_rejected && ctx->declared_arrays != declared);
+    emit_end(ctx, &ctx->program_chunk);
+    if (ctx->program_chunk.out_of_memory || !reserve_caches(ctx, ctx->program_chunk.cache_count)) {
+        return -1;
+    }
+
+    // Bind GOTO/GOSUB targets now that every line has its code offset
+    for (size_t i = 0; i < ctx->program_chunk.fixup_count; i++) {
+        const LineFixup* fixup = &ctx->program_chunk.fixups[i];
+        bind_fixup(ctx, fixup, find_program_line(ctx, fixup->line_number));
+    }
+    ctx->program_chunk.compiled_count = ctx->program_chunk.code_count;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Number of spans starting at or before @p pc
+ */
+static size_t span_position(const Chunk* chunk, size_t pc) {
+    size_t low = 0;
+    size_t high = chunk->span_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (chunk->spans[mid].offset <= pc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static ProgramLine* find_line_at_offset(g2basic_ctx_t* ctx, size_t pc) {
+    const Chunk* chunk = &ctx->program_chunk;
+    if (chunk->span_count > 0) {
+        size_t position = span_position(chunk, pc);
+        return position > 0 ? chunk->spans[position - 1].line : NULL;
+    }
+    // Code offsets grow with line numbers, so the line index is sorted by
+    // them as well
+    size_t low = 0;
+    size_t high = ctx->line_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ctx->line_index[mid]->code_offset <= pc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? ctx->line_index[low - 1] : NULL;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* PROGRAM PATCHING */
+/*--------------------------------------------------------------------------------------------------------------------*/
+static bool add_span(g2basic_ctx_t* ctx, size_t offset, ProgramLine* line) {
+    Chunk* chunk = &ctx->program_chunk;
+    LineSpan* spans = grow_buffer(ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->spans, &chunk->span_capacity,
+                                  sizeof(LineSpan), chunk->span_count + 1);
+    if (spans == NULL) {
+        return false;
+    }
+    chunk->spans = spans;
+    chunk->spans[chunk->span_count].offset = offset;
+    chunk->spans[chunk->span_count].line = line;
+    chunk->span_count++;
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check that program_chunk can be patched and note where its lines are
+ *
+ * The spans are built on the first patch after a full compile, from the
+ * line index, which holds every compiled line except @p added.
+ *
+ * @return false if the program has to be compiled again instead
+ */
+static bool patch_begin(g2basic_ctx_t* ctx, const ProgramLine* added) {
+#ifdef G2BASIC_PROFILE
+    // OP_LINE operands are positions in the line index, which an edit moves
+    (void)ctx;
+    (void)added;
+    return false;
+#else
+    Chunk* chunk = &ctx->program_chunk;
+    // A stepped run resumes at a code offset and reports the change, an
+    // image is read only, an edit may change what loops cache and once the
+    // dead code left behind by patches outgrows the program a full compile
+    // is due
+    if (ctx->program_dirty || ctx->run_active || ctx->program_running || chunk->borrowed ||
+        chunk->cache_count > 0 || chunk->code_count > 2 * chunk->compiled_count + 256) {
+        return false;
+    }
+    if (chunk->span_count == 0) {
+        for (size_t i = 0; i < ctx->line_count; i++) {
+            ProgramLine* line = ctx->line_index[i];
+            if (line != added && !add_span(ctx, line->code_offset, line)) {
+                chunk->span_count = 0;
+                return false;
+            }
+        }
+    }
+    return true;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Forget the line jumps in the current code of @p line
+ */
+static void patch_retire(g2basic_ctx_t* ctx, const ProgramLine* line) {
+    Chunk* chunk = &ctx->program_chunk;
+    size_t position = span_position(chunk, line->code_offset);
+    size_t start = line->code_offset;
+    size_t end = position < chunk->span_count ? chunk->spans[position].offset : chunk->code_count;
+    size_t kept = 0;
+    for (size_t i = 0; i < chunk->fixup_count; i++) {
+        if (chunk->fixups[i].operand < start || chunk->fixups[i].operand >= end) {
+            chunk->fixups[kept++] = chunk->fixups[i];
+        }
+    }
+    chunk->fixup_count = kept;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile @p first and @p second (or NULL) at the end of program_chunk
+ *
+ * The new code continues with the line after them. The code at @p entry,
+ * where the code of a line used to start, is turned into a jump to it, and
+ * only the line jumps to the two lines and the ones in the new code are
+ * bound again.
+ *
+ * @return false if memory ran out
+ */
+static bool patch_lines(g2basic_ctx_t* ctx, size_t entry, ProgramLine* first, ProgramLine* second) {
+    Chunk* chunk = &ctx->program_chunk;
+    size_t first_fixup = chunk->fixup_count;
+    ProgramLine* last = first;
+    for (ProgramLine* line = first; line != NULL; line = line == first ? second : NULL) {
+        if (!add_span(ctx, chunk->code_count, line)) {
+            return false;
+        }
+        compile_program_line(ctx, line, NULL);
+        last = line;
+    }
+    Parser p = {.ctx = ctx, .chunk = chunk};
+    if (last->next != NULL) {
+        emit_op_arg(&p, OP_JUMP, (int32_t)last->next->code_offset, 0);
+    } else {
+        emit_op(&p, OP_END, 0);
+    }
+    if (chunk->out_of_memory) {
+        return false;
+    }
+
+    chunk->code[entry] = OP_JUMP;
+    chunk->code[entry + 1] = (int32_t)first->code_offset;
+    for (size_t i = 0; i < chunk->fixup_count; i++) {
+        const LineFixup* fixup = &chunk->fixups[i];
+        if (i >= first_fixup || fixup->line_number == first->line_number ||
+            (second != NULL && fixup->line_number == second->line_number)) {
+            bind_fixup(ctx, fixup, find_program_line(ctx, fixup->line_number));
+        }
+    }
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Bring program_chunk up to date after @p line was stored
+ *
+ * A replaced line is compiled again on its own. A new line is compiled
+ * together with the line before it (or after it, when it comes first),
+ * which falls through into it. Anything else marks the program dirty.
+ */
+static void patch_stored_line(g2basic_ctx_t* ctx, ProgramLine* line, bool added) {
+    ProgramLine* first = line;
+    ProgramLine* second = NULL;
+    ProgramLine* moved = line;
+    if (added) {
+        size_t position = line_index_position(ctx, line->line_number);
+        if (position > 0) {
+            first = ctx->line_index[position - 1];
+            second = line;
+            moved = first;
+        } else {
+            second = line->next;
+            moved = second;
+        }
+    }
+    if (moved == NULL || !patch_begin(ctx, added ? line : NULL)) {
+        ctx->program_dirty = true;
+        return;
+    }
+    size_t entry = moved->code_offset;
+    patch_retire(ctx, moved);
+    if (!patch_lines(ctx, entry, first, second)) {
+        ctx->program_dirty = true;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Bring program_chunk up to date before @p line is deleted
+ *
+ * The code of the line is turned into a jump to the next line and jumps to
+ * it report the missing line again.
+ */
+static void patch_deleted_line(g2basic_ctx_t* ctx, ProgramLine* line) {
+    if (!patch_begin(ctx, NULL)) {
+        ctx->program_dirty = true;
+        return;
+    }
+    Chunk* chunk = &ctx->program_chunk;
+    patch_retire(ctx, line);
+    if (line->next != NULL) {
+        chunk->code[line->code_offset] = OP_JUMP;
+        chunk->code[line->code_offset + 1] = (int32_t)line->next->code_offset;
+    } else {
+        chunk->code[line->code_offset] = OP_END;
+    }
+    for (size_t i = 0; i < chunk->fixup_count; i++) {
+        if (chunk->fixups[i].line_number == line->line_number) {
+            bind_fixup(ctx, &chunk->fixups[i], NULL);
+        }
+    }
+    for (size_t i = 0; i < chunk->span_count; i++) {
+        if (chunk->spans[i].line == line) {
+            chunk->spans[i].line = NULL;
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* VIRTUAL MACHINE */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(G2BASIC_NO_COMPUTED_GOTO)
+/** @brief Dispatch with a computed goto table instead of a switch */
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+/** @brief Format the error for reading an unassigned variable */
+static const char* undefined_variable(g2basic_ctx_t* ctx, int32_t slot) {
+    snprintf(ctx->message, sizeof(ctx->message), "undefined variable '%s'",
+             ctx->variable_symbols[slot]->name);
+    return ctx->message;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Push a FOR loop frame, growing the FOR stack when it is full
+ *
+ * @return The frame, or NULL if memory allocation failed
+ */
+static ForLoop* for_loop_push(g2basic_ctx_t* ctx) {
+    if (ctx->for_depth == ctx->for_capacity) {
+        ForLoop* grown = grow_buffer(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_FOR_STACK, ctx->for_stack,
+                                     &ctx->for_capacity, sizeof(ForLoop), ctx->for_depth + 1);
+        if (grown == NULL) {
+            return NULL;
+        }
+        ctx->for_stack = grown;
+    }
+    ForLoop* loop = &ctx->for_stack[ctx->for_depth++];
+    if (ctx->for_depth > ctx->for_peak_depth) {
+        ctx->for_peak_depth = ctx->for_depth;
+    }
+#ifdef G2BASIC_ASSERT_NO_ALLOC
+    loop->allocations = SIZE_MAX;
+#endif
+#ifdef G2BASIC_TRACE
+    loop->trace_line = ctx->trace_line;
+    trace_event(ctx, G2BASIC_TRACE_FOR, (int32_t)ctx->for_depth, NULL);
+#endif
+    return loop;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Note a completed pass through the body of a FOR loop
+ *
+ * With G2BASIC_ASSERT_NO_ALLOC defined, asserts that the pass did not
+ * allocate. The first pass through the body may grow the stacks, every
+ * following iteration must run without touching the heap. Immediate mode
+ * loops are left out, their lines are compiled between the iterations.
+ */
+static void for_loop_iterated(g2basic_ctx_t* ctx, const Chunk* chunk, ForLoop* loop) {
+#ifdef G2BASIC_ASSERT_NO_ALLOC
+    if (!chunk->immediate) {
+        assert(loop->allocations == SIZE_MAX ||
+               loop->allocations == ctx->allocation_count);
+        loop->allocations = ctx->allocation_count;
+    }
+#else
+    (void)ctx;
+    (void)chunk;
+    (void)loop;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Call a function for OP_CALL_ASYNC, storing its value in @p result
+ *
+ * A program image binds its calls by name, so the function may as well be
+ * one that never waits.
+ */
+static g2basic_call_status_t call_async_function(g2basic_ctx_t* ctx, const Function* func, g2basic_number_t args[],
+                                                 int count, g2basic_number_t* result) {
+    if (func->async_ptr == NULL) {
+        *result = func->func_ptr(args, count);
+        return function_failed(*result) ? G2BASIC_CALL_ERROR : G2BASIC_CALL_DONE;
+    }
+    g2basic_call_status_t status = func->async_ptr(func->async_context, ctx, args, count, result);
+    if (status == G2BASIC_CALL_DONE && function_failed(*result)) {
+        return G2BASIC_CALL_ERROR;
+    }
+    return status;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+#if VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+/**
+ * @brief Execute compiled bytecode
+ *
+ * Runs @p chunk starting at code offset @p start_pc until OP_END or an
+ * error. FOR and GOSUB frames are kept on the interpreter stacks, so a
+ * program may leave loops and subroutines through GOTO just like in the line
+ * interpreter.
+ *
+ * Every taken branch (jump, loop iteration, GOSUB and RETURN) uses up one
+ * step of @p budget. The operand stack is empty at every branch, so when the
+ * budget runs out execution stops right there and can be resumed later
+ * from nothing but the code offset. Straight-line code between two branches
+ * is never longer than the program.
+ *
+ * A function call that waits in a stepped run parks the run in the middle
+ * of an expression. The operand stacks go to ctx->call_wait, and they are
+ * restored with the result pushed when execution resumes after the call.
+ *
+ * @param chunk Chunk to execute
+ * @param start_pc Code offset of the first instruction
+ * @param budget Number of taken branches before yielding (at least 1)
+ * @param exit Receives the result value, or the error details
+ * @return Execution status
+ */
+static VmStatus vm_execute(g2basic_ctx_t* ctx, const Chunk* chunk, size_t start_pc, size_t budget,
+                           VmExit* exit) {
+    const int32_t* code = chunk->code;
+    const int32_t* pc = code + start_pc;
+    g2basic_number_t* values = ctx->variable_values;
+    int32_t* integers = ctx->integer_values;
+    CachedValue* caches = ctx->caches;
+    g2basic_number_t stack[VM_STACK_SIZE];
+    g2basic_number_t* sp = stack;
+    int32_t istack[VM_STACK_SIZE];
+    int32_t* isp = istack;
+    // FOR frames below this depth belong to earlier immediate lines, whose
+    // code is gone, so NEXT does not jump back to them
+    const size_t line_for_depth = ctx->for_depth;
+
+    exit->result = 0;
+    exit->error = NULL;
+    exit->pc = 0;
+    exit->line_number = 0;
+
+// Operands of the current instruction are read as pc[0], pc[1], ... and
+// skipped at the end, so pc - 1 still is the opcode when an error is raised.
+#define VM_FAIL(message)                       \
+    do {                                       \
+        exit->error = (message);               \
+        exit->pc = (size_t)(pc - 1 - code);    \
+        return VM_ERROR;                       \
+    } while (0)
+
+    CallWait* wait = ctx->call_wait;
+    if (wait != NULL && wait->state == CALL_COMPLETE && chunk == &ctx->program_chunk) {
+        wait->state = CALL_NONE;
+        memcpy(stack, wait->values, wait->value_count * sizeof(stack[0]));
+        memcpy(istack, wait->integers, wait->integer_count * sizeof(istack[0]));
+        sp = stack + wait->value_count;
+        isp = istack + wait->integer_count;
+        *sp++ = wait->result;
+        if (function_failed(wait->result)) {
+            VM_FAIL("invalid function argument");  // pc - 1 is within the call
+        }
+    }
+
+// Charges a taken branch to the budget, pc already is the branch target
+#define VM_STEP()                              \
+    do {                                       \
+        if (--budget == 0) {                   \
+            exit->pc = (size_t)(pc - code);    \
+            return VM_YIELD;                   \
+        }                                      \
+    } while (0)
+
+#if VM_COMPUTED_GOTO
+#define OPCODE_LABEL(op, operands) &&label_##op,
+    static const void* const dispatch_table[OPCODE_COUNT] = {
+        OPCODE_LIST(OPCODE_LABEL)};
+#undef OPCODE_LABEL
+#define VM_CASE(op) label_##op
+#define VM_NEXT() goto* dispatch_table[*pc++]
+    VM_NEXT();
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT() continue
+    for (;;) {
+        switch (*pc++) {
+#endif
+    VM_CASE(OP_END) : {
+        return VM_DONE;
+    }
+    VM_CASE(OP_PUSH_CONST) : {
+        *sp++ = chunk->constants[pc[0]];
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOAD) : {
+        g2basic_number_t value = values[pc[0]];
+        if (number_is_undefined(value)) {
+            VM_FAIL(undefined_variable(ctx, pc[0]));
+        }
+        *sp++ = value;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOAD_HOST) : {
+        // Host values are used as they are, NaN (G2BASIC_NUMBER_INVALID) included
+        *sp++ = *chunk->loads[pc[0]].location;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_STORE) : {
+        values[pc[0]] = *--sp;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_DUP) : {
+        sp[0] = sp[-1];
+        sp++;
+        VM_NEXT();
+    }
+    VM_CASE(OP_POP) : {
+        sp--;
+        VM_NEXT();
+    }
+    VM_CASE(OP_RESULT) : {
+        exit->result = *--sp;
+        VM_NEXT();
+    }
+    VM_CASE(OP_NEG) : {
+        sp[-1] = -sp[-1];
+        VM_NEXT();
+    }
+    VM_CASE(OP_ADD) : {
+        sp--;
+        if (!number_add(sp[-1], sp[0], &sp[-1])) {
+            VM_FAIL("numeric overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_SUB) : {
+        sp--;
+        if (!number_sub(sp[-1], sp[0], &sp[-1])) {
+            VM_FAIL("numeric overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_MUL) : {
+        sp--;
+        if (!number_mul(sp[-1], sp[0], &sp[-1])) {
+            VM_FAIL("numeric overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_DIV) : {
+        if (sp[-1] == 0) {
+            VM_FAIL("division by zero");
+        }
+        sp--;
+        if (!number_div(sp[-1], sp[0], &sp[-1])) {
+            VM_FAIL("numeric overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_LT) : {
+        sp--;
+        sp[-1] = (sp[-1] < sp[0]) ? NUMBER_ONE : 0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_GT) : {
+        sp--;
+        sp[-1] = (sp[-1] > sp[0]) ? NUMBER_ONE : 0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_LE) : {
+        sp--;
+        sp[-1] = (sp[-1] <= sp[0]) ? NUMBER_ONE : 0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_GE) : {
+        sp--;
+        sp[-1] = (sp[-1] >= sp[0]) ? NUMBER_ONE : 0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_EQ) : {
+        sp--;
+        sp[-1] = (sp[-1] == sp[0]) ? NUMBER_ONE : 0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_NE) : {
+        sp--;
+        sp[-1] = (sp[-1] != sp[0]) ? NUMBER_ONE : 0;
+        VM_NEXT();
+    }
+    VM_CASE(OP_CALL) : {
+        // Arguments are passed in place, straight from the operand stack
+        const Function* func = chunk->functions[pc[0]];
+        int arg_count = pc[1];
+#ifdef G2BASIC_PROFILE
+        (*function_profile_calls(ctx, func))++;
+#endif
+#ifdef G2BASIC_TRACE
+        trace_event(ctx, G2BASIC_TRACE_CALL, arg_count, func->name);
+#endif
+        sp -= arg_count;
+        *sp = func->func_ptr(sp, arg_count);
+        if (function_failed(*sp)) {
+            VM_FAIL("invalid function argument");
+        }
+        sp++;
+        pc += 2;
+        VM_NEXT();
+    }
+    VM_CASE(OP_CALL_ASYNC) : {
+        const Function* func = chunk->functions[pc[0]];
+        int arg_count = pc[1];
+#ifdef G2BASIC_PROFILE
+        (*function_profile_calls(ctx, func))++;
+#endif
+#ifdef G2BASIC_TRACE
+        trace_event(ctx, G2BASIC_TRACE_CALL, arg_count, func->name);
+#endif
+        sp -= arg_count;
+        g2basic_call_status_t status = call_async_function(ctx, func, sp, arg_count, sp);
+        if (status == G2BASIC_CALL_PENDING) {
+            pc += 2;
+            if (chunk != &ctx->program_chunk || !ctx->run_active || wait == NULL) {
+                VM_FAIL("function call cannot wait here");
+            }
+            wait->state = CALL_PENDING;
+            wait->value_count = (size_t)(sp - stack);
+            wait->integer_count = (size_t)(isp - istack);
+            memcpy(wait->values, stack, wait->value_count * sizeof(stack[0]));
+            memcpy(wait->integers, istack, wait->integer_count * sizeof(istack[0]));
+            exit->pc = (size_t)(pc - code);
+            return VM_WAIT;
+        }
+        if (status != G2BASIC_CALL_DONE) {
+            VM_FAIL("invalid function argument");
+        }
+        sp++;
+        pc += 2;
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP) : {
+        pc = code + pc[0];
+        VM_STEP();
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_IF_FALSE) : {
+        if (*--sp == 0) {
+            pc = code + pc[0];
+            VM_STEP();
+        } else {
+            pc += 1;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_UNLESS) : {
+        sp -= 2;
+        if (compare_values(pc[0], sp[0], sp[1])) {
+            pc += 2;
+        } else {
+            pc = code + pc[1];
+            VM_STEP();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_UNLESS_VAR) : {
+        g2basic_number_t value = values[pc[1]];
+        if (number_is_undefined(value)) {
+            VM_FAIL(undefined_variable(ctx, pc[1]));
+        }
+        if (compare_values(pc[0], value, chunk->constants[pc[2]])) {
+            pc += 4;
+        } else {
+            pc = code + pc[3];
+            VM_STEP();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_GOSUB) : {
+        if (ctx->gosub_depth == ctx->gosub_capacity) {
+            GosubStackEntry* grown =
+                grow_buffer(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_GOSUB_STACK, ctx->gosub_stack,
+                            &ctx->gosub_capacity, sizeof(GosubStackEntry), ctx->gosub_depth + 1);
+            if (grown == NULL) {
+                VM_FAIL("memory allocation failed for GOSUB stack");
+            }
+            ctx->gosub_stack = grown;
+        }
+        ctx->gosub_stack[ctx->gosub_depth].return_pc = (size_t)(pc + 1 - code);
+#ifdef G2BASIC_TRACE
+        ctx->gosub_stack[ctx->gosub_depth].trace_line = ctx->trace_line;
+#endif
+        ctx->gosub_depth++;
+        if (ctx->gosub_depth > ctx->gosub_peak_depth) {
+            ctx->gosub_peak_depth = ctx->gosub_depth;
+        }
+        pc = code + pc[0];
+        VM_STEP();
+        VM_NEXT();
+    }
+    VM_CASE(OP_GOTO) : {
+        // Only emitted for jumps whose target line did not exist at compile
+        // time, and the program cannot change while it runs
+        exit->line_number = pc[0];
+        return VM_LINE_NOT_FOUND;
+    }
+    VM_CASE(OP_RETURN) : {
+        if (ctx->gosub_depth == 0) {
+            VM_FAIL("RETURN without matching GOSUB");
+        }
+        ctx->gosub_depth--;
+        if (!chunk->immediate) {
+            pc = code + ctx->gosub_stack[ctx->gosub_depth].return_pc;
+#ifdef G2BASIC_PROFILE
+            // The rest of the calling line is not entered through its marker
+            profile_switch(ctx, find_line_at_offset(ctx, (size_t)(pc - code)));
+#endif
+#ifdef G2BASIC_TRACE
+            trace_event(ctx, G2BASIC_TRACE_RETURN, ctx->gosub_stack[ctx->gosub_depth].trace_line, NULL);
+            ctx->trace_line = ctx->gosub_stack[ctx->gosub_depth].trace_line;
+#endif
+            VM_STEP();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_FOR) : {
+        ForLoop* loop = for_loop_push(ctx);
+        if (loop == NULL) {
+            VM_FAIL("memory allocation failed for FOR loop");
+        }
+        sp -= 3;
+        loop->slot = pc[0];
+        loop->end_value = sp[1];
+        loop->step_value = sp[2];
+        loop->ascending = sp[2] > 0;
+        loop->body_pc = (size_t)(pc + 1 - code);
+
+        // Set the loop variable to start value
+        values[loop->slot] = sp[0];
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_NEXT) : {
+        // Check if there's a matching FOR loop
+        if (ctx->for_depth == 0) {
+            VM_FAIL("NEXT without matching FOR");
+        }
+        ForLoop* loop = &ctx->for_stack[ctx->for_depth - 1];
+        if (loop->slot != pc[0]) {
+            VM_FAIL("NEXT variable doesn't match FOR variable");
+        }
+
+        // An unassigned loop variable fails the step or both comparisons
+        // (NaN), so it is only checked for once the loop seems to be done.
+        // Stepping past the number range ends the loop.
+        g2basic_number_t current_val;
+        if (number_step(values[loop->slot], loop->step_value, &current_val) &&
+            (loop->ascending ? current_val <= loop->end_value
+                             : current_val >= loop->end_value)) {
+            // Update variable and jump back to the start of the loop body
+            values[loop->slot] = current_val;
+            pc = chunk->immediate && ctx->for_depth <= line_for_depth ? pc + 1 : code + loop->body_pc;
+            for_loop_iterated(ctx, chunk, loop);
+#ifdef G2BASIC_TRACE
+            if (!chunk->immediate) {
+                ctx->trace_line = loop->trace_line;  // The body goes on in the FOR line
+            }
+#endif
+            VM_STEP();
+        } else {
+            if (number_is_undefined(values[loop->slot])) {
+                VM_FAIL("FOR variable not found");
+            }
+            // Loop finished, pop from stack
+#ifdef G2BASIC_TRACE
+            trace_event(ctx, G2BASIC_TRACE_FOR_END, (int32_t)ctx->for_depth, NULL);
+#endif
+            ctx->for_depth--;
+            pc += 1;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_PRINT) : {
+        char text[32];
+        output_write(ctx, text, format_number(*--sp, text));
+        VM_NEXT();
+    }
+    VM_CASE(OP_PRINT_CHAR) : {
+        char c = (char)pc[0];
+        output_write(ctx, &c, 1);
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_PUSH_INT) : {
+        *isp++ = pc[0];
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOAD_INT) : {
+        int32_t value = integers[pc[0]];
+        if (value == INTEGER_UNDEFINED) {
+            VM_FAIL(undefined_variable(ctx, pc[0]));
+        }
+        *isp++ = value;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_LOAD_INT_NUM) : {
+        int32_t value = integers[pc[0]];
+        if (value == INTEGER_UNDEFINED) {
+            VM_FAIL(undefined_variable(ctx, pc[0]));
+        }
+        if (!integer_to_number(value, sp)) {
+            VM_FAIL("numeric overflow");
+        }
+        sp++;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_STORE_INT) : {
+        integers[pc[0]] = *--isp;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_RESULT_INT) : {
+        // The assignment is done already, a result a fixed-point number
+        // cannot hold is reported as invalid instead of failing it
+        if (!integer_to_number(*--isp, &exit->result)) {
+            exit->result = G2BASIC_NUMBER_INVALID;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_INT_TO_NUM) : {
+        if (!integer_to_number(*--isp, sp)) {
+            VM_FAIL("numeric overflow");
+        }
+        sp++;
+        VM_NEXT();
+    }
+    VM_CASE(OP_INT_TO_NUM_UNDER) : {
+        sp[0] = sp[-1];
+        if (!integer_to_number(*--isp, &sp[-1])) {
+            VM_FAIL("numeric overflow");
+        }
+        sp++;
+        VM_NEXT();
+    }
+    VM_CASE(OP_NUM_TO_INT) : {
+        if (!number_to_integer(*--sp, isp)) {
+            VM_FAIL("number out of integer range");
+        }
+        isp++;
+        VM_NEXT();
+    }
+    VM_CASE(OP_NEG_INT) : {
+        isp[-1] = -isp[-1];
+        VM_NEXT();
+    }
+    VM_CASE(OP_ADD_INT) : {
+        isp--;
+        if (!narrow_integer((int64_t)isp[-1] + isp[0], &isp[-1])) {
+            VM_FAIL("integer overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_SUB_INT) : {
+        isp--;
+        if (!narrow_integer((int64_t)isp[-1] - isp[0], &isp[-1])) {
+            VM_FAIL("integer overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_MUL_INT) : {
+        isp--;
+        if (!narrow_integer((int64_t)isp[-1] * isp[0], &isp[-1])) {
+            VM_FAIL("integer overflow");
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_COMPARE_INT) : {
+        isp -= 2;
+        *sp++ = compare_values(pc[0], isp[0], isp[1]) ? NUMBER_ONE : 0;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_UNLESS_INT) : {
+        isp -= 2;
+        if (compare_values(pc[0], isp[0], isp[1])) {
+            pc += 2;
+        } else {
+            pc = code + pc[1];
+            VM_STEP();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_UNLESS_VAR_INT) : {
+        int32_t value = integers[pc[1]];
+        if (value == INTEGER_UNDEFINED) {
+            VM_FAIL(undefined_variable(ctx, pc[1]));
+        }
+        if (compare_values(pc[0], value, pc[2])) {
+            pc += 4;
+        } else {
+            pc = code + pc[3];
+            VM_STEP();
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_FOR_INT) : {
+        ForLoop* loop = for_loop_push(ctx);
+        if (loop == NULL) {
+            VM_FAIL("memory allocation failed for FOR loop");
+        }
+        isp -= 3;
+        loop->slot = pc[0];
+        loop->end_integer = isp[1];
+        loop->step_integer = isp[2];
+        loop->ascending = isp[2] > 0;
+        loop->body_pc = (size_t)(pc + 1 - code);
+        integers[loop->slot] = isp[0];
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_NEXT_INT) : {
+        if (ctx->for_depth == 0) {
+            VM_FAIL("NEXT without matching FOR");
+        }
+        ForLoop* loop = &ctx->for_stack[ctx->for_depth - 1];
+        if (loop->slot != pc[0]) {
+            VM_FAIL("NEXT variable doesn't match FOR variable");
+        }
+
+        // Stepping past the end always fits in 64 bits
+        int32_t value = integers[loop->slot];
+        int64_t current_val = (int64_t)value + loop->step_integer;
+        if (value != INTEGER_UNDEFINED &&
+            (loop->ascending ? current_val <= loop->end_integer
+                             : current_val >= loop->end_integer)) {
+            integers[loop->slot] = (int32_t)current_val;
+            pc = chunk->immediate && ctx->for_depth <= line_for_depth ? pc + 1 : code + loop->body_pc;
+            for_loop_iterated(ctx, chunk, loop);
+#ifdef G2BASIC_TRACE
+            if (!chunk->immediate) {
+                ctx->trace_line = loop->trace_line;  // The body goes on in the FOR line
+            }
+#endif
+            VM_STEP();
+        } else {
+            if (value == INTEGER_UNDEFINED) {
+                VM_FAIL("FOR variable not found");
+            }
+#ifdef G2BASIC_TRACE
+            trace_event(ctx, G2BASIC_TRACE_FOR_END, (int32_t)ctx->for_depth, NULL);
+#endif
+            ctx->for_depth--;
+            pc += 1;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_PRINT_INT) : {
+        char text[32];
+        int32_t value = *--isp;
+        output_write(ctx, text, format_integer(value < 0 ? (uint64_t)-(int64_t)value : (uint64_t)value, value < 0,
+                                               text));
+        VM_NEXT();
+    }
+    VM_CASE(OP_DIM) : {
+        const char* message = dimension_array(ctx, ctx->arrays[pc[0]], *--isp);
+        if (message != NULL) {
+            VM_FAIL(message);
+        }
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_LOAD) : {
+        // Arrays are read through the context, the host may remap them
+        // while a stepped run is suspended
+        const Array* array = ctx->arrays[pc[0]];
+        int32_t index = *--isp;
+        if (index < 0 || (size_t)index >= array->length) {
+            VM_FAIL(array_index_error(ctx, array));
+        }
+        *sp++ = array->values[index];
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_STORE) : {
+        Array* array = ctx->arrays[pc[0]];
+        int32_t index = *--isp;
+        if (index < 0 || (size_t)index >= array->length) {
+            VM_FAIL(array_index_error(ctx, array));
+        }
+        array->values[index] = *--sp;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_SUM) : {
+        const Array* array = ctx->arrays[pc[0]];
+        if (array->values == NULL) {
+            VM_FAIL(undefined_array(ctx, array));
+        }
+        if (!array_sum(array->values, array->length, sp)) {
+            VM_FAIL("numeric overflow");
+        }
+        sp++;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_MEAN) : {
+        const Array* array = ctx->arrays[pc[0]];
+        if (array->values == NULL) {
+            VM_FAIL(undefined_array(ctx, array));
+        }
+        *sp++ = array_mean(array->values, array->length);
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_DOT) : {
+        const Array* a = ctx->arrays[pc[0]];
+        const Array* b = ctx->arrays[pc[1]];
+        if (a->values == NULL || b->values == NULL) {
+            VM_FAIL(undefined_array(ctx, a->values == NULL ? a : b));
+        }
+        if (a->length != b->length) {
+            VM_FAIL("array size mismatch");
+        }
+        if (!array_dot(a->values, b->values, a->length, sp)) {
+            VM_FAIL("numeric overflow");
+        }
+        sp++;
+        pc += 2;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_FILL) : {
+        Array* array = ctx->arrays[pc[0]];
+        if (array->values == NULL) {
+            VM_FAIL(undefined_array(ctx, array));
+        }
+        array_fill(array->values, array->length, *--sp);
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ARRAY_COPY) : {
+        Array* dest = ctx->arrays[pc[0]];
+        const Array* source = ctx->arrays[pc[1]];
+        if (dest->values == NULL || source->values == NULL) {
+            VM_FAIL(undefined_array(ctx, source->values == NULL ? source : dest));
+        }
+        if (dest->length != source->length) {
+            VM_FAIL("array size mismatch");
+        }
+        memmove(dest->values, source->values, dest->length * sizeof(g2basic_number_t));
+        pc += 2;
+        VM_NEXT();
+    }
+    VM_CASE(OP_CACHE_RESET) : {
+        for (int32_t i = 0; i < pc[1]; i++) {
+            caches[pc[0] + i].valid = false;
+        }
+        pc += 2;
+        VM_NEXT();
+    }
+    VM_CASE(OP_CACHED) : {
+        // Skipping the code forward is no branch, the value is still on the stack
+        const CachedValue* cached = &caches[pc[0]];
+        if (cached->valid) {
+            *sp++ = cached->value;
+            pc += 2 + pc[1];
+        } else {
+            pc += 2;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_CACHED_INT) : {
+        const CachedValue* cached = &caches[pc[0]];
+        if (cached->valid) {
+            *isp++ = cached->integer;
+            pc += 2 + pc[1];
+        } else {
+            pc += 2;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_CACHE_STORE) : {
+        caches[pc[0]].value = sp[-1];
+        caches[pc[0]].valid = true;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_CACHE_STORE_INT) : {
+        caches[pc[0]].integer = isp[-1];
+        caches[pc[0]].valid = true;
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_ERROR) : {
+        VM_FAIL(pc[0] >= 0 ? chunk->messages[pc[0]] : NULL);
+    }
+    VM_CASE(OP_LINE) : {
+#ifdef G2BASIC_PROFILE
+        ProgramLine* line = ctx->line_index[pc[0]];
+        line->profile_hits++;
+        profile_switch(ctx, line);
+#endif
+        pc += 1;
+        VM_NEXT();
+    }
+    VM_CASE(OP_TRACE) : {
+#ifdef G2BASIC_TRACE
+        if (pc[0] == G2BASIC_TRACE_LINE) {
+            ctx->trace_line = pc[1];
+            trace_event(ctx, G2BASIC_TRACE_LINE, 0, NULL);
+        } else {
+            trace_event(ctx, (g2basic_trace_event_t)pc[0], pc[1], NULL);
+        }
+#endif
+        pc += 2;
+        VM_NEXT();
+    }
+#if !VM_COMPUTED_GOTO
+    default:
+        VM_FAIL("invalid instruction");
+        }
+    }
+#endif
+
+#undef VM_FAIL
+#undef VM_STEP
+#undef VM_CASE
+#undef VM_NEXT
+}
+#if VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Evaluate a compiled expression for a block of rows
+ *
+ * Same instruction set as vm_execute(), restricted to what an expression
+ * compiles to, but every operand is a column of @p lanes values. The
+ * dispatch cost is paid once per block instead of once per row and each
+ * instruction is a loop the compiler can vectorize.
+ *
+ * Bound host locations are read as columns starting at row @p row.
+ *
+ * @param stack Operand stack of at least chunk->max_depth entries
+ * @param out Receives the results of the block
+ */
+static VmStatus vm_execute_batch(g2basic_ctx_t* ctx,
+                                 const Chunk* chunk,
+                                 BatchLanes* stack,
+                                 size_t row,
+                                 size_t lanes,
+                                 g2basic_number_t* out,
+                                 VmExit* exit) {
+    const int32_t* code = chunk->code;
+    const int32_t* pc = code;
+    BatchLanes* sp = stack;
+
+    exit->error = NULL;
+    exit->pc = 0;
+
+#define VM_FAIL(message)                    \
+    do {                                    \
+        exit->error = (message);            \
+        exit->pc = (size_t)(pc - 1 - code); \
+        return VM_ERROR;                    \
+    } while (0)
+// Apply a binary operator (one of the number_* operations) lane by lane,
+// leaving the result in sp[-1]. Overflow is checked once for the block.
+#define BATCH_BINARY(operation)                            \
+    do {                                                   \
+        sp--;                                              \
+        g2basic_number_t* a = sp[-1];                      \
+        const g2basic_number_t* b = sp[0];                 \
+        bool in_range = true;                              \
+        for (size_t i = 0; i < lanes; i++) {               \
+            in_range &= operation(a[i], b[i], &a[i]);      \
+        }                                                  \
+        if (!in_range) {                                   \
+            VM_FAIL("numeric overflow");                   \
+        }                                                  \
+    } while (0)
+
+    for (;;) {
+        switch (*pc++) {
+            case OP_END:
+                return VM_DONE;
+            case OP_PUSH_CONST: {
+                g2basic_number_t value = chunk->constants[pc[0]];
+                for (size_t i = 0; i < lanes; i++) {
+                    sp[0][i] = value;
+                }
+                sp++;
+                pc += 1;
+                break;
+            }
+            case OP_LOAD: {
+                g2basic_number_t value = ctx->variable_values[pc[0]];
+                if (number_is_undefined(value)) {
+                    VM_FAIL(undefined_variable(ctx, pc[0]));
+                }
+                for (size_t i = 0; i < lanes; i++) {
+                    sp[0][i] = value;
+                }
+                sp++;
+                pc += 1;
+                break;
+            }
+            case OP_LOAD_INT_NUM: {
+                int32_t integer = ctx->integer_values[pc[0]];
+                g2basic_number_t value;
+                if (integer == INTEGER_UNDEFINED) {
+                    VM_FAIL(undefined_variable(ctx, pc[0]));
+                }
+                if (!integer_to_number(integer, &value)) {
+                    VM_FAIL("numeric overflow");
+                }
+                for (size_t i = 0; i < lanes; i++) {
+                    sp[0][i] = value;
+                }
+                sp++;
+                pc += 1;
+                break;
+            }
+            case OP_LOAD_HOST:
+                memcpy(sp[0], chunk->loads[pc[0]].location + row,
+                       lanes * sizeof(g2basic_number_t));
+                sp++;
+                pc += 1;
+                break;
+            case OP_RESULT:
+                sp--;
+                memcpy(out, sp[0], lanes * sizeof(g2basic_number_t));
+                break;
+            case OP_NEG: {
+                g2basic_number_t* a = sp[-1];
+                for (size_t i = 0; i < lanes; i++) {
+                    a[i] = -a[i];
+                }
+                break;
+            }
+            case OP_ADD:
+                BATCH_BINARY(number_add);
+                break;
+            case OP_SUB:
+                BATCH_BINARY(number_sub);
+                break;
+            case OP_MUL:
+                BATCH_BINARY(number_mul);
+                break;
+            case OP_DIV: {
+                // Check the whole block first, so the division loop itself
+                // has no branch
+                bool zero = false;
+                for (size_t i = 0; i < lanes; i++) {
+                    zero |= sp[-1][i] == 0;
+                }
+                if (zero) {
+                    VM_FAIL("division by zero");
+                }
+                BATCH_BINARY(number_div);
+                break;
+            }
+            case OP_CALL: {
+                const Function* func = chunk->functions[pc[0]];
+                int arg_count = pc[1];
+                sp -= arg_count;
+                if (func->batch_ptr != NULL) {
+                    func->batch_ptr(sp, arg_count, lanes);
+                } else {
+                    // Host functions without a kernel run row by row
+                    g2basic_number_t args[MAX_FUNC_ARGS];
+                    for (size_t i = 0; i < lanes; i++) {
+                        for (int arg = 0; arg < arg_count; arg++) {
+                            args[arg] = sp[arg][i];
+                        }
+                        sp[0][i] = func->func_ptr(args, arg_count);
+                        if (function_failed(sp[0][i])) {
+                            VM_FAIL("invalid function argument");
+                        }
+                    }
+                }
+                sp++;
+                pc += 2;
+                break;
+            }
+            case OP_CALL_ASYNC: {
+                const Function* func = chunk->functions[pc[0]];
+                int arg_count = pc[1];
+                sp -= arg_count;
+                g2basic_number_t args[MAX_FUNC_ARGS];
+                for (size_t i = 0; i < lanes; i++) {
+                    for (int arg = 0; arg < arg_count; arg++) {
+                        args[arg] = sp[arg][i];
+                    }
+                    g2basic_call_status_t status = call_async_function(ctx, func, args, arg_count, &sp[0][i]);
+                    if (status != G2BASIC_CALL_DONE) {
+                        VM_FAIL(status == G2BASIC_CALL_PENDING ? "function call cannot wait here"
+                                                               : "invalid function argument");
+                    }
+                }
+                sp++;
+                pc += 2;
+                break;
+            }
+            default:
+                VM_FAIL("invalid instruction");
+        }
+    }
+
+#undef BATCH_BINARY
+#undef VM_FAIL
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* JIT - translates the bytecode of a compiled expression into x86-64 code.
+ * The operand stack lives in the SSE registers (entry i in xmm<i>), variable
+ * slots are addressed relative to the value arrays passed in, bound host
+ * locations and constants are embedded and functions are called straight
+ * through their func_ptr. Failing checks return the offset of the failing
+ * instruction, for which the error message is worked out afterwards.
+ */
+/*--------------------------------------------------------------------------------------------------------------------*/
+#if JIT_ENABLED
+
+/** @brief Operand stack entries held in registers, xmm14 and xmm15 are scratch */
+#define JIT_REGISTERS 14
+/** @brief Native stack frame: function arguments, then the registers saved around a call */
+#define JIT_FRAME_SIZE ((8 * (MAX_FUNC_ARGS + JIT_REGISTERS) + 15) & ~15)
+/** @brief Scratch register */
+#define JIT_SCRATCH 15
+
+/** @brief General purpose registers used by the generated code */
+enum { JIT_RAX = 0, JIT_RBX = 3, JIT_RSP = 4, JIT_R12 = 12, JIT_R13 = 13 };
+
+/** @brief SSE2 opcodes (after 0F), F2 prefixed are scalar double, 66 prefixed packed */
+enum {
+    SSE_MOVSD_LOAD = 0x10,
+    SSE_MOVSD_STORE = 0x11,
+    SSE_CVTSI2SD = 0x2A,
+    SSE_MOVAPD = 0x28,
+    SSE_UCOMISD = 0x2E,
+    SSE_XORPD = 0x57,
+    SSE_ADDSD = 0x58,
+    SSE_MULSD = 0x59,
+    SSE_SUBSD = 0x5C,
+    SSE_DIVSD = 0x5E,
+};
+
+/**
+ * @brief Destination of the generated code
+ *
+ * Like the tokenizer, code is generated twice: once without a buffer to
+ * measure it, then into the executable mapping.
+ */
+typedef struct JitWriter {
+    uint8_t* out; /**< Code buffer, NULL to measure only */
+    size_t len;   /**< Bytes generated so far */
+} JitWriter;
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void jit_byte(JitWriter* w, uint8_t byte) {
+    if (w->out != NULL) {
+        w->out[w->len] = byte;
+    }
+    w->len++;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void jit_bytes(JitWriter* w, const uint8_t* bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        jit_byte(w, bytes[i]);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void jit_u32(JitWriter* w, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        jit_byte(w, (uint8_t)(value >> (8 * i)));
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void jit_u64(JitWriter* w, uint64_t value) {
+    jit_u32(w, (uint32_t)value);
+    jit_u32(w, (uint32_t)(value >> 32));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief SSE2 instruction on two xmm registers (prefix, REX, 0F, opcode, ModRM)
+ */
+static void jit_sse(JitWriter* w, uint8_t prefix, uint8_t opcode, int reg, int rm) {
+    jit_byte(w, prefix);
+    if (reg >= 8 || rm >= 8) {
+        jit_byte(w, (uint8_t)(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0)));
+    }
+    jit_byte(w, 0x0F);
+    jit_byte(w, opcode);
+    jit_byte(w, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief SSE2 instruction on an xmm register and [base + disp32]
+ */
+static void jit_sse_mem(JitWriter* w, uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp) {
+    jit_byte(w, prefix);
+    if (reg >= 8 || base >= 8) {
+        jit_byte(w, (uint8_t)(0x40 | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0)));
+    }
+    jit_byte(w, 0x0F);
+    jit_byte(w, opcode);
+    jit_byte(w, (uint8_t)(0x80 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == JIT_RSP) {
+        jit_byte(w, 0x24);  // SIB without index, required for rsp and r12
+    }
+    jit_u32(w, (uint32_t)disp);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief mov rax, imm64
+ */
+static void jit_mov_rax(JitWriter* w, uint64_t value) {
+    jit_bytes(w, (const uint8_t[]){0x48, 0xB8}, 2);
+    jit_u64(w, value);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Load a 64-bit pattern into an xmm register (through rax)
+ */
+static void jit_load_bits(JitWriter* w, int reg, uint64_t bits) {
+    jit_mov_rax(w, bits);
+    // movq xmm, rax
+    jit_bytes(w, (const uint8_t[]){0x66, (uint8_t)(0x48 | (reg >= 8 ? 4 : 0)), 0x0F, 0x6E}, 4);
+    jit_byte(w, (uint8_t)(0xC0 | (reg & 7) << 3));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Leave with the code offset of a failing instruction
+ *
+ * Always 10 bytes, the checks in front of it jump over it. The epilogue sits
+ * at the start of the code, so the jump back to it needs no patching.
+ */
+static void jit_fail(JitWriter* w, size_t pc) {
+    jit_byte(w, 0xB8);  // mov eax, imm32
+    jit_u32(w, (uint32_t)pc);
+    jit_byte(w, 0xE9);  // jmp rel32 to offset 0
+    jit_u32(w, (uint32_t)(-(int64_t)(w->len + 4)));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Call a function with the @p arg_count entries below @p depth
+ *
+ * The arguments are passed in the frame as the array func_ptr expects. The
+ * registers below them are caller saved, so they are kept in the frame
+ * across the call.
+ */
+static void jit_call(JitWriter* w, const Function* func, int arg_count, int depth) {
+    int base = depth - arg_count;
+    for (int i = 0; i < base; i++) {
+        jit_sse_mem(w, 0xF2, SSE_MOVSD_STORE, i, JIT_RSP, 8 * (MAX_FUNC_ARGS + i));
+    }
+    for (int i = 0; i < arg_count; i++) {
+        jit_sse_mem(w, 0xF2, SSE_MOVSD_STORE, base + i, JIT_RSP, 8 * i);
+    }
+    jit_bytes(w, (const uint8_t[]){0x48, 0x8D, 0x3C, 0x24}, 4);  // lea rdi, [rsp]
+    jit_byte(w, 0xBE);                                            // mov esi, imm32
+    jit_u32(w, (uint32_t)arg_count);
+    jit_mov_rax(w, (uint64_t)(uintptr_t)&func->func_ptr);
+    jit_bytes(w, (const uint8_t[]){0xFF, 0x10}, 2);  // call [rax]
+    if (base != 0) {
+        jit_sse(w, 0x66, SSE_MOVAPD, base, 0);
+    }
+    for (int i = 0; i < base; i++) {
+        jit_sse_mem(w, 0xF2, SSE_MOVSD_LOAD, i, JIT_RSP, 8 * (MAX_FUNC_ARGS + i));
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Translate the bytecode of a compiled expression
+ *
+ * @param entry Receives the offset of the entry point
+ * @return false if the expression uses an instruction that is not translated
+ * or more operand stack than there are registers
+ */
+static bool jit_emit(JitWriter* w, const Chunk* chunk, size_t* entry) {
+    // Epilogue first, every exit jumps back to it
+    jit_bytes(w, (const uint8_t[]){0x48, 0x81, 0xC4}, 3);  // add rsp, imm32
+    jit_u32(w, JIT_FRAME_SIZE);
+    jit_bytes(w, (const uint8_t[]){0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}, 6);  // pop r13, r12, rbx; ret
+
+    // Prologue: rbx = values, r12 = integers, r13 = result
+    *entry = w->len;
+    jit_bytes(w, (const uint8_t[]){0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x81, 0xEC}, 8);
+    jit_u32(w, JIT_FRAME_SIZE);
+    jit_bytes(w, (const uint8_t[]){0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5}, 9);
+
+    const int32_t* code = chunk->code;
+    int depth = 0;
+    size_t pc = 0;
+    while (pc < chunk->code_count) {
+        Opcode op = (Opcode)code[pc];
+        bool push = op == OP_PUSH_CONST || op == OP_LOAD || op == OP_LOAD_HOST || op == OP_LOAD_INT_NUM;
+        if (push && depth == JIT_REGISTERS) {
+            return false;
+        }
+        switch (op) {
+            case OP_PUSH_CONST: {
+                uint64_t bits;
+                memcpy(&bits, &chunk->constants[code[pc + 1]], sizeof(bits));
+                jit_load_bits(w, depth++, bits);
+                pc += 2;
+                break;
+            }
+            case OP_LOAD:
+                jit_sse_mem(w, 0xF2, SSE_MOVSD_LOAD, depth, JIT_RBX, 8 * code[pc + 1]);
+                jit_sse(w, 0x66, SSE_UCOMISD, depth, depth);
+                jit_bytes(w, (const uint8_t[]){0x7B, 0x0A}, 2);  // jnp over the failure, NaN is undefined
+                jit_fail(w, pc);
+                depth++;
+                pc += 2;
+                break;
+            case OP_LOAD_HOST:
+                jit_mov_rax(w, (uint64_t)(uintptr_t)chunk->loads[code[pc + 1]].location);
+                jit_sse_mem(w, 0xF2, SSE_MOVSD_LOAD, depth++, JIT_RAX, 0);
+                pc += 2;
+                break;
+            case OP_LOAD_INT_NUM:
+                jit_bytes(w, (const uint8_t[]){0x41, 0x8B, 0x84, 0x24}, 4);  // mov eax, [r12 + disp32]
+                jit_u32(w, (uint32_t)(4 * code[pc + 1]));
+                jit_byte(w, 0x3D);  // cmp eax, INTEGER_UNDEFINED
+                jit_u32(w, (uint32_t)INTEGER_UNDEFINED);
+                jit_bytes(w, (const uint8_t[]){0x75, 0x0A}, 2);  // jne over the failure
+                jit_fail(w, pc);
+                jit_sse(w, 0xF2, SSE_CVTSI2SD, depth++, JIT_RAX);
+                pc += 2;
+                break;
+            case OP_NEG:
+                jit_load_bits(w, JIT_SCRATCH, UINT64_C(1) << 63);
+                jit_sse(w, 0x66, SSE_XORPD, depth - 1, JIT_SCRATCH);
+                pc += 1;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+                depth--;
+                jit_sse(w, 0xF2, op == OP_ADD ? SSE_ADDSD : op == OP_SUB ? SSE_SUBSD : SSE_MULSD, depth - 1, depth);
+                pc += 1;
+                break;
+            case OP_DIV:
+                // Fails on an ordered compare equal to zero, NaN divides
+                jit_sse(w, 0x66, SSE_XORPD, JIT_SCRATCH, JIT_SCRATCH);
+                jit_sse(w, 0x66, SSE_UCOMISD, depth - 1, JIT_SCRATCH);
+                jit_bytes(w, (const uint8_t[]){0x7A, 0x0C, 0x75, 0x0A}, 4);  // jp, jne over the failure
+                jit_fail(w, pc);
+                depth--;
+                jit_sse(w, 0xF2, SSE_DIVSD, depth - 1, depth);
+                pc += 1;
+                break;
+            case OP_CALL: {
+                int arg_count = code[pc + 2];
+                jit_call(w, chunk->functions[code[pc + 1]], arg_count, depth);
+                depth -= arg_count - 1;
+                pc += 3;
+                break;
+            }
+            case OP_RESULT:
+                jit_sse_mem(w, 0xF2, SSE_MOVSD_STORE, --depth, JIT_R13, 0);
+                pc += 1;
+                break;
+            case OP_END:
+                jit_byte(w, 0xB8);  // mov eax, -1
+                jit_u32(w, UINT32_MAX);
+                jit_byte(w, 0xE9);
+                jit_u32(w, (uint32_t)(-(int64_t)(w->len + 4)));
+                pc += 1;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void jit_release(g2basic_expr_t* expr) {
+    if (expr->jit.memory != NULL) {
+        munmap(expr->jit.memory, expr->jit.size);
+    }
+    expr->jit = (JitCode){0};
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Generate the native code of a compiled expression
+ *
+ * The code is written to fresh pages that are made executable (and read
+ * only) afterwards. Executable memory cannot come from the allocator of the
+ * context, so these pages are not part of the memory statistics. Without
+ * native code the expression simply keeps running in the VM.
+ */
+static void jit_compile(g2basic_expr_t* expr) {
+    jit_release(expr);
+    JitWriter measure = {.out = NULL, .len = 0};
+    size_t entry;
+    if (!jit_emit(&measure, &expr->chunk, &entry)) {
+        return;
+    }
+    void* memory = mmap(NULL, measure.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return;
+    }
+    JitWriter writer = {.out = (uint8_t*)memory, .len = 0};
+    jit_emit(&writer, &expr->chunk, &entry);
+    if (mprotect(memory, measure.len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, measure.len);
+        return;
+    }
+    void* address = (uint8_t*)memory + entry;
+    expr->jit.memory = memory;
+    expr->jit.size = measure.len;
+    memcpy(&expr->jit.entry, &address, sizeof(expr->jit.entry));  // ISO C has no object to function pointer cast
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Error message of the instruction at @p pc that failed in native code
+ */
+static const char* jit_error(const g2basic_expr_t* expr, int32_t pc) {
+    const int32_t* code = expr->chunk.code;
+    if (code[pc] == OP_DIV) {
+        return "division by zero";
+    }
+    return undefined_variable(expr->ctx, code[pc + 1]);
+}
+
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* PROGRAM IMAGES - the compiled program, its tables and the token streams of
+ * its lines in one flat, versioned buffer that can be stored in flash and
+ * executed from there.
+ */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief First bytes of every program image */
+#define IMAGE_MAGIC "G2BI"
+/** @brief Image format version, changed with the layout or the instruction set */
+#define IMAGE_VERSION 5
+/** @brief Byte order marker, reads differently on a machine of the other byte order */
+#define IMAGE_BYTE_ORDER 0x0102
+#ifdef G2BASIC_FIXED_POINT
+/** @brief Fraction bits of the number format, 0 for doubles */
+#define IMAGE_FRACTION_BITS G2BASIC_FIXED_FRACTION_BITS
+#else
+/** @brief Fraction bits of the number format, 0 for doubles */
+#define IMAGE_FRACTION_BITS 0
+#endif
+
+/**
+ * @brief Program image header
+ *
+ * The header is followed by the sections, each starting at a multiple of 8
+ * bytes from the start of the image: the constant pool, the code, the
+ * argument count of every referenced function, the line table, the strings
+ * (function names, variable names by slot, array names by slot and error
+ * messages, each NUL-terminated) and the token streams of the lines. All values are stored
+ * in the byte order of the machine that wrote the image.
+ */
+typedef struct ImageHeader {
+    char magic[4];           /**< IMAGE_MAGIC */
+    uint16_t version;        /**< IMAGE_VERSION */
+    uint16_t byte_order;     /**< IMAGE_BYTE_ORDER */
+    uint16_t value_size;     /**< Size of a variable value */
+    uint16_t opcode_count;   /**< Number of opcodes of the instruction set */
+    uint16_t fraction_bits;  /**< IMAGE_FRACTION_BITS */
+    uint16_t reserved;       /**< Zero */
+    uint32_t size;           /**< Size of the whole image */
+    uint32_t checksum;       /**< FNV-1a hash of the image, this field as zero */
+    uint32_t code_count;     /**< Instruction words */
+    uint32_t constant_count; /**< Constant pool entries */
+    uint32_t function_count; /**< Referenced functions */
+    uint32_t message_count;  /**< Compile error messages */
+    uint32_t variable_count; /**< Variable slots */
+    uint32_t array_count;    /**< Array slots */
+    uint32_t line_count;     /**< Program lines */
+    uint32_t string_size;    /**< Bytes of the string section */
+    uint32_t token_size;     /**< Bytes of the token section */
+    uint32_t max_depth;      /**< Deepest operand stack use */
+    uint32_t cache_count;    /**< Loop invariant cache slots */
+} ImageHeader;
+
+/** @brief Line table entry of a program image */
+typedef struct ImageLine {
+    int32_t line_number;   /**< Line number */
+    uint32_t code_offset;  /**< Start of the line in the code */
+    uint32_t token_offset; /**< Start of the token stream in the token section */
+} ImageLine;
+
+/** @brief Offsets of the sections of a program image */
+typedef struct ImageLayout {
+    size_t constants;  /**< Constant pool */
+    size_t code;       /**< Instruction words */
+    size_t arg_counts; /**< Argument count of each function */
+    size_t lines;      /**< Line table */
+    size_t strings;    /**< Names and messages */
+    size_t tokens;     /**< Token streams */
+    size_t size;       /**< Size of the whole image */
+} ImageLayout;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compute the section offsets from the counts of an image header
+ *
+ * @return false if the image would not fit the 32-bit size of the header
+ */
+static bool image_layout(const ImageHeader* header, ImageLayout* layout) {
+    uint64_t offset = (sizeof(ImageHeader) + 7u) & ~(uint64_t)7u;
+    uint64_t sections[6];
+    uint64_t sizes[6] = {
+        (uint64_t)header->constant_count * sizeof(g2basic_number_t),
+        (uint64_t)header->code_count * sizeof(int32_t),
+        (uint64_t)header->function_count * sizeof(int32_t),
+        (uint64_t)header->line_count * sizeof(ImageLine),
+        header->string_size,
+        header->token_size,
+    };
+    for (int i = 0; i < 6; i++) {
+        sections[i] = offset;
+        offset = (offset + sizes[i] + 7u) & ~(uint64_t)7u;
+    }
+    if (offset > UINT32_MAX) {
+        return false;
+    }
+    layout->constants = (size_t)sections[0];
+    layout->code = (size_t)sections[1];
+    layout->arg_counts = (size_t)sections[2];
+    layout->lines = (size_t)sections[3];
+    layout->strings = (size_t)sections[4];
+    layout->tokens = (size_t)sections[5];
+    layout->size = (size_t)offset;
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief FNV-1a hash of the whole image
+ *
+ * The header is covered too, its counts size the buffers the image is
+ * installed into. The checksum field itself is hashed as zero.
+ */
+static uint32_t image_checksum(const uint8_t* image, size_t size) {
+    const size_t field = offsetof(ImageHeader, checksum);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= i >= field && i < field + sizeof(uint32_t) ? 0u : image[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check that a token stream ends within @p size bytes
+ */
+static bool image_tokens_valid(const uint8_t* t, size_t size) {
+    size_t pos = 0;
+    while (pos < size && t[pos] != TOKEN_END) {
+        size_t header = t[pos] == TOKEN_NUMBER       ? 1 + sizeof(double) + 2
+                        : t[pos] == TOKEN_IDENTIFIER ? 3
+                                                     : 1;
+        if (size - pos < header) {
+            return false;
+        }
+        pos += token_length(t + pos);
+    }
+    return pos < size;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check that every cache slot the code uses is below @p cache_count
+ *
+ * The VM indexes the cache slots without bounds checks, and they are
+ * allocated by the count of the header alone.
+ */
+static bool image_caches_valid(const uint8_t* code, uint32_t code_count, uint32_t cache_count) {
+    uint32_t pc = 0;
+    while (pc < code_count) {
+        int32_t op;
+        memcpy(&op, code + pc * sizeof(int32_t), sizeof(op));
+        if (op < 0 || op >= OPCODE_COUNT || code_count - pc - 1 < opcode_operands[op]) {
+            return false;
+        }
+        int32_t operands[2] = {0, 0};
+        size_t operand_count = opcode_operands[op] < 2 ? opcode_operands[op] : 2;
+        memcpy(operands, code + (pc + 1) * sizeof(int32_t), operand_count * sizeof(int32_t));
+        switch (op) {
+            case OP_CACHE_RESET:
+                if (operands[0] < 0 || operands[1] < 0 || (uint32_t)operands[0] > cache_count ||
+                    (uint32_t)operands[1] > cache_count - (uint32_t)operands[0]) {
+                    return false;
+                }
+                break;
+            case OP_CACHED:
+            case OP_CACHED_INT:
+            case OP_CACHE_STORE:
+            case OP_CACHE_STORE_INT:
+                if (operands[0] < 0 || (uint32_t)operands[0] >= cache_count) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+        pc += 1u + opcode_operands[op];
+    }
+    return true;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check the tables of an image against its own sections
+ *
+ * Catches images that are truncated or were not written by
+ * save_image(). The instructions themselves are trusted, guarded by the
+ * checksum, except for the cache slots.
+ */
+static bool image_valid(const uint8_t* image, const ImageHeader* header, const ImageLayout* layout) {
+    // A cache slot is only ever used by the code of a single expression
+    if (header->code_count == 0 || header->cache_count > header->code_count ||
+        !image_caches_valid(image + layout->code, header->code_count, header->cache_count)) {
+        return false;
+    }
+    const uint8_t* tokens = image + layout->tokens;
+    int previous = -1;
+    for (uint32_t i = 0; i < header->line_count; i++) {
+        ImageLine line;
+        memcpy(&line, image + layout->lines + i * sizeof(ImageLine), sizeof(line));
+        if (line.line_number <= previous || line.line_number > 65535 ||
+            line.code_offset >= header->code_count || line.token_offset >= header->token_size ||
+            !image_tokens_valid(tokens + line.token_offset, header->token_size - line.token_offset)) {
+            return false;
+        }
+        previous = line.line_number;
+    }
+
+    const uint8_t* strings = image + layout->strings;
+    size_t string_count = 0;
+    for (uint32_t i = 0; i < header->string_size; i++) {
+        string_count += strings[i] == '\0';
+    }
+    return string_count ==
+               (size_t)header->function_count + header->variable_count + header->array_count + header->message_count &&
+           (header->string_size == 0 || strings[header->string_size - 1] == '\0');
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Append a NUL-terminated string to the string section
+ */
+static size_t image_put_string(uint8_t* strings, size_t offset, const char* text) {
+    size_t length = strlen(text) + 1;
+    memcpy(strings + offset, text, length);
+    return offset + length;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Write the compiled stored program as a program image
+ *
+ * @param buffer Destination, or NULL to only compute the size
+ * @param capacity Size of @p buffer
+ * @param size Set to the size of the image
+ * @return 0 on success, -1 on error
+ */
+static int save_image(g2basic_ctx_t* ctx,
+                      uint8_t* buffer,
+                      size_t capacity,
+                      size_t* size,
+                      const char** error) {
+    if (ctx->program_chunk.span_count > 0) {
+        ctx->program_dirty = true;  // The image keeps lines in code order
+    }
+    if (compile_if_dirty(ctx) != 0) {
+        *error = "memory allocation failed for compiled program";
+        return -1;
+    }
+    const Chunk* chunk = &ctx->program_chunk;
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.value_size = sizeof(g2basic_number_t);
+    header.opcode_count = OPCODE_COUNT;
+    header.fraction_bits = IMAGE_FRACTION_BITS;
+    header.code_count = (uint32_t)chunk->code_count;
+    header.constant_count = (uint32_t)chunk->constant_count;
+    header.function_count = (uint32_t)chunk->function_count;
+    header.message_count = (uint32_t)chunk->message_count;
+    header.variable_count = (uint32_t)ctx->variable_count;
+    header.array_count = (uint32_t)ctx->array_count;
+    header.line_count = (uint32_t)ctx->line_count;
+    header.max_depth = (uint32_t)chunk->max_depth;
+    header.cache_count = (uint32_t)chunk->cache_count;
+    size_t string_size = 0;
+    for (size_t i = 0; i < chunk->function_count; i++) {
+        string_size += strlen(chunk->functions[i]->name) + 1;
+    }
+    for (size_t i = 0; i < ctx->variable_count; i++) {
+        string_size += strlen(ctx->variable_symbols[i]->name) + 1;
+    }
+    for (size_t i = 0; i < ctx->array_count; i++) {
+        string_size += strlen(ctx->arrays[i]->name) + 1;
+    }
+    for (size_t i = 0; i < chunk->message_count; i++) {
+        string_size += strlen(chunk->messages[i]) + 1;
+    }
+    size_t token_size = 0;
+    for (ProgramLine* line = ctx->program_head; line != NULL; line = line->next) {
+        token_size += token_stream_length(line->tokens);
+    }
+    header.string_size = (uint32_t)string_size;
+    header.token_size = (uint32_t)token_size;
+
+    ImageLayout layout;
+    if (string_size > UINT32_MAX || token_size > UINT32_MAX || !image_layout(&header, &layout)) {
+        *error = "program too large for an image";
+        return -1;
+    }
+    *size = layout.size;
+    if (buffer == NULL) {
+        return 0;
+    }
+    if (capacity < layout.size) {
+        *error = "program image buffer too small";
+        return -1;
+    }
+
+    memset(buffer, 0, layout.size);  // Padding too, for a stable checksum
+    memcpy(buffer + layout.constants, chunk->constants, chunk->constant_count * sizeof(g2basic_number_t));
+    memcpy(buffer + layout.code, chunk->code, chunk->code_count * sizeof(int32_t));
+    for (size_t i = 0; i < chunk->function_count; i++) {
+        int32_t arg_count = chunk->functions[i]->arg_count;
+        memcpy(buffer + layout.arg_counts + i * sizeof(int32_t), &arg_count, sizeof(arg_count));
+    }
+
+    size_t token_offset = 0;
+    size_t line_offset = layout.lines;
+    for (ProgramLine* line = ctx->program_head; line != NULL; line = line->next) {
+        ImageLine entry = {.line_number = line->line_number,
+                           .code_offset = (uint32_t)line->code_offset,
+                           .token_offset = (uint32_t)token_offset};
+        memcpy(buffer + line_offset, &entry, sizeof(entry));
+        line_offset += sizeof(entry);
+        size_t length = token_stream_length(line->tokens);
+        memcpy(buffer + layout.tokens + token_offset, line->tokens, length);
+        token_offset += length;
+    }
+
+    uint8_t* strings = buffer + layout.strings;
+    size_t string_offset = 0;
+    for (size_t i = 0; i < chunk->function_count; i++) {
+        string_offset = image_put_string(strings, string_offset, chunk->functions[i]->name);
+    }
+    for (size_t i = 0; i < ctx->variable_count; i++) {
+        string_offset = image_put_string(strings, string_offset, ctx->variable_symbols[i]->name);
+    }
+    for (size_t i = 0; i < ctx->array_count; i++) {
+        string_offset = image_put_string(strings, string_offset, ctx->arrays[i]->name);
+    }
+    for (size_t i = 0; i < chunk->message_count; i++) {
+        string_offset = image_put_string(strings, string_offset, chunk->messages[i]);
+    }
+
+    header.size = (uint32_t)layout.size;
+    memcpy(buffer, &header, sizeof(header));
+    header.checksum = image_checksum(buffer, layout.size);
+    memcpy(buffer + offsetof(ImageHeader, checksum), &header.checksum, sizeof(header.checksum));
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Make a checked program image the stored program
+ *
+ * The code, the constant pool, the messages and the token streams stay in
+ * the image. Only the line entries, the line index and the function and
+ * message tables are allocated.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int install_image(g2basic_ctx_t* ctx,
+                         const uint8_t* image,
+                         const ImageHeader* header,
+                         const ImageLayout* layout,
+                         const char** error) {
+    Chunk* chunk = &ctx->program_chunk;
+    chunk_free(ctx, chunk);
+
+    const Function** functions = grow_buffer(ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->functions,
+                                             &chunk->function_capacity, sizeof(Function*), header->function_count);
+    char** messages = grow_buffer(ctx, chunk->kind, G2BASIC_MEMORY_USE_CODE, chunk->messages,
+                                  &chunk->message_capacity, sizeof(char*), header->message_count);
+    bool out_of_memory = (functions == NULL && header->function_count > 0) ||
+                         (messages == NULL && header->message_count > 0);
+    chunk->functions = functions;
+    chunk->messages = messages;
+    if (header->line_count > 0) {
+        ctx->loaded_line_count = header->line_count;
+        ctx->line_index_capacity = header->line_count;
+        ctx->loaded_lines = (ProgramLine*)mem_calloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM,
+                                                     header->line_count, sizeof(ProgramLine));
+        ctx->line_index = (ProgramLine**)mem_alloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM,
+                                                   header->line_count * sizeof(ProgramLine*));
+        out_of_memory = out_of_memory || ctx->loaded_lines == NULL || ctx->line_index == NULL;
+    }
+    out_of_memory = out_of_memory || !reserve_caches(ctx, header->cache_count);
+    if (out_of_memory) {
+        *error = "memory allocation failed for program image";
+        return -1;
+    }
+
+    // Functions are bound by name to the ones registered in this context
+    const char* name = (const char*)image + layout->strings;
+    for (uint32_t i = 0; i < header->function_count; i++) {
+        int32_t arg_count;
+        memcpy(&arg_count, image + layout->arg_counts + i * sizeof(int32_t), sizeof(arg_count));
+        const Function* func = find_function(ctx, name);
+        if (func == NULL || func->arg_count != arg_count) {
+            snprintf(ctx->message, sizeof(ctx->message), "unknown function '%s' in program image", name);
+            *error = ctx->message;
+            return -1;
+        }
+        functions[i] = func;
+        name += strlen(name) + 1;
+    }
+
+    // The code refers to variables and arrays by slot, so they have to get
+    // the same slots here
+    for (uint32_t i = 0; i < header->variable_count; i++) {
+        int32_t slot = intern_variable(ctx, name);
+        if (slot < 0) {
+            *error = "memory allocation failed for program image";
+            return -1;
+        }
+        if (slot != (int32_t)i) {
+            *error = "program image variables do not match the context";
+            return -1;
+        }
+        name += strlen(name) + 1;
+    }
+    for (uint32_t i = 0; i < header->array_count; i++) {
+        int32_t slot = intern_array(ctx, name);
+        if (slot < 0) {
+            *error = "memory allocation failed for program image";
+            return -1;
+        }
+        if (slot != (int32_t)i) {
+            *error = "program image arrays do not match the context";
+            return -1;
+        }
+        name += strlen(name) + 1;
+    }
+
+    for (uint32_t i = 0; i < header->message_count; i++) {
+        messages[i] = (char*)name;
+        name += strlen(name) + 1;
+    }
+
+    ProgramLine** tail = &ctx->program_head;
+    for (uint32_t i = 0; i < header->line_count; i++) {
+        ImageLine line;
+        memcpy(&line, image + layout->lines + i * sizeof(ImageLine), sizeof(line));
+        ProgramLine* entry = &ctx->loaded_lines[i];
+        entry->line_number = line.line_number;
+        entry->tokens = (uint8_t*)image + layout->tokens + line.token_offset;
+        entry->code_offset = line.code_offset;
+        entry->loaded = true;
+        entry->shared_tokens = true;
+        ctx->line_index[i] = entry;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    *tail = NULL;
+    ctx->line_count = header->line_count;
+
+    chunk->code = (int32_t*)(image + layout->code);
+    chunk->code_count = header->code_count;
+    chunk->constants = (g2basic_number_t*)(image + layout->constants);
+    chunk->constant_count = header->constant_count;
+    chunk->function_count = header->function_count;
+    chunk->message_count = header->message_count;
+    chunk->max_depth = (int)header->max_depth;
+    chunk->cache_count = header->cache_count;
+    chunk->borrowed = true;
+    ctx->program_dirty = false;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a program image
+ *
+ * @param copy Copy the image into program memory instead of executing it
+ * in place
+ * @return 0 on success, -1 on error (the stored program is empty then)
+ */
+static int load_image(g2basic_ctx_t* ctx,
+                      const uint8_t* image,
+                      size_t size,
+                      bool copy,
+                      const char** error) {
+    ImageHeader header;
+    ImageLayout layout;
+    if (size < sizeof(header)) {
+        *error = "invalid program image";
+        return -1;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0) {
+        *error = "not a program image";
+        return -1;
+    }
+    if (header.version != IMAGE_VERSION || header.byte_order != IMAGE_BYTE_ORDER ||
+        header.value_size != sizeof(g2basic_number_t) || header.opcode_count != OPCODE_COUNT ||
+        header.fraction_bits != IMAGE_FRACTION_BITS) {
+        *error = "program image of an incompatible interpreter build";
+        return -1;
+    }
+    if (!image_layout(&header, &layout) || layout.size != header.size || header.size > size) {
+        *error = "invalid program image";
+        return -1;
+    }
+    if (image_checksum(image, header.size) != header.checksum) {
+        *error = "program image checksum mismatch";
+        return -1;
+    }
+    if (!copy && (uintptr_t)image % sizeof(g2basic_number_t) != 0) {
+        *error = "misaligned program image";
+        return -1;
+    }
+    if (!image_valid(image, &header, &layout)) {
+        *error = "invalid program image";
+        return -1;
+    }
+
+    clear_all_program_lines(ctx);
+    if (copy) {
+        uint8_t* data = (uint8_t*)mem_alloc(ctx, G2BASIC_MEMORY_PROGRAM, G2BASIC_MEMORY_USE_PROGRAM, header.size);
+        if (data == NULL) {
+            *error = "memory allocation failed for program image";
+            return -1;
+        }
+        ctx->loaded_token_size = header.size;
+        memcpy(data, image, header.size);
+        ctx->loaded_tokens = data;
+        image = data;
+    }
+    if (install_image(ctx, image, &header, &layout, error) != 0) {
+        clear_all_program_lines(ctx);
+        return -1;
+    }
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* ARENA ALLOCATOR */
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief Alignment of every arena block */
+#define ARENA_ALIGNMENT sizeof(ArenaAlignment)
+/** @brief Size of the block header holding the block capacity */
+#define ARENA_HEADER arena_align(sizeof(size_t))
+
+/** @brief Types whose alignment arena blocks must satisfy */
+typedef union ArenaAlignment {
+    void* pointer;
+    double number;
+    size_t size;
+    long long integer;
+} ArenaAlignment;
+
+static size_t arena_align(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static size_t arena_block_capacity(const void* ptr) {
+    size_t capacity;
+    memcpy(&capacity, (const uint8_t*)ptr - ARENA_HEADER, sizeof(capacity));
+    return capacity;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void* arena_make_block(uint8_t* block, size_t capacity) {
+    memcpy(block, &capacity, sizeof(capacity));
+    return block + ARENA_HEADER;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Check whether @p ptr is the most recent block of its end
+ *
+ * Only the most recent block of each end can be released or grown in place.
+ */
+static bool arena_is_last(const g2basic_arena_t* arena,
+                          g2basic_memory_kind_t kind,
+                          const uint8_t* ptr) {
+    if (kind == G2BASIC_MEMORY_PROGRAM) {
+        return ptr - ARENA_HEADER == arena->buffer + arena->size - arena->high;
+    }
+    return ptr + arena_block_capacity(ptr) == arena->buffer + arena->low;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void arena_update_peak(g2basic_arena_t* arena) {
+    if (arena->low + arena->high > arena->peak) {
+        arena->peak = arena->low + arena->high;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Allocate a block from the arena
+ *
+ * Interpreter state grows from the start of the buffer, the stored program
+ * grows down from its end, so both can be reset independently.
+ */
+static void* arena_alloc(void* context, g2basic_memory_kind_t kind, size_t size) {
+    g2basic_arena_t* arena = (g2basic_arena_t*)context;
+    size_t capacity = arena_align(size);
+    size_t available = arena->size - arena->low - arena->high;
+    if (capacity < size || available < ARENA_HEADER ||
+        capacity > available - ARENA_HEADER) {
+        return NULL;
+    }
+
+    uint8_t* block;
+    if (kind == G2BASIC_MEMORY_PROGRAM) {
+        arena->high += ARENA_HEADER + capacity;
+        block = arena->buffer + arena->size - arena->high;
+    } else {
+        block = arena->buffer + arena->low;
+        arena->low += ARENA_HEADER + capacity;
+    }
+    arena_update_peak(arena);
+    return arena_make_block(block, capacity);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void arena_free(void* context, g2basic_memory_kind_t kind, void* ptr) {
+    g2basic_arena_t* arena = (g2basic_arena_t*)context;
+    if (!arena_is_last(arena, kind, (uint8_t*)ptr)) {
+        return;  // Reclaimed by the next reset
+    }
+    size_t block_size = ARENA_HEADER + arena_block_capacity(ptr);
+    if (kind == G2BASIC_MEMORY_PROGRAM) {
+        arena->high -= block_size;
+    } else {
+        arena->low -= block_size;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void* arena_realloc(void* context,
+                           g2basic_memory_kind_t kind,
+                           void* ptr,
+                           size_t size) {
+    g2basic_arena_t* arena = (g2basic_arena_t*)context;
+    if (ptr == NULL) {
+        return arena_alloc(context, kind, size);
+    }
+    size_t capacity = arena_block_capacity(ptr);
+    if (size <= capacity) {
+        return ptr;
+    }
+    if (arena_align(size) < size) {
+        return NULL;
+    }
+
+    // Grow the most recent block in place
+    size_t grow = arena_align(size) - capacity;
+    if (arena_is_last(arena, kind, (uint8_t*)ptr) &&
+        grow <= arena->size - arena->low - arena->high) {
+        if (kind == G2BASIC_MEMORY_PROGRAM) {
+            // This end grows downwards, move the contents along
+            arena->high += grow;
+            uint8_t* block = arena->buffer + arena->size - arena->high;
+            memmove(block + ARENA_HEADER, ptr, capacity);
+            ptr = arena_make_block(block, capacity + grow);
+        } else {
+            arena->low += grow;
+            arena_make_block((uint8_t*)ptr - ARENA_HEADER, capacity + grow);
+        }
+        arena_update_peak(arena);
+        return ptr;
+    }
+
+    void* moved = arena_alloc(context, kind, size);
+    if (moved != NULL) {
+        memcpy(moved, ptr, capacity);
+    }
+    return moved;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void arena_reset(void* context, g2basic_memory_kind_t kind) {
+    g2basic_arena_t* arena = (g2basic_arena_t*)context;
+    if (kind == G2BASIC_MEMORY_PROGRAM) {
+        arena->high = 0;
+    } else {
+        arena->low = 0;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* PUBLIC API IMPLEMENTATION */
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Release all memory of a context
+ *
+ * Everything is released with the allocator it came from, in bulk if the
+ * allocator supports it. The context is left empty but still usable.
+ */
+static void ctx_release(g2basic_ctx_t* ctx) {
+    clear_all_variables(ctx);
+    clear_all_arrays(ctx);
+    clear_all_functions(ctx);
+    clear_all_program_lines(ctx);
+    free_control_stacks(ctx);
+    chunk_free(ctx, &ctx->program_chunk);
+    chunk_free(ctx, &ctx->immediate_chunk);
+    if (memory_bulk_release(ctx)) {
+        memory_reset(ctx, G2BASIC_MEMORY_STATE);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Reset a context to a clean state using @p custom_allocator
+ */
+static void ctx_setup(g2basic_ctx_t* ctx,
+                      void (*print_func)(const char* str),
+                      const g2basic_allocator_t* custom_allocator) {
+    ctx_release(ctx);
+    memset(ctx->memory, 0, sizeof(ctx->memory));
+    ctx->memory_live = 0;
+    ctx->memory_peak = 0;
+    ctx->for_peak_depth = 0;
+    ctx->gosub_peak_depth = 0;
+
+    ctx->print_function = print_func;
+    ctx->write_function = NULL;
+    ctx->write_context = NULL;
+    ctx->output_length = 0;
+    ctx->allocator = custom_allocator ? *custom_allocator : default_allocator;
+    ctx->program_chunk.kind = G2BASIC_MEMORY_PROGRAM;
+    ctx->immediate_chunk.kind = G2BASIC_MEMORY_STATE;
+    ctx->program_dirty = true;
+    reserve_control_stacks(ctx);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Initialize the G2Basic interpreter system
+ *
+ * @copydetails g2basic_init()
+ */
+void g2basic_init(void (*print_func)(const char* str)) {
+    ctx_setup(&default_ctx, print_func, NULL);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Initialize the G2Basic interpreter with a custom allocator
+ *
+ * @copydetails g2basic_init_with_allocator()
+ */
+void g2basic_init_with_allocator(void (*print_func)(const char* str),
+                                 const g2basic_allocator_t* custom_allocator) {
+    ctx_setup(&default_ctx, print_func, custom_allocator);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Create an interpreter context
+ *
+ * @copydetails g2basic_ctx_create()
+ */
+g2basic_ctx_t* g2basic_ctx_create(void (*print_func)(const char* str),
+                                  const g2basic_allocator_t* custom_allocator) {
+    const g2basic_allocator_t* source =
+        custom_allocator ? custom_allocator : &default_allocator;
+    g2basic_ctx_t* ctx = (g2basic_ctx_t*)source->alloc(
+        source->context, G2BASIC_MEMORY_STATE, sizeof(g2basic_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx_setup(ctx, print_func, source);
+    return ctx;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Destroy an interpreter context
+ *
+ * @copydetails g2basic_ctx_destroy()
+ */
+void g2basic_ctx_destroy(g2basic_ctx_t* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    g2basic_allocator_t source = ctx->allocator;
+    ctx_release(ctx);
+    // A bulk release has reclaimed the context itself already
+    if (source.reset == NULL) {
+        source.free(source.context, G2BASIC_MEMORY_STATE, ctx);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static int g2basic_eval(g2basic_ctx_t* ctx, const uint8_t* tokens,
+                        g2basic_number_t* result,
+                        const char** error) {
+    chunk_clear(ctx, &ctx->immediate_chunk);
+    compile_line(ctx, &ctx->immediate_chunk, tokens, true, NULL);
+    emit_end(ctx, &ctx->immediate_chunk);
+    if (ctx->immediate_chunk.out_of_memory) {
+        if (error) {
+            *error = "memory allocation failed for compiled line";
+        }
+        return -1;
+    }
+
+    // FOR and GOSUB frames outlive the line, so they must never be followed
+    // back into the scratch chunk once it has been compiled again
+    ctx->immediate_chunk.immediate = true;
+    // The line may assign variables a paused run has cached values of
+    forget_caches(ctx);
+
+    VmExit exit;
+#ifdef G2BASIC_TRACE
+    // The line may run while a stepped run is paused in a program line
+    int32_t trace_line = ctx->trace_line;
+    ctx->trace_line = 0;
+#endif
+    VmStatus status = vm_execute(ctx, &ctx->immediate_chunk, 0, SIZE_MAX, &exit);
+#ifdef G2BASIC_TRACE
+    if (status != VM_DONE) {
+        trace_event(ctx, G2BASIC_TRACE_ERROR, 0, exit.error);
+    }
+    ctx->trace_line = trace_line;
+#endif
+    if (status != VM_DONE) {
+        if (error) {
+            *error = exit.error ? exit.error : "Unknown error";
+        }
+        return -1;  // Error: parsing or execution failed
+    }
+    *result = exit.result;
+    return 0;
+}
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+static int parse_input(g2basic_ctx_t* ctx,
+                       const char* input,
+                       g2basic_number_t* result,
+                       const char** error) {
+    const char* p = input;
+
+    while (isspace((unsigned char)*p))
+        p++;
+
+    // Check for special BASIC commands first
+    if (handle_basic_command(ctx, input)) {
+        *result = 0;
+        return 3;  // Special command executed
+    }
+
+    // Check if line starts with a number (line number)
+    if (isdigit((unsigned char)*p)) {
+        // Parse line number
+        char* endptr;
+        long line_num = strtol(p, &endptr, 10);
+
+        if (line_num < 0 || line_num > 65535) {
+            return -1;  // Invalid line number
+        }
+
+        p = endptr;
+
+        // Skip whitespace after line number
+        while (isspace((unsigned char)*p))
+            p++;
+
+        if (*p == '\0') {
+            // Just a line number - delete the line
+            delete_program_line(ctx, (int)line_num);
+            *result = number_from_integer((int32_t)line_num);
+            return 1;  // Line deleted
+        } else {
+            // Line number followed by statement - store the line
+            const char* store_error = NULL;
+            if (insert_program_line(ctx, (int)line_num, p, &store_error) != 0) {
+                if (error) {
+                    *error = store_error;
+                }
+                return -1;
+            }
+            *result = number_from_integer((int32_t)line_num);
+            return 2;  // Line stored
+        }
+    } else {
+        // No line number - tokenize and evaluate in immediate mode
+        const char* tokenize_error = NULL;
+        uint8_t* tokens =
+            tokenize(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, input, &tokenize_error);
+        if (tokens == NULL) {
+            if (error) {
+                *error = tokenize_error;
+            }
+            return -1;
+        }
+        int ret = g2basic_eval(ctx, tokens, result, error);
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, tokens, token_stream_length(tokens));
+        return ret;
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Parse and execute a BASIC language line in a context
+ * 
+ * @copydetails g2basic_ctx_parse()
+ */
+int g2basic_ctx_parse(g2basic_ctx_t* ctx,
+                      const char* input,
+                      g2basic_number_t* result,
+                      const char** error) {
+    int ret = parse_input(ctx, input, result, error);
+    output_flush(ctx);
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program of a context with a program text
+ *
+ * @copydetails g2basic_ctx_load_program()
+ */
+int g2basic_ctx_load_program(g2basic_ctx_t* ctx,
+                             const char* text,
+                             size_t length,
+                             const char** error) {
+    const char* load_error = NULL;
+    int ret = load_program(ctx, text, length, &load_error);
+    if (ret != 0 && error) {
+        *error = load_error;
+    }
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a program text
+ *
+ * @copydetails g2basic_load_program()
+ */
+int g2basic_load_program(const char* text, size_t length, const char** error) {
+    return g2basic_ctx_load_program(&default_ctx, text, length, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program of a context with a program file
+ *
+ * @copydetails g2basic_ctx_load_file()
+ */
+int g2basic_ctx_load_file(g2basic_ctx_t* ctx,
+                          const char* path,
+                          const char** error) {
+    const char* load_error = NULL;
+    int ret = -1;
+    char* text = NULL;
+    size_t text_size = 0;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        load_error = "cannot open program file";
+    } else if (fseek(file, 0, SEEK_END) != 0) {
+        load_error = "cannot read program file";
+    } else {
+        long size = ftell(file);
+        if (size < 0 || fseek(file, 0, SEEK_SET) != 0) {
+            load_error = "cannot read program file";
+        } else if ((text = (char*)mem_alloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY,
+                                            text_size = (size_t)size + 1)) == NULL) {
+            load_error = "memory allocation failed for program file";
+        } else if (fread(text, 1, (size_t)size, file) != (size_t)size) {
+            load_error = "cannot read program file";
+        } else {
+            ret = load_program(ctx, text, (size_t)size, &load_error);
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, text, text_size);
+    if (ret != 0 && error) {
+        *error = load_error;
+    }
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a program file
+ *
+ * @copydetails g2basic_load_file()
+ */
+int g2basic_load_file(const char* path, const char** error) {
+    return g2basic_ctx_load_file(&default_ctx, path, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Write the compiled program of a context as a program image
+ *
+ * @copydetails g2basic_ctx_save_image()
+ */
+int g2basic_ctx_save_image(g2basic_ctx_t* ctx,
+                           void* buffer,
+                           size_t capacity,
+                           size_t* size,
+                           const char** error) {
+    const char* save_error = NULL;
+    size_t image_size = 0;
+    int ret = save_image(ctx, (uint8_t*)buffer, capacity, &image_size, &save_error);
+    if (size) {
+        *size = image_size;
+    }
+    if (ret != 0 && error) {
+        *error = save_error;
+    }
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Write the compiled program as a program image
+ *
+ * @copydetails g2basic_save_image()
+ */
+int g2basic_save_image(void* buffer, size_t capacity, size_t* size, const char** error) {
+    return g2basic_ctx_save_image(&default_ctx, buffer, capacity, size, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program of a context with a copy of a program image
+ *
+ * @copydetails g2basic_ctx_load_image()
+ */
+int g2basic_ctx_load_image(g2basic_ctx_t* ctx,
+                           const void* image,
+                           size_t size,
+                           const char** error) {
+    const char* load_error = NULL;
+    int ret = load_image(ctx, (const uint8_t*)image, size, true, &load_error);
+    if (ret != 0 && error) {
+        *error = load_error;
+    }
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a copy of a program image
+ *
+ * @copydetails g2basic_load_image()
+ */
+int g2basic_load_image(const void* image, size_t size, const char** error) {
+    return g2basic_ctx_load_image(&default_ctx, image, size, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Execute a program image of a context in place
+ *
+ * @copydetails g2basic_ctx_map_image()
+ */
+int g2basic_ctx_map_image(g2basic_ctx_t* ctx,
+                          const void* image,
+                          size_t size,
+                          const char** error) {
+    const char* load_error = NULL;
+    int ret = load_image(ctx, (const uint8_t*)image, size, false, &load_error);
+    if (ret != 0 && error) {
+        *error = load_error;
+    }
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Execute a program image in place
+ *
+ * @copydetails g2basic_map_image()
+ */
+int g2basic_map_image(const void* image, size_t size, const char** error) {
+    return g2basic_ctx_map_image(&default_ctx, image, size, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Map an array of a context onto a host buffer
+ *
+ * @copydetails g2basic_ctx_map_array()
+ */
+int g2basic_ctx_map_array(g2basic_ctx_t* ctx,
+                          const char* name,
+                          g2basic_number_t* values,
+                          size_t length) {
+    // Same names as the tokenizer reads, integer names excluded
+    if (name == NULL || !is_alpha_or_underscore(name[0]) || (values != NULL && length == 0)) {
+        return -1;
+    }
+    for (const char* c = name + 1; *c != '\0'; c++) {
+        if (!is_alnum_or_underscore(*c)) {
+            return -1;
+        }
+    }
+    int32_t slot = intern_array(ctx, name);
+    if (slot < 0) {
+        return -1;
+    }
+    Array* array = ctx->arrays[slot];
+    if (!array->mapped) {
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_ARRAYS, array->values,
+                 array->capacity * sizeof(g2basic_number_t));
+    }
+    array->values = values;
+    array->length = values != NULL ? length : 0;
+    array->capacity = 0;
+    array->mapped = values != NULL;
+    if (array->mapped) {
+        declare_array(ctx, array);
+    }
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Map an array onto a host buffer
+ *
+ * @copydetails g2basic_map_array()
+ */
+int g2basic_map_array(const char* name, g2basic_number_t* values, size_t length) {
+    return g2basic_ctx_map_array(&default_ctx, name, values, length);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Parse and execute a BASIC language line
+ * 
+ * @copydetails g2basic_parse()
+ */
+int g2basic_parse(const char* input, g2basic_number_t* result, const char** error) {
+    return g2basic_ctx_parse(&default_ctx, input, result, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Run the stored program of a context
+ *
+ * @copydetails g2basic_ctx_run()
+ */
+int g2basic_ctx_run(g2basic_ctx_t* ctx) {
+    int ret = run_program(ctx);
+    output_flush(ctx);
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Start a stepped run of the stored program of a context
+ *
+ * @copydetails g2basic_ctx_run_begin()
+ */
+int g2basic_ctx_run_begin(g2basic_ctx_t* ctx) {
+    int ret = start_program(ctx);
+    if (ret == 0) {
+        ctx->run_pc = 0;
+        ctx->run_active = true;
+    }
+    output_flush(ctx);
+    return ret;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Continue the stepped run of a context
+ *
+ * @copydetails g2basic_ctx_run_steps()
+ */
+g2basic_run_status_t g2basic_ctx_run_steps(g2basic_ctx_t* ctx, size_t max_steps) {
+    g2basic_run_status_t status = run_steps(ctx, max_steps);
+    output_flush(ctx);
+    return status;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Deliver the result of the function call a context waits for
+ *
+ * @copydetails g2basic_ctx_complete_call()
+ */
+int g2basic_ctx_complete_call(g2basic_ctx_t* ctx, g2basic_number_t result) {
+    CallWait* wait = ctx->call_wait;
+    if (!ctx->run_active || wait == NULL || wait->state != CALL_PENDING) {
+        return -1;
+    }
+    wait->result = result;
+    wait->state = CALL_COMPLETE;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set the profiler clock of a context
+ *
+ * @copydetails g2basic_ctx_set_profile_clock()
+ */
+void g2basic_ctx_set_profile_clock(g2basic_ctx_t* ctx, g2basic_clock_func_t clock, void* context) {
+#ifdef G2BASIC_PROFILE
+    ctx->profile_clock = clock;
+    ctx->profile_clock_context = context;
+#else
+    (void)ctx;
+    (void)clock;
+    (void)context;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set the profiler clock
+ *
+ * @copydetails g2basic_set_profile_clock()
+ */
+void g2basic_set_profile_clock(g2basic_clock_func_t clock, void* context) {
+    g2basic_ctx_set_profile_clock(&default_ctx, clock, context);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set up a trace ring buffer over caller supplied records
+ *
+ * @copydetails g2basic_trace_init()
+ */
+void g2basic_trace_init(g2basic_trace_ring_t* ring, g2basic_trace_record_t* records, size_t capacity) {
+    // The indices wrap around at 2^32, which the capacity has to divide
+    uint32_t usable = 0;
+    if (records != NULL && capacity > 0) {
+        usable = 1;
+        while (usable <= capacity / 2 && usable < (UINT32_C(1) << 31)) {
+            usable *= 2;
+        }
+    }
+    ring->records = records;
+    ring->capacity = usable;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Record the execution trace of a context into a ring buffer
+ *
+ * @copydetails g2basic_ctx_set_trace()
+ */
+void g2basic_ctx_set_trace(g2basic_ctx_t* ctx, g2basic_trace_ring_t* ring, g2basic_clock_func_t clock, void* context) {
+#ifdef G2BASIC_TRACE
+    ctx->trace_ring = ring;
+    ctx->trace_clock = clock;
+    ctx->trace_clock_context = context;
+#else
+    (void)ctx;
+    (void)ring;
+    (void)clock;
+    (void)context;
+#endif
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Record the execution trace into a ring buffer
+ *
+ * @copydetails g2basic_set_trace()
+ */
+void g2basic_set_trace(g2basic_trace_ring_t* ring, g2basic_clock_func_t clock, void* context) {
+    g2basic_ctx_set_trace(&default_ctx, ring, clock, context);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Take the oldest records out of a trace ring buffer
+ *
+ * @copydetails g2basic_trace_read()
+ */
+size_t g2basic_trace_read(g2basic_trace_ring_t* ring, g2basic_trace_record_t* records, size_t max) {
+    uint32_t tail = ring->tail;  // Only the reader changes it
+    uint32_t available = TRACE_LOAD(ring->head) - tail;
+    size_t count = available < max ? available : max;
+    for (size_t i = 0; i < count; i++) {
+        records[i] = ring->records[(tail + i) & (ring->capacity - 1)];
+    }
+    TRACE_STORE(ring->tail, tail + (uint32_t)count);
+    return count;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Start a stepped run of the stored program
+ *
+ * @copydetails g2basic_run_begin()
+ */
+int g2basic_run_begin(void) {
+    return g2basic_ctx_run_begin(&default_ctx);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Continue the stepped run
+ *
+ * @copydetails g2basic_run_steps()
+ */
+g2basic_run_status_t g2basic_run_steps(size_t max_steps) {
+    return g2basic_ctx_run_steps(&default_ctx, max_steps);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Deliver the result of the function call the stepped run waits for
+ *
+ * @copydetails g2basic_complete_call()
+ */
+int g2basic_complete_call(g2basic_number_t result) {
+    return g2basic_ctx_complete_call(&default_ctx, result);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Send the output of a context to a length-aware sink
+ *
+ * @copydetails g2basic_ctx_set_output()
+ */
+void g2basic_ctx_set_output(g2basic_ctx_t* ctx,
+                            g2basic_write_func_t write_func,
+                            void* context) {
+    output_flush(ctx);
+    ctx->write_function = write_func;
+    ctx->write_context = context;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Send the interpreter output to a length-aware sink
+ *
+ * @copydetails g2basic_set_output()
+ */
+void g2basic_set_output(g2basic_write_func_t write_func, void* context) {
+    g2basic_ctx_set_output(&default_ctx, write_func, context);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile an expression in a context
+ *
+ * @copydetails g2basic_ctx_compile_expr()
+ */
+int g2basic_ctx_compile_expr(g2basic_ctx_t* ctx,
+                             const char* text,
+                             g2basic_expr_t** handle,
+                             const char** error) {
+    *handle = NULL;
+    const char* tokenize_error = NULL;
+    uint8_t* tokens = tokenize(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, text, &tokenize_error);
+    if (tokens == NULL) {
+        if (error) {
+            *error = tokenize_error;
+        }
+        return -1;
+    }
+
+    g2basic_expr_t* expr =
+        (g2basic_expr_t*)mem_calloc(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_CODE, 1, sizeof(g2basic_expr_t));
+    if (expr == NULL) {
+        mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, tokens, token_stream_length(tokens));
+        if (error) {
+            *error = "memory allocation failed for compiled expression";
+        }
+        return -1;
+    }
+    expr->ctx = ctx;
+    expr->chunk.kind = G2BASIC_MEMORY_STATE;
+    expr->chunk.immediate = true;
+
+    Parser p = {.ctx = ctx,
+                .start = tokens,
+                .s = tokens,
+                .chunk = &expr->chunk,
+                .immediate = true,
+                .expression = true};
+    parse_expr(&p);
+    if (!p.err) {
+        p.s = skip_ws(p.s);
+        if (*p.s != TOKEN_END) {
+            p.err = "Unexpected characters at end";
+        }
+    }
+    emit_op(&p, OP_RESULT, -1);
+    emit_op(&p, OP_END, 0);
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_TEMPORARY, tokens, token_stream_length(tokens));
+
+    if (p.err == NULL && expr->chunk.out_of_memory) {
+        p.err = "memory allocation failed for compiled expression";
+    }
+    if (p.err) {
+        if (error) {
+            *error = p.err;
+        }
+        g2basic_expr_free(expr);
+        return -1;
+    }
+#if JIT_ENABLED
+    jit_compile(expr);
+#endif
+    *handle = expr;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile an expression
+ *
+ * @copydetails g2basic_compile_expr()
+ */
+int g2basic_compile_expr(const char* text,
+                         g2basic_expr_t** handle,
+                         const char** error) {
+    return g2basic_ctx_compile_expr(&default_ctx, text, handle, error);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Bind a variable of a compiled expression to a host location
+ *
+ * @copydetails g2basic_expr_bind()
+ */
+int g2basic_expr_bind(g2basic_expr_t* expr,
+                      const char* name,
+                      const g2basic_number_t* location) {
+    Chunk* chunk = &expr->chunk;
+    int found = -1;
+    for (size_t i = 0; i < chunk->load_count; i++) {
+        VariableLoad* load = &chunk->loads[i];
+        if (strcmp(expr->ctx->variable_symbols[load->slot]->name, name) != 0) {
+            continue;
+        }
+        load->location = location;
+        if (location != NULL) {
+            chunk->code[load->operand - 1] = OP_LOAD_HOST;
+            chunk->code[load->operand] = (int32_t)i;
+        } else {
+            chunk->code[load->operand - 1] = OP_LOAD;
+            chunk->code[load->operand] = load->slot;
+        }
+        found = 0;
+    }
+#if JIT_ENABLED
+    // Host locations are embedded in the native code
+    if (found == 0) {
+        jit_compile(expr);
+    }
+#endif
+    return found;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Evaluate a compiled expression
+ *
+ * @copydetails g2basic_eval_compiled()
+ */
+int g2basic_eval_compiled(const g2basic_expr_t* expr,
+                          g2basic_number_t* result,
+                          const char** error) {
+#if JIT_ENABLED
+    if (expr->jit.entry != NULL) {
+        int32_t failed = expr->jit.entry(expr->ctx->variable_values, expr->ctx->integer_values, result);
+        if (failed >= 0) {
+            if (error) {
+                *error = jit_error(expr, failed);
+            }
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    VmExit exit;
+    if (vm_execute(expr->ctx, &expr->chunk, 0, SIZE_MAX, &exit) != VM_DONE) {
+        if (error) {
+            *error = exit.error ? exit.error : "Unknown error";
+        }
+        return -1;
+    }
+    *result = exit.result;
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Evaluate a compiled expression over columns of input rows
+ *
+ * @copydetails g2basic_eval_batch()
+ */
+int g2basic_eval_batch(g2basic_expr_t* expr,
+                       g2basic_number_t* out,
+                       size_t count,
+                       const char** error) {
+    g2basic_ctx_t* ctx = expr->ctx;
+    if (expr->lanes == NULL) {
+        // Expressions always push at least one value
+        expr->lanes = (BatchLanes*)mem_alloc(
+            ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_CODE,
+            (size_t)expr->chunk.max_depth * sizeof(BatchLanes));
+        if (expr->lanes == NULL) {
+            if (error) {
+                *error = "memory allocation failed for batch evaluation";
+            }
+            return -1;
+        }
+    }
+
+    VmExit exit;
+    for (size_t row = 0; row < count; row += G2BASIC_BATCH_WIDTH) {
+        size_t lanes = count - row < G2BASIC_BATCH_WIDTH ? count - row
+                                                         : G2BASIC_BATCH_WIDTH;
+        if (vm_execute_batch(ctx, &expr->chunk, expr->lanes, row, lanes,
+                             out + row, &exit) != VM_DONE) {
+            if (error) {
+                *error = exit.error ? exit.error : "Unknown error";
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Release a compiled expression
+ *
+ * @copydetails g2basic_expr_free()
+ */
+void g2basic_expr_free(g2basic_expr_t* expr) {
+    if (expr == NULL) {
+        return;
+    }
+    g2basic_ctx_t* ctx = expr->ctx;
+#if JIT_ENABLED
+    jit_release(expr);
+#endif
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_CODE, expr->lanes,
+             (size_t)expr->chunk.max_depth * sizeof(BatchLanes));
+    chunk_free_buffers(ctx, &expr->chunk);
+    mem_free(ctx, G2BASIC_MEMORY_STATE, G2BASIC_MEMORY_USE_CODE, expr, sizeof(g2basic_expr_t));
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function with the expression evaluator
+ * 
+ * @copydetails g2basic_register_function()
+ */
+int g2basic_register_function(const char* name,
+                              int arg_count,
+                              g2basic_number_t (*func_ptr)(g2basic_number_t[], int)) {
+    return g2basic_ctx_register_function(&default_ctx, name, arg_count,
+                                         func_ptr);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function with flags
+ * 
+ * @copydetails g2basic_register_function_ex()
+ */
+int g2basic_register_function_ex(const char* name,
+                                 int arg_count,
+                                 g2basic_number_t (*func_ptr)(g2basic_number_t[], int),
+                                 unsigned flags) {
+    return g2basic_ctx_register_function_ex(&default_ctx, name, arg_count,
+                                            func_ptr, flags);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function that may wait for its result
+ *
+ * @copydetails g2basic_register_async_function()
+ */
+int g2basic_register_async_function(const char* name, int arg_count, g2basic_async_func_t func, void* context) {
+    return g2basic_ctx_register_async_function(&default_ctx, name, arg_count, func, context);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get the number of heap allocations made by a context
+ *
+ * @copydetails g2basic_ctx_allocation_count()
+ */
+size_t g2basic_ctx_allocation_count(const g2basic_ctx_t* ctx) {
+    return ctx->allocation_count;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get the number of heap allocations made by the interpreter
+ *
+ * @copydetails g2basic_allocation_count()
+ */
+size_t g2basic_allocation_count(void) {
+    return g2basic_ctx_allocation_count(&default_ctx);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get memory and stack statistics of a context
+ *
+ * @copydetails g2basic_ctx_get_stats()
+ */
+void g2basic_ctx_get_stats(const g2basic_ctx_t* ctx, g2basic_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t use = 0; use < G2BASIC_MEMORY_USE_COUNT; use++) {
+        const MemoryAccount* account = &ctx->memory[use];
+        g2basic_memory_usage_t* usage = &stats->memory[use];
+        usage->live_bytes = account->live_bytes[G2BASIC_MEMORY_STATE] + account->live_bytes[G2BASIC_MEMORY_PROGRAM];
+        usage->peak_bytes = account->peak_bytes;
+        usage->allocations = account->allocations;
+        usage->frees = account->frees;
+    }
+    stats->live_bytes = ctx->memory_live;
+    stats->peak_bytes = ctx->memory_peak;
+    stats->for_depth = ctx->for_depth;
+    stats->for_peak_depth = ctx->for_peak_depth;
+    stats->gosub_depth = ctx->gosub_depth;
+    stats->gosub_peak_depth = ctx->gosub_peak_depth;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get memory and stack statistics of the interpreter
+ *
+ * @copydetails g2basic_get_stats()
+ */
+void g2basic_get_stats(g2basic_stats_t* stats) {
+    g2basic_ctx_get_stats(&default_ctx, stats);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Restart the statistics of a context
+ *
+ * @copydetails g2basic_ctx_reset_stats()
+ */
+void g2basic_ctx_reset_stats(g2basic_ctx_t* ctx) {
+    for (size_t use = 0; use < G2BASIC_MEMORY_USE_COUNT; use++) {
+        MemoryAccount* account = &ctx->memory[use];
+        account->peak_bytes = account->live_bytes[G2BASIC_MEMORY_STATE] + account->live_bytes[G2BASIC_MEMORY_PROGRAM];
+        account->allocations = 0;
+        account->frees = 0;
+    }
+    ctx->memory_peak = ctx->memory_live;
+    ctx->for_peak_depth = ctx->for_depth;
+    ctx->gosub_peak_depth = ctx->gosub_depth;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Restart the statistics of the interpreter
+ *
+ * @copydetails g2basic_reset_stats()
+ */
+void g2basic_reset_stats(void) {
+    g2basic_ctx_reset_stats(&default_ctx);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set up an arena allocator over a caller supplied buffer
+ *
+ * @copydetails g2basic_arena_init()
+ */
+void g2basic_arena_init(g2basic_arena_t* arena, void* buffer, size_t size) {
+    // Start at an aligned address, the block headers keep the alignment
+    uintptr_t address = (uintptr_t)buffer;
+    size_t padding = arena_align((size_t)address) - (size_t)address;
+    if (buffer == NULL || size < padding) {
+        padding = 0;
+        size = 0;
+    }
+    arena->buffer = (uint8_t*)buffer + padding;
+    arena->size = (size - padding) & ~(ARENA_ALIGNMENT - 1);
+    arena->low = 0;
+    arena->high = 0;
+    arena->peak = 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get allocator callbacks allocating from an arena
+ *
+ * @copydetails g2basic_arena_allocator()
+ */
+g2basic_allocator_t g2basic_arena_allocator(g2basic_arena_t* arena) {
+    g2basic_allocator_t arena_allocator = {
+        .alloc = arena_alloc,
+        .realloc = arena_realloc,
+        .free = arena_free,
+        .reset = arena_reset,
+        .context = arena,
+    };
+    return arena_allocator;
 }
 /*--------------------------------------------------------------------------------------------------------------------*/
@@ -26,19 +26,92 @@
 #ifndef G2BASIC_H
 #define G2BASIC_H
 /*--------------------------------------------------------------------------------------------------------------------*/
+#include <stddef.h>
+#include <stdint.h>
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*
+ * Building with G2BASIC_FIXED_POINT defined (for targets without a floating
+ * point unit) replaces double with a signed 32-bit fixed-point number
+ * carrying G2BASIC_FIXED_FRACTION_BITS fraction bits. Host code must be built
+ * with the same definitions as the interpreter.
+ */
+#ifdef G2BASIC_FIXED_POINT
+#ifndef G2BASIC_FIXED_FRACTION_BITS
+/** @brief Fraction bits of a fixed-point number (1 to 30) */
+#define G2BASIC_FIXED_FRACTION_BITS 16
+#endif
+#if G2BASIC_FIXED_FRACTION_BITS < 1 || G2BASIC_FIXED_FRACTION_BITS > 30
+#error "G2BASIC_FIXED_FRACTION_BITS must be between 1 and 30"
+#endif
+#else
+#include <math.h>
+#endif
+
+/**
+ * @brief Numeric value of the interpreter
+ *
+ * Variables, constants, function arguments and results are all of this
+ * type: a double, or a fixed-point number in builds with
+ * G2BASIC_FIXED_POINT defined. Use G2BASIC_NUMBER() and
+ * G2BASIC_NUMBER_TO_DOUBLE() to write host code that works with both.
+ *
+ * @since 0.1.0
+ */
+#ifdef G2BASIC_FIXED_POINT
+typedef int32_t g2basic_number_t;
+
+/** @brief The number 1 of the fixed-point format */
+#define G2BASIC_FIXED_ONE ((int32_t)1 << G2BASIC_FIXED_FRACTION_BITS)
+/** @brief Convert a C number to a g2basic_number_t (rounded, @p x is evaluated twice) */
+#define G2BASIC_NUMBER(x) \
+    ((g2basic_number_t)((x) * (double)G2BASIC_FIXED_ONE + ((x) < 0 ? -0.5 : 0.5)))
+/** @brief Convert a g2basic_number_t to a double */
+#define G2BASIC_NUMBER_TO_DOUBLE(n) ((double)(n) / (double)G2BASIC_FIXED_ONE)
+/** @brief Function result for invalid arguments, raises an error */
+#define G2BASIC_NUMBER_INVALID INT32_MIN
+#else
+typedef double g2basic_number_t;
+
+/** @brief Convert a C number to a g2basic_number_t */
+#define G2BASIC_NUMBER(x) ((g2basic_number_t)(x))
+/** @brief Convert a g2basic_number_t to a double */
+#define G2BASIC_NUMBER_TO_DOUBLE(n) ((double)(n))
+/** @brief Function result for invalid arguments */
+#define G2BASIC_NUMBER_INVALID NAN
+#endif
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Interpreter context handle
+ *
+ * Opaque handle holding the complete state of one interpreter: variables,
+ * functions, the stored program and the execution stacks. Contexts are
+ * independent of each other and can be used from different threads at the
+ * same time, as long as each context is only used by one thread at a time.
+ *
+ * The functions without a context argument (g2basic_init(),
+ * g2basic_parse(), ...) work on a built-in default context.
+ *
+ * @see g2basic_ctx_create()
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_ctx g2basic_ctx_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
 /**
  * @brief Initialize the G2Basic interpreter system
  *
  * This function initializes the entire G2Basic interpreter, clearing all
  * variables, program lines, and resetting the interpreter state to a clean
- * starting condition. It also registers all built-in mathematical functions.
+ * starting condition. The built-in mathematical functions are a constant table
+ * shared by all contexts, so they are always available and cost no memory.
  *
  * The function performs the following operations:
  * - Clears all variables from memory
  * - Clears all stored program lines
  * - Resets FOR loop and GOSUB stacks
  * - Resets GOTO target and execution state
- * - Registers built-in math functions (sin, cos, tan, sqrt, abs, pow, etc.)
+ * - Removes the custom functions, keeping the built-in math functions (sin,
+ *   cos, tan, sqrt, abs, pow, etc.)
  * - Sets up the print function for program output
  *
  * @param print_func Function pointer for output operations. Pass NULL to
@@ -47,15 +120,172 @@
  *
  * @note This function must be called before any other G2Basic operations.
  * @note The print function will be called for all PRINT statements in BASIC
- * programs.
+ * programs. Output is buffered and passed on a line at a time (or in
+ * pieces of G2BASIC_OUTPUT_BUFFER_SIZE bytes), and always before
+ * g2basic_parse() returns.
  *
  * @see g2basic_parse()
  * @see g2basic_register_function()
+ * @see g2basic_set_output()
  *
  * @since 0.0.1
  */
 void g2basic_init(void (*print_func)(const char* str));
 /*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Length-aware output sink
+ *
+ * @param context Value passed to g2basic_set_output()
+ * @param data Output bytes, not NUL-terminated
+ * @param length Number of bytes in @p data
+ *
+ * @since 0.1.0
+ */
+typedef void (*g2basic_write_func_t)(void* context,
+                                     const char* data,
+                                     size_t length);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Send the interpreter output to a length-aware sink
+ *
+ * Replaces the print function given to g2basic_init(). The sink receives
+ * the output buffer directly with its length, without NUL termination or
+ * extra copies. The buffer (G2BASIC_OUTPUT_BUFFER_SIZE bytes, 128 by
+ * default) is flushed at the end of every line, when it is full and before
+ * g2basic_parse() returns.
+ *
+ * @param write_func Output sink, NULL to go back to the print function
+ * @param context Value passed to every @p write_func call
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static void write_stdout(void* context, const char* data, size_t length) {
+ *     fwrite(data, 1, length, (FILE*)context);
+ * }
+ *
+ * g2basic_set_output(write_stdout, stdout);
+ * @endcode
+ */
+void g2basic_set_output(g2basic_write_func_t write_func, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Kind of memory the interpreter asks its allocator for
+ *
+ * Every allocation is tagged with the part of the interpreter state it
+ * belongs to, so an allocator can keep them apart and release one kind as a
+ * whole.
+ *
+ * @since 0.1.0
+ */
+typedef enum g2basic_memory_kind {
+    G2BASIC_MEMORY_STATE,   /**< Variables, functions, stacks, scratch data */
+    G2BASIC_MEMORY_PROGRAM, /**< Stored program lines and compiled program */
+} g2basic_memory_kind_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Allocator callbacks used for all interpreter memory
+ *
+ * The callbacks follow the semantics of malloc(), realloc() and free(),
+ * every call receives the @p context pointer and the kind of memory
+ * requested. Memory must be suitably aligned for pointers and doubles.
+ *
+ * If @p reset is not NULL, the interpreter never frees memory block by block
+ * when it is cleared. NEW resets G2BASIC_MEMORY_PROGRAM, re-initialization
+ * resets both kinds, and the allocator must then release all memory of that
+ * kind at once.
+ *
+ * @see g2basic_init_with_allocator()
+ * @see g2basic_arena_allocator()
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_allocator {
+    void* (*alloc)(void* context, g2basic_memory_kind_t kind, size_t size);
+    void* (*realloc)(void* context,
+                     g2basic_memory_kind_t kind,
+                     void* ptr,
+                     size_t size);
+    void (*free)(void* context, g2basic_memory_kind_t kind, void* ptr);
+    void (*reset)(void* context, g2basic_memory_kind_t kind); /**< Optional */
+    void* context; /**< Passed to every callback */
+} g2basic_allocator_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Initialize the G2Basic interpreter system with a custom allocator
+ *
+ * Works like g2basic_init(), but all memory of the interpreter is obtained
+ * from @p allocator instead of the C library heap. The state of a previous
+ * initialization is released with the allocator it was created with before
+ * switching to the new one.
+ *
+ * @param print_func Function pointer for output operations, see
+ *                   g2basic_init()
+ * @param allocator Allocator callbacks, copied by the interpreter. Pass NULL
+ *                  to use malloc(), realloc() and free().
+ *
+ * @see g2basic_init()
+ * @see g2basic_arena_allocator()
+ *
+ * @since 0.1.0
+ */
+void g2basic_init_with_allocator(void (*print_func)(const char* str),
+                                 const g2basic_allocator_t* allocator);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Arena allocator state
+ *
+ * A bump allocator working in a caller supplied buffer, meant for targets
+ * without a heap or with very little RAM. Interpreter state is allocated
+ * from the start of the buffer, the stored program from its end, so NEW can
+ * drop the whole program with a single reset. Freed memory is only reused
+ * if it was the most recent allocation of its kind, everything else is
+ * reclaimed by the next reset.
+ *
+ * The members are managed by the arena functions and may be read to monitor
+ * memory use.
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_arena {
+    unsigned char* buffer; /**< Aligned start of the buffer */
+    size_t size;           /**< Usable size of the buffer */
+    size_t low;            /**< Bytes used by interpreter state */
+    size_t high;           /**< Bytes used by the stored program */
+    size_t peak;           /**< Highest total number of bytes used */
+} g2basic_arena_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set up an arena allocator over a caller supplied buffer
+ *
+ * @param arena Arena state to initialize
+ * @param buffer Memory to allocate from, typically a static array. It must
+ *               stay valid as long as the interpreter uses the arena.
+ * @param size Size of @p buffer in bytes
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static unsigned char memory[16 * 1024];
+ * static g2basic_arena_t arena;
+ *
+ * g2basic_arena_init(&arena, memory, sizeof(memory));
+ * g2basic_allocator_t allocator = g2basic_arena_allocator(&arena);
+ * g2basic_init_with_allocator(my_print, &allocator);
+ * @endcode
+ */
+void g2basic_arena_init(g2basic_arena_t* arena, void* buffer, size_t size);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get allocator callbacks allocating from an arena
+ *
+ * @param arena Arena set up with g2basic_arena_init()
+ * @return Allocator to pass to g2basic_init_with_allocator()
+ *
+ * @since 0.1.0
+ */
+g2basic_allocator_t g2basic_arena_allocator(g2basic_arena_t* arena);
+/*--------------------------------------------------------------------------------------------------------------------*/
 /**
  * @brief Register a custom function with the expression evaluator
  *
@@ -76,10 +306,10 @@ void g2basic_init(void (*print_func)(const char* str));
  *
  * @param func_ptr Pointer to the C function implementing the functionality.
  *                 The function must have the signature:
- *                 double function_name(double args[], int count)
+ *                 g2basic_number_t function_name(g2basic_number_t args[], int count)
  *                 - args[]: Array of argument values
  *                 - count: Number of arguments passed
- *                 - Returns: Double precision result value
+ *                 - Returns: Result value
  *
  * @return 0 on success, -1 on error (invalid name, memory allocation failure,
  * etc.)
@@ -87,7 +317,8 @@ void g2basic_init(void (*print_func)(const char* str));
  * @note Function names must be unique. Registering a function with an existing
  *       name will replace the previous function.
  * @note Variadic functions should validate the argument count internally
- * @note Functions should return NAN for invalid arguments or error conditions
+ * @note Functions should return G2BASIC_NUMBER_INVALID (NAN) for invalid
+ *       arguments or error conditions
  *
  * @warning The function pointer must remain valid for the lifetime of the
  * interpreter
@@ -98,8 +329,8 @@ void g2basic_init(void (*print_func)(const char* str));
  *
  * @code
  * // Example: Register a simple square function
- * double my_square(double args[], int count) {
- *     if (count != 1) return NAN;  // Expect exactly 1 argument
+ * g2basic_number_t my_square(g2basic_number_t args[], int count) {
+ *     if (count != 1) return G2BASIC_NUMBER_INVALID;  // Expect exactly 1 argument
  *     return args[0] * args[0];
  * }
  *
@@ -109,7 +340,135 @@ void g2basic_init(void (*print_func)(const char* str));
  */
 int g2basic_register_function(const char* name,
                               int arg_count,
-                              double (*func_ptr)(double[], int));
+                              g2basic_number_t (*func_ptr)(g2basic_number_t[], int));
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Properties of a registered function
+ *
+ * Flags for g2basic_register_function_ex(), combined with bitwise or.
+ *
+ * @since 0.1.0
+ */
+typedef enum {
+    /** Result depends on the arguments only and the function has no side
+        effects. Calls with constant arguments are evaluated once, at compile
+        time, and calls inside a FOR loop whose arguments the loop does not
+        change are evaluated once each time the loop is entered. */
+    G2BASIC_FUNCTION_PURE = 1u << 0,
+    /** The function may suspend the running program. Its calls are never
+        evaluated at compile time, even if it is marked pure. */
+    G2BASIC_FUNCTION_MAY_YIELD = 1u << 1,
+} g2basic_function_flags_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function with flags
+ *
+ * Same as g2basic_register_function(), with additional properties the
+ * compiler can use. Call sites are bound to the function when the program is
+ * compiled, and a non-negative @p arg_count is checked once at that point,
+ * so a fixed arity function is always called with exactly @p arg_count
+ * arguments and does not need to check @p count itself. The arguments are
+ * passed in place from the interpreter stack, without copying.
+ *
+ * @param name Function name, see g2basic_register_function()
+ * @param arg_count Number of arguments, -1 for variadic functions
+ * @param func_ptr Implementing C function
+ * @param flags Combination of g2basic_function_flags_t values, 0 for none
+ * @return 0 on success, -1 on error
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_register_function_ex("SQUARE", 1, my_square, G2BASIC_FUNCTION_PURE);
+ * // PRINT SQUARE(5) now compiles to PRINT 25
+ * @endcode
+ */
+int g2basic_register_function_ex(const char* name,
+                                 int arg_count,
+                                 g2basic_number_t (*func_ptr)(g2basic_number_t[], int),
+                                 unsigned flags);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Outcome of a call to a function that may wait
+ *
+ * @see g2basic_async_func_t
+ *
+ * @since 0.1.0
+ */
+typedef enum {
+    G2BASIC_CALL_ERROR = -1,  /**< Invalid arguments, the program stops with an error */
+    G2BASIC_CALL_DONE = 0,    /**< The result is stored, the program goes on */
+    G2BASIC_CALL_PENDING = 1, /**< The result follows through g2basic_complete_call() */
+} g2basic_call_status_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Host function that may wait for its result
+ *
+ * A function reading a slow sensor or a network value starts the request
+ * and returns #G2BASIC_CALL_PENDING instead of blocking. The program is
+ * then parked at the call, with its operand stack saved, and
+ * g2basic_run_steps() returns #G2BASIC_RUN_WAITING until the host passes
+ * the result to g2basic_complete_call(). One thread can so keep many
+ * waiting programs going.
+ *
+ * Only a stepped run (g2basic_run_begin()) can wait. A pending call in a
+ * RUN, an immediate mode line or an expression evaluation stops it with an
+ * error.
+ *
+ * @param context Value passed at registration
+ * @param ctx Context running the call, the default context for the
+ *            single-instance API
+ * @param args Argument values
+ * @param count Number of arguments
+ * @param result Receives the result when the call is done
+ * @return Outcome of the call
+ *
+ * @since 0.1.0
+ */
+typedef g2basic_call_status_t (*g2basic_async_func_t)(void* context,
+                                                      g2basic_ctx_t* ctx,
+                                                      g2basic_number_t args[],
+                                                      int count,
+                                                      g2basic_number_t* result);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function that may wait for its result
+ *
+ * Same as g2basic_register_function(), but @p func may leave the program
+ * waiting for a result the host delivers later. Calls to it are never
+ * evaluated at compile time (#G2BASIC_FUNCTION_MAY_YIELD).
+ *
+ * @param name Function name, see g2basic_register_function()
+ * @param arg_count Number of arguments, -1 for variadic functions
+ * @param func Implementing C function
+ * @param context Passed to @p func
+ * @return 0 on success, -1 on error
+ *
+ * @see g2basic_complete_call()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static g2basic_call_status_t read_sensor(void* context, g2basic_ctx_t* ctx,
+ *                                          g2basic_number_t args[], int count,
+ *                                          g2basic_number_t* result) {
+ *     sensor_request((int)args[0]);  // sensor_ready() follows later
+ *     return G2BASIC_CALL_PENDING;
+ * }
+ *
+ * g2basic_register_async_function("SENSOR", 1, read_sensor, NULL);
+ * g2basic_run_begin();
+ * for (;;) {
+ *     g2basic_run_status_t status = g2basic_run_steps(100);
+ *     if (status == G2BASIC_RUN_WAITING && sensor_ready()) {
+ *         g2basic_complete_call(sensor_value());
+ *     } else if (status != G2BASIC_RUN_RUNNING && status != G2BASIC_RUN_WAITING) {
+ *         break;
+ *     }
+ * }
+ * @endcode
+ */
+int g2basic_register_async_function(const char* name, int arg_count, g2basic_async_func_t func, void* context);
 /*--------------------------------------------------------------------------------------------------------------------*/
 /**
  * @brief Parse and execute a BASIC language line
@@ -136,6 +495,8 @@ int g2basic_register_function(const char* name,
  * @param result Pointer to store the result value. For statements that produce
  *               a value (expressions, calculations), the result is stored here.
  *               For statements without return values, this may be set to 0.
+ *               An integer assignment (I% = ...) whose value a fixed-point
+ *               number cannot hold yields G2BASIC_NUMBER_INVALID.
  *               Can be NULL if result is not needed.
  *
  * @param error Pointer to store error message string. If parsing or execution
@@ -167,7 +528,7 @@ int g2basic_register_function(const char* name,
  *
  * @code
  * // Example usage:
- * double result;
+ * g2basic_number_t result;
  * const char* error;
  *
  * // Store a program line
@@ -183,6 +544,924 @@ int g2basic_register_function(const char* name,
  * if (ret == -1) printf("Error: %s\\n", error);
  * @endcode
  */
-int g2basic_parse(const char* input, double* result, const char** error);
+int g2basic_parse(const char* input, g2basic_number_t* result, const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get the number of heap allocations made by the interpreter
+ *
+ * The counter increases with every successful or failed malloc, calloc and
+ * realloc call the interpreter makes, from g2basic_init() on. Sampling it
+ * before and after running a program shows whether the program allocates
+ * memory in steady state: storing or changing program lines (which
+ * recompiles the program on the next RUN) and nesting FOR loops or GOSUB
+ * calls deeper than ever before allocate, executing loops and subroutines
+ * does not.
+ *
+ * Building the interpreter with G2BASIC_ASSERT_NO_ALLOC defined additionally
+ * asserts that no allocation happens between two iterations of any FOR
+ * loop.
+ *
+ * @return Number of allocation calls made so far
+ *
+ * @see g2basic_init()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * size_t before = g2basic_allocation_count();
+ * g2basic_parse("RUN", &result, &error);
+ * printf("RUN allocated %zu times\n", g2basic_allocation_count() - before);
+ * @endcode
+ */
+size_t g2basic_allocation_count(void);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Part of the interpreter a block of memory is used for
+ *
+ * @see g2basic_get_stats()
+ *
+ * @since 0.1.0
+ */
+typedef enum g2basic_memory_use {
+    G2BASIC_MEMORY_USE_VARIABLES,   /**< Variable symbols, values and hash table */
+    G2BASIC_MEMORY_USE_ARRAYS,      /**< Array symbols and elements of DIM arrays */
+    G2BASIC_MEMORY_USE_FUNCTIONS,   /**< Registered functions and their hash table */
+    G2BASIC_MEMORY_USE_PROGRAM,     /**< Program lines, token streams, loaded images */
+    G2BASIC_MEMORY_USE_CODE,        /**< Compiled program, lines and expressions */
+    G2BASIC_MEMORY_USE_FOR_STACK,   /**< FOR loop frames */
+    G2BASIC_MEMORY_USE_GOSUB_STACK, /**< GOSUB return addresses */
+    G2BASIC_MEMORY_USE_TEMPORARY,   /**< Scratch buffers of tokenizing and loading */
+    G2BASIC_MEMORY_USE_COUNT        /**< Number of memory uses */
+} g2basic_memory_use_t;
+
+/**
+ * @brief Memory statistics of one memory use
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_memory_usage {
+    size_t live_bytes;  /**< Bytes allocated and not released */
+    size_t peak_bytes;  /**< Highest value of live_bytes */
+    size_t allocations; /**< Blocks allocated (a resize counts as one) */
+    size_t frees;       /**< Blocks released (a resize counts as one) */
+} g2basic_memory_usage_t;
+
+/**
+ * @brief Memory and stack statistics of an interpreter
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_stats {
+    g2basic_memory_usage_t memory[G2BASIC_MEMORY_USE_COUNT]; /**< By memory use */
+    size_t live_bytes;       /**< Bytes allocated and not released, in total */
+    size_t peak_bytes;       /**< Highest value of live_bytes */
+    size_t for_depth;        /**< Active FOR loops */
+    size_t for_peak_depth;   /**< Deepest FOR loop nesting */
+    size_t gosub_depth;      /**< Pending RETURNs */
+    size_t gosub_peak_depth; /**< Deepest GOSUB nesting */
+} g2basic_stats_t;
+
+/**
+ * @brief Get memory and stack statistics of the interpreter
+ *
+ * Every block the interpreter allocates is accounted to the part of the
+ * interpreter it is used for. Sizes are the sizes requested from the
+ * allocator, without its own overhead. The highest values reached since
+ * g2basic_init() (or since g2basic_reset_stats()) tell how much memory and
+ * how deep FOR and GOSUB stacks a program needs, for sizing the heap or an
+ * arena of a device.
+ *
+ * When the allocator releases memory in bulk (like the arena allocator),
+ * blocks count as released only once their memory kind is reset, which for
+ * the state memory is when the interpreter is initialized again.
+ *
+ * @param stats Filled with the current statistics
+ *
+ * @see g2basic_reset_stats()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_stats_t stats;
+ * g2basic_parse("RUN", &result, &error);
+ * g2basic_get_stats(&stats);
+ * printf("peak %zu bytes, %zu GOSUB levels\n", stats.peak_bytes, stats.gosub_peak_depth);
+ * @endcode
+ */
+void g2basic_get_stats(g2basic_stats_t* stats);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Restart the statistics of the interpreter
+ *
+ * Sets the peak values to the current ones and the allocation and free
+ * counts to zero. Live bytes and stack depths are kept.
+ *
+ * @see g2basic_get_stats()
+ *
+ * @since 0.1.0
+ */
+void g2basic_reset_stats(void);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a whole program text
+ *
+ * Stores every numbered line of @p text at once, like entering the lines
+ * one by one with g2basic_parse() after NEW, but in a single pass: the
+ * tokens of all lines share one allocation and the line index is built
+ * directly, sorting only when the lines are not already in ascending order.
+ * A later line with the same number replaces an earlier one and a line
+ * number on its own deletes the line. Blank lines are skipped, a line
+ * without a number is an error.
+ *
+ * Variables are kept. The program can be edited afterwards as usual.
+ *
+ * @param text   Program text, lines separated by '\n' (the text does not need
+ *               to be NUL-terminated)
+ * @param length Length of @p text in bytes
+ * @param error  Pointer to store the error message (can be NULL)
+ * @return 0 on success, -1 on error (the stored program is empty then)
+ *
+ * @see g2basic_load_file()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static const char program[] = "10 FOR I = 1 TO 3\n20 PRINT I\n30 NEXT I\n";
+ * if (g2basic_load_program(program, sizeof(program) - 1, &error) == 0) {
+ *     g2basic_parse("RUN", &result, &error);
+ * }
+ * @endcode
+ */
+int g2basic_load_program(const char* text, size_t length, const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with the contents of a file
+ *
+ * Reads the whole file and stores it with g2basic_load_program().
+ *
+ * @param path  Path of the program file
+ * @param error Pointer to store the error message (can be NULL)
+ * @return 0 on success, -1 on error
+ *
+ * @since 0.1.0
+ */
+int g2basic_load_file(const char* path, const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Write the compiled program as a program image
+ *
+ * A program image holds the stored program in its compiled form: the
+ * bytecode, the constant pool, the names of the variables and functions it
+ * uses and the token streams of its lines (for LIST and error messages). It
+ * can be loaded back with g2basic_load_image() or executed straight from
+ * read-only memory with g2basic_map_image(), without tokenizing or
+ * compiling anything.
+ *
+ * Images are only portable between builds of the same interpreter version
+ * on machines of the same byte order, loading checks this.
+ *
+ * @param buffer   Destination buffer, or NULL to only query the size
+ * @param capacity Size of @p buffer in bytes
+ * @param size     Set to the size of the image (can be NULL)
+ * @param error    Pointer to store the error message (can be NULL)
+ * @return 0 on success, -1 on error (for example a too small buffer)
+ *
+ * @see g2basic_load_image()
+ * @see g2basic_map_image()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * size_t size;
+ * g2basic_save_image(NULL, 0, &size, &error);
+ * void* image = malloc(size);
+ * g2basic_save_image(image, size, &size, &error);
+ * // ... store the image in flash ...
+ * @endcode
+ */
+int g2basic_save_image(void* buffer, size_t capacity, size_t* size, const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program with a copy of a program image
+ *
+ * The image is copied into program memory, so the buffer can be released
+ * right after the call. The functions used by the program must be
+ * registered under the same names and argument counts before loading, and
+ * the variables of the image keep their slots, so load images before
+ * creating any other variables (or into the context they were saved from).
+ *
+ * @param image Image written by g2basic_save_image()
+ * @param size  Size of @p image in bytes
+ * @param error Pointer to store the error message (can be NULL)
+ * @return 0 on success, -1 on error (the stored program is empty then)
+ *
+ * @since 0.1.0
+ */
+int g2basic_load_image(const void* image, size_t size, const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Execute a program image in place
+ *
+ * Like g2basic_load_image(), but the code, the constants and the token
+ * streams are used right where they are, for example in flash or in a
+ * memory mapped file. Only the line table and the function bindings take
+ * RAM. The image must be aligned to 8 bytes and stay unchanged until the
+ * program is replaced. Editing a line afterwards recompiles the program
+ * into RAM; the other lines keep using the image.
+ *
+ * @param image Image written by g2basic_save_image(), aligned to 8 bytes
+ * @param size  Size of @p image in bytes
+ * @param error Pointer to store the error message (can be NULL)
+ * @return 0 on success, -1 on error (the stored program is empty then)
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * extern const uint8_t program_image[]; // aligned to 8 bytes
+ * extern const size_t program_image_size;
+ * if (g2basic_map_image(program_image, program_image_size, &error) == 0) {
+ *     g2basic_parse("RUN", &result, &error);
+ * }
+ * @endcode
+ */
+int g2basic_map_image(const void* image, size_t size, const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief State of a stepped run
+ *
+ * @see g2basic_run_steps()
+ *
+ * @since 0.1.0
+ */
+typedef enum {
+    G2BASIC_RUN_ERROR = -1,  /**< The program stopped with an error */
+    G2BASIC_RUN_DONE = 0,    /**< The program ended (or no run is active) */
+    G2BASIC_RUN_RUNNING = 1, /**< The step budget is used up, call again */
+    G2BASIC_RUN_WAITING = 2, /**< A function call waits for
+                                  g2basic_complete_call(), call again after it */
+} g2basic_run_status_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Map a BASIC array onto a host buffer
+ *
+ * Programs then read and write the elements of @p values directly, without
+ * copying them in or out: A(0) is values[0] and sum(A), dot(A, B), FILL and
+ * COPY work on the buffer in place. The array is @p length elements long,
+ * so its indexes go from 0 to @p length - 1. An array allocated by DIM
+ * before is released, and DIM fails on a mapped array.
+ *
+ * The mapping lasts until it is replaced, removed by passing NULL as
+ * @p values, or the interpreter is initialized again. The buffer must stay
+ * valid as long as it is mapped.
+ *
+ * @param name Array name as used in BASIC code (case-sensitive, without
+ *             '%')
+ * @param values Host buffer, or NULL to unmap the array
+ * @param length Number of elements of @p values, at least 1 unless
+ *               unmapping
+ * @return 0 on success, -1 on an invalid name or length, or if memory
+ * allocation failed
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static g2basic_number_t samples[64];
+ *
+ * g2basic_map_array("S", samples, 64);
+ * adc_read(samples, 64);
+ * g2basic_parse("PRINT sum(S) / 64", &result, &error);
+ * @endcode
+ */
+int g2basic_map_array(const char* name, g2basic_number_t* values, size_t length);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Start a stepped run of the stored program
+ *
+ * Prepares the stored program like RUN does (compiling it if needed and
+ * resetting the FOR and GOSUB stacks), but does not execute anything yet.
+ * The program then runs in slices with g2basic_run_steps(), so a host
+ * without threads can interleave it with its own work.
+ *
+ * @return 0 on success, -1 if the program could not be compiled
+ *
+ * @see g2basic_run_steps()
+ *
+ * @since 0.1.0
+ */
+int g2basic_run_begin(void);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Continue the stepped run for at most @p max_steps steps
+ *
+ * A step is a taken branch: a jump, a FOR loop iteration, a GOSUB or a
+ * RETURN. Straight-line code between two branches always runs to the next
+ * branch, so the time of a slice is bounded by @p max_steps and the length
+ * of the program. The program position and the FOR and GOSUB stacks persist
+ * between calls; immediate mode lines may be executed in between, for
+ * example to read or set variables.
+ *
+ * Errors are reported through the print function like for RUN. Changing
+ * the stored program ends the run: the next call reports an error for an
+ * edited program and returns #G2BASIC_RUN_DONE after NEW or loading another
+ * program.
+ *
+ * @param max_steps Step budget of this slice
+ * @return #G2BASIC_RUN_RUNNING while the program has not finished,
+ *         #G2BASIC_RUN_WAITING while a function call waits for its result,
+ *         #G2BASIC_RUN_DONE when it ended, #G2BASIC_RUN_ERROR on error
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_run_begin();
+ * while (g2basic_run_steps(100) == G2BASIC_RUN_RUNNING) {
+ *     do_other_work();
+ * }
+ * @endcode
+ */
+g2basic_run_status_t g2basic_run_steps(size_t max_steps);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Deliver the result of the function call the stepped run waits for
+ *
+ * The next g2basic_run_steps() continues the program with @p result as the
+ * value of the call, checked like the return value of a function registered
+ * with g2basic_register_function().
+ *
+ * @param result Result of the pending call
+ * @return 0 on success, -1 if no call is waiting
+ *
+ * @see g2basic_register_async_function()
+ *
+ * @since 0.1.0
+ */
+int g2basic_complete_call(g2basic_number_t result);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Clock for the profiler
+ *
+ * Returns a monotonic tick count in any unit, for example CPU cycles or
+ * microseconds. The PROFILE command reports line times in these ticks.
+ *
+ * @param context The context pointer given with the clock
+ * @return Current tick count
+ *
+ * @since 0.1.0
+ */
+typedef uint64_t (*g2basic_clock_func_t)(void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set the clock that times program lines for the PROFILE command
+ *
+ * When the interpreter is built with G2BASIC_PROFILE defined, every run
+ * counts how often each program line is entered and how often each
+ * function is called. With a clock set it also accumulates the ticks spent
+ * in every line (including the clock calls themselves). The PROFILE command
+ * prints the counts of the last run, lines sorted by time (or hits without
+ * a clock). Without G2BASIC_PROFILE nothing is recorded and this call has
+ * no effect.
+ *
+ * @param clock   Clock function, or NULL to count without timing
+ * @param context Passed to @p clock on every call
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static uint64_t cycles(void* context) {
+ *     (void)context;
+ *     return DWT->CYCCNT;
+ * }
+ *
+ * g2basic_set_profile_clock(cycles, NULL);
+ * g2basic_parse("RUN", &result, &error);
+ * g2basic_parse("PROFILE", &result, &error);
+ * @endcode
+ */
+void g2basic_set_profile_clock(g2basic_clock_func_t clock, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Events recorded by the execution trace
+ *
+ * @see g2basic_trace_record_t
+ *
+ * @since 0.1.0
+ */
+typedef enum {
+    G2BASIC_TRACE_LINE,    /**< A program line is entered */
+    G2BASIC_TRACE_GOTO,    /**< GOTO (or IF ... THEN line) taken, value is the target line */
+    G2BASIC_TRACE_GOSUB,   /**< GOSUB taken, value is the target line */
+    G2BASIC_TRACE_RETURN,  /**< RETURN taken, value is the line returned to */
+    G2BASIC_TRACE_FOR,     /**< FOR loop entered, value is the loop nesting depth */
+    G2BASIC_TRACE_FOR_END, /**< FOR loop finished by its NEXT, value is the loop nesting depth */
+    G2BASIC_TRACE_CALL,    /**< Custom or built-in function called, value is the argument count */
+    G2BASIC_TRACE_ERROR,   /**< Run or immediate line stopped with an error */
+} g2basic_trace_event_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Fixed-size record of the execution trace
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_trace_record {
+    uint64_t time;    /**< Clock reading when the event happened, 0 without a clock */
+    uint32_t event;   /**< Event, a g2basic_trace_event_t */
+    int32_t line;     /**< Program line running, 0 for immediate lines and compiled expressions */
+    int32_t value;    /**< Event detail, see g2basic_trace_event_t */
+    const char* text; /**< Function name (#G2BASIC_TRACE_CALL) or error message (#G2BASIC_TRACE_ERROR,
+                           valid until the next error of the context), otherwise NULL */
+} g2basic_trace_record_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Ring buffer receiving trace records
+ *
+ * The interpreter appends records while it runs, and the host takes them
+ * out with g2basic_trace_read(), which may run at the same time on another
+ * thread or in an interrupt handler. Neither side takes a lock: one writer
+ * and one reader share the buffer through the two indices. When the buffer
+ * is full, further records are dropped and counted.
+ *
+ * The members are managed by the trace functions and may be read to
+ * monitor the trace.
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_trace_ring {
+    g2basic_trace_record_t* records; /**< Record storage */
+    uint32_t capacity;               /**< Number of records, a power of two */
+    uint32_t head;                   /**< Records written so far (wraps around) */
+    uint32_t tail;                   /**< Records read so far (wraps around) */
+    uint32_t dropped;                /**< Records dropped because the buffer was full */
+} g2basic_trace_ring_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set up a trace ring buffer over caller supplied records
+ *
+ * @param ring Ring buffer state to initialize
+ * @param records Record storage, typically a static array. It must stay
+ *                valid as long as the ring buffer is in use.
+ * @param capacity Number of records in @p records. Only the largest power
+ *                 of two not above it is used.
+ *
+ * @since 0.1.0
+ */
+void g2basic_trace_init(g2basic_trace_ring_t* ring, g2basic_trace_record_t* records, size_t capacity);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Record the execution trace into a ring buffer
+ *
+ * When the interpreter is built with G2BASIC_TRACE defined, program runs,
+ * immediate lines and g2basic_eval_compiled() append a record for every
+ * event listed by g2basic_trace_event_t, stamped with @p clock (batch
+ * evaluation is not traced, and such builds leave out the JIT). Recording
+ * costs one clock call and a record copy per event, nothing is formatted or
+ * printed. Without G2BASIC_TRACE no tracing code is compiled in and this
+ * call has no effect.
+ *
+ * @param ring Ring buffer set up with g2basic_trace_init(), or NULL to stop
+ *             tracing
+ * @param clock Clock stamping the records, or NULL to leave their time 0
+ * @param context Passed to @p clock on every call
+ *
+ * @see g2basic_trace_read()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * static g2basic_trace_record_t records[256];
+ * static g2basic_trace_ring_t ring;
+ *
+ * g2basic_trace_init(&ring, records, 256);
+ * g2basic_set_trace(&ring, cycles, NULL);
+ * g2basic_parse("RUN", &result, &error);
+ *
+ * g2basic_trace_record_t record;
+ * while (g2basic_trace_read(&ring, &record, 1) == 1) {
+ *     log_event(record.time, record.event, record.line, record.value);
+ * }
+ * @endcode
+ */
+void g2basic_set_trace(g2basic_trace_ring_t* ring, g2basic_clock_func_t clock, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Take the oldest records out of a trace ring buffer
+ *
+ * Safe to call while the interpreter appends to the buffer, from one reader
+ * at a time.
+ *
+ * @param ring Ring buffer
+ * @param records Receives the records, oldest first
+ * @param max Maximum number of records to take
+ * @return Number of records stored in @p records
+ *
+ * @since 0.1.0
+ */
+size_t g2basic_trace_read(g2basic_trace_ring_t* ring, g2basic_trace_record_t* records, size_t max);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Create an independent interpreter context
+ *
+ * The context starts out like the default context after g2basic_init(): no
+ * variables, no stored program and only the built-in functions. All
+ * memory of the context, including the context itself, comes from
+ * @p allocator. Give every context its own arena when using the bundled
+ * arena allocator.
+ *
+ * @param print_func Output function of the context. Can be NULL to discard
+ *                   output.
+ * @param allocator Allocator callbacks, copied into the context. NULL
+ *                  selects the C library allocator.
+ * @return New context, or NULL if it could not be allocated
+ *
+ * @see g2basic_ctx_destroy()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_ctx_t* ctx = g2basic_ctx_create(my_print, NULL);
+ * g2basic_ctx_parse(ctx, "10 PRINT 42", &result, &error);
+ * g2basic_ctx_run(ctx);
+ * g2basic_ctx_destroy(ctx);
+ * @endcode
+ */
+g2basic_ctx_t* g2basic_ctx_create(void (*print_func)(const char* str),
+                                  const g2basic_allocator_t* allocator);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Destroy a context and release all of its memory
+ *
+ * @param ctx Context created with g2basic_ctx_create(), or NULL
+ *
+ * @since 0.1.0
+ */
+void g2basic_ctx_destroy(g2basic_ctx_t* ctx);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function in a context
+ *
+ * Same as g2basic_register_function(), but the function is only visible to
+ * programs of @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_register_function(g2basic_ctx_t* ctx,
+                                  const char* name,
+                                  int arg_count,
+                                  g2basic_number_t (*func_ptr)(g2basic_number_t[], int));
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function with flags in a context
+ *
+ * Same as g2basic_register_function_ex(), but the function is only visible
+ * to programs of @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_register_function_ex(g2basic_ctx_t* ctx,
+                                     const char* name,
+                                     int arg_count,
+                                     g2basic_number_t (*func_ptr)(g2basic_number_t[], int),
+                                     unsigned flags);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Register a custom function that may wait in a context
+ *
+ * Same as g2basic_register_async_function(), but the function is only
+ * visible to programs of @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_register_async_function(g2basic_ctx_t* ctx,
+                                        const char* name,
+                                        int arg_count,
+                                        g2basic_async_func_t func,
+                                        void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Parse and execute a BASIC language line in a context
+ *
+ * Same as g2basic_parse(), but on the variables and stored program of
+ * @p ctx. Error messages point into the context and stay valid until the
+ * next call on the same context.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_parse(g2basic_ctx_t* ctx,
+                      const char* input,
+                      g2basic_number_t* result,
+                      const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Run the stored program of a context
+ *
+ * Equivalent to parsing "RUN" with g2basic_ctx_parse().
+ *
+ * @param ctx Context to run
+ * @return 0 when the program ended normally, -1 on a runtime error
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_run(g2basic_ctx_t* ctx);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Map an array of a context onto a host buffer
+ *
+ * Same as g2basic_map_array(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_map_array(g2basic_ctx_t* ctx,
+                          const char* name,
+                          g2basic_number_t* values,
+                          size_t length);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Start a stepped run of the stored program of a context
+ *
+ * Same as g2basic_run_begin(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_run_begin(g2basic_ctx_t* ctx);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Continue the stepped run of a context
+ *
+ * Same as g2basic_run_steps(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+g2basic_run_status_t g2basic_ctx_run_steps(g2basic_ctx_t* ctx, size_t max_steps);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Deliver the result of the function call a context waits for
+ *
+ * Same as g2basic_complete_call(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_complete_call(g2basic_ctx_t* ctx, g2basic_number_t result);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Set the profiler clock of a context
+ *
+ * Same as g2basic_set_profile_clock(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+void g2basic_ctx_set_profile_clock(g2basic_ctx_t* ctx, g2basic_clock_func_t clock, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Record the execution trace of a context into a ring buffer
+ *
+ * Same as g2basic_set_trace(), but for @p ctx. Every context traced at the
+ * same time needs a ring buffer of its own.
+ *
+ * @since 0.1.0
+ */
+void g2basic_ctx_set_trace(g2basic_ctx_t* ctx, g2basic_trace_ring_t* ring, g2basic_clock_func_t clock, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program of a context with a program text
+ *
+ * Same as g2basic_load_program(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_load_program(g2basic_ctx_t* ctx,
+                             const char* text,
+                             size_t length,
+                             const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program of a context with the contents of a file
+ *
+ * Same as g2basic_load_file(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_load_file(g2basic_ctx_t* ctx,
+                          const char* path,
+                          const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Write the compiled program of a context as a program image
+ *
+ * Same as g2basic_save_image(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_save_image(g2basic_ctx_t* ctx,
+                           void* buffer,
+                           size_t capacity,
+                           size_t* size,
+                           const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Replace the stored program of a context with a copy of a program image
+ *
+ * Same as g2basic_load_image(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_load_image(g2basic_ctx_t* ctx,
+                           const void* image,
+                           size_t size,
+                           const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Execute a program image in place in a context
+ *
+ * Same as g2basic_map_image(), but for @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_map_image(g2basic_ctx_t* ctx,
+                          const void* image,
+                          size_t size,
+                          const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Send the output of a context to a length-aware sink
+ *
+ * @copydetails g2basic_set_output()
+ */
+void g2basic_ctx_set_output(g2basic_ctx_t* ctx,
+                            g2basic_write_func_t write_func,
+                            void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get the number of heap allocations made by a context
+ *
+ * @copydetails g2basic_allocation_count()
+ *
+ * @since 0.1.0
+ */
+size_t g2basic_ctx_allocation_count(const g2basic_ctx_t* ctx);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Get memory and stack statistics of a context
+ *
+ * @copydetails g2basic_get_stats()
+ *
+ * @since 0.1.0
+ */
+void g2basic_ctx_get_stats(const g2basic_ctx_t* ctx, g2basic_stats_t* stats);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Restart the statistics of a context
+ *
+ * @copydetails g2basic_reset_stats()
+ *
+ * @since 0.1.0
+ */
+void g2basic_ctx_reset_stats(g2basic_ctx_t* ctx);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compiled expression handle
+ *
+ * Opaque handle of an expression compiled by g2basic_compile_expr(). It
+ * belongs to the context it was compiled in and must be released with
+ * g2basic_expr_free() before that context is destroyed or initialized
+ * again.
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_expr g2basic_expr_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile an expression for repeated evaluation
+ *
+ * Parses @p text once, with the same grammar and the same registered
+ * functions as g2basic_parse(), into a handle that g2basic_eval_compiled()
+ * evaluates without parsing again. Variables of the expression read the
+ * context variables of the same name unless they are bound to host
+ * locations with g2basic_expr_bind().
+ *
+ * @param text Expression, e.g. "sqrt(X*X+Y*Y)*K"
+ * @param handle Receives the compiled expression, NULL on error
+ * @param error Receives an error message on failure. Can be NULL.
+ * @return 0 on success, -1 on a syntax error or allocation failure
+ *
+ * @see g2basic_eval_compiled()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_number_t x, y, result;
+ * g2basic_expr_t* expr;
+ *
+ * g2basic_compile_expr("sqrt(X*X+Y*Y)", &expr, &error);
+ * g2basic_expr_bind(expr, "X", &x);
+ * g2basic_expr_bind(expr, "Y", &y);
+ * for (int i = 0; i < count; i++) {
+ *     x = xs[i];
+ *     y = ys[i];
+ *     g2basic_eval_compiled(expr, &result, &error);
+ * }
+ * g2basic_expr_free(expr);
+ * @endcode
+ */
+int g2basic_compile_expr(const char* text,
+                         g2basic_expr_t** handle,
+                         const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Compile an expression in a context
+ *
+ * Same as g2basic_compile_expr(), but with the variables and functions of
+ * @p ctx.
+ *
+ * @since 0.1.0
+ */
+int g2basic_ctx_compile_expr(g2basic_ctx_t* ctx,
+                             const char* text,
+                             g2basic_expr_t** handle,
+                             const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Bind a variable of a compiled expression to a host location
+ *
+ * Every evaluation then reads the variable straight from @p location. Bound
+ * values are used as they are, no "undefined variable" check is made.
+ *
+ * @param expr Compiled expression
+ * @param name Variable name as written in the expression
+ * @param location Value to read, must stay valid while bound. For
+ *                 g2basic_eval_batch() it is the first element of a column
+ *                 holding one value per row. NULL unbinds the variable, so
+ *                 it reads the context variable again.
+ * @return 0 on success, -1 if the expression does not use @p name
+ *
+ * @since 0.1.0
+ */
+int g2basic_expr_bind(g2basic_expr_t* expr,
+                      const char* name,
+                      const g2basic_number_t* location);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Evaluate a compiled expression
+ *
+ * With the interpreter built with G2BASIC_JIT defined, on x86-64 the
+ * expression runs as native code generated when it was compiled (and again
+ * whenever a binding changes). Results and errors are the same as in the
+ * virtual machine, which runs every expression the native code tier does not
+ * cover.
+ *
+ * @param expr Compiled expression
+ * @param result Receives the value of the expression
+ * @param error Receives an error message on failure, e.g. division by zero.
+ *              Can be NULL.
+ * @return 0 on success, -1 on a runtime error
+ *
+ * @since 0.1.0
+ */
+int g2basic_eval_compiled(const g2basic_expr_t* expr,
+                          g2basic_number_t* result,
+                          const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Evaluate a compiled expression over columns of input rows
+ *
+ * Evaluates @p expr once for each of @p count rows, reading row i of every
+ * bound variable from location[i] of its binding (struct-of-arrays input)
+ * and storing the value of row i in out[i]. Rows are processed in blocks
+ * of G2BASIC_BATCH_WIDTH (64 by default), one instruction at a time over
+ * the whole block, so the interpreter overhead is shared by the block and
+ * the arithmetic and built-in functions run as vectorizable loops.
+ *
+ * The first call allocates the block workspace of the expression, later
+ * calls do not allocate.
+ *
+ * @param expr Compiled expression
+ * @param out Output column of @p count values
+ * @param count Number of rows
+ * @param error Receives an error message on failure. Can be NULL.
+ * @return 0 on success, -1 on a runtime error (e.g. division by zero in any
+ *         row of a block). Output of the blocks before the failing one has
+ *         been stored.
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_number_t samples[4096], scaled[4096];
+ *
+ * g2basic_compile_expr("sqrt(abs(S))*K", &expr, &error);
+ * g2basic_expr_bind(expr, "S", samples);
+ * g2basic_eval_batch(expr, scaled, 4096, &error);
+ * @endcode
+ */
+int g2basic_eval_batch(g2basic_expr_t* expr,
+                       g2basic_number_t* out,
+                       size_t count,
+                       const char** error);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Release a compiled expression
+ *
+ * @param expr Compiled expression, or NULL
+ *
+ * @since 0.1.0
+ */
+void g2basic_expr_free(g2basic_expr_t* expr);
 /*--------------------------------------------------------------------------------------------------------------------*/
 #endif  // G2BASIC_H
\ No newline at end of file
@@ -0,0 +1,394 @@
+/**
+ * @file g2basic_pool.c
+ * @brief G2Basic Thread Pool Scheduler Implementation
+ *
+ * Every worker owns a queue of contexts. It takes contexts from the front of
+ * its own queue, runs one slice and puts unfinished ones back at the end, so
+ * the contexts of a worker take turns. A worker whose queue is empty steals
+ * from the end of the other queues before it goes to sleep. New contexts
+ * are spread over the queues in turn.
+ *
+ * Each queue has a lock of its own, so workers only contend when they steal.
+ * The pool lock guards the counters the workers sleep and the waiters block
+ * on, and the list of submitted contexts a function call result is
+ * delivered through.
+ *
+ * A context waiting for a function call result is parked: it is in no queue
+ * until g2basic_pool_complete_call() puts it back. A result that comes in
+ * before the worker parked the context is kept in the job until it does.
+ *
+ * @author Grzegorz Grzęda
+ * @version 0.1.0
+ * @date 2025
+ * @copyright SPDX-License-Identifier: MIT
+ */
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* SPDX-License-Identifier: MIT */
+/*--------------------------------------------------------------------------------------------------------------------*/
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L  // sysconf() in strict C modes
+#endif
+#include "g2basic_pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief Step budget of a slice when none is given */
+#ifndef G2BASIC_POOL_SLICE_STEPS
+#define G2BASIC_POOL_SLICE_STEPS 1000
+#endif
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+
+/** @brief Submitted context, queued while it waits for its next slice */
+typedef struct PoolJob {
+    g2basic_ctx_t* ctx;             /**< Context whose program runs */
+    g2basic_pool_done_func_t done;  /**< Completion callback, or NULL */
+    void* context;                  /**< Callback context */
+    bool started;                   /**< g2basic_ctx_run_begin() was called */
+    bool parked;                    /**< Waits for a function call result */
+    bool completed;                 /**< result arrived before it was parked */
+    g2basic_number_t result;        /**< Function call result to deliver */
+    struct PoolJob* prev;           /**< Queue neighbour towards the front */
+    struct PoolJob* next;           /**< Queue neighbour towards the end */
+    struct PoolJob* submitted_prev; /**< Neighbour in pool->submitted */
+    struct PoolJob* submitted_next; /**< Neighbour in pool->submitted */
+} PoolJob;
+
+/** @brief Queue of a worker, a doubly linked list */
+typedef struct PoolQueue {
+    pthread_mutex_t lock; /**< Guards the list */
+    PoolJob* head;        /**< Front, taken by the owner */
+    PoolJob* tail;        /**< End, where jobs are added and stolen */
+} PoolQueue;
+
+/** @brief Worker thread with its queue */
+typedef struct PoolWorker {
+    struct g2basic_pool* pool; /**< Pool of the worker */
+    size_t index;              /**< Position in pool->workers */
+    pthread_t thread;          /**< Thread running pool_worker() */
+    PoolQueue queue;           /**< Contexts of this worker */
+} PoolWorker;
+
+struct g2basic_pool {
+    PoolWorker* workers;  /**< Workers, worker_count entries */
+    size_t worker_count;  /**< Number of workers */
+    size_t slice_steps;   /**< Step budget of a slice */
+    pthread_mutex_t lock; /**< Guards the fields below */
+    pthread_cond_t work;  /**< Signaled when jobs are queued or the pool stops */
+    pthread_cond_t idle;  /**< Signaled when the last pending job finished */
+    size_t queued;        /**< Jobs in the queues */
+    size_t pending;       /**< Jobs submitted and not finished */
+    size_t next_worker;   /**< Queue receiving the next submitted job */
+    PoolJob* submitted;   /**< Jobs submitted and not finished */
+    bool stopping;        /**< Workers exit once this is set */
+};
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* QUEUES */
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void queue_push(PoolQueue* queue, PoolJob* job) {
+    pthread_mutex_lock(&queue->lock);
+    job->next = NULL;
+    job->prev = queue->tail;
+    if (queue->tail != NULL) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    pthread_mutex_unlock(&queue->lock);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Remove the job at the front (the owner) or the end (a thief) of a queue
+ *
+ * @return The job, or NULL if the queue is empty
+ */
+static PoolJob* queue_pop(PoolQueue* queue, bool steal) {
+    pthread_mutex_lock(&queue->lock);
+    PoolJob* job = steal ? queue->tail : queue->head;
+    if (job != NULL) {
+        if (job->prev != NULL) {
+            job->prev->next = job->next;
+        } else {
+            queue->head = job->next;
+        }
+        if (job->next != NULL) {
+            job->next->prev = job->prev;
+        } else {
+            queue->tail = job->prev;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* WORKERS */
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void pool_queue_job(struct g2basic_pool* pool, PoolQueue* queue, PoolJob* job) {
+    queue_push(queue, job);
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Take the next job for @p worker, from its own queue or stolen
+ *
+ * Sleeps while every queue is empty.
+ *
+ * @return The job, or NULL when the pool stops
+ */
+static PoolJob* pool_take_job(PoolWorker* worker) {
+    struct g2basic_pool* pool = worker->pool;
+    for (;;) {
+        PoolJob* job = queue_pop(&worker->queue, false);
+        for (size_t i = 1; job == NULL && i < pool->worker_count; i++) {
+            job = queue_pop(&pool->workers[(worker->index + i) % pool->worker_count].queue, true);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (job != NULL) {
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            return job;
+        }
+        // A job counted in queued but not found is being moved, look again
+        while (pool->queued == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        bool stop = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Report a finished job and release it
+ */
+static void pool_finish_job(struct g2basic_pool* pool, PoolJob* job, g2basic_run_status_t status) {
+    pthread_mutex_lock(&pool->lock);
+    if (job->submitted_prev != NULL) {
+        job->submitted_prev->submitted_next = job->submitted_next;
+    } else {
+        pool->submitted = job->submitted_next;
+    }
+    if (job->submitted_next != NULL) {
+        job->submitted_next->submitted_prev = job->submitted_prev;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (job->done != NULL) {
+        job->done(job->ctx, status, job->context);
+    }
+    free(job);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+        pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Park a job waiting for a function call result, or queue it again if
+ * the result is already there
+ */
+static void pool_park_job(struct g2basic_pool* pool, PoolQueue* queue, PoolJob* job) {
+    pthread_mutex_lock(&pool->lock);
+    bool ready = job->completed;
+    if (ready) {
+        job->completed = false;
+        g2basic_ctx_complete_call(job->ctx, job->result);
+    } else {
+        job->parked = true;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (ready) {
+        pool_queue_job(pool, queue, job);
+    }
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+static void* pool_worker(void* argument) {
+    PoolWorker* worker = (PoolWorker*)argument;
+    struct g2basic_pool* pool = worker->pool;
+    PoolJob* job;
+    while ((job = pool_take_job(worker)) != NULL) {
+        g2basic_run_status_t status = G2BASIC_RUN_RUNNING;
+        if (!job->started) {
+            job->started = true;
+            if (g2basic_ctx_run_begin(job->ctx) != 0) {
+                status = G2BASIC_RUN_ERROR;
+            }
+        }
+        if (status == G2BASIC_RUN_RUNNING) {
+            status = g2basic_ctx_run_steps(job->ctx, pool->slice_steps);
+        }
+        if (status == G2BASIC_RUN_RUNNING) {
+            pool_queue_job(pool, &worker->queue, job);
+        } else if (status == G2BASIC_RUN_WAITING) {
+            pool_park_job(pool, &worker->queue, job);
+        } else {
+            pool_finish_job(pool, job, status);
+        }
+    }
+    return NULL;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* PUBLIC API IMPLEMENTATION */
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Stop the first @p started workers and release the pool
+ */
+static void pool_release(g2basic_pool_t* pool, size_t started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        pthread_mutex_destroy(&pool->workers[i].queue.lock);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Create a thread pool
+ *
+ * @copydetails g2basic_pool_create()
+ */
+g2basic_pool_t* g2basic_pool_create(size_t workers, size_t slice_steps) {
+    if (workers == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = online > 0 ? (size_t)online : 1;
+    }
+    g2basic_pool_t* pool = (g2basic_pool_t*)calloc(1, sizeof(g2basic_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->workers = (PoolWorker*)calloc(workers, sizeof(PoolWorker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->worker_count = workers;
+    pool->slice_steps = slice_steps ? slice_steps : G2BASIC_POOL_SLICE_STEPS;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (size_t i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].queue.lock, NULL);
+    }
+
+    for (size_t i = 0; i < workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker, &pool->workers[i]) != 0) {
+            pool_release(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Run the stored program of a context on the pool
+ *
+ * @copydetails g2basic_pool_submit()
+ */
+int g2basic_pool_submit(g2basic_pool_t* pool, g2basic_ctx_t* ctx, g2basic_pool_done_func_t done, void* context) {
+    PoolJob* job = (PoolJob*)calloc(1, sizeof(PoolJob));
+    if (job == NULL) {
+        return -1;
+    }
+    job->ctx = ctx;
+    job->done = done;
+    job->context = context;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    job->submitted_next = pool->submitted;
+    if (pool->submitted != NULL) {
+        pool->submitted->submitted_prev = job;
+    }
+    pool->submitted = job;
+    size_t index = pool->next_worker++ % pool->worker_count;
+    pthread_mutex_unlock(&pool->lock);
+    pool_queue_job(pool, &pool->workers[index].queue, job);
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Deliver the result of the function call a submitted context waits for
+ *
+ * @copydetails g2basic_pool_complete_call()
+ */
+int g2basic_pool_complete_call(g2basic_pool_t* pool, g2basic_ctx_t* ctx, g2basic_number_t result) {
+    pthread_mutex_lock(&pool->lock);
+    PoolJob* job = pool->submitted;
+    while (job != NULL && job->ctx != ctx) {
+        job = job->submitted_next;
+    }
+    if (job == NULL || job->completed) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    bool parked = job->parked;
+    size_t index = 0;
+    if (parked) {
+        // Nothing runs the context while it is parked
+        job->parked = false;
+        g2basic_ctx_complete_call(ctx, result);
+        index = pool->next_worker++ % pool->worker_count;
+    } else {
+        job->completed = true;
+        job->result = result;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (parked) {
+        pool_queue_job(pool, &pool->workers[index].queue, job);
+    }
+    return 0;
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Wait until every submitted context has finished
+ *
+ * @copydetails g2basic_pool_wait()
+ */
+void g2basic_pool_wait(g2basic_pool_t* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Release a thread pool
+ *
+ * @copydetails g2basic_pool_destroy()
+ */
+void g2basic_pool_destroy(g2basic_pool_t* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    g2basic_pool_wait(pool);
+    pool_release(pool, pool->worker_count);
+}
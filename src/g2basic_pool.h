@@ -0,0 +1,143 @@
+/**
+ * @file g2basic_pool.h
+ * @brief G2Basic Thread Pool Scheduler
+ *
+ * Runs the stored programs of many independent interpreter contexts on a
+ * pool of worker threads. Every context runs in stepped slices
+ * (g2basic_ctx_run_steps()), so a long program never holds up the others
+ * queued behind it, and workers that run out of contexts take them over
+ * from the queues of busy workers. A context waiting for the result of a
+ * function call (g2basic_register_async_function()) leaves its worker free
+ * until the result is delivered with g2basic_pool_complete_call().
+ *
+ * The scheduler needs POSIX threads and the C library allocator, it is meant
+ * for hosted targets. The interpreter itself does not depend on it.
+ *
+ * @author Grzegorz Grzęda
+ * @version 0.1.0
+ * @date 2025
+ * @copyright SPDX-License-Identifier: MIT
+ */
+
+/*--------------------------------------------------------------------------------------------------------------------*/
+/* SPDX-License-Identifier: MIT */
+/*--------------------------------------------------------------------------------------------------------------------*/
+#ifndef G2BASIC_POOL_H
+#define G2BASIC_POOL_H
+/*--------------------------------------------------------------------------------------------------------------------*/
+#include <stddef.h>
+#include "g2basic.h"
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Thread pool running interpreter contexts
+ *
+ * @see g2basic_pool_create()
+ *
+ * @since 0.1.0
+ */
+typedef struct g2basic_pool g2basic_pool_t;
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Completion callback of a submitted context
+ *
+ * Called on the worker thread that ran the last slice, once the program of
+ * @p ctx has finished. The context is no longer used by the pool and may be
+ * destroyed or submitted again from the callback.
+ *
+ * @param ctx Context whose program finished
+ * @param status #G2BASIC_RUN_DONE when the program ended, #G2BASIC_RUN_ERROR
+ *               when it stopped with an error (reported through the output
+ *               of the context) or could not be compiled
+ * @param context Value passed to g2basic_pool_submit()
+ *
+ * @since 0.1.0
+ */
+typedef void (*g2basic_pool_done_func_t)(g2basic_ctx_t* ctx, g2basic_run_status_t status, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Create a thread pool
+ *
+ * @param workers Number of worker threads, 0 for one per online processor
+ * @param slice_steps Step budget of a slice (see g2basic_ctx_run_steps()), 0
+ *                    for the default of 1000. Smaller slices share the
+ *                    workers more fairly, larger ones schedule less often.
+ * @return New pool, or NULL if it or its threads could not be created
+ *
+ * @see g2basic_pool_destroy()
+ *
+ * @since 0.1.0
+ *
+ * @code
+ * g2basic_pool_t* pool = g2basic_pool_create(0, 0);
+ * for (size_t i = 0; i < count; i++) {
+ *     g2basic_pool_submit(pool, scripts[i], script_done, &results[i]);
+ * }
+ * g2basic_pool_wait(pool);
+ * g2basic_pool_destroy(pool);
+ * @endcode
+ */
+g2basic_pool_t* g2basic_pool_create(size_t workers, size_t slice_steps);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Run the stored program of a context on the pool
+ *
+ * The run starts (g2basic_ctx_run_begin()) on a worker thread and continues
+ * in slices until the program finishes, then @p done is called. Until then
+ * the context belongs to the pool: the caller must not use it, and it must
+ * not be submitted a second time. Contexts must not share state through
+ * the single-instance API, which works on one global context.
+ *
+ * Can be called from any thread, including from a completion callback.
+ *
+ * @param pool Thread pool
+ * @param ctx Context holding the program to run
+ * @param done Completion callback, or NULL
+ * @param context Passed to @p done
+ * @return 0 on success, -1 if memory allocation failed
+ *
+ * @since 0.1.0
+ */
+int g2basic_pool_submit(g2basic_pool_t* pool, g2basic_ctx_t* ctx, g2basic_pool_done_func_t done, void* context);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Deliver the result of the function call a submitted context waits for
+ *
+ * Use this instead of g2basic_ctx_complete_call() for contexts run by the
+ * pool. The context goes back into a queue and continues with @p result as
+ * the value of the call. The result may be delivered from any thread, also
+ * from the function itself before it returns #G2BASIC_CALL_PENDING.
+ *
+ * @param pool Thread pool
+ * @param ctx Submitted context whose function call returned
+ *            #G2BASIC_CALL_PENDING
+ * @param result Result of the call
+ * @return 0 on success, -1 if @p ctx is not running on the pool or already has
+ * a result waiting
+ *
+ * @since 0.1.0
+ */
+int g2basic_pool_complete_call(g2basic_pool_t* pool, g2basic_ctx_t* ctx, g2basic_number_t result);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Wait until every submitted context has finished
+ *
+ * Contexts submitted while waiting, for example from completion callbacks,
+ * are waited for as well, and so are contexts waiting for a function call
+ * result. Must not be called from a completion callback.
+ *
+ * @param pool Thread pool
+ *
+ * @since 0.1.0
+ */
+void g2basic_pool_wait(g2basic_pool_t* pool);
+/*--------------------------------------------------------------------------------------------------------------------*/
+/**
+ * @brief Wait for the submitted contexts, then stop the workers and release the pool
+ *
+ * @param pool Thread pool, or NULL
+ *
+ * @since 0.1.0
+ */
+void g2basic_pool_destroy(g2basic_pool_t* pool);
+/*--------------------------------------------------------------------------------------------------------------------*/
+#endif  // G2BASIC_POOL_H